@@ -40,12 +40,16 @@ pub fn build(b: *std.Build) void {
 	cmake_build.setCwd( b.path( build_dir ) );
 	cmake_build.step.dependOn( &cmake_config.step );
 
-	const dynlib = b.addInstallBinFile( b.path(build_dir ++ "/libclang_tool_lib.dll"), "libclang_tool_lib.dll" );
+	const is_windows = target.result.os.tag == .windows;
+	const dynlib_name = if ( is_windows ) "libclang_tool_lib.dll" else "libclang_tool_lib.so";
+	const dynlib = b.addInstallBinFile( b.path( b.fmt( "{s}/{s}", .{ build_dir, dynlib_name } ) ), dynlib_name );
 	dynlib.step.dependOn( &cmake_build.step );
 	b.getInstallStep().dependOn( &dynlib.step );
-	const dynlib_sym = b.addInstallBinFile( b.path( build_dir ++ "/libclang_tool_lib.pdb"), "libclang_tool_lib.pdb" );
-	dynlib_sym.step.dependOn( &cmake_build.step );
-	b.getInstallStep().dependOn( &dynlib_sym.step );
+	if ( is_windows ) {
+		const dynlib_sym = b.addInstallBinFile( b.path( build_dir ++ "/libclang_tool_lib.pdb"), "libclang_tool_lib.pdb" );
+		dynlib_sym.step.dependOn( &cmake_build.step );
+		b.getInstallStep().dependOn( &dynlib_sym.step );
+	}
 
 	const imgui_lib = b.addStaticLibrary(.{
 		.name = "imgui",
@@ -104,6 +108,8 @@ pub fn build(b: *std.Build) void {
 	});
 	driver.addIncludePath( b.path("src/") );
 	driver.step.dependOn( &cmake_build.step );
+	// dlopen of the library, and posix_spawn for the driver's process pool
+	if ( !is_windows ) driver.linkLibC();
 	b.installArtifact( driver );
 
 	const cl = b.addExecutable(.{
@@ -114,6 +120,7 @@ pub fn build(b: *std.Build) void {
 	});
 	cl.addIncludePath( b.path("src/") );
 	cl.step.dependOn( &cmake_build.step );
+	if ( !is_windows ) cl.linkLibC();
 	b.installArtifact( cl );
 
 	const ld = b.addExecutable(.{
@@ -126,6 +133,23 @@ pub fn build(b: *std.Build) void {
 	ld.step.dependOn( &cmake_build.step );
 	b.installArtifact( ld );
 
+	const sqlite_module = b.createModule(.{
+			.root_source_file = b.path("src/zig/sqlite.zig"),
+			.target = target,
+			.optimize = optimize,
+	});
+	sqlite_module.addIncludePath( b.path("src/") );
+	sqlite_module.linkLibrary( sqlite_lib );
+
+	const export_sqlite = b.addExecutable(.{
+			.name = "cet-sqlite",
+			.root_source_file = b.path("src/parser/cet-sqlite.zig"),
+			.target = target,
+			.optimize = optimize,
+	});
+	export_sqlite.root_module.addImport( "sqlite", sqlite_module );
+	b.installArtifact( export_sqlite );
+
 	const dump = b.addExecutable(.{
 			.name = "cet-dump",
 			.root_source_file = b.path("src/parser/cet-dump.zig"),
@@ -136,6 +160,35 @@ pub fn build(b: *std.Build) void {
 	dump.step.dependOn( &cmake_build.step );
 	b.installArtifact( dump );
 
+	const server = b.addExecutable(.{
+			.name = "cet-server",
+			.root_source_file = b.path("src/parser/cet-server.zig"),
+			.target = target,
+			.optimize = optimize,
+	});
+	server.addIncludePath( b.path("src/") );
+	server.step.dependOn( &cmake_build.step );
+	if ( !is_windows ) server.linkLibC();
+	b.installArtifact( server );
+
+	const bench = b.addExecutable(.{
+			.name = "cet-bench",
+			.root_source_file = b.path("src/parser/cet-bench.zig"),
+			.target = target,
+			.optimize = optimize,
+	});
+	bench.addIncludePath( b.path("src/") );
+	bench.step.dependOn( &cmake_build.step );
+	b.installArtifact( bench );
+
+	// generates and indexes a synthetic project in zig-out/cet-bench, args go to cet-bench: `zig build bench -- --tus 1000 -- --in-process`
+	const bench_cmd = b.addRunArtifact( bench );
+	bench_cmd.step.dependOn( b.getInstallStep() );
+	bench_cmd.setCwd( .{ .cwd_relative = b.install_path } );
+	if ( b.args ) |args| bench_cmd.addArgs( args );
+	const bench_step = b.step( "bench", "Index a generated project and report the throughput" );
+	bench_step.dependOn( &bench_cmd.step );
+
 	//exe.addIncludePath( .{ .cwd_relative = "/Program Files (x86)/Windows Kits/10/include/10.0.22621.0/um/"});
 	//exe.linkLibC();
 	exe.addIncludePath( b.path("src/") );
@@ -192,4 +245,16 @@ pub fn build(b: *std.Build) void {
     const test_step = b.step("test", "Run tests");
     //test_step.dependOn(&run_lib_unit_tests.step);
     test_step.dependOn(&run_exe_tests.step);
+
+	// the inline tests of the parser's modules, none of them load clang_tool_lib
+	inline for ( .{ "objfile", "recorder", "schedule", "graph", "lz4", "cet-bench" } ) |name|
+	{
+		const unit_tests = b.addTest(.{
+				.root_source_file = b.path( "src/parser/" ++ name ++ ".zig" ),
+				.target = target,
+				.optimize = optimize,
+		});
+		unit_tests.addIncludePath( b.path("src/") );
+		test_step.dependOn( &b.addRunArtifact( unit_tests ).step );
+	}
 }
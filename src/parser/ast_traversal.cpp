@@ -17,21 +17,49 @@
 #include "clang.h"
 
 #include <clang/Frontend/Utils.h>
-
-void* OS_MemReserve( size_t size );
-void OS_MemFree( void* ptr );
-void* OS_MemCommit( void* ptr, size_t size );
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/PrecompiledPreamble.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/StringSaver.h>
+#include <llvm/Support/Path.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
+#include <clang/Driver/ToolChain.h>
+#include <clang/Serialization/ASTReader.h>
+#include <clang/Serialization/ModuleManager.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/MacroInfo.h>
+#include <clang/Basic/DiagnosticIDs.h>
+#include <clang/Basic/DiagnosticFrontend.h>
+
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <optional>
+
+#include "virtual_alloc.h"
 
 template <typename T>
 class InfiniteArray
 {
 public:
-	static InfiniteArray Init()
+	static InfiniteArray Init( size_t reserve_size = RESERVE_GRANULARITY * 256 )
 	{
-		ptrdiff_t reserve_size = RESERVE_GRANULARITY * 256;
 		char* begin = (char*)OS_MemReserve(reserve_size);
-		
-		return InfiniteArray( begin );
+		if (begin == NULL) abort();
+
+		return InfiniteArray( begin, reserve_size );
 	}
 
 
@@ -56,36 +84,46 @@ public:
 
 	void deinit()
 	{
-		OS_MemFree( m_head );
+		OS_MemFree( m_start, m_end - m_start );
 	}
 
 	size_t size() { return (reinterpret_cast<size_t>( m_head ) - reinterpret_cast<size_t>( m_start )) / sizeof(T); };
 	T* data() { return reinterpret_cast<T*>( m_start ); };
+	size_t committed() const { return m_tail - m_start; }
 
 private:
-	static const size_t COMMIT_GRANULARITY = 1024 * 4;
+	static const size_t COMMIT_GRANULARITY = 1024 * 64;
 	static const size_t RESERVE_GRANULARITY = 1024 * 64;
 	
-	InfiniteArray( char* begin) : m_start{begin}, m_head{begin}, m_tail{begin} {}
+	InfiniteArray( char* begin, size_t reserve_size ) : m_start{begin}, m_head{begin}, m_tail{begin}, m_end{begin + reserve_size} {}
 
 	char* m_start; // start of the whole reserved area
 	char* m_head; // start of the current free but commited area
 	char* m_tail; // end of current committed area
+	char* m_end; // end of the whole reserved area
 
 	
 	void expand( ptrdiff_t amount )
 	{
+		// grow by at least what is already committed so the number of commits stays logarithmic
+		ptrdiff_t committed = m_tail - m_start;
+		ptrdiff_t wanted = amount > committed ? amount : committed;
+
 		// round to nearest COMMIT_GRANULARITY
-		ptrdiff_t commit_size = amount % COMMIT_GRANULARITY;
+		ptrdiff_t commit_size = wanted % COMMIT_GRANULARITY;
 		if (commit_size != 0) commit_size = COMMIT_GRANULARITY - commit_size;
-		commit_size += amount;
-		
-		// attemt to commit enough size starting at end
-		// this might commit the same page again, but that won't cause an error, and for now I'm not gonna worry about it
+		commit_size += wanted;
+
+		// the doubling can run past the reservation even when the request itself fits
+		if (commit_size > m_end - m_tail) commit_size = m_end - m_tail;
+		if (commit_size < amount) {
+			fprintf(stderr, "InfiniteArray ran out of reserved memory (%zu bytes)\n", (size_t)(m_end - m_start));
+			abort();
+		}
+
 		void* result = OS_MemCommit( m_tail, commit_size );
 		if (result == NULL) {
-			// TODO: if the error is ERROR_INVALID_ADDRESS, we have probably run out of reserved memory and should give a different message
-			// DWORD err = GetLastError();
+			fprintf(stderr, "InfiniteArray failed to commit %zu bytes\n", (size_t)commit_size);
 			abort();
 		}
 		m_tail += commit_size;
@@ -107,11 +145,118 @@ public:
 
 };
 
+// every string once, each is hashed a single time and gets a 32 bit id in the order it was first seen
+// the text is null terminated back to back in id order, so it can be written out as is and id n is the nth string
+// strings are told apart by their XXH3-64 hash alone, the same as everywhere they are stored
+class StringInterner
+{
+public:
+	explicit StringInterner( size_t reserve_size = 1ull << 30 )
+		: m_text{ InfiniteArray<char>::Init( reserve_size ) },
+		m_hashes{ InfiniteArray<uint64_t>::Init( maxStrings( reserve_size ) * sizeof( uint64_t ) ) },
+		m_slots( INITIAL_SLOTS, Slot{ 0, EMPTY } ) {}
+	StringInterner( const StringInterner& ) = delete;
+	StringInterner& operator=( const StringInterner& ) = delete;
+	~StringInterner() { m_text.deinit(); m_hashes.deinit(); }
+
+	static uint64_t hash( std::string_view str )
+	{
+		return llvm::xxh3_64bits( llvm::arrayRefFromStringRef( str ) );
+	}
+
+	// a string takes at least 2 bytes of text with its terminator, and ids are 32 bit
+	static size_t maxStrings( size_t reserve_size ) { return std::min<size_t>( reserve_size / 2, UINT32_MAX ); }
+
+	// inserted is set when the string had not been seen before
+	uint32_t intern( std::string_view str, uint64_t hash, bool* inserted = nullptr )
+	{
+		size_t mask = m_slots.size() - 1;
+		size_t slot = hash & mask;
+		while ( m_slots[slot].id != EMPTY )
+		{
+			if ( m_slots[slot].hash == hash ) {
+				if ( inserted ) *inserted = false;
+				return m_slots[slot].id;
+			}
+			slot = (slot + 1) & mask;
+		}
+
+		uint32_t id = (uint32_t)m_hashes.size();
+		m_slots[slot] = { hash, id };
+		m_hashes.push_back( hash );
+		m_text.dupe( str.data(), str.size() );
+		if ( inserted ) *inserted = true;
+
+		// keep the load under a half so probes stay short
+		if ( (size_t)id * 2 >= m_slots.size() ) grow();
+		return id;
+	}
+
+	uint32_t intern( std::string_view str ) { return intern( str, hash( str ) ); }
+
+	uint64_t hashOf( uint32_t id ) { return m_hashes.data()[id]; }
+	uint32_t size() { return (uint32_t)m_hashes.size(); }
+
+	const char* text() { return m_text.data(); }
+	size_t textSize() { return m_text.size(); }
+	const uint64_t* hashes() { return m_hashes.data(); }
+
+	size_t committed() const { return m_text.committed() + m_hashes.committed() + m_slots.size() * sizeof( Slot ); }
+
+private:
+	struct Slot
+	{
+		uint64_t hash;
+		uint32_t id;
+	};
+
+	static const uint32_t EMPTY = UINT32_MAX;
+	static const size_t INITIAL_SLOTS = 1024;
+
+	// the hashes are kept, nothing gets hashed again
+	void grow()
+	{
+		std::vector<Slot> slots( m_slots.size() * 2, Slot{ 0, EMPTY } );
+		size_t mask = slots.size() - 1;
+		for ( const Slot& s : m_slots )
+		{
+			if ( s.id == EMPTY ) continue;
+			size_t slot = s.hash & mask;
+			while ( slots[slot].id != EMPTY ) slot = (slot + 1) & mask;
+			slots[slot] = s;
+		}
+		m_slots.swap( slots );
+	}
+
+	InfiniteTextBuffer m_text;
+	InfiniteArray<uint64_t> m_hashes; // by id
+	std::vector<Slot> m_slots;
+};
+
+// the whole graph of a compile database, nodes and connections are deduplicated across TUs
+// nodes with a link name get the same id in every TU, everything else gets an id unique to its TU
 struct ParsedModuleInfo
 {
 	InfiniteArray<Node> nodes;
 	InfiniteArray<Connection> connections;
-	InfiniteTextBuffer text_buf; // TODO: make this a hashmap + allocator
+	StringInterner strings; // every node string once
+
+	// a whole database doesn't fit the default reservation
+	static const size_t RESERVE_SIZE = 1ull << 36;
+
+	ParsedModuleInfo() 
+		: nodes{ InfiniteArray<Node>::Init( RESERVE_SIZE ) }, 
+		connections{ InfiniteArray<Connection>::Init( RESERVE_SIZE ) }, 
+		strings{ RESERVE_SIZE } {}
+
+	struct ConnectionHash
+	{
+		size_t operator()( const std::pair<u64, u64>& c ) const { return c.first * 0x9E3779B97F4A7C15ull ^ c.second; }
+	};
+
+	std::mutex lock;
+	std::unordered_set<u64> node_ids;
+	std::unordered_set<std::pair<u64, u64>, ConnectionHash> connection_set;
 };
 
 EXPORTED struct Slice_Node ParsedModuleInfo_getNodes( ParsedModuleInfo* minfo )
@@ -127,7 +272,7 @@ EXPORTED struct Slice_Connection ParsedModuleInfo_getConnections( ParsedModuleIn
 
 Slice_Byte ParsedModuleInfo_getTextCache( ParsedModuleInfo* minfo )
 {
-	return { minfo->text_buf.data(), minfo->text_buf.size() };
+	return { minfo->strings.text(), minfo->strings.textSize() };
 }
 
 void ParsedModuleInfo_deinit( ParsedModuleInfo* minfo )
@@ -137,25 +282,375 @@ void ParsedModuleInfo_deinit( ParsedModuleInfo* minfo )
 	delete minfo;
 }
 
+// strings a recorder has already handed over, the interner keeps them back to back in the order they were first seen
+// so everything added since the last flush is one contiguous range
+struct InternedStrings
+{
+	StringInterner table;
+	size_t flushed_len = 0;
+	uint32_t flushed_count = 0;
+
+	InternedStrings() : table{ 1ull << 26 } {}
+
+	// the id is the string's index in the order strings are handed over
+	uint32_t intern( std::string_view str ) { return table.intern( str ); }
+	uint64_t hashOf( uint32_t id ) { return table.hashOf( id ); }
+
+	size_t committed() const { return table.committed(); }
+
+	void take( const char** ptr, const u64** hash_ptr, u64* len, u64* count )
+	{
+		*ptr = table.text() + flushed_len;
+		*hash_ptr = (const u64*)table.hashes() + flushed_count; // uint64_t is unsigned long on LP64, u64 unsigned long long
+		*len = table.textSize() - flushed_len;
+		*count = table.size() - flushed_count;
+		flushed_len = table.textSize();
+		flushed_count = table.size();
+	}
+};
+
+// adds the time from construction to destruction to *out
+class ScopedTimer {
+public:
+	explicit ScopedTimer( u64* o ) : out{ o }, start{ std::chrono::steady_clock::now() } {}
+	ScopedTimer( const ScopedTimer& ) = delete;
+	ScopedTimer& operator=( const ScopedTimer& ) = delete;
+	~ScopedTimer() { *out += std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count(); }
+
+private:
+	u64* out;
+	std::chrono::steady_clock::time_point start;
+};
+
 class Recorder {
 public:
 	RecorderInterface interface;
+
+	ParseStats stats{}; // the phases are timed by whoever runs them
+
+	Recorder( RecorderInterface i ) : interface{ i }, block{ std::make_unique<RecordBlock>() }
+	{
+		index( 0 ); // the translation unit
+	}
+	Recorder( const Recorder& ) = delete;
+	Recorder& operator=( const Recorder& ) = delete;
+
+	// a decl gets one node, however often it is visited
 	void addNode( int64_t id, std::string_view identifier )
 	{
-		interface.addNode( interface.ud, id, identifier.data(), identifier.size() );
+		uint32_t node = index( id );
+		if ( named[node] ) return;
+		named[node] = true;
+
+		if ( block->nodes_len == RECORD_BLOCK_SIZE ) flush();
+		block->node_ids[block->nodes_len] = node;
+		block->node_strings[block->nodes_len++] = strings.intern( identifier );
+		stats.nodes++;
 	}
 
 	void addConnection( int64_t from, int64_t to )
 	{
-		interface.addConnection( interface.ud, from, to );
+		uint32_t from_index = index( from );
+		uint32_t to_index = index( to );
+		if ( block->connections_len == RECORD_BLOCK_SIZE ) flush();
+		block->connection_from[block->connections_len] = from_index;
+		block->connection_to[block->connections_len++] = to_index;
+		stats.connections++;
 	}
 
 	void addLinkIdentifier( int64_t id, std::string_view identifier )
 	{
-		interface.addLinkIdentifier( interface.ud, id, identifier.data(), identifier.size() );
+		uint32_t node = index( id );
+		if ( block->links_len == RECORD_BLOCK_SIZE ) flush();
+		block->links[block->links_len++] = { node, linknames.hashOf( linknames.intern( identifier ) ) };
+		stats.links++;
+	}
+
+	// the same edge from the same decl is only recorded once per TU
+	void addReference( int64_t from, int64_t to, ReferenceKind kind )
+	{
+		uint32_t from_index = index( from );
+		uint32_t to_index = index( to );
+		if ( !references.insert( { (uint64_t)from_index << 32 | to_index, (uint32_t)kind } ).second ) return;
+
+		if ( block->references_len == RECORD_BLOCK_SIZE ) flush();
+		block->reference_from[block->references_len] = from_index;
+		block->reference_to[block->references_len] = to_index;
+		block->reference_kinds[block->references_len++] = (unsigned char)kind;
+		stats.references++;
+	}
+
+	void addDependency( std::string_view path, uint64_t size, int64_t mtime, uint64_t hash )
+	{
+		interface.addDependency( interface.ud, path.data(), path.size(), size, mtime, hash );
+	}
+
+	void addHeaderReference( uint64_t key, std::string_view path, bool owned )
+	{
+		interface.addHeaderReference( interface.ud, key, strings.hashOf( strings.intern( path ) ), owned );
+	}
+
+	// hands over what the last block holds
+	void finish()
+	{
+		flush();
+	}
+
+	// once the TU is done, after the dependencies
+	void reportStats()
+	{
+		stats.strings = strings.table.size();
+		stats.string_bytes = strings.table.textSize();
+		stats.arena_committed = strings.committed() + linknames.committed() + sizeof( RecordBlock )
+			+ indices.getMemorySize() + named.capacity() / 8 + references.getMemorySize();
+		if ( interface.stats ) interface.stats( interface.ud, &stats );
+	}
+
+private:
+	// hand over everything recorded since the last flush
+	void flush()
+	{
+		strings.take( &block->strings, &block->string_hashes, &block->strings_len, &block->strings_count );
+		linknames.take( &block->linknames, &block->linkname_hashes, &block->linknames_len, &block->linknames_count );
+		interface.flush( interface.ud, block.get() );
+
+		block->nodes_len = 0;
+		block->connections_len = 0;
+		block->links_len = 0;
+		block->references_len = 0;
+	}
+
+	// decl and expr ids from clang are only used to look up the dense index
+	uint32_t index( int64_t id )
+	{
+		auto [it, inserted] = indices.try_emplace( id, (uint32_t)named.size() );
+		if ( inserted ) named.push_back( false );
+		return it->second;
+	}
+
+	std::unique_ptr<RecordBlock> block;
+	InternedStrings strings;
+	InternedStrings linknames;
+	llvm::DenseMap<int64_t, uint32_t> indices;
+	std::vector<bool> named; // by index, whether the node has been recorded
+	llvm::DenseSet<std::pair<uint64_t, uint32_t>> references;
+};
+
+// headers whose decls are recorded by a single TU in the session, keyed by the header's path and the definitions of the macros it tests where it was included
+// the owner is the TU with the lowest command index that includes the header, whichever thread gets there first
+// a TU that recorded a header before a lower one claimed it, or that refers to a header nobody owns anymore, is parsed again
+// TUs are tracked by command index, a TU parsed again gives up the headers it no longer includes
+class HeaderRegistry
+{
+public:
+	static const u64 NO_OWNER = UINT64_MAX;
+
+	// tu is about to be parsed, call end once it is done even if it failed
+	void begin( u64 tu )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		Tu& t = tus[tu];
+		t.previous.swap( t.keys );
+		t.keys.clear();
+	}
+
+	// true if tu owns the header and should record its decls, called once per header per parse
+	bool claim( u64 tu, uint64_t key )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		tus[tu].keys.push_back( key );
+		Header& header = headers[key];
+		header.users.insert( tu );
+		if ( header.owner == tu ) return true;
+		if ( header.owner != NO_OWNER && header.owner < tu ) return false;
+
+		// its object has the decls too, it has to be parsed again without them
+		if ( header.owner != NO_OWNER ) redo.insert( header.owner );
+		header.owner = tu;
+		return true;
+	}
+
+	// what tu's object from an earlier run refers to, whether or not the TU gets parsed again
+	void keep( u64 tu, uint64_t key, bool owned )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		tus[tu].keys.push_back( key );
+		Header& header = headers[key];
+		header.users.insert( tu );
+		if ( !owned || header.owner == tu ) return;
+		if ( header.owner != NO_OWNER && header.owner < tu ) { redo.insert( tu ); return; }
+		if ( header.owner != NO_OWNER ) redo.insert( header.owner );
+		header.owner = tu;
+	}
+
+	// headers tu included last time but not this time stop being its
+	void end( u64 tu )
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		Tu& t = tus[tu];
+		llvm::DenseSet<uint64_t> current( t.keys.begin(), t.keys.end() );
+		for ( uint64_t key : t.previous )
+		{
+			if ( current.contains( key ) ) continue;
+			Header& header = headers[key];
+			header.users.erase( tu );
+			if ( header.owner == tu ) header.owner = NO_OWNER;
+		}
+		t.previous.clear();
+	}
+
+	// the TUs to parse again, in command order: ones that lost a header they recorded
+	// and ones that refer to a header whose owner stopped including it
+	std::vector<u64> takeRedo()
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		for ( auto& [key, header] : headers )
+		{
+			if ( header.owner == NO_OWNER ) redo.insert( header.users.begin(), header.users.end() );
+		}
+		std::vector<u64> out( redo.begin(), redo.end() );
+		std::sort( out.begin(), out.end() );
+		redo.clear();
+		return out;
+	}
+
+private:
+	struct Header
+	{
+		u64 owner = NO_OWNER;
+		llvm::DenseSet<u64> users; // TUs that include it, owner or not
+	};
+
+	struct Tu
+	{
+		std::vector<uint64_t> keys; // claimed by the current or last parse
+		std::vector<uint64_t> previous; // from the parse before, while the TU is being parsed
+	};
+
+	std::mutex lock;
+	std::unordered_map<uint64_t, Header> headers;
+	std::unordered_map<u64, Tu> tus;
+	std::unordered_set<u64> redo;
+};
+
+// what a header's decls can depend on: the definitions, where it was included, of the macros it tests in #if, #ifdef, #ifndef and #elif
+// macros the header never tests don't change its key, so including it under different values of anything else still shares it
+// include guards are left out, all they do is keep their own header from being read twice
+class MacroStates
+{
+public:
+	explicit MacroStates( clang::Preprocessor& p ) : pp{ p }, sm{ p.getSourceManager() }
+	{
+		// macros from a preamble or pch only have their history once they are loaded
+		for ( const auto& macro : pp.macros( true ) ) (void)macro;
+	}
+
+	// the header in fid, included at include_loc
+	uint64_t at( clang::FileID fid, clang::SourceLocation include_loc )
+	{
+		llvm::SmallVector<uint64_t, 16> definitions;
+		for ( const clang::IdentifierInfo* name : tested( fid ) ) definitions.push_back( definitionAt( name, include_loc ) );
+		return llvm::xxh3_64bits( llvm::ArrayRef<uint8_t>( (const uint8_t*)definitions.data(), definitions.size() * sizeof( uint64_t ) ) );
+	}
+
+private:
+	clang::Preprocessor& pp;
+	clang::SourceManager& sm;
+	llvm::DenseMap<const clang::FileEntry*, std::vector<const clang::IdentifierInfo*>> testedByFile;
+	llvm::SmallString<256> text;
+
+	// every identifier in the header's conditions in the order they first show up, from a raw lex of the header
+	const std::vector<const clang::IdentifierInfo*>& tested( clang::FileID fid )
+	{
+		auto [it, inserted] = testedByFile.try_emplace( sm.getFileEntryForID( fid ) );
+		if ( !inserted ) return it->second;
+
+		llvm::DenseSet<const clang::IdentifierInfo*> seen;
+		clang::Lexer lexer( fid, sm.getBufferOrFake( fid ), sm, pp.getLangOpts() );
+		clang::Token tok;
+		bool condition = false;
+		do {
+			lexer.LexFromRawLexer( tok );
+			if ( tok.isAtStartOfLine() ) condition = false;
+			if ( tok.is( clang::tok::hash ) && tok.isAtStartOfLine() ) {
+				lexer.LexFromRawLexer( tok );
+				if ( !tok.is( clang::tok::raw_identifier ) ) continue;
+				llvm::StringRef directive = tok.getRawIdentifier();
+				condition = directive == "if" || directive == "ifdef" || directive == "ifndef" || directive == "elif" || directive == "elifdef" || directive == "elifndef";
+				continue;
+			}
+			if ( !condition || !tok.is( clang::tok::raw_identifier ) || tok.getRawIdentifier() == "defined" ) continue;
+
+			const clang::IdentifierInfo* name = pp.getIdentifierInfo( tok.getRawIdentifier() );
+			if ( seen.insert( name ).second ) it->second.push_back( name );
+		} while ( tok.isNot( clang::tok::eof ) );
+		return it->second;
+	}
+
+	// 0 when the macro isn't defined at loc or is an include guard, the history is latest first
+	uint64_t definitionAt( const clang::IdentifierInfo* name, clang::SourceLocation loc )
+	{
+		const clang::MacroDirective* md = pp.getLocalMacroDirectiveHistory( name );
+		for ( ; md; md = md->getPrevious() )
+		{
+			if ( md->getLocation().isValid() && sm.isBeforeInTranslationUnit( md->getLocation(), loc ) ) break;
+		}
+
+		auto* def = llvm::dyn_cast_or_null<clang::DefMacroDirective>( md );
+		if ( !def || def->getInfo()->isUsedForHeaderGuard() ) return 0;
+
+		const clang::MacroInfo* info = def->getInfo();
+		text = name->getName();
+		text.push_back( '\0' );
+		text += clang::Lexer::getSourceText( clang::CharSourceRange::getTokenRange( info->getDefinitionLoc(), info->getDefinitionEndLoc() ), sm, pp.getLangOpts() );
+		return llvm::xxh3_64bits( llvm::arrayRefFromStringRef( text ) ) | 1;
 	}
 };
 
+static void recordDependency( Recorder* recorder, clang::FileManager& fm, clang::FileEntryRef file, std::optional<llvm::MemoryBufferRef> buffer )
+{
+	llvm::SmallString<256> path = file.getName();
+	fm.makeAbsolutePath( path );
+
+	uint64_t hash;
+	if ( buffer ) {
+		hash = llvm::xxh3_64bits( llvm::arrayRefFromStringRef( buffer->getBuffer() ) );
+	} else {
+		auto loaded = fm.getBufferForFile( file );
+		if ( !loaded ) return;
+		hash = llvm::xxh3_64bits( llvm::arrayRefFromStringRef( (*loaded)->getBuffer() ) );
+	}
+
+	recorder->addDependency( { path.data(), path.size() }, file.getSize(), file.getModificationTime(), hash );
+}
+
+// report every file the TU read so the caller can tell when it needs to be parsed again
+// headers that came out of a preamble or pch are only in the source manager once something in them was used,
+// they are all listed as inputs of the pch so those are added too
+static void recordDependencies( Recorder* recorder, clang::ASTUnit& ast )
+{
+	clang::SourceManager& sm = ast.getSourceManager();
+	clang::FileManager& fm = ast.getFileManager();
+	llvm::DenseSet<const clang::FileEntry*> seen;
+	for ( auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it )
+	{
+		seen.insert( &it->first.getFileEntry() );
+		recordDependency( recorder, fm, it->first, it->second->getBufferIfLoaded() );
+	}
+
+	llvm::IntrusiveRefCntPtr<clang::ASTReader> reader = ast.getASTReader();
+	if ( !reader ) return;
+	for ( clang::serialization::ModuleFile& module : reader->getModuleManager() )
+	{
+		reader->visitInputFiles( module, true, false, [&]( const clang::serialization::InputFile& input, bool )
+		{
+			clang::OptionalFileEntryRef file = input.getFile();
+			if ( !file || !seen.insert( &file->getFileEntry() ).second ) return;
+			recordDependency( recorder, fm, *file, std::nullopt );
+		} );
+	}
+}
+
 
 
 class Visitor : public clang::RecursiveASTVisitor<Visitor> {
@@ -198,6 +693,7 @@ public:
 
 	bool TraverseDecl(clang::Decl *D) {
 		if (!D) return true;
+		if (!isInOwnedFile(D)) return true;
 		bool recordParent = D->getKind() != clang::Decl::Kind::Var;
 
 		ParentPopper pp = {};
@@ -207,8 +703,15 @@ public:
 			pp = pushParent(D->getID());
 		}
 
+		// expressions in a local's initializer belong to the function it is in
+		auto* referrer = llvm::dyn_cast<clang::NamedDecl>(D);
+		if (referrer && isLocal(referrer)) referrer = nullptr;
+		if (referrer) referrers.push_back(referrer);
 
-		return clang::RecursiveASTVisitor<Visitor>::TraverseDecl(D);; // Return false to stop the AST analyzing
+		bool result = clang::RecursiveASTVisitor<Visitor>::TraverseDecl(D); // Return false to stop the AST analyzing
+
+		if (referrer) referrers.pop_back();
+		return result;
 	}
 
 
@@ -243,46 +746,108 @@ public:
 
 		recorder->addNode( id, name );
 		recorder->addConnection(id, get_parent());
+		addLinkName(D);
+		return true;
+	}
 
+	// D is canonical, each decl is only mangled once per TU
+	// references can name decls this TU never records, the link name is what ties them to the TU that does
+	// decls with internal linkage keep the id of the TU they are in, another TU can't refer to them
+	// with lazy link names the decls are only mangled after the traversal and only if the linker needs them
+	void addLinkName(clang::NamedDecl *D)
+	{
+		if (!linkNamed.insert(D).second) return;
 
 		// TAKEN FROM llvm JSONNodeDumper
 		// FIXME: There are likely other contexts in which it makes no sense to ask
 		// for a mangled name.
 		if (llvm::isa<clang::RequiresExprBodyDecl>(D->getDeclContext()))
-			return true;
+			return;
 
 		// If the declaration is dependent or is in a dependent context, then the
 		// mangling is unlikely to be meaningful (and in some cases may cause
 		// "don't know how to mangle this" assertion failures.
 		if (D->isTemplated())
-			return true;
+			return;
 
 		// Mangled names are not meaningful for locals, and may not be well-defined
 		// in the case of VLAs.
 		auto *VD = llvm::dyn_cast<clang::VarDecl>(D);
 		if (VD && VD->hasLocalStorage())
-			return true;
+			return;
 
 		// Do not mangle template deduction guides.
 		if (llvm::isa<clang::CXXDeductionGuideDecl>(D))
-			return true;
+			return;
 
-		
-		llvm::SmallString<1024> name_buf;
-		llvm::raw_svector_ostream stream(name_buf);
+		if (!D->isExternallyVisible())
+			return;
+
+		if (lazyLinkNames) pendingLinkNames.push_back(D);
+		else writeLinkName(D);
+	}
+
+	// the linker only ties a decl to another TU's copy if this TU defines it or refers to it
+	// declarations a header brings in that the TU never uses don't need a name
+	static bool neededByLinker(clang::NamedDecl *D)
+	{
+		if (D->isReferenced()) return true;
+		if (auto *FD = llvm::dyn_cast<clang::FunctionDecl>(D)) return FD->isDefined();
+		if (auto *VD = llvm::dyn_cast<clang::VarDecl>(D)) return VD->hasDefinition() != clang::VarDecl::DeclarationOnly;
+		return false;
+	}
+
+	void writeLinkName(clang::NamedDecl *D)
+	{
+		ScopedTimer timer( &recorder->stats.link_names_ns );
+		nameBuf.clear();
+		llvm::raw_svector_ostream stream(nameBuf);
 		if ( astNameGenerator.writeName(D, stream) == false )
 		{
-			recorder->addLinkIdentifier( id, { name_buf.c_str(), name_buf.size() });
+			recorder->addLinkIdentifier( D->getID(), { nameBuf.data(), nameBuf.size() });
 		}
 
 		//std::vector<std::string> identifiers = astNameGenerator.getAllManglings( D );
 		//for ( std::string& str : identifiers ) {
 		//	recorder->addLinkIdentifier( id, str );
 		//}
-		return true;
+	}
+
+	// the traversal only kept the decls, their names are only worked out now
+	void materializeLinkNames()
+	{
+		for (clang::NamedDecl* D : pendingLinkNames)
+		{
+			if (neededByLinker(D)) writeLinkName(D);
+		}
+		pendingLinkNames.clear();
+	}
+
+	// locals and parameters are only ever referred to from inside their own function
+	static bool isLocal(clang::NamedDecl *D)
+	{
+		auto *VD = llvm::dyn_cast<clang::VarDecl>(D);
+		return VD && VD->isLocalVarDeclOrParm();
+	}
+
+	// an edge from the innermost enclosing decl to the canonical decl being referred to
+	void addReference(clang::NamedDecl *D, ReferenceKind kind)
+	{
+		clang::NamedDecl* to = llvm::cast<clang::NamedDecl>(D->getCanonicalDecl());
+		addLinkName(to);
+
+		int64_t from = 0; // the translation unit
+		if (!referrers.empty()) {
+			clang::NamedDecl* referrer = llvm::cast<clang::NamedDecl>(referrers.back()->getCanonicalDecl());
+			addLinkName(referrer);
+			from = referrer->getID();
+		}
+
+		recorder->addReference(from, to->getID(), kind);
 	}
 
 	bool TraverseStmt(clang::Stmt *x) {
+		if (!visitStmts) return true;
 
 		//parentStack.push_back(x->getID(*Context));
 		clang::RecursiveASTVisitor<Visitor>::TraverseStmt(x);
@@ -298,14 +863,40 @@ public:
 		return true;
 	}
 
+	// calls are visited before their callee, so the callee's DeclRefExpr or MemberExpr isn't also recorded as a use
+	// the callee isn't always the next expr visited, arguments can hold calls of their own and an operator call's left operand comes first
+	bool VisitCallExpr(clang::CallExpr* expr)
+	{
+		if (!recordReferences) return true;
+		clang::FunctionDecl* callee = expr->getDirectCallee();
+		if (callee == nullptr) return true; // calls through pointers, dependent calls
+		const clang::Expr* calleeExpr = expr->getCallee()->IgnoreParenImpCasts();
+		if (llvm::isa<clang::DeclRefExpr, clang::MemberExpr>(calleeExpr)) calleeExprs.insert(calleeExpr);
+		addReference(callee, REFERENCE_CALL);
+		return true;
+	}
+
+	bool VisitCXXConstructExpr(clang::CXXConstructExpr* expr)
+	{
+		if (!recordReferences) return true;
+		addReference(expr->getConstructor(), REFERENCE_CONSTRUCT);
+		return true;
+	}
+
 	bool VisitDeclRefExpr(clang::DeclRefExpr* expr)
 	{
-		//if (pStmt == NULL) fprintf( stderr, "null statement\n");
-		//printf("%s %lli %s\n", indent + parentStack.size(), expr->getID(*Context), expr->getDecl()->getName().data());
-		int64_t id = expr->getID(*Context);
-		recorder->addNode( id, expr->getDecl()->getNameAsString().data()); 
-		recorder->addConnection( id, parentStack.back());
-		return false;
+		if (!recordReferences || calleeExprs.erase(expr)) return true;
+		clang::ValueDecl* decl = expr->getDecl();
+		if (isLocal(decl)) return true;
+		addReference(decl, REFERENCE_USE);
+		return true;
+	}
+
+	bool VisitMemberExpr(clang::MemberExpr* expr)
+	{
+		if (!recordReferences || calleeExprs.erase(expr)) return true;
+		addReference(expr->getMemberDecl(), REFERENCE_USE);
+		return true;
 	}
 
 	bool VisitExpr(clang::Expr *expr)
@@ -321,26 +912,136 @@ public:
 	}
 
 
-	Visitor(Recorder *r, clang::ASTContext* c) : recorder{r}, Context{c}, astNameGenerator{*c} {};
+	// false if D lives in a header another TU in the session has already recorded
+	bool isInOwnedFile( clang::Decl* D )
+	{
+		if ( headers == nullptr ) return true;
+
+		// these can hold decls from any number of files, the check happens on their children
+		if ( llvm::isa<clang::TranslationUnitDecl, clang::NamespaceDecl, clang::LinkageSpecDecl, clang::ExportDecl>( D ) ) return true;
+
+		clang::SourceManager& sm = Context->getSourceManager();
+		clang::SourceLocation loc = sm.getExpansionLoc( D->getLocation() );
+		if ( loc.isInvalid() ) return true;
+
+		clang::FileID fid = sm.getFileID( loc );
+		if ( fid == sm.getMainFileID() ) return true;
+
+		auto [it, inserted] = ownedFiles.try_emplace( fid, true );
+		if ( inserted ) it->second = claimHeader( fid );
+		return it->second;
+	}
+
+	bool claimHeader( clang::FileID fid )
+	{
+		clang::SourceManager& sm = Context->getSourceManager();
+		clang::OptionalFileEntryRef file = sm.getFileEntryRefForID( fid );
+		if ( !file ) return true; // builtins and scratch space
+
+		llvm::SmallString<256> path = file->getName();
+		sm.getFileManager().makeAbsolutePath( path );
+		uint64_t state = macros->at( fid, sm.getIncludeLoc( fid ) );
+		path.append( llvm::StringRef( (const char*)&state, sizeof( state ) ) );
+		uint64_t key = llvm::xxh3_64bits( llvm::arrayRefFromStringRef( path ) );
+		path.resize( path.size() - sizeof( state ) );
+
+		// a header without an include guard gets a FileID per include, only ask the session the first time
+		auto [it, inserted] = ownedKeys.try_emplace( key, false );
+		if ( inserted ) {
+			it->second = headers->claim( tu, key );
+			recorder->addHeaderReference( key, { path.data(), path.size() }, it->second );
+		}
+		return it->second;
+	}
+
+
+	Visitor(Recorder *r, clang::ASTContext* c, HeaderRegistry* h, MacroStates* m, u64 t, u64 flags) 
+		: recorder{r}, Context{c}, astNameGenerator{*c}, headers{h}, macros{m}, tu{t}, 
+		recordReferences{ !( flags & PARSE_NO_REFERENCES ) }, 
+		lazyLinkNames{ ( flags & PARSE_LAZY_LINK_NAMES ) != 0 },
+		visitStmts{ !( flags & PARSE_SKIP_BODIES ) || ( flags & PARSE_KEEP_MAIN_BODIES ) } {};
 	clang::ASTContext* Context;
 	std::vector<int64_t> parentStack;
+	std::vector<clang::NamedDecl*> referrers; // enclosing decls that aren't locals, innermost last
+	llvm::DenseSet<clang::NamedDecl*> linkNamed; // every canonical decl addLinkName has seen
+	std::vector<clang::NamedDecl*> pendingLinkNames;
+	llvm::SmallString<1024> nameBuf;
+	llvm::SmallPtrSet<const clang::Expr*, 8> calleeExprs; // callees of calls whose callee hasn't been visited yet
 	Recorder* recorder;
 	clang::ASTNameGenerator astNameGenerator;
-
-
-	static void RecordAst( Recorder* recorder, clang::ASTContext* context )
+	HeaderRegistry* headers;
+	MacroStates* macros; // only with headers
+	u64 tu; // the command index headers know the TU by
+	bool recordReferences;
+	bool lazyLinkNames;
+	bool visitStmts; // false when only the decl tree is wanted, initializers and default arguments are skipped too
+	llvm::DenseMap<clang::FileID, bool> ownedFiles;
+	llvm::DenseMap<uint64_t, bool> ownedKeys;
+
+
+	// headers is null unless headers are deduplicated across the session, tu is the TU's command index
+	// flags are the session's ParseFlags, call and reference edges are recorded in the same pass as the decls
+	static void RecordAst( Recorder* recorder, clang::ASTUnit& ast, HeaderRegistry* headers, u64 tu, u64 flags )
 	{
-		Visitor visitor( recorder, context );
-		visitor.TraverseDecl( context->getTranslationUnitDecl() );
+		std::optional<MacroStates> macros;
+		if ( headers ) macros.emplace( ast.getPreprocessor() );
+
+		clang::ASTContext* context = &ast.getASTContext();
+		Visitor visitor( recorder, context, headers, macros ? &*macros : nullptr, tu, flags );
+		{
+			ScopedTimer timer( &recorder->stats.traverse_ns );
+			visitor.TraverseDecl( context->getTranslationUnitDecl() );
+		}
+		// writeLinkName times itself, without lazy link names that happened during the traversal
+		recorder->stats.traverse_ns -= recorder->stats.link_names_ns;
+		visitor.materializeLinkNames();
+		ScopedTimer timer( &recorder->stats.finish_ns );
+		recorder->finish();
 	}
 };
 
 
+// every string of a database is interned, the arguments that every command repeats are stored once
+// and the argv of each command points straight into the shared text
+// the reservations are upper bounds worked out by whoever loads the database, going past one aborts
 struct CompileDatabase
 {
 	InfiniteTextBuffer text;
 	InfiniteArray<const char*> argv;
-	InfiniteArray<CompileCommand> commands; 
+	InfiniteArray<CompileCommand> commands;
+	llvm::DenseSet<llvm::StringRef> strings; // views of text
+
+	CompileDatabase( size_t text_bytes, size_t argv_count, size_t command_count )
+		: text{ InfiniteArray<char>::Init( reservation( text_bytes ) ) },
+		argv{ InfiniteArray<const char*>::Init( reservation( argv_count * sizeof( const char* ) ) ) },
+		commands{ InfiniteArray<CompileCommand>::Init( reservation( command_count * sizeof( CompileCommand ) ) ) } {}
+
+	static size_t reservation( size_t bytes ) { return std::max<size_t>( bytes, 1ull << 16 ); }
+
+	// null terminated and valid as long as the database
+	const char* intern( llvm::StringRef str )
+	{
+		auto it = strings.find( str );
+		if ( it != strings.end() ) return it->data();
+
+		const char* copy = text.dupe( str.data(), str.size() );
+		strings.insert( llvm::StringRef( copy, str.size() ) );
+		return copy;
+	}
+
+	// every string is already interned
+	void add( const char* directory, const char* filename, const char* output, const char* heuristic, llvm::ArrayRef<const char*> args )
+	{
+		CompileCommand* cmd = commands.create( 1 );
+		cmd->directory = directory;
+		cmd->filename = filename;
+		cmd->output = output;
+		cmd->heuristic = heuristic;
+		cmd->argc = args.size();
+		const char** copy = argv.create( args.size() );
+		std::copy( args.begin(), args.end(), copy );
+		cmd->argv = copy;
+	}
 };
 
 EXPORTED Slice_CompileCommand CompileDatabase_getAllCommands( CompileDatabase* db )
@@ -356,59 +1057,990 @@ EXPORTED void CompileDatabase_deinit( CompileDatabase* db )
 	delete db;
 }
 
-EXPORTED CompileDatabase* parseDB( const char* directory, const char** err )
+// reads compile_commands.json in one pass over the file instead of building a yaml tree and a std::string
+// per argument like clang's JSONCompilationDatabase, strings without escapes are interned straight from the file
+// gives the same commands as CompilationDatabase::loadFromDirectory: wrappers like ccache are dropped and
+// --target and --driver-mode are added from the program name
+// load returns false on anything it doesn't handle, invalid json, unknown keys, response files,
+// so the caller can leave it to clang, which also has the error messages
+class CompileCommandsLoader
 {
+public:
+	CompileCommandsLoader( CompileDatabase* db, llvm::StringRef json ) : m_db{ db }, m_p{ json.begin() }, m_end{ json.end() } {}
 
-	std::string load_err;
-	std::unique_ptr<clang::tooling::CompilationDatabase> db = 
-		clang::tooling::CompilationDatabase::loadFromDirectory(directory, load_err);
-	if ( !db ) {
-		*err = strdup( load_err.c_str() );
-		return nullptr;
+	bool load()
+	{
+		if ( llvm::StringRef( m_p, m_end - m_p ).starts_with( "\xEF\xBB\xBF" ) ) m_p += 3;
+		skipSpace();
+		if ( !consume( '[' ) ) return false;
+		skipSpace();
+		if ( consume( ']' ) ) return true;
+		while ( true )
+		{
+			if ( !command() ) return false;
+			skipSpace();
+			if ( consume( ']' ) ) return true;
+			if ( !consume( ',' ) ) return false;
+			skipSpace();
+		}
 	}
 
-	fflush( stdout );
-	CompileDatabase* out = new CompileDatabase{
-		InfiniteArray<char>::Init(), 
-		InfiniteArray<const char*>::Init(),
-		InfiniteArray<CompileCommand>::Init() };
+private:
+	struct ProgramName
+	{
+		const char* target; // --target=<prefix>, null if the name has none
+		const char* mode; // --driver-mode=<mode>, null if the name has none
+	};
 
-	std::vector<clang::tooling::CompileCommand> cmds = db->getAllCompileCommands();
+	CompileDatabase* m_db;
+	const char* m_p;
+	const char* m_end;
 
-	for ( clang::tooling::CompileCommand& cmd : cmds )
+	llvm::SmallVector<const char*, 256> m_args;
+	std::string m_key_text;
+	std::string m_value_text;
+	std::string m_command_text;
+	llvm::BumpPtrAllocator m_tokens;
+	llvm::DenseMap<const char*, ProgramName> m_program_names; // by interned argv[0]
+
+	void skipSpace()
 	{
-		CompileCommand* ptr = out->commands.create(1);
+		while ( m_p < m_end && ( *m_p == ' ' || *m_p == '\n' || *m_p == '\r' || *m_p == '\t' ) ) m_p++;
+	}
 
-		ptr->directory = out->text.dupe( cmd.Directory.c_str(), cmd.Directory.size() );
-		ptr->filename = out->text.dupe( cmd.Filename.c_str(), cmd.Filename.size() );
-		ptr->output = out->text.dupe( cmd.Output.c_str(), cmd.Output.size() );
+	bool consume( char c )
+	{
+		if ( m_p == m_end || *m_p != c ) return false;
+		m_p++;
+		return true;
+	}
 
-		ptr->heuristic = nullptr;
-		if (cmd.Heuristic.size() > 0)
+	bool command()
+	{
+		if ( !consume( '{' ) ) return false;
+
+		const char* directory = nullptr;
+		const char* filename = nullptr;
+		const char* output = "";
+		llvm::StringRef command;
+		bool has_command = false;
+		bool has_arguments = false;
+		m_args.clear();
+
+		skipSpace();
+		if ( !consume( '}' ) ) while ( true )
 		{
-			ptr->heuristic = out->text.dupe( cmd.Heuristic.c_str(), cmd.Heuristic.size() );
-		}
+			llvm::StringRef key, value;
+			if ( !string( &key, m_key_text ) ) return false;
+			skipSpace();
+			if ( !consume( ':' ) ) return false;
+			skipSpace();
+
+			if ( key == "arguments" ) {
+				if ( !arguments() ) return false;
+				has_arguments = true;
+			} else if ( key == "command" ) {
+				if ( !string( &command, m_command_text ) ) return false;
+				has_command = true;
+			} else {
+				if ( !string( &value, m_value_text ) ) return false;
+				if ( key == "directory" ) directory = m_db->intern( value );
+				else if ( key == "file" ) filename = m_db->intern( value );
+				else if ( key == "output" ) output = m_db->intern( value );
+				else return false;
+			}
 
-		size_t argc = cmd.CommandLine.size();
-		ptr->argc = argc;
-	
-		const char** argv = out->argv.create( argc );
-		for (int i = 0; i < argc; i++)
-		{
-			argv[i] = out->text.dupe( cmd.CommandLine[i].c_str(), cmd.CommandLine[i].size() );
+			skipSpace();
+			if ( consume( '}' ) ) break;
+			if ( !consume( ',' ) ) return false;
+			skipSpace();
 		}
-		ptr->argv = argv;
+
+		if ( !directory || !filename || ( !has_arguments && !has_command ) ) return false;
+
+		// arguments wins over command, and a single argument is split like a command, both the same as clang
+		if ( has_arguments ) {
+			if ( m_args.size() == 1 ) tokenize( m_args[0] );
+		} else {
+			tokenize( command );
+		}
+
+		for ( const char* arg : m_args ) if ( arg[0] == '@' ) return false;
+
+		llvm::ArrayRef<const char*> args = m_args;
+		while ( args.size() >= 2 && isWrapped( args ) ) args = args.drop_front();
+		addProgramName( args, filename, directory, output );
+		return true;
+	}
+
+	bool arguments()
+	{
+		if ( !consume( '[' ) ) return false;
+		skipSpace();
+		if ( consume( ']' ) ) return true;
+		while ( true )
+		{
+			llvm::StringRef arg;
+			if ( !string( &arg, m_value_text ) ) return false;
+			m_args.push_back( m_db->intern( arg ) );
+			skipSpace();
+			if ( consume( ']' ) ) return true;
+			if ( !consume( ',' ) ) return false;
+			skipSpace();
+		}
+	}
+
+	// clang splits commands with the syntax of the host
+	void tokenize( llvm::StringRef line )
+	{
+		m_tokens.Reset();
+		llvm::StringSaver saver( m_tokens );
+		llvm::SmallVector<const char*, 256> tokens;
+#ifdef _WIN32
+		llvm::cl::TokenizeWindowsCommandLineFull( line, saver, tokens );
+#else
+		llvm::cl::TokenizeGNUCommandLine( line, saver, tokens );
+#endif
+		m_args.clear();
+		for ( const char* token : tokens ) m_args.push_back( m_db->intern( token ) );
+	}
+
+	// `ccache g++ file.c` runs g++, `ccache file.c` runs cc so the wrapper is left in for the driver
+	static bool isWrapped( llvm::ArrayRef<const char*> args )
+	{
+		llvm::StringRef wrapper = llvm::sys::path::filename( args[0] );
+		wrapper.consume_back( ".exe" );
+		if ( wrapper != "distcc" && wrapper != "ccache" && wrapper != "sccache" ) return false;
+
+		llvm::StringRef next = args[1];
+		next.consume_back( ".exe" );
+		return !next.empty() && next[0] != '-' && !llvm::sys::path::has_extension( next );
+	}
+
+	// what clang::tooling::addTargetAndModeForProgramName does, with the program names looked up once
+	void addProgramName( llvm::ArrayRef<const char*> args, const char* filename, const char* directory, const char* output )
+	{
+		ProgramName name = { nullptr, nullptr };
+		if ( !args.empty() && args[0][0] != '\0' ) name = programName( args[0] );
+
+		bool add_target = name.target != nullptr;
+		bool add_mode = name.mode != nullptr;
+		for ( size_t i = 1; i < args.size() && ( add_target || add_mode ); i++ )
+		{
+			llvm::StringRef arg = args[i];
+			if ( arg.starts_with( "--target=" ) || arg == "-target" ) add_target = false;
+			if ( arg.starts_with( "--driver-mode=" ) ) add_mode = false;
+		}
+
+		if ( !add_target && !add_mode ) {
+			m_db->add( directory, filename, output, nullptr, args );
+			return;
+		}
+
+		llvm::SmallVector<const char*, 256> full;
+		full.push_back( args[0] );
+		if ( add_target ) full.push_back( name.target );
+		if ( add_mode ) full.push_back( name.mode );
+		full.append( args.begin() + 1, args.end() );
+		m_db->add( directory, filename, output, nullptr, full );
+	}
+
+	ProgramName programName( const char* program )
+	{
+		auto it = m_program_names.find( program );
+		if ( it != m_program_names.end() ) return it->second;
+
+		clang::driver::ParsedClangName parsed = clang::driver::ToolChain::getTargetAndModeFromProgramName( program );
+		ProgramName name = { nullptr, nullptr };
+		if ( parsed.TargetIsValid ) name.target = m_db->intern( "--target=" + parsed.TargetPrefix );
+		if ( parsed.DriverMode ) name.mode = m_db->intern( parsed.DriverMode );
+		m_program_names[program] = name;
+		return name;
+	}
+
+	// the string at m_p, out views the file unless the string has escapes, then it views scratch
+	bool string( llvm::StringRef* out, std::string& scratch )
+	{
+		if ( !consume( '"' ) ) return false;
+		const char* quote = (const char*)memchr( m_p, '"', m_end - m_p );
+		if ( !quote ) return false;
+
+		const char* backslash = (const char*)memchr( m_p, '\\', quote - m_p );
+		if ( !backslash ) {
+			*out = llvm::StringRef( m_p, quote - m_p );
+			m_p = quote + 1;
+			return true;
+		}
+
+		// copy the runs between escapes, an escaped quote means the closing one is further on
+		scratch.clear();
+		while ( true )
+		{
+			scratch.append( m_p, backslash );
+			m_p = backslash + 1;
+			if ( m_p == m_end ) return false;
+			char c = *m_p++;
+			switch ( c )
+			{
+			case '"': case '\\': case '/': scratch.push_back( c ); break;
+			case 'b': scratch.push_back( '\b' ); break;
+			case 'f': scratch.push_back( '\f' ); break;
+			case 'n': scratch.push_back( '\n' ); break;
+			case 'r': scratch.push_back( '\r' ); break;
+			case 't': scratch.push_back( '\t' ); break;
+			case 'u': if ( !codePoint( scratch ) ) return false; break;
+			default: return false;
+			}
+
+			quote = (const char*)memchr( m_p, '"', m_end - m_p );
+			if ( !quote ) return false;
+			backslash = (const char*)memchr( m_p, '\\', quote - m_p );
+			if ( !backslash ) {
+				scratch.append( m_p, quote );
+				m_p = quote + 1;
+				*out = scratch;
+				return true;
+			}
+		}
+	}
+
+	bool hex4( uint32_t* out )
+	{
+		if ( m_end - m_p < 4 ) return false;
+		uint32_t value = 0;
+		for ( int i = 0; i < 4; i++ )
+		{
+			unsigned digit = llvm::hexDigitValue( *m_p++ );
+			if ( digit == -1U ) return false;
+			value = value << 4 | digit;
+		}
+		*out = value;
+		return true;
+	}
+
+	// after \u, a surrogate pair is a second \u
+	bool codePoint( std::string& scratch )
+	{
+		uint32_t code;
+		if ( !hex4( &code ) ) return false;
+		if ( code >= 0xD800 && code < 0xDC00 ) {
+			uint32_t low;
+			if ( m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u' ) return false;
+			m_p += 2;
+			if ( !hex4( &low ) || low < 0xDC00 || low >= 0xE000 ) return false;
+			code = 0x10000 + ( ( code - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+		}
+
+		if ( code < 0x80 ) {
+			scratch.push_back( (char)code );
+		} else if ( code < 0x800 ) {
+			scratch.push_back( (char)( 0xC0 | code >> 6 ) );
+			scratch.push_back( (char)( 0x80 | ( code & 0x3F ) ) );
+		} else if ( code < 0x10000 ) {
+			scratch.push_back( (char)( 0xE0 | code >> 12 ) );
+			scratch.push_back( (char)( 0x80 | ( code >> 6 & 0x3F ) ) );
+			scratch.push_back( (char)( 0x80 | ( code & 0x3F ) ) );
+		} else {
+			scratch.push_back( (char)( 0xF0 | code >> 18 ) );
+			scratch.push_back( (char)( 0x80 | ( code >> 12 & 0x3F ) ) );
+			scratch.push_back( (char)( 0x80 | ( code >> 6 & 0x3F ) ) );
+			scratch.push_back( (char)( 0x80 | ( code & 0x3F ) ) );
+		}
+		return true;
+	}
+};
+
+// null if there is no compile_commands.json or the loader leaves it to clang
+static CompileDatabase* loadCompileCommands( const char* directory )
+{
+	llvm::SmallString<256> path( directory );
+	llvm::sys::path::append( path, "compile_commands.json" );
+
+	// mapped rather than read unless it's small
+	llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> file = llvm::MemoryBuffer::getFile( path, false, false );
+	if ( !file ) return nullptr;
+
+	// nothing gets longer when it's interned, the only text that isn't in the file is a --target and --driver-mode per program name
+	// a command takes more than 16 bytes of json, an argument at least 2 and each command can get 2 more for its program name
+	size_t len = (*file)->getBufferSize();
+	size_t commands = len / 16 + 1;
+	CompileDatabase* db = new CompileDatabase( len * 2 + 4096, len / 2 + commands * 3, commands );
+	if ( CompileCommandsLoader( db, (*file)->getBuffer() ).load() ) return db;
+	CompileDatabase_deinit( db );
+	return nullptr;
+}
+
+EXPORTED CompileDatabase* parseDB( const char* directory, const char** err )
+{
+	fflush( stdout );
+	CompileDatabase* out = loadCompileCommands( directory );
+	if ( out ) return out;
+
+	std::string load_err;
+	std::unique_ptr<clang::tooling::CompilationDatabase> db = 
+		clang::tooling::CompilationDatabase::loadFromDirectory(directory, load_err);
+	if ( !db ) {
+		*err = strdup( load_err.c_str() );
+		return nullptr;
+	}
+
+	std::vector<clang::tooling::CompileCommand> cmds = db->getAllCompileCommands();
+
+	// every string once per use is more than enough, interning only shrinks it
+	size_t text_bytes = 0;
+	size_t argv_count = 0;
+	for ( const clang::tooling::CompileCommand& cmd : cmds )
+	{
+		text_bytes += cmd.Directory.size() + cmd.Filename.size() + cmd.Output.size() + cmd.Heuristic.size() + 4;
+		for ( const std::string& arg : cmd.CommandLine ) text_bytes += arg.size() + 1;
+		argv_count += cmd.CommandLine.size();
+	}
+	out = new CompileDatabase( text_bytes, argv_count, cmds.size() );
+
+	llvm::SmallVector<const char*, 256> args;
+	for ( clang::tooling::CompileCommand& cmd : cmds )
+	{
+		args.clear();
+		for ( const std::string& arg : cmd.CommandLine ) args.push_back( out->intern( arg ) );
+
+		const char* heuristic = cmd.Heuristic.empty() ? nullptr : out->intern( cmd.Heuristic );
+		out->add( out->intern( cmd.Directory ), out->intern( cmd.Filename ), out->intern( cmd.Output ), heuristic, args );
 	}
 
 	return out;
 }
 
-// TODO: look at  ASTUnit::LoadFromCommandLine and see if there is anything missing
-EXPORTED void parseFromArgs( RecorderInterface interface, u64 argc, const char* argv[] )
+// a file's contents shared by every TU that opens it, kept alive by whoever still holds it
+// the contents are a copy on the heap, so a TU that is mid parse when the file gets invalidated keeps reading the old contents
+class SharedBuffer : public llvm::MemoryBuffer
 {
+public:
+	SharedBuffer( std::shared_ptr<llvm::MemoryBuffer> b, llvm::StringRef n ) : owner{ std::move( b ) }, name{ n.str() }
+	{
+		init( owner->getBufferStart(), owner->getBufferEnd(), true );
+	}
+
+	llvm::StringRef getBufferIdentifier() const override { return name; }
+	BufferKind getBufferKind() const override { return owner->getBufferKind(); }
+
+private:
+	std::shared_ptr<llvm::MemoryBuffer> owner;
+	std::string name;
+};
+
+// stat results and file contents shared by every TU parsed in a session, keyed by absolute path
+// so an entry is valid for every TU regardless of its working directory
+// TUs of a database come through WorkingDirectoryFS, anything still relative is taken from the process's working directory
+// contents are read into memory the first time a TU asks for them, never mapped
+// a mapping would outlive the TU in the cache, and an editor rewriting the file in place would change it under every TU or truncate it into a SIGBUS
+// at most CONTENT_BUDGET bytes of contents are kept, the least recently used go first, buffers a TU still holds stay valid
+class SharedFileCacheFS : public llvm::vfs::ProxyFileSystem
+{
+public:
+	static const u64 CONTENT_BUDGET = 1ull << 30;
+
+	SharedFileCacheFS( llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs ) : ProxyFileSystem( std::move( fs ) ) {}
+
+	llvm::ErrorOr<llvm::vfs::Status> status( const llvm::Twine& path ) override
+	{
+		llvm::SmallString<256> buf;
+		llvm::StringRef key = absolute( path, buf );
+		{
+			std::shared_lock<std::shared_mutex> guard( lock );
+			auto it = stats.find( key );
+			if ( it != stats.end() ) {
+				counters.stat_hits++;
+				return it->second;
+			}
+		}
+
+		counters.stat_misses++;
+		llvm::ErrorOr<llvm::vfs::Status> result = ProxyFileSystem::status( key );
+
+		std::unique_lock<std::shared_mutex> guard( lock );
+		stats.insert( { key, result } );
+		return result;
+	}
+
+	// regular files are opened without touching the disk, anything else goes straight through
+	llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead( const llvm::Twine& path ) override
+	{
+		llvm::SmallString<256> buf;
+		llvm::StringRef key = absolute( path, buf );
+		llvm::ErrorOr<llvm::vfs::Status> result = status( key );
+		if ( !result ) return result.getError();
+		if ( !result->isRegularFile() ) return ProxyFileSystem::openFileForRead( key );
+		return std::unique_ptr<llvm::vfs::File>( new CachedFile( this, *result ) );
+	}
+
+	// the file changed or was created since it was cached
+	void invalidate( llvm::StringRef path )
+	{
+		llvm::SmallString<256> buf;
+		llvm::StringRef key = absolute( path, buf );
+		std::unique_lock<std::shared_mutex> guard( lock );
+		stats.erase( key );
+		auto it = contents.find( key );
+		if ( it != contents.end() ) {
+			contentBytes -= it->second.buffer->getBufferSize();
+			contents.erase( it );
+		}
+	}
+
+	void clear()
+	{
+		std::unique_lock<std::shared_mutex> guard( lock );
+		stats.clear();
+		contents.clear();
+		contentBytes = 0;
+	}
+
+	FileStats fileStats() const
+	{
+		return { counters.stat_hits, counters.stat_misses, counters.read_hits, counters.read_misses, counters.bytes_read, counters.bytes_served, counters.bytes_evicted };
+	}
+
+private:
+	class CachedFile : public llvm::vfs::File
+	{
+	public:
+		CachedFile( SharedFileCacheFS* f, llvm::vfs::Status s ) : fs{ f }, stat{ std::move( s ) } {}
+
+		llvm::ErrorOr<llvm::vfs::Status> status() override { return stat; }
+		llvm::ErrorOr<std::string> getName() override { return stat.getName().str(); }
+		std::error_code close() override { return {}; }
+
+		// always null terminated, that satisfies callers that don't need it too
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer( const llvm::Twine& name, int64_t, bool, bool volatile_file ) override
+		{
+			return fs->read( stat.getName(), name, volatile_file );
+		}
+
+	private:
+		SharedFileCacheFS* fs;
+		llvm::vfs::Status stat;
+	};
+
+	llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> read( llvm::StringRef key, const llvm::Twine& name, bool volatile_file )
+	{
+		llvm::SmallString<256> name_buf;
+		llvm::StringRef buffer_name = name.toStringRef( name_buf );
+		if ( !volatile_file ) {
+			std::shared_lock<std::shared_mutex> guard( lock );
+			auto it = contents.find( key );
+			if ( it != contents.end() ) {
+				counters.read_hits++;
+				counters.bytes_served += it->second.buffer->getBufferSize();
+				it->second.used.store( ticks++, std::memory_order_relaxed );
+				return std::make_unique<SharedBuffer>( it->second.buffer, buffer_name );
+			}
+		}
+
+		auto file = ProxyFileSystem::openFileForRead( key );
+		if ( !file ) return file.getError();
+		auto loaded = (*file)->getBuffer( buffer_name, -1, true, /* IsVolatile, read instead of mapped */ true );
+		if ( !loaded ) return loaded.getError();
+
+		counters.read_misses++;
+		counters.bytes_read += (*loaded)->getBufferSize();
+		if ( volatile_file ) return loaded;
+
+		// another TU may have read it in the meantime, everyone shares whichever copy got in first
+		std::shared_ptr<llvm::MemoryBuffer> shared = std::move( *loaded );
+		u64 size = shared->getBufferSize();
+		if ( size <= CONTENT_BUDGET )
+		{
+			std::unique_lock<std::shared_mutex> guard( lock );
+			auto [it, inserted] = contents.try_emplace( key );
+			if ( inserted ) {
+				it->second.buffer = shared;
+				contentBytes += size;
+				evict( it->getKey() );
+			}
+			else {
+				shared = it->second.buffer;
+			}
+			it->second.used.store( ticks++, std::memory_order_relaxed );
+		}
+		return std::make_unique<SharedBuffer>( std::move( shared ), buffer_name );
+	}
+
+	// with the lock held, drops the least recently used contents until they fit in three quarters of the budget
+	// so a full cache doesn't evict on every read, keep is the entry that was just added
+	void evict( llvm::StringRef keep )
+	{
+		if ( contentBytes <= CONTENT_BUDGET ) return;
+
+		std::vector<std::pair<u64, llvm::StringRef>> order;
+		order.reserve( contents.size() );
+		for ( auto& entry : contents )
+		{
+			if ( entry.getKey() != keep ) order.push_back( { entry.second.used.load( std::memory_order_relaxed ), entry.getKey() } );
+		}
+		std::sort( order.begin(), order.end() );
+
+		std::vector<std::string> evicted;
+		for ( auto& [used, key] : order )
+		{
+			if ( contentBytes <= CONTENT_BUDGET / 4 * 3 ) break;
+			u64 size = contents.find( key )->second.buffer->getBufferSize();
+			contentBytes -= size;
+			counters.bytes_evicted += size;
+			evicted.push_back( key.str() );
+		}
+		// the keys in order point into the entries
+		for ( const std::string& key : evicted ) contents.erase( key );
+	}
+
+	static llvm::StringRef absolute( const llvm::Twine& path, llvm::SmallVectorImpl<char>& buf )
+	{
+		path.toVector( buf );
+		llvm::sys::fs::make_absolute( buf );
+		// .. is kept, through a symlinked directory it isn't where collapsing it would go
+		llvm::sys::path::remove_dots( buf, false );
+		return { buf.data(), buf.size() };
+	}
+
+	struct Counters
+	{
+		std::atomic<u64> stat_hits{ 0 };
+		std::atomic<u64> stat_misses{ 0 };
+		std::atomic<u64> read_hits{ 0 };
+		std::atomic<u64> read_misses{ 0 };
+		std::atomic<u64> bytes_read{ 0 };
+		std::atomic<u64> bytes_served{ 0 };
+		std::atomic<u64> bytes_evicted{ 0 };
+	};
+
+	struct Content
+	{
+		std::shared_ptr<llvm::MemoryBuffer> buffer;
+		std::atomic<u64> used{ 0 }; // ticks at the last read, bumped under the shared lock
+	};
+
+	std::shared_mutex lock;
+	llvm::StringMap<llvm::ErrorOr<llvm::vfs::Status>> stats;
+	llvm::StringMap<Content> contents;
+	u64 contentBytes = 0; // sizes of every buffer in contents
+	std::atomic<u64> ticks{ 0 };
+	Counters counters;
+};
+
+// per TU view of the shared file system, the TUs in a database each have their own
+// directory so relative paths get made absolute here before they reach the shared cache
+class WorkingDirectoryFS : public llvm::vfs::ProxyFileSystem
+{
+public:
+	WorkingDirectoryFS( const char* directory, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs ) 
+		: ProxyFileSystem( std::move( fs ) ), cwd{ directory } {}
+
+	llvm::ErrorOr<llvm::vfs::Status> status( const llvm::Twine& path ) override
+	{
+		llvm::SmallString<256> buf;
+		return ProxyFileSystem::status( absolute( path, buf ) );
+	}
+
+	llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead( const llvm::Twine& path ) override
+	{
+		llvm::SmallString<256> buf;
+		return ProxyFileSystem::openFileForRead( absolute( path, buf ) );
+	}
+
+	llvm::vfs::directory_iterator dir_begin( const llvm::Twine& dir, std::error_code& ec ) override
+	{
+		llvm::SmallString<256> buf;
+		return ProxyFileSystem::dir_begin( absolute( dir, buf ), ec );
+	}
+
+	llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const override
+	{
+		return cwd;
+	}
+
+	std::error_code setCurrentWorkingDirectory( const llvm::Twine& path ) override
+	{
+		llvm::SmallString<256> buf;
+		cwd = absolute( path, buf ).str();
+		return {};
+	}
+
+private:
+	std::string cwd;
+
+	llvm::StringRef absolute( const llvm::Twine& path, llvm::SmallVectorImpl<char>& buf ) const
+	{
+		path.toVector( buf );
+		llvm::sys::fs::make_absolute( cwd, buf );
+		// .. is left alone, collapsing it lexically goes to the wrong place when the directory before it is a symlink
+		llvm::sys::path::remove_dots( buf, false );
+		return { buf.data(), buf.size() };
+	}
+};
+
+// precompiled preambles shared between TUs, keyed by the preamble text, the main file's directory
+// (for quoted includes) and every flag that isn't the input or output
+// each one is built from a copy of the preamble written next to it and stored as a regular pch,
+// clang validates it against the headers on load so they stay valid across runs
+class PreambleCache
+{
+public:
+	struct Entry
+	{
+		std::string pch; // empty if there is no usable preamble
+		clang::PreambleBounds bounds{ 0, false };
+		u64 key = 0;
+	};
+
+	// skip_bodies leaves function bodies out of every preamble, they are then skipped in headers even when the main file keeps them
+	// the pch files get rebuilt in place, file_cache is told whenever one is
+	PreambleCache( const char* dir, bool skip_bodies, SharedFileCacheFS* file_cache ) : skipBodies{ skip_bodies }, fileCache{ file_cache }
+	{
+		llvm::SmallString<256> buf;
+		if ( dir ) {
+			buf = dir;
+		} else {
+			llvm::sys::path::system_temp_directory( true, buf );
+			llvm::sys::path::append( buf, "cet-preamble" );
+		}
+		directory = buf.str();
+		llvm::sys::fs::create_directories( directory );
+	}
+
+	Entry get( const clang::CompilerInvocation& invocation, u64 argc, const char* argv[], llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs )
+	{
+		Entry entry;
+		const clang::FrontendOptions& frontend = invocation.getFrontendOpts();
+		if ( frontend.Inputs.size() != 1 || !frontend.Inputs[0].isFile() ) return entry;
+
+		llvm::StringRef main_file = frontend.Inputs[0].getFile();
+		auto buffer = vfs->getBufferForFile( main_file );
+		if ( !buffer ) return entry;
+
+		entry.bounds = clang::ComputePreambleBounds( invocation.getLangOpts(), (*buffer)->getMemBufferRef(), 0 );
+		if ( entry.bounds.Size == 0 ) return entry;
+
+		llvm::StringRef preamble = (*buffer)->getBuffer().substr( 0, entry.bounds.Size );
+
+		llvm::SmallString<256> main_dir = main_file;
+		vfs->makeAbsolute( main_dir );
+		llvm::sys::path::remove_filename( main_dir );
+
+		std::string key_text;
+		key_text.append( preamble.data(), preamble.size() );
+		key_text.push_back( '\0' );
+		key_text.append( main_dir.data(), main_dir.size() );
+		key_text.push_back( skipBodies ? 'S' : 'F' );
+		for ( u64 i = 1; i < argc; i++ )
+		{
+			llvm::StringRef arg = argv[i];
+			if ( arg == main_file ) continue;
+			if ( arg == "-o" ) { i++; continue; }
+			if ( arg.starts_with( "-o" ) || arg.starts_with( "/Fo" ) || arg.starts_with( "-Fo" ) ) continue;
+			key_text.push_back( '\0' );
+			key_text.append( arg.data(), arg.size() );
+		}
+		entry.key = llvm::xxh3_64bits( llvm::arrayRefFromStringRef( key_text ) );
+
+		llvm::SmallString<256> pch = llvm::StringRef( directory );
+		llvm::sys::path::append( pch, llvm::Twine::utohexstr( entry.key ) + ".pch" );
+
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			State& state = states[entry.key];
+			if ( state == State::Ready ) { entry.pch = pch.str(); return entry; }
+			if ( state != State::Unknown ) return entry; // failed before or another thread is building it, parse without
+			state = State::Building;
+		}
 
-		// fixme: do I need to use injectResourceDir here?
+		// built by an earlier run
+		bool ready = llvm::sys::fs::exists( pch ) || build( invocation, preamble, main_dir, pch, vfs );
+		fileCache->invalidate( pch );
 
+		std::lock_guard<std::mutex> guard( lock );
+		states[entry.key] = ready ? State::Ready : State::Failed;
+		if ( ready ) entry.pch = pch.str();
+		return entry;
+	}
+
+	// the pch failed to load or one of its inputs changed
+	// delete it so the next TU that needs it will build it again
+	void invalidate( u64 key )
+	{
+		llvm::SmallString<256> pch = llvm::StringRef( directory );
+		llvm::sys::path::append( pch, llvm::Twine::utohexstr( key ) + ".pch" );
+		llvm::sys::fs::remove( pch );
+		fileCache->invalidate( pch );
+
+		std::lock_guard<std::mutex> guard( lock );
+		states[key] = State::Unknown;
+		auto it = inputs.find( key );
+		if ( it == inputs.end() ) return;
+		for ( const std::string& file : it->second )
+		{
+			auto users = usedBy.find( file );
+			if ( users == usedBy.end() ) continue;
+			users->second.erase( std::remove( users->second.begin(), users->second.end(), key ), users->second.end() );
+			if ( users->second.empty() ) usedBy.erase( users );
+		}
+		inputs.erase( it );
+	}
+
+	// the files the pch was built from, taken from the first TU that loads it whether it was built this run or an earlier one
+	void addInputs( u64 key, clang::ASTUnit& ast )
+	{
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			if ( inputs.count( key ) ) return;
+		}
+
+		llvm::IntrusiveRefCntPtr<clang::ASTReader> reader = ast.getASTReader();
+		if ( !reader ) return;
+		clang::FileManager& fm = ast.getFileManager();
+		std::vector<std::string> files;
+		for ( clang::serialization::ModuleFile& module : reader->getModuleManager() )
+		{
+			reader->visitInputFiles( module, true, false, [&]( const clang::serialization::InputFile& input, bool )
+			{
+				clang::OptionalFileEntryRef file = input.getFile();
+				if ( !file ) return;
+				llvm::SmallString<256> path = file->getName();
+				fm.makeAbsolutePath( path );
+				files.push_back( inputKey( path ) );
+			} );
+		}
+
+		std::lock_guard<std::mutex> guard( lock );
+		auto [it, inserted] = inputs.try_emplace( key, std::move( files ) );
+		if ( !inserted ) return;
+		for ( const std::string& file : it->second ) usedBy[file].push_back( key );
+	}
+
+	// drops every pch built from one of paths, paths are absolute
+	void invalidateInputs( const char** paths, u64 count )
+	{
+		std::vector<u64> keys;
+		{
+			std::lock_guard<std::mutex> guard( lock );
+			for ( u64 i = 0; i < count; i++ )
+			{
+				llvm::SmallString<256> path = llvm::StringRef( paths[i] );
+				auto it = usedBy.find( inputKey( path ) );
+				if ( it != usedBy.end() ) keys.insert( keys.end(), it->second.begin(), it->second.end() );
+			}
+		}
+		std::sort( keys.begin(), keys.end() );
+		keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+		for ( u64 key : keys ) invalidate( key );
+	}
+
+	static void apply( clang::CompilerInvocation& invocation, const Entry& entry )
+	{
+		clang::PreprocessorOptions& pp = invocation.getPreprocessorOpts();
+		pp.ImplicitPCHInclude = entry.pch;
+		pp.PrecompiledPreambleBytes = { entry.bounds.Size, entry.bounds.PreambleEndsAtStartOfLine };
+	}
+
+private:
+	enum class State { Unknown, Building, Ready, Failed };
+
+	std::string directory;
+	bool skipBodies;
+	SharedFileCacheFS* fileCache;
+	std::mutex lock;
+	std::unordered_map<u64, State> states;
+	std::unordered_map<u64, std::vector<std::string>> inputs; // by key, once a TU has loaded the pch
+	llvm::StringMap<std::vector<u64>> usedBy; // the keys of the pchs built from each input
+
+	// only for matching paths, the paths callers invalidate have .. collapsed
+	static std::string inputKey( llvm::SmallVectorImpl<char>& path )
+	{
+		llvm::sys::path::remove_dots( path, true );
+		return std::string( path.data(), path.size() );
+	}
+
+	bool build( const clang::CompilerInvocation& invocation, llvm::StringRef preamble, llvm::StringRef main_dir, llvm::StringRef pch, llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs )
+	{
+		// other processes can share the directory and be building from the same header right now, so nothing is written in place
+		// the header is the same for everyone with the same key and only ever created, replacing it would change its mtime under their pch
+		std::string header = (pch.drop_back( 4 ) + ".h").str();
+		if ( !llvm::sys::fs::exists( header ) )
+		{
+			int fd;
+			llvm::SmallString<256> tmp_header;
+			if ( llvm::sys::fs::createUniqueFile( header + "-%%%%%%%%.tmp", fd, tmp_header ) ) return false;
+			{
+				llvm::raw_fd_ostream out( fd, true );
+				out << preamble;
+				if ( out.has_error() ) { out.clear_error(); llvm::sys::fs::remove( tmp_header ); return false; }
+			}
+			std::error_code ec = llvm::sys::fs::create_hard_link( tmp_header, header );
+			llvm::sys::fs::remove( tmp_header );
+			if ( ec && ec != std::errc::file_exists ) return false;
+		}
+
+		// written next to it and moved into place once it is complete, a reader never sees half a pch
+		llvm::SmallString<256> tmp_pch;
+		llvm::sys::fs::createUniquePath( pch + "-%%%%%%%%.tmp", tmp_pch, false );
+
+		auto pch_invocation = std::make_shared<clang::CompilerInvocation>( invocation );
+		clang::FrontendOptions& frontend = pch_invocation->getFrontendOpts();
+		clang::InputKind kind = frontend.Inputs[0].getKind().getHeader();
+		frontend.Inputs.clear();
+		frontend.Inputs.emplace_back( header, kind );
+		frontend.OutputFile = tmp_pch.str().str();
+		frontend.ProgramAction = clang::frontend::GeneratePCH;
+		frontend.SkipFunctionBodies = skipBodies;
+
+		// the header doesn't live next to the main file anymore, its directory goes ahead of any -iquote dirs
+		// which is where a quoted include in the main file would have looked first
+		std::vector<clang::HeaderSearchOptions::Entry>& entries = pch_invocation->getHeaderSearchOpts().UserEntries;
+		entries.insert( entries.begin(), clang::HeaderSearchOptions::Entry( main_dir, clang::frontend::Quoted, false, true ) );
+
+		clang::CompilerInstance ci( std::make_shared<clang::PCHContainerOperations>() );
+		ci.setInvocation( pch_invocation );
+		ci.createDiagnostics();
+		ci.createFileManager( vfs );
+
+		clang::GeneratePCHAction action;
+		if ( !ci.ExecuteAction( action ) || ci.getDiagnostics().hasErrorOccurred() || llvm::sys::fs::rename( tmp_pch, pch ) ) {
+			llvm::sys::fs::remove( tmp_pch );
+			return false;
+		}
+		return true;
+	}
+};
+
+// arenas reserved or committed from now on follow the options
+static void applyMemoryFlags( ParseOptions options )
+{
+	uint64_t flags = 0;
+	if ( options.flags & PARSE_HUGE_PAGES ) flags |= OS_MEM_HUGE_PAGES;
+	if ( options.flags & PARSE_PREFAULT ) flags |= OS_MEM_PREFAULT;
+	OS_MemSetFlags( flags );
+}
+
+// state shared between every TU parsed by the same caller, kept warm between calls by a parse server
+struct ParseSession
+{
+	ParseOptions options;
+	llvm::IntrusiveRefCntPtr<SharedFileCacheFS> vfs;
+	std::unique_ptr<PreambleCache> preambles;
+	std::unique_ptr<HeaderRegistry> headers;
+
+	ParseSession( ParseOptions o ) : options{ o }, vfs{ llvm::makeIntrusiveRefCnt<SharedFileCacheFS>( llvm::vfs::createPhysicalFileSystem() ) }
+	{
+		applyMemoryFlags( options );
+		if ( options.flags & PARSE_SHARED_PREAMBLE ) preambles = std::make_unique<PreambleCache>( options.preamble_dir, options.flags & PARSE_SKIP_BODIES, vfs.get() );
+		if ( options.flags & PARSE_DEDUPE_HEADERS ) headers = std::make_unique<HeaderRegistry>();
+	}
+};
+
+// Preamble only skips bodies in the leading includes, everything after them and the main file is parsed in full
+static clang::SkipFunctionBodiesScope skipScope( u64 flags )
+{
+	if ( !( flags & PARSE_SKIP_BODIES ) ) return clang::SkipFunctionBodiesScope::None;
+	if ( flags & PARSE_KEEP_MAIN_BODIES ) return clang::SkipFunctionBodiesScope::Preamble;
+	return clang::SkipFunctionBodiesScope::PreambleAndMainFile;
+}
+
+// notes whether the pch could not be loaded or validated, every diagnostic still goes on to the original client
+// those come from the serialization diagnostics, errors anywhere else are the TU's own and say nothing about the pch
+class PchFailureConsumer : public clang::DiagnosticConsumer
+{
+public:
+	explicit PchFailureConsumer( std::unique_ptr<clang::DiagnosticConsumer> t ) : target{ std::move( t ) } {}
+
+	void BeginSourceFile( const clang::LangOptions& opts, const clang::Preprocessor* pp ) override { if ( target ) target->BeginSourceFile( opts, pp ); }
+	void EndSourceFile() override { if ( target ) target->EndSourceFile(); }
+	void finish() override { if ( target ) target->finish(); }
+
+	void HandleDiagnostic( clang::DiagnosticsEngine::Level level, const clang::Diagnostic& info ) override
+	{
+		unsigned id = info.getID();
+		bool serialization = id >= clang::diag::DIAG_START_SERIALIZATION && id < clang::diag::DIAG_START_LEX;
+		if ( level >= clang::DiagnosticsEngine::Error && ( serialization || id == clang::diag::err_fe_unable_to_load_pch ) ) failed = true;
+
+		clang::DiagnosticConsumer::HandleDiagnostic( level, info );
+		if ( target ) target->HandleDiagnostic( level, info );
+	}
+
+	bool failed = false;
+
+private:
+	std::unique_ptr<clang::DiagnosticConsumer> target;
+};
+
+static std::unique_ptr<clang::ASTUnit> loadAstWithPreamble( ParseSession& session, u64 argc, const char* argv[], llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs )
+{
+	auto diags = clang::CompilerInstance::createDiagnostics( new clang::DiagnosticOptions );
+	clang::CreateInvocationOptions invocation_options;
+	invocation_options.Diags = diags;
+	invocation_options.VFS = vfs;
+	std::shared_ptr<clang::CompilerInvocation> invocation = clang::createInvocation( llvm::ArrayRef( argv, argc ), invocation_options );
+	if ( !invocation ) return nullptr;
+	invocation->getFrontendOpts().SkipFunctionBodies = skipScope( session.options.flags ) == clang::SkipFunctionBodiesScope::PreambleAndMainFile;
+
+	PreambleCache::Entry preamble = session.preambles->get( *invocation, argc, argv, vfs );
+	if ( preamble.pch.empty() ) {
+		auto fm = llvm::makeIntrusiveRefCnt<clang::FileManager>( clang::FileSystemOptions(), vfs );
+		return clang::ASTUnit::LoadFromCompilerInvocation( invocation, std::make_shared<clang::PCHContainerOperations>(), diags, fm.get() );
+	}
+
+	auto with_preamble = std::make_shared<clang::CompilerInvocation>( *invocation );
+	PreambleCache::apply( *with_preamble, preamble );
+
+	// owned by diags, which the ast keeps
+	PchFailureConsumer* pch = new PchFailureConsumer( diags->takeClient() );
+	diags->setClient( pch, true );
+
+	auto fm = llvm::makeIntrusiveRefCnt<clang::FileManager>( clang::FileSystemOptions(), vfs );
+	std::unique_ptr<clang::ASTUnit> ast = clang::ASTUnit::LoadFromCompilerInvocation( with_preamble, std::make_shared<clang::PCHContainerOperations>(), diags, fm.get() );
+	// errors in the TU itself don't make the pch stale, the TU would fail the same way without it
+	if ( !pch->failed ) {
+		if ( ast ) session.preambles->addInputs( preamble.key, *ast );
+		return ast;
+	}
+
+	// stale or broken pch, throw it away and parse the whole file
+	session.preambles->invalidate( preamble.key );
+	diags->Reset();
+	fm = llvm::makeIntrusiveRefCnt<clang::FileManager>( clang::FileSystemOptions(), vfs );
+	return clang::ASTUnit::LoadFromCompilerInvocation( invocation, std::make_shared<clang::PCHContainerOperations>(), diags, fm.get() );
+}
+
+static std::unique_ptr<clang::ASTUnit> loadAst( ParseSession& session, u64 argc, const char* argv[], llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs )
+{
+	if ( session.preambles ) return loadAstWithPreamble( session, argc, argv, vfs );
+
+	// keeping the main file's bodies needs a preamble to skip the header bodies in, built in memory for this TU alone
+	clang::SkipFunctionBodiesScope skip = skipScope( session.options.flags );
+	bool own_preamble = skip == clang::SkipFunctionBodiesScope::Preamble;
+
+	// fixme: do I need to use injectResourceDir here?
+	return clang::ASTUnit::LoadFromCommandLine( 
+		argv, argv + argc,
+		std::make_shared<clang::PCHContainerOperations>(),
+		clang::CompilerInstance::createDiagnostics(new clang::DiagnosticOptions),
+		"",
+		own_preamble, llvm::StringRef(), false, clang::CaptureDiagsKind::None, std::nullopt, true, own_preamble ? 1 : 0,
+		clang::TU_Complete, false, false, false, skip, false, false, false, false,
+		std::nullopt, nullptr, std::move( vfs )
+		);
+}
+
+static void recordTU( ParseSession& session, Recorder& recorder, clang::ASTUnit& ast, u64 tu )
+{
+	Visitor::RecordAst( &recorder, ast, session.headers.get(), tu, session.options.flags );
+	{
+		ScopedTimer timer( &recorder.stats.dependencies_ns );
+		recordDependencies( &recorder, ast );
+	}
+	recorder.reportStats();
+}
+
+// TODO: look at  ASTUnit::LoadFromCommandLine and see if there is anything missing
+EXPORTED int parseFromArgs( ParseOptions options, RecorderInterface interface, u64 argc, const char* argv[] )
+{
 #if 0 
 	clang::ArrayRef<const char*> args( argv, argc );
 	std::unique_ptr<clang::CompilerInvocation> invocation( clang::createInvocation( args ) );
@@ -420,36 +2052,292 @@ EXPORTED void parseFromArgs( RecorderInterface interface, u64 argc, const char*
                                             /*ShouldOwnClient=*/false), nullptr );
 #endif
 
+	ParseSession session( options );
+	u64 load_ns = 0;
+	std::unique_ptr<clang::ASTUnit> ast;
+	{
+		ScopedTimer timer( &load_ns );
+		ast = loadAst( session, argc, argv, session.vfs );
+	}
+	if ( !ast ) return 0;
 
-	std::unique_ptr<clang::ASTUnit> ast = clang::ASTUnit::LoadFromCommandLine( 
-		argv, argv + argc,
-		std::make_shared<clang::PCHContainerOperations>(),
-		clang::CompilerInstance::createDiagnostics(new clang::DiagnosticOptions),
-		""
-		);
+	Recorder recorder( interface );
+	recorder.stats.load_ns = load_ns;
+	recordTU( session, recorder, *ast, 0 );
+	return 1;
+}
+
+// command indices owned by a single worker, the owner takes from the front
+// and idle workers steal the back half
+struct WorkRange
+{
+	std::mutex lock;
+	// only written under the lock, atomic so thieves can size up a range without taking it
+	std::atomic<u64> begin{ 0 };
+	std::atomic<u64> end{ 0 };
+};
 
+static bool takeWork( WorkRange& range, u64* index )
+{
+	std::lock_guard<std::mutex> guard( range.lock );
+	if ( range.begin == range.end ) return false;
+	*index = range.begin++;
+	return true;
+}
+
+static bool stealWork( WorkRange* ranges, u64 count, u64 self, u64* index )
+{
+	for (;;)
+	{
+		// pick the victim with the most remaining work, the sizes are read without the lock so they are only a guess
+		u64 victim = count;
+		u64 most = 0;
+		for ( u64 i = 0; i < count; i++ )
+		{
+			if ( i == self ) continue;
+			u64 remaining = ranges[i].end - ranges[i].begin;
+			if ( remaining > most ) { most = remaining; victim = i; }
+		}
+		if ( victim == count ) return false;
+
+		u64 begin, end;
+		{
+			std::lock_guard<std::mutex> guard( ranges[victim].lock );
+			u64 remaining = ranges[victim].end - ranges[victim].begin;
+			if ( remaining == 0 ) continue;
+
+			end = ranges[victim].end;
+			begin = end - (remaining + 1) / 2;
+			ranges[victim].end = begin;
+		}
+
+		std::lock_guard<std::mutex> guard( ranges[self].lock );
+		ranges[self].begin = begin + 1;
+		ranges[self].end = end;
+		*index = begin;
+		return true;
+	}
+}
+
+static void parseCommand( ParseSession& session, RecorderFactory factory, u64 index, const CompileCommand& cmd )
+{
+	RecorderInterface interface = factory.begin( factory.ud, index );
+	if ( interface.ud == nullptr ) return;
 
-	Recorder recorder = Recorder{interface};
-	Visitor::RecordAst( &recorder, &ast->getASTContext() );
+	auto vfs = llvm::makeIntrusiveRefCnt<WorkingDirectoryFS>( cmd.directory, session.vfs );
+	u64 load_ns = 0;
+	std::unique_ptr<clang::ASTUnit> ast;
+	{
+		ScopedTimer timer( &load_ns );
+		ast = loadAst( session, cmd.argc, cmd.argv, vfs );
+	}
+	if ( session.headers ) session.headers->begin( index );
+	if ( ast )
+	{
+		Recorder recorder( interface );
+		recorder.stats.load_ns = load_ns;
+		recordTU( session, recorder, *ast, index );
+	}
+	if ( session.headers ) session.headers->end( index );
+
+	factory.end( factory.ud, index, interface, ast != nullptr );
+}
+
+static void runPass( ParseSession& session, Slice_CompileCommand commands, const u64* indices, u64 count, RecorderFactory factory, u64 thread_count )
+{
+	if ( thread_count == 0 ) thread_count = std::max( 1u, std::thread::hardware_concurrency() );
+	if ( thread_count > count ) thread_count = std::max( (u64)1, count );
+
+	// start with an even split, stealing evens out whatever the split gets wrong
+	std::unique_ptr<WorkRange[]> ranges( new WorkRange[thread_count] );
+	for ( u64 i = 0; i < thread_count; i++ )
+	{
+		ranges[i].begin = count * i / thread_count;
+		ranges[i].end = count * (i + 1) / thread_count;
+	}
+
+	auto worker = [&]( u64 self )
+	{
+		u64 work;
+		while ( takeWork( ranges[self], &work ) || stealWork( ranges.get(), thread_count, self, &work ) )
+		{
+			u64 index = indices ? indices[work] : work;
+			parseCommand( session, factory, index, commands.ptr[index] );
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for ( u64 i = 1; i < thread_count; i++ )
+	{
+		threads.emplace_back( worker, i );
+	}
+	worker( 0 );
+
+	for ( std::thread& t : threads ) t.join();
+}
+
+// parses commands[indices[i]] for every i below count, or the first count commands if indices is null
+// with PARSE_DEDUPE_HEADERS, TUs the header registry asks for again are parsed once the rest are done, the factory sees them twice
+static void runCommands( ParseSession& session, Slice_CompileCommand commands, const u64* indices, u64 count, RecorderFactory factory, u64 thread_count )
+{
+	runPass( session, commands, indices, count, factory, thread_count );
+	if ( !session.headers ) return;
+
+	// ownership only ever moves to a lower command index, so this settles
+	for ( std::vector<u64> redo = session.headers->takeRedo(); !redo.empty(); redo = session.headers->takeRedo() )
+	{
+		runPass( session, commands, redo.data(), redo.size(), factory, thread_count );
+	}
+}
+
+EXPORTED void parseCommands( CompileDatabase* db, ParseOptions options, RecorderFactory factory, u64 thread_count )
+{
+	Slice_CompileCommand commands = CompileDatabase_getAllCommands( db );
+	ParseSession session( options );
+	runCommands( session, commands, nullptr, commands.len, factory, thread_count );
+}
+
+EXPORTED ParseSession* ParseSession_create( ParseOptions options )
+{
+	return new ParseSession( options );
+}
+
+EXPORTED void ParseSession_deinit( ParseSession* session )
+{
+	delete session;
+}
+
+EXPORTED void ParseSession_invalidate( ParseSession* session, const char** paths, u64 count )
+{
+	if ( !paths ) {
+		session->vfs->clear();
+		return;
+	}
+	for ( u64 i = 0; i < count; i++ ) session->vfs->invalidate( paths[i] );
+	if ( session->preambles ) session->preambles->invalidateInputs( paths, count );
+}
+
+EXPORTED void ParseSession_keepHeaders( ParseSession* session, u64 index, const HeaderRef* refs, u64 count )
+{
+	if ( !session->headers ) return;
+	for ( u64 i = 0; i < count; i++ ) session->headers->keep( index, refs[i].key, refs[i].owned != 0 );
+}
+
+EXPORTED FileStats ParseSession_fileStats( ParseSession* session )
+{
+	return session->vfs->fileStats();
+}
+
+EXPORTED void parseSessionCommands( ParseSession* session, CompileDatabase* db, const u64* indices, u64 count, RecorderFactory factory, u64 thread_count )
+{
+	runCommands( *session, CompileDatabase_getAllCommands( db ), indices, count, factory, thread_count );
 }
 
 int dumpAst( clang::ASTContext& ctx );
-EXPORTED void dumpFromArgs( u64 argc, const char* argv[] )
+EXPORTED void dumpFromArgs( ParseOptions options, u64 argc, const char* argv[] )
 {
-	std::unique_ptr<clang::ASTUnit> ast = clang::ASTUnit::LoadFromCommandLine( 
-	argv, argv + argc,
-	std::make_shared<clang::PCHContainerOperations>(),
-	clang::CompilerInstance::createDiagnostics(new clang::DiagnosticOptions),
-	""
-	);
+	ParseSession session( options );
+	std::unique_ptr<clang::ASTUnit> ast = loadAst( session, argc, argv, session.vfs );
+	if ( !ast ) return;
 
 	dumpAst( ast->getASTContext() );
 	
 }
 
-EXPORTED ParsedModuleInfo* parseFromDB( const char* path )
+// one TU of parseFromDB, held until the TU is done since a node's link name can show up after its connections
+struct ModuleTU
 {
-	return nullptr;
+	std::vector<Node> nodes;
+	std::vector<Connection> connections;
+	std::vector<LinkIdentifier> links;
+	std::string strings;
+	std::vector<u64> string_hashes;
+
+	static void flush( void* ud, const RecordBlock* block )
+	{
+		ModuleTU* tu = (ModuleTU*)ud;
+		// the block's strings first, its nodes can refer to them
+		tu->strings.append( block->strings, block->strings_len );
+		tu->string_hashes.insert( tu->string_hashes.end(), block->string_hashes, block->string_hashes + block->strings_count );
+		for ( u64 i = 0; i < block->nodes_len; i++ ) tu->nodes.push_back( { block->node_ids[i], tu->string_hashes[block->node_strings[i]] } );
+		for ( u64 i = 0; i < block->connections_len; i++ ) tu->connections.push_back( { block->connection_from[i], block->connection_to[i] } );
+		tu->links.insert( tu->links.end(), block->links, block->links + block->links_len );
+	}
+
+	static void addDependency( void*, const char*, u64, u64, i64, u64 ) {}
+	static void addHeaderReference( void*, u64, u64, int ) {}
+};
+
+static void mergeIntoModule( ParsedModuleInfo* minfo, u64 tu_index, const ModuleTU& tu )
+{
+	// link names are the same in every TU that has the symbol, the top bit keeps them apart from the per TU ids
+	std::unordered_map<u64, u64> remap;
+	for ( const LinkIdentifier& link : tu.links )
+	{
+		remap.try_emplace( (u64)link.node_id, link.string_hash | (1ull << 63) );
+	}
+
+	auto global = [&]( u64 local ) -> u64
+	{
+		if ( local == 0 ) return 0; // the translation unit itself
+		auto it = remap.find( local );
+		if ( it != remap.end() ) return it->second;
+		return ((tu_index + 1) << 40) | local;
+	};
+
+	std::lock_guard<std::mutex> guard( minfo->lock );
+
+	size_t start = 0;
+	for ( u64 hash : tu.string_hashes )
+	{
+		size_t len = strlen( tu.strings.data() + start );
+		minfo->strings.intern( { tu.strings.data() + start, len }, hash );
+		start += len + 1;
+	}
+
+	for ( const Node& node : tu.nodes )
+	{
+		u64 id = global( node.id );
+		if ( minfo->node_ids.insert( id ).second ) minfo->nodes.push_back( { id, node.string_hash } );
+	}
+
+	for ( const Connection& connection : tu.connections )
+	{
+		std::pair<u64, u64> c = { global( connection.from ), global( connection.to ) };
+		if ( minfo->connection_set.insert( c ).second ) minfo->connections.push_back( { c.first, c.second } );
+	}
+}
+
+EXPORTED ParsedModuleInfo* parseFromDB( const char* directory, ParseOptions options )
+{
+	const char* err = nullptr;
+	CompileDatabase* db = parseDB( directory, &err );
+	if ( db == nullptr ) {
+		fprintf( stderr, "failed to load compile database: %s\n", err );
+		free( (void*)err );
+		return nullptr;
+	}
+
+	applyMemoryFlags( options );
+	ParsedModuleInfo* minfo = new ParsedModuleInfo();
+
+	RecorderFactory factory;
+	factory.ud = minfo;
+	factory.begin = []( void* ud, u64 index ) -> RecorderInterface
+	{
+		return { new ModuleTU(), &ModuleTU::flush, &ModuleTU::addDependency, &ModuleTU::addHeaderReference, nullptr };
+	};
+	factory.end = []( void* ud, u64 index, RecorderInterface recorder, int status )
+	{
+		ModuleTU* tu = (ModuleTU*)recorder.ud;
+		if ( status ) mergeIntoModule( (ParsedModuleInfo*)ud, index, *tu );
+		delete tu;
+	};
+
+	parseCommands( db, options, factory, 0 );
+	CompileDatabase_deinit( db );
+
+	return minfo;
 }
 
 
@@ -0,0 +1,496 @@
+const std = @import("std");
+const builtin = @import("builtin");
+
+const Report = @import("report.zig");
+
+
+const OptionsParser = @import("options.zig").makeOptions(.{
+	.{ "out", ?[:0]const u8, null, 'o', "directory the synthetic project is generated and indexed in, defaults to cet-bench" },
+	.{ "tus", usize, 200, 0, "number of TUs to generate" },
+	.{ "headers", usize, 64, 0, "number of headers to generate, each TU includes some of them" },
+	.{ "functions", usize, 16, 0, "functions defined in each TU" },
+	.{ "calls", usize, 8, 0, "calls in each function to functions defined in other TUs" },
+	.{ "includes", usize, 8, 0, "headers each TU includes on top of the ones it defines functions for" },
+	.{ "template-depth", usize, 64, 0, "depth of the recursive template instantiations in each header" },
+	.{ "seed", u64, 0, 0, "seed of the generator, the same seed and sizes generate the same project" },
+	.{ "jobs", usize, 0, 'j', "forwarded to cet-driver and cet-ld, 0 uses every hardware thread" },
+	.{ "generate-only", bool, false, 0, "only write the project and its compile_commands.json" },
+	.{ "results", ?[:0]const u8, null, 'r', "append the result to this path as a line of json" },
+	.{ "label", ?[:0]const u8, null, 0, "stored with the result, to tell runs with different driver options apart" },
+});
+
+// generates a synthetic project, indexes it with cet-driver, links it with cet-ld and reports the throughput
+// the args after "--" are forwarded to cet-driver, eg "cet-bench -- --in-process --skip-bodies"
+// results are printed to stdout as a line of json so runs of different commits can be compared
+
+
+pub const Params = struct {
+	tus: usize,
+	headers: usize,
+	functions: usize,
+	calls: usize,
+	includes: usize,
+	template_depth: usize,
+	seed: u64,
+};
+
+// one line of results, sizes are in bytes and times in nanoseconds
+const Result = struct {
+	commit: ?[]const u8,
+	label: ?[]const u8,
+	driver_args: []const [:0]const u8,
+	params: Params,
+	parse_ns: u64,
+	link_ns: u64,
+	tus_parsed: u64,
+	tus_failed: u64,
+	nodes: u64,
+	references: u64,
+	tus_per_s: f64,
+	nodes_per_s: f64,
+	parse_peak_rss: ?usize, // includes the cet-cl processes cet-driver waited on
+	link_peak_rss: ?usize,
+	objects_bytes: u64,
+	linked_bytes: u64,
+};
+
+// the parts of cet-driver's --report that are summed up
+const DriverReport = struct {
+	const Tu = struct {
+		ok: bool,
+		stats: ?Report.TuStats,
+	};
+
+	total_ns: u64,
+	tus: []const Tu,
+};
+
+pub fn main() !u8
+{
+	var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+	const allocator = gpa.allocator();
+	defer {
+		const deinit_status = gpa.deinit();
+		if (deinit_status == .leak) @panic("LEAK");
+	}
+
+	const options = try OptionsParser.parse( allocator );
+	defer options.deinit();
+
+	const params = Params{
+		.tus = options.get( .tus ),
+		.headers = options.get( .headers ),
+		.functions = options.get( .functions ),
+		.calls = options.get( .calls ),
+		.includes = options.get( .includes ),
+		.template_depth = options.get( .@"template-depth" ),
+		.seed = options.get( .seed ),
+	};
+	if ( params.tus == 0 or params.headers == 0 or params.functions == 0 or params.template_depth == 0 ) {
+		_ = try std.io.getStdErr().write( "tus, headers, functions and template-depth must be at least 1\n" );
+		return 1;
+	}
+
+	const out: []const u8 = options.get( .out ) orelse "cet-bench";
+	try std.fs.cwd().makePath( out );
+	var dir = try std.fs.cwd().openDir( out, .{} );
+	defer dir.close();
+
+	const root = try dir.realpathAlloc( allocator, "." );
+	defer allocator.free( root );
+
+	const stderr = std.io.getStdErr().writer();
+	var timer = try std.time.Timer.start();
+	try generate( allocator, dir, root, params );
+	try stderr.print( "generated {} TUs and {} headers in {}ms\n", .{ params.tus, params.headers, timer.read() / std.time.ns_per_ms } );
+	if ( options.get( .@"generate-only" ) ) return 0;
+
+	var jobs_buf: [32]u8 = undefined;
+	const jobs = try std.fmt.bufPrint( &jobs_buf, "{}", .{ options.get( .jobs ) } );
+
+	// parse
+	const driver_path = try childExePath( allocator, "cet-driver" );
+	defer allocator.free( driver_path );
+	const report_path = try std.fs.path.join( allocator, &.{ root, "report.json" } );
+	defer allocator.free( report_path );
+
+	var driver_args = std.ArrayList( []const u8 ).init( allocator );
+	defer driver_args.deinit();
+	try driver_args.appendSlice( &.{ driver_path, "--path", root, "--clean", "--report", report_path, "--jobs", jobs } );
+	for ( options.args ) |arg| try driver_args.append( arg );
+
+	const parse = try runTimed( allocator, driver_args.items, root );
+	if ( !parse.ok ) {
+		try stderr.print( "cet-driver failed\n", .{} );
+		return 1;
+	}
+
+	const report_text = try dir.readFileAlloc( allocator, "report.json", 1 << 30 );
+	defer allocator.free( report_text );
+	const report = try std.json.parseFromSlice( DriverReport, allocator, report_text, .{ .ignore_unknown_fields = true } );
+	defer report.deinit();
+
+	var result = Result{
+		.commit = null,
+		.label = options.get( .label ),
+		.driver_args = options.args,
+		.params = params,
+		.parse_ns = parse.ns,
+		.link_ns = 0,
+		.tus_parsed = 0,
+		.tus_failed = 0,
+		.nodes = 0,
+		.references = 0,
+		.tus_per_s = 0,
+		.nodes_per_s = 0,
+		.parse_peak_rss = parse.peak_rss,
+		.link_peak_rss = null,
+		.objects_bytes = 0,
+		.linked_bytes = 0,
+	};
+	for ( report.value.tus ) |tu|
+	{
+		const stats = tu.stats orelse {
+			result.tus_failed += 1;
+			continue;
+		};
+		result.tus_parsed += 1;
+		result.nodes += stats.nodes;
+		result.references += stats.references;
+	}
+	const parse_s = @as( f64, @floatFromInt( parse.ns ) ) / std.time.ns_per_s;
+	result.tus_per_s = @as( f64, @floatFromInt( result.tus_parsed ) ) / parse_s;
+	result.nodes_per_s = @as( f64, @floatFromInt( result.nodes ) ) / parse_s;
+
+	// link every object that was written
+	const ld_path = try childExePath( allocator, "cet-ld" );
+	defer allocator.free( ld_path );
+
+	var objects = std.ArrayList( []const u8 ).init( allocator );
+	defer {
+		for ( objects.items ) |path| allocator.free( path );
+		objects.deinit();
+	}
+	for ( 0..params.tus ) |t|
+	{
+		const path = try std.fmt.allocPrint( allocator, "obj/tu{}.cetobj", .{ t } );
+		const stat = dir.statFile( path ) catch {
+			allocator.free( path );
+			continue;
+		};
+		objects.append( path ) catch |err| {
+			allocator.free( path );
+			return err;
+		};
+		result.objects_bytes += stat.size;
+	}
+
+	var ld_args = std.ArrayList( []const u8 ).init( allocator );
+	defer ld_args.deinit();
+	try ld_args.appendSlice( &.{ ld_path, "--output", "linked.cetobj", "--jobs", jobs, "--" } );
+	try ld_args.appendSlice( objects.items );
+
+	const link = try runTimed( allocator, ld_args.items, root );
+	if ( !link.ok ) {
+		try stderr.print( "cet-ld failed\n", .{} );
+		return 1;
+	}
+	result.link_ns = link.ns;
+	result.link_peak_rss = link.peak_rss;
+	result.linked_bytes = ( try dir.statFile( "linked.cetobj" ) ).size;
+
+	const commit = gitCommit( allocator );
+	defer if ( commit ) |c| allocator.free( c );
+	result.commit = commit;
+
+	try stderr.print( "parsed {} TUs ({} failed) in {}ms, {d:.1} TUs/s, {d:.0} nodes/s, peak rss {} MiB\n", .{
+		result.tus_parsed, result.tus_failed, result.parse_ns / std.time.ns_per_ms, result.tus_per_s, result.nodes_per_s, ( result.parse_peak_rss orelse 0 ) >> 20,
+	} );
+	try stderr.print( "linked {} MiB of objects into {} MiB in {}ms, peak rss {} MiB\n", .{
+		result.objects_bytes >> 20, result.linked_bytes >> 20, result.link_ns / std.time.ns_per_ms, ( result.link_peak_rss orelse 0 ) >> 20,
+	} );
+
+	var line = std.ArrayList( u8 ).init( allocator );
+	defer line.deinit();
+	try std.json.stringify( result, .{}, line.writer() );
+	try line.append( '\n' );
+
+	try std.io.getStdOut().writeAll( line.items );
+	if ( options.get( .results ) ) |path|
+	{
+		const file = try std.fs.cwd().createFile( path, .{ .truncate = false } );
+		defer file.close();
+		try file.seekFromEnd( 0 );
+		try file.writeAll( line.items );
+	}
+
+	return 0;
+}
+
+const Run = struct {
+	ok: bool,
+	ns: u64,
+	peak_rss: ?usize,
+};
+
+fn runTimed( allocator: std.mem.Allocator, argv: []const []const u8, cwd: []const u8 ) !Run
+{
+	var child = std.process.Child.init( argv, allocator );
+	child.cwd = cwd;
+	child.request_resource_usage_statistics = true;
+
+	var timer = try std.time.Timer.start();
+	const term = try child.spawnAndWait();
+	const ns = timer.read();
+
+	return .{
+		.ok = term == .Exited and term.Exited == 0,
+		.ns = ns,
+		.peak_rss = child.resource_usage_statistics.getMaxRss(),
+	};
+}
+
+// the tools are installed next to cet-bench
+fn childExePath( allocator: std.mem.Allocator, name: []const u8 ) ![]u8
+{
+	var buf: [std.fs.max_path_bytes]u8 = undefined;
+	const self_dir = try std.fs.selfExeDirPath( &buf );
+	const file = try std.mem.concat( allocator, u8, &.{ name, builtin.target.exeFileExt() } );
+	defer allocator.free( file );
+	return std.fs.path.join( allocator, &.{ self_dir, file } );
+}
+
+// null outside of a git checkout
+fn gitCommit( allocator: std.mem.Allocator ) ?[]u8
+{
+	var buf: [std.fs.max_path_bytes]u8 = undefined;
+	const self_dir = std.fs.selfExeDirPath( &buf ) catch return null;
+	const result = std.process.Child.run( .{
+		.allocator = allocator,
+		.argv = &.{ "git", "rev-parse", "--short", "HEAD" },
+		.cwd = self_dir,
+	} ) catch return null;
+	defer {
+		allocator.free( result.stderr );
+		allocator.free( result.stdout );
+	}
+
+	if ( result.term != .Exited or result.term.Exited != 0 ) return null;
+	return allocator.dupe( u8, std.mem.trimRight( u8, result.stdout, "\r\n" ) ) catch null;
+}
+
+
+// the project:
+//   include/h<i>.hpp  a recursive class template, a recursive aggregate template and a struct, plus function declarations
+//                     each header includes two earlier ones, the includes form a tree so the nesting stays shallow
+//   include/tus.hpp   declares the functions of every TU
+//   src/tu<t>.cpp     defines the functions of the headers with i % tus == t and its own functions
+//                     which call into other TUs and instantiate the templates of the headers it includes
+//   compile_commands.json
+pub fn generate( allocator: std.mem.Allocator, dir: std.fs.Dir, root: []const u8, params: Params ) !void
+{
+	var prng = std.Random.DefaultPrng.init( params.seed );
+	const random = prng.random();
+
+	try dir.makePath( "include" );
+	try dir.makePath( "src" );
+	try dir.makePath( "obj" );
+
+	var name_buf: [64]u8 = undefined;
+	for ( 0..params.headers ) |h|
+	{
+		const name = try std.fmt.bufPrint( &name_buf, "include/h{}.hpp", .{ h } );
+		try writeFile( dir, name, params, h, random, writeHeader );
+	}
+	try writeFile( dir, "include/tus.hpp", params, 0, random, writeTuDeclarations );
+	for ( 0..params.tus ) |t|
+	{
+		const name = try std.fmt.bufPrint( &name_buf, "src/tu{}.cpp", .{ t } );
+		try writeFile( dir, name, params, t, random, writeTu );
+	}
+
+	try writeCompileCommands( allocator, dir, root, params );
+}
+
+fn writeFile( dir: std.fs.Dir, name: []const u8, params: Params, index: usize, random: std.Random, comptime write: anytype ) !void
+{
+	const file = try dir.createFile( name, .{} );
+	defer file.close();
+	var buffer = std.io.bufferedWriter( file.writer() );
+	try write( buffer.writer(), params, index, random );
+	try buffer.flush();
+}
+
+fn writeHeader( writer: anytype, params: Params, h: usize, random: std.Random ) !void
+{
+	try writer.writeAll( "#pragma once\n" );
+	if ( h > 0 ) try writer.print( "#include \"h{}.hpp\"\n", .{ ( h - 1 ) / 2 } );
+	if ( h > 1 ) try writer.print( "#include \"h{}.hpp\"\n", .{ random.uintLessThan( usize, h ) } );
+
+	try writer.print(
+		\\
+		\\namespace bench_h{0} {{
+		\\
+		\\template <int N> struct Chain {{ static constexpr long value = Chain<N - 1>::value + N % {1}; }};
+		\\template <> struct Chain<0> {{ static constexpr long value = {0}; }};
+		\\
+		\\template <typename T, int N> struct Wrap {{
+		\\	T inner;
+		\\	Wrap<T, N - 1> next;
+		\\	T get() const {{ return inner + next.get(); }}
+		\\}};
+		\\template <typename T> struct Wrap<T, 0> {{
+		\\	T inner;
+		\\	T get() const {{ return inner; }}
+		\\}};
+		\\
+		\\struct Type {{
+		\\	long a;
+		\\	Type( long v );
+		\\	long method( long x ) const;
+		\\}};
+		\\
+		\\
+	, .{ h, h + 2 } );
+	for ( 0..params.functions ) |f| try writer.print( "long f{}( long x );\n", .{ f } );
+	try writer.writeAll( "\n}\n" );
+}
+
+fn writeTuDeclarations( writer: anytype, params: Params, _: usize, _: std.Random ) !void
+{
+	try writer.writeAll( "#pragma once\n\n" );
+	for ( 0..params.tus ) |t|
+	{
+		try writer.print( "namespace bench_tu{} {{\n", .{ t } );
+		for ( 0..params.functions ) |f| try writer.print( "long g{}( long x );\n", .{ f } );
+		try writer.writeAll( "}\n" );
+	}
+}
+
+fn writeTu( writer: anytype, params: Params, t: usize, random: std.Random ) !void
+{
+	// the headers this TU defines functions for come first, then the random ones
+	var included: [256]usize = undefined;
+	var included_len: usize = 0;
+	var h = t;
+	while ( h < params.headers and included_len < included.len ) : ( h += params.tus )
+	{
+		included[included_len] = h;
+		included_len += 1;
+	}
+	const owned_len = included_len;
+	for ( 0..@min( params.includes, included.len - included_len ) ) |_|
+	{
+		included[included_len] = random.uintLessThan( usize, params.headers );
+		included_len += 1;
+	}
+
+	try writer.writeAll( "#include \"tus.hpp\"\n" );
+	for ( included[0..included_len] ) |i| try writer.print( "#include \"h{}.hpp\"\n", .{ i } );
+
+	for ( included[0..owned_len] ) |i|
+	{
+		try writer.print(
+			\\
+			\\namespace bench_h{0} {{
+			\\Type::Type( long v ) : a( v ) {{}}
+			\\long Type::method( long x ) const {{ return a * x + Chain<{1}>::value; }}
+			\\
+		, .{ i, params.template_depth } );
+		for ( 0..params.functions ) |f|
+		{
+			if ( f == 0 ) {
+				try writer.print( "long f0( long x ) {{ return x + {}; }}\n", .{ i } );
+			} else {
+				try writer.print( "long f{}( long x ) {{ return f{}( x ) * {}; }}\n", .{ f, f - 1, f } );
+			}
+		}
+		try writer.writeAll( "}\n" );
+	}
+
+	try writer.print( "\nnamespace bench_tu{} {{\n", .{ t } );
+	for ( 0..params.functions ) |f|
+	{
+		const local = included[random.uintLessThan( usize, included_len )];
+		try writer.print(
+			\\
+			\\long g{0}( long x ) {{
+			\\	long sum = x;
+			\\	bench_h{1}::Type value( x );
+			\\	sum += value.method( {0} );
+			\\	bench_h{1}::Wrap<long, {2}> wrap{{}};
+			\\	sum += wrap.get() + bench_h{1}::Chain<{3}>::value;
+			\\
+		, .{ f, local, params.template_depth, random.uintLessThan( usize, params.template_depth ) } );
+
+		// half the calls go to the functions of the included headers, defined in whichever TU owns the header
+		// the other half to the functions of any TU
+		for ( 0..params.calls ) |c|
+		{
+			if ( c % 2 == 0 ) {
+				const target = included[random.uintLessThan( usize, included_len )];
+				try writer.print( "\tsum += bench_h{}::f{}( sum );\n", .{ target, random.uintLessThan( usize, params.functions ) } );
+			} else {
+				const target = random.uintLessThan( usize, params.tus );
+				try writer.print( "\tsum += bench_tu{}::g{}( sum );\n", .{ target, random.uintLessThan( usize, params.functions ) } );
+			}
+		}
+		try writer.writeAll( "\treturn sum;\n}\n" );
+	}
+	try writer.writeAll( "\n}\n" );
+}
+
+fn writeCompileCommands( allocator: std.mem.Allocator, dir: std.fs.Dir, root: []const u8, params: Params ) !void
+{
+	const Command = struct {
+		directory: []const u8,
+		arguments: []const []const u8,
+		file: []const u8,
+		output: []const u8,
+	};
+
+	var arena_state = std.heap.ArenaAllocator.init( allocator );
+	defer arena_state.deinit();
+	const arena = arena_state.allocator();
+
+	const commands = try arena.alloc( Command, params.tus );
+	for ( commands, 0.. ) |*command, t|
+	{
+		const file = try std.fmt.allocPrint( arena, "src/tu{}.cpp", .{ t } );
+		const output = try std.fmt.allocPrint( arena, "obj/tu{}.o", .{ t } );
+		command.* = .{
+			.directory = root,
+			.arguments = try arena.dupe( []const u8, &.{ "clang++", "-std=c++17", "-Iinclude", "-c", file, "-o", output } ),
+			.file = file,
+			.output = output,
+		};
+	}
+
+	const file = try dir.createFile( "compile_commands.json", .{} );
+	defer file.close();
+	var buffer = std.io.bufferedWriter( file.writer() );
+	try std.json.stringify( commands, .{ .whitespace = .indent_tab }, buffer.writer() );
+	try buffer.flush();
+}
+
+
+test "generate" {
+	const allocator = std.testing.allocator;
+	var tmp = std.testing.tmpDir( .{} );
+	defer tmp.cleanup();
+
+	const params = Params{ .tus = 5, .headers = 12, .functions = 3, .calls = 4, .includes = 2, .template_depth = 8, .seed = 1 };
+	try generate( allocator, tmp.dir, "/bench", params );
+
+	const text = try tmp.dir.readFileAlloc( allocator, "compile_commands.json", 1 << 20 );
+	defer allocator.free( text );
+	const parsed = try std.json.parseFromSlice( std.json.Value, allocator, text, .{} );
+	defer parsed.deinit();
+	try std.testing.expectEqual( params.tus, parsed.value.array.items.len );
+
+	// TU 1 defines the functions of headers 1, 6 and 11
+	const tu = try tmp.dir.readFileAlloc( allocator, "src/tu1.cpp", 1 << 20 );
+	defer allocator.free( tu );
+	try std.testing.expect( std.mem.indexOf( u8, tu, "namespace bench_h11 {\nType::Type" ) != null );
+	try tmp.dir.access( "include/h11.hpp", .{} );
+}
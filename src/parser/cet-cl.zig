@@ -2,10 +2,25 @@ const Clang = @import("clang.zig");
 const std = @import("std");
 const Options = @import("options.zig");
 
-const ObjFile = @import("objfile.zig");
+const Recorder = @import("recorder.zig").Recorder;
+const StreamingRecorder = @import("recorder.zig").StreamingRecorder;
+const Fingerprint = @import("fingerprint.zig");
+const Report = @import("report.zig");
 
 const OptionsParser = Options.makeOptions(.{
     .{ "dump", bool, false, 0, "dump tree in clang" },
+    .{ "shared-preamble", bool, false, 0, "reuse a precompiled preamble shared with other TUs that include the same headers with the same flags" },
+    .{ "preamble-dir", ?[:0]const u8, null, 0, "directory shared preambles are kept in, defaults to the system temp dir" },
+    .{ "dedupe-headers", bool, false, 0, "write a header ref for every header the TU has decls in, keyed like an in-process run, a single TU owns all of them so every decl is still recorded" },
+    .{ "no-references", bool, false, 0, "only record the decl tree, not the call and reference edges between decls" },
+    .{ "skip-bodies", bool, false, 0, "skip function bodies, only the decl tree is recorded" },
+    .{ "keep-main-bodies", bool, false, 0, "with --skip-bodies, still parse function bodies in the main file" },
+    .{ "lazy-link-names", bool, false, 0, "mangle link names after the traversal, only for decls the TU defines or refers to" },
+    .{ "huge-pages", bool, false, 0, "back the parser's arenas with transparent huge pages where the OS supports them" },
+    .{ "prefault", bool, false, 0, "fault arena pages in when they are committed instead of on first touch" },
+    .{ "fingerprint", ?u64, null, 0, "write a fingerprint of every input next to the output, tagged with this command hash" },
+    .{ "stats", ?[:0]const u8, null, 0, "write the timings and counters of the TU to this path as json" },
+    .{ "streaming", bool, false, 0, "write records to disk as they arrive instead of keeping a copy of the TU here, the parser still keeps the TU's strings and node index until it is done" },
 });
 
 pub fn main() !u8 {
@@ -37,156 +52,68 @@ pub fn main() !u8 {
     const args_c: [][*c]const u8 = try cifyArgs(allocator, args);
     defer allocator.free(args_c);
 
+    var parse_options: Clang.ParseOptions = .{};
     if (options) |o| {
+        parse_options.flags.shared_preamble = o.get(.@"shared-preamble");
+        parse_options.flags.dedupe_headers = o.get(.@"dedupe-headers");
+        parse_options.flags.no_references = o.get(.@"no-references");
+        parse_options.flags.skip_bodies = o.get(.@"skip-bodies");
+        parse_options.flags.keep_main_bodies = o.get(.@"keep-main-bodies");
+        parse_options.flags.lazy_link_names = o.get(.@"lazy-link-names");
+        parse_options.flags.huge_pages = o.get(.@"huge-pages");
+        parse_options.flags.prefault = o.get(.prefault);
+        if (o.get(.@"preamble-dir")) |dir| parse_options.preamble_dir = dir.ptr;
+
         if (o.get(.dump)) {
-            Clang.dumpFromArgs(args_c);
+            Clang.dumpFromArgs(parse_options, args_c);
             return 0;
         }
     }
 
-    var recorder: Recorder = .{ .allocator = allocator, .stringarena = StringArena.init(), .linknames = StringArena.init() };
-    defer recorder.deinit();
-
-    Clang.parseFromArgs(&recorder, args_c);
-
-    var writer = try ObjFile.Writer.open(outputPath);
-    const header = ObjFile.Header{
-        .run_id = 0, // TODO: generate this
-        .connections_count = recorder.connections.items.len,
-        .nodes_count = recorder.nodes.items.len,
-        .strings_len = recorder.stringarena.len(),
-        .strings_count = recorder.hashtable.size,
-		.linklinks_count = @intCast( recorder.linklinks.items.len ),
-		.linknames_len = recorder.linknames.len(),
-		.linknames_count = recorder.linknamesmap.size
-    };
-    try writer.writeHeader(header);
-    try writer.writeNodes(recorder.nodes.items);
-    try writer.writeConnections(recorder.connections.items);
-    try writer.writeStrings(recorder.stringarena.data());
-	try writer.writeLinkLinks( recorder.linklinks.items );
-	try writer.writeLinkNames( recorder.linknames.data() );
-
-    try writer.close();
-
-    return 0;
-}
-
-const StringArena = struct {
-    start: [*]u8, // start of the whole reserved area
-    head: [*]u8, // start of the current free but committed area
-    tail: [*]u8, // end of current committed area
-
-    const COMMIT_GRANULARITY: usize = 1024 * 4;
-    const RESERVE_GRANULARITY: usize = 1024 * 64;
-
-    pub fn init() StringArena {
-        const win = std.os.windows;
-        const reserve_size = RESERVE_GRANULARITY * 256;
-        const ptr: [*]u8 = @ptrCast(win.VirtualAlloc(null, reserve_size, win.MEM_RESERVE, win.PAGE_NOACCESS) catch @panic("page reserve failed"));
-        return .{
-            .start = ptr,
-            .head = ptr,
-            .tail = ptr,
-        };
-    }
-
-    pub fn add(self: *StringArena, str: []const u8) void {
-        const write_len = str.len + 1; // +1 for null terminator
-        const ilen: isize = @intCast(write_len);
-        const ispace: isize = @intCast(self.tail - self.head);
-        const delta: isize = ispace - ilen;
-
-        if (delta < 0) {
-            self.expand(@intCast(-delta));
-        }
-
-        @memcpy(self.head[0..str.len], str);
-        self.head[str.len] = 0;
-
-        self.head += write_len;
-    }
-
-    pub fn deinit(self: *StringArena) void {
-        const win = std.os.windows;
-        win.VirtualFree(self.start, 0, win.MEM_RELEASE);
+    if (options != null and options.?.get(.streaming)) {
+        var recorder = try StreamingRecorder.create(allocator, outputPath);
+        defer recorder.deinit();
+        return record(allocator, options, parse_options, &recorder, args_c, outputPath);
     }
 
-    pub fn data(self: StringArena) []const u8 {
-        return self.start[0..self.len()];
-    }
+    var recorder = Recorder.init(allocator);
+    defer recorder.deinit();
+    return record(allocator, options, parse_options, &recorder, args_c, outputPath);
+}
 
-    pub fn len(self: StringArena) usize {
-        return self.head - self.start;
+// recorder is a *Recorder or a *StreamingRecorder
+fn record(allocator: std.mem.Allocator, options: ?OptionsParser, parse_options: Clang.ParseOptions, recorder: anytype, args_c: [][*c]const u8, outputPath: []const u8) !u8 {
+    if (!Clang.parseFromArgs(parse_options, recorder, args_c)) {
+        // an object and fingerprint left from an earlier run would have the driver skip the TU next time
+        std.fs.cwd().deleteFile(outputPath) catch {};
+        const fingerprint_path = try Fingerprint.pathForObject(allocator, outputPath);
+        defer allocator.free(fingerprint_path);
+        std.fs.cwd().deleteFile(fingerprint_path) catch {};
+        try std.io.getStdErr().writer().print("failed to parse {s}\n", .{outputPath});
+        return 1;
     }
 
-    fn expand(self: *StringArena, amount: usize) void {
-        const win = std.os.windows;
-        const commit_size = std.mem.alignForward(usize, amount, COMMIT_GRANULARITY);
-
-        _ = win.VirtualAlloc(self.tail, commit_size, win.MEM_COMMIT, win.PAGE_READWRITE) catch @panic("allocation failed");
-        self.tail += commit_size;
-    }
-};
+    var write_timer = try std.time.Timer.start();
+    try recorder.write(outputPath);
+    const write_ns = write_timer.read();
 
-const Recorder = struct {
-    const HashContext = struct {
-        pub fn hash(self: HashContext, a: u64) u64 {
-            _ = self;
-            return a;
+    if (options) |o| {
+        if (o.get(.fingerprint)) |command_hash| {
+            const fingerprint_path = try Fingerprint.pathForObject(allocator, outputPath);
+            defer allocator.free(fingerprint_path);
+            try recorder.writeFingerprint(fingerprint_path, command_hash);
         }
 
-        pub fn eql(self: HashContext, a: u64, b: u64) bool {
-            _ = self;
-            return a == b;
+        if (o.get(.stats)) |stats_path| {
+            var stats = if (recorder.stats) |s| Report.TuStats.fromParse(s) else Report.TuStats{};
+            stats.write_ns = write_ns;
+            stats.bytes_written = (try std.fs.cwd().statFile(outputPath)).size;
+            try Report.writeStats(stats_path, stats);
         }
-    };
-
-	const StringHashSet = std.HashMapUnmanaged(u64, void, HashContext, 88);
-
-    allocator: std.mem.Allocator,
-    hashtable: StringHashSet = .empty,
-    nodes: std.ArrayListUnmanaged(ObjFile.Node) = .empty,
-    connections: std.ArrayListUnmanaged(ObjFile.Connection) = .empty,
-    stringarena: StringArena,
-	linklinks: std.ArrayListUnmanaged( ObjFile.LinkLink ) = .empty,
-	linknames: StringArena,
-	linknamesmap: StringHashSet = .empty,
-
-    pub fn addNode(self: *Recorder, id: i64, identifier: []const u8) void {
-        const hash = std.hash.Wyhash.hash(0, identifier);
-        self.nodes.append(self.allocator, .{ .id = id, .string_hash = hash }) catch unreachable;
-
-        const result = self.hashtable.getOrPut(self.allocator, hash) catch unreachable;
-        if (!result.found_existing) {
-            self.stringarena.add(identifier);
-        }
-    }
-
-    pub fn addConnection(self: *Recorder, from: i64, to: i64) void {
-        self.connections.append(self.allocator, .{ .from = from, .to = to }) catch unreachable;
     }
 
-	pub fn addLinkIdentifier(self: *Recorder, id:i64, identifier: []const u8) void {
-		const hash = std.hash.Wyhash.hash(0, identifier);
-		self.linklinks.append( self.allocator, .{ .node_id = id, .string_hash = hash }) catch unreachable;
-
-		const result = self.linknamesmap.getOrPut(self.allocator, hash) catch unreachable;
-		if (!result.found_existing) {
-			self.linknames.add(identifier);
-		}
-	}
-
-    pub fn deinit(self: *Recorder) void {
-        self.hashtable.deinit(self.allocator);
-        self.nodes.deinit(self.allocator);
-        self.connections.deinit(self.allocator);
-        self.stringarena.deinit();
-		self.linklinks.deinit( self.allocator );
-		self.linknames.deinit();
-		self.linknamesmap.deinit( self.allocator );
-    }
-};
+    return 0;
+}
 
 fn getOutputPath(args: [][:0]const u8) ?[]const u8 {
     for (args, 0..) |a, i| {
@@ -1,15 +1,39 @@
 const std = @import("std");
+const builtin = @import("builtin");
 const DynLib = std.DynLib;
 
-const Child = @import("Child.zig");
 const Clang = @import("clang.zig");
 const Options = @import("options.zig");
+const Recorder = @import("recorder.zig").Recorder;
+const StreamingRecorder = @import("recorder.zig").StreamingRecorder;
+const Fingerprint = @import("fingerprint.zig");
+const Report = @import("report.zig");
+const Schedule = @import("schedule.zig");
+const ObjFile = @import("objfile.zig");
+const ProcessPool = @import("process_pool.zig").ProcessPool;
 
 
 const OptionsParser = Options.makeOptions(.{
 	.{ "path", ?[:0]const u8, null, 'p', "path" },
 	.{ "print-invocations", bool, false, 0, "print out all the invoked commands" },
-	.{ "clean", bool, false, 0, "delete all cetobj files that will be written if they exist" },
+	.{ "clean", bool, false, 0, "delete all cetobj files that will be written if they exist and parse every command, even if its inputs have not changed" },
+	.{ "in-process", bool, false, 0, "parse every command inside this process instead of starting cet-cl for each one" },
+	.{ "jobs", usize, 0, 'j', "number of commands to parse at once, 0 uses every hardware thread" },
+	.{ "memory-budget", usize, 0, 0, "megabytes the running cet-cl processes may use between them, from their peak memory last run, 0 uses the physical memory, not used with --in-process" },
+	.{ "fifo", bool, false, 0, "start commands in database order instead of the longest first" },
+	.{ "history", ?[:0]const u8, null, 0, "file the time each command took is kept in to order the next run, defaults to cet-history.json in path" },
+	.{ "shared-preamble", bool, false, 0, "share precompiled preambles between TUs that include the same headers with the same flags" },
+	.{ "preamble-dir", ?[:0]const u8, null, 0, "directory shared preambles are kept in, defaults to the system temp dir" },
+	.{ "dedupe-headers", bool, false, 0, "record the decls of each header in only the first TU in the database that includes it, requires --in-process" },
+	.{ "no-references", bool, false, 0, "only record the decl tree, not the call and reference edges between decls" },
+	.{ "skip-bodies", bool, false, 0, "skip function bodies, only the decl tree is recorded" },
+	.{ "keep-main-bodies", bool, false, 0, "with --skip-bodies, still parse function bodies in each TU's main file" },
+	.{ "lazy-link-names", bool, false, 0, "mangle link names after the traversal, only for decls the TU defines or refers to" },
+	.{ "huge-pages", bool, false, 0, "back the parser's arenas with transparent huge pages where the OS supports them" },
+	.{ "prefault", bool, false, 0, "fault arena pages in when they are committed instead of on first touch" },
+	.{ "streaming", bool, false, 0, "write records to disk as they arrive instead of keeping a copy of each TU until it is done, the parser still keeps the TU's strings and node index" },
+	.{ "report", ?[:0]const u8, null, 0, "write the timings and counters of every parsed TU to this path as json, slowest first" },
+	.{ "trace", ?[:0]const u8, null, 0, "write the TUs and their phases to this path as a chrome trace" },
 });
 
 pub fn main() !u8
@@ -42,24 +66,149 @@ pub fn main() !u8
 
 	const s = db.getAllCommands();
 
+	var parse_options: Clang.ParseOptions = .{};
+	parse_options.flags.shared_preamble = options.get( .@"shared-preamble" );
+	parse_options.flags.dedupe_headers = options.get( .@"dedupe-headers" );
+	parse_options.flags.no_references = options.get( .@"no-references" );
+	parse_options.flags.skip_bodies = options.get( .@"skip-bodies" );
+	parse_options.flags.keep_main_bodies = options.get( .@"keep-main-bodies" );
+	parse_options.flags.lazy_link_names = options.get( .@"lazy-link-names" );
+	parse_options.flags.huge_pages = options.get( .@"huge-pages" );
+	parse_options.flags.prefault = options.get( .prefault );
+	if ( options.get( .@"preamble-dir" ) ) |dir| parse_options.preamble_dir = dir.ptr;
+
+	// forwarded to every cet-cl, also part of each command's hash since they change what gets recorded
+	var cl_options = std.ArrayList( []const u8 ).init( allocator );
+	defer cl_options.deinit();
+	try Fingerprint.appendModeArgs( &cl_options, parse_options.flags, options.get( .@"preamble-dir" ) );
+	// everything after mode_len is forwarded but doesn't change the output
+	const mode_len = cl_options.items.len;
+	if ( parse_options.flags.huge_pages ) try cl_options.append( "--huge-pages" );
+	if ( parse_options.flags.prefault ) try cl_options.append( "--prefault" );
+	if ( options.get( .streaming ) ) try cl_options.append( "--streaming" );
+	const forwarded_len = cl_options.items.len - mode_len;
+
+	const clean = options.get( .clean );
+	const in_process = options.get( .@"in-process" );
+	if ( parse_options.flags.dedupe_headers and !in_process )
+	{
+		// every cet-cl would only know about its own TU
+		_ = try std.io.getStdErr().write( "--dedupe-headers requires --in-process\n" );
+		return 1;
+	}
+
+	var report_storage: Report.Report = try Report.Report.init( allocator );
+	defer report_storage.deinit();
+	const report: ?*Report.Report = if ( options.get( .report ) != null or options.get( .trace ) != null ) &report_storage else null;
+	// times are kept from the start of the report even without one, for the history
+	const clock = &report_storage;
+
+	const history_path = if ( options.get( .history ) ) |p| try allocator.dupe( u8, p ) else try std.fs.path.join( allocator, &.{ path, "cet-history.json" } );
+	defer allocator.free( history_path );
+	var history = try Schedule.History.load( allocator, history_path );
+	defer history.deinit();
+
+	// commands whose output is out of date, in database order
+	var pending = std.ArrayList( u32 ).init( allocator );
+	defer pending.deinit();
+	for ( s, 0.. ) |cmd, index|
+	{
+		if ( try checkOutput( allocator, cmd, Fingerprint.hashCommand( cmd, cl_options.items[0..mode_len] ), clean ) ) continue;
+		try pending.append( @intCast( index ) );
+	}
+	try std.io.getStdErr().writer().print( "{} of {} commands up to date\n", .{ s.len - pending.items.len, s.len } );
+
+	var jobs = options.get( .jobs );
+	if ( jobs == 0 ) jobs = std.Thread.getCpuCount() catch 1;
+	if ( !in_process ) jobs = @min( jobs, ProcessPool.max_len );
+	jobs = @max( 1, @min( jobs, pending.items.len ) );
+
+	const plan = try Schedule.plan( allocator, s, pending.items, &history, options.get( .fifo ) );
+	defer plan.deinit();
+	const estimate = try Schedule.estimate( allocator, plan, jobs );
+	try estimate.print( std.io.getStdErr().writer() );
+	if ( report ) |r| r.schedule = estimate;
+
+	// when each command was started, from the start of the report
+	const starts = try allocator.alloc( u64, s.len );
+	defer allocator.free( starts );
+	// what each command took this run, null if it didn't run
+	const took = try allocator.alloc( ?Schedule.History.Entry, s.len );
+	defer allocator.free( took );
+	@memset( took, null );
+
+	if ( in_process )
+	{
+		const positions = try Schedule.deal( allocator, plan.order, jobs );
+		defer allocator.free( positions );
+
+		const session = try Clang.ParseSession.create( parse_options );
+		defer session.deinit();
+		// up to date TUs keep the headers they own, any they lose to a lower index get parsed too
+		if ( parse_options.flags.dedupe_headers ) try keepHeaders( allocator, session, s, pending.items );
+
+		const failed = switch ( options.get( .streaming ) ) {
+			inline else => |streaming| blk: {
+				const R = if ( streaming ) StreamingRecorder else Recorder;
+				var ctx = InProcessContext( R ){ .allocator = allocator, .commands = s, .mode = cl_options.items[0..mode_len], .report = report, .clock = clock, .starts = starts, .took = took };
+				session.parseCommands( db, positions, &ctx, *R, jobs );
+				break :blk ctx.failed.load( .monotonic );
+			},
+		};
+		const files = session.fileStats();
+		try Report.printFileStats( std.io.getStdErr().writer(), files );
+		if ( report ) |r| r.files = files;
+		try finishRun( options, report, global_timer.read(), &history, history_path, s, took );
+		return if ( failed == 0 ) 0 else 1;
+	}
+
+	if ( pending.items.len == 0 )
+	{
+		try finishRun( options, report, global_timer.read(), &history, history_path, s, took );
+		return 0;
+	}
+
 	const selfpath = try std.fs.selfExeDirPathAlloc( allocator );
 	defer allocator.free( selfpath );
 
-	const cl_path = try getChildExePath( allocator, "cet-cl.exe" );
+	const cl_path = try getChildExePath( allocator, if ( builtin.os.tag == .windows ) "cet-cl.exe" else "cet-cl" );
 	defer allocator.free( cl_path );
 
-	const instances: usize = 8;
-	var pool = try ProcessPool.init( allocator, instances );
+	var pool = try ProcessPool.init( allocator, jobs );
 	defer pool.deinit( allocator );
 
-	var completed: usize = 0;
-	for ( s ) |cmd|
+	const budget: u64 = if ( options.get( .@"memory-budget" ) != 0 ) options.get( .@"memory-budget" ) * 1024 * 1024 else std.process.totalSystemMemory() catch std.math.maxInt( u64 );
+	var queue = try Schedule.Queue.init( allocator, plan.order, plan.memory, budget );
+	defer queue.deinit();
+
+	var failed: u32 = 0;
+	const exits = ExitContext{ .allocator = allocator, .report = report, .clock = clock, .commands = s, .starts = starts, .took = took, .queue = &queue, .failed = &failed };
+	while ( !queue.empty() )
 	{
+		const next = if ( pool.hasFree() ) try queue.next() else null;
+		const index = next orelse {
+			// every process slot is taken or the next commands don't fit in the budget until something exits
+			try pool.waitExit();
+			exits.collect( &pool );
+			continue;
+		};
+		const cmd = s[index];
+
+		const command_hash = Fingerprint.hashCommand( cmd, cl_options.items[0..mode_len] );
 		const child_args_c = cmd.argv[0..cmd.argc];
-		const child_output = try rewriteOutputPath( allocator, cmd.output[0..std.mem.len(cmd.output)]);
+		const child_output = try Fingerprint.objectOutput( allocator, cmd.output[0..std.mem.len(cmd.output)]);
 		defer allocator.free( child_output );
 
-		const child_args = try rewriteOrAppendOutput( allocator, child_args_c, child_output );
+		const hash_arg = try std.fmt.allocPrint( allocator, "{}", .{ command_hash } );
+		defer allocator.free( hash_arg );
+		try cl_options.appendSlice( &.{ "--fingerprint", hash_arg } );
+		defer cl_options.shrinkRetainingCapacity( mode_len + forwarded_len );
+
+		const stats_path = if ( report != null ) try statsPathFor( allocator, cmd ) else null;
+		defer if ( stats_path ) |p| allocator.free( p );
+		if ( stats_path ) |p| try cl_options.appendSlice( &.{ "--stats", p } );
+
+		const child_args = try rewriteOrAppendOutput( allocator, child_args_c, child_output, cl_options.items );
 		defer allocator.free( child_args );
 
 		if (options.get( .@"print-invocations" ) ) try printInvocation( child_args );
@@ -69,307 +218,232 @@ pub fn main() !u8
 
 		const cwd = cmd.directory[ 0..std.mem.len( cmd.directory ) ];
 		
-		try pool.add( allocator, child_args, cwd );
-		if ( try pool.run() )
-		{
-			completed += 1;
-		}
+		starts[index] = clock.now();
+		try pool.add( allocator, child_args, cwd, index );
 	}
 
-	while( try pool.finish() ) {}
+	while( try pool.finish() ) exits.collect( &pool );
+	exits.collect( &pool );
 
-	const end = global_timer.read();
-	_ = end;
-	//try std.io.getStdErr().writer().print( "parsing completed in {}s\n", .{ end / std.time.ns_per_s } );
+	try finishRun( options, report, global_timer.read(), &history, history_path, s, took );
 
-	return 0;
+	return if ( failed == 0 ) 0 else 1;
 }
 
+// the history is updated with every command that ran, a history that can't be written only costs the next run its order
+fn finishRun( options: OptionsParser, report: ?*Report.Report, elapsed_ns: u64, history: *Schedule.History, history_path: []const u8, commands: []Clang.CompileCommand, took: []const ?Schedule.History.Entry ) !void
+{
+	try std.io.getStdErr().writer().print( "parsing completed in {}ms\n", .{ elapsed_ns / std.time.ns_per_ms } );
 
-
-const DWORD = std.os.windows.DWORD;
-const HANDLE = std.os.windows.HANDLE;
-const BOOL = std.os.windows.BOOL;
-
-extern "kernel32" fn PeekNamedPipe( 
-  hNamedPipe: HANDLE,
-  lpBuffer: ?*anyopaque,
-  nBufferSize: DWORD,
-  lpBytesRead: ?*DWORD,
-  lpTotalBytesAvail: *DWORD,
-  lpBytesLeftThisMessage: ?*DWORD
-) BOOL;
-
-
-
-const ProcessPool = struct {
-
-	const HandlePair = struct {
-		id: Child.Id,
-		idx: u32
-	};
-
-	const HandleList = std.MultiArrayList( HandlePair );
-
-	const Item = struct {
-		process: Child,
-		id: ?Child.Id,
-		next_free: ?u32,
-
-		overlapped: std.os.windows.OVERLAPPED,
-		buffer: []u8,
-
-		pipe_read: ?std.fs.File,
-		pipe_write: std.fs.File,
+	for ( commands, took ) |cmd, entry|
+	{
+		if ( entry ) |e| try history.put( cmd, e );
+	}
+	history.write( history_path ) catch |err| {
+		try std.io.getStdErr().writer().print( "failed to write {s}: {}\n", .{ history_path, err } );
 	};
 
-	const ItemList = std.MultiArrayList( Item );
-
-	items: ItemList,
-	handles: HandleList,
-	first_free: ?u32,
-	free_count: u32,
-	nul_handle: std.fs.File,
-
+	const r = report orelse return;
+	if ( options.get( .report ) ) |p| try r.writeJson( p );
+	if ( options.get( .trace ) ) |p| try r.writeTrace( p );
+}
 
-	pub fn init( allocator: std.mem.Allocator, len: usize ) !ProcessPool
+// where cet-cl writes the stats for cmd, caller owns the returned path
+// hands the session the header refs of every object that won't be parsed, pending is in database order
+fn keepHeaders( allocator: std.mem.Allocator, session: Clang.ParseSession, commands: []Clang.CompileCommand, pending: []const u32 ) !void
+{
+	var next: usize = 0;
+	for ( commands, 0.. ) |cmd, index|
 	{
-		const windows = std.os.windows;
-		var items = ItemList{};
-		try items.resize( allocator, len );
-
-		const s = items.items( .next_free );
-		for ( s[0..s.len-1], 0.. ) |*idx, i| {
-			idx.* = @as( u32, @intCast(i) ) + 1;
-		}
-		s[s.len-1] = null;
-
-		for ( items.items( .id ) ) |*id|
+		if ( next < pending.len and pending[next] == index )
 		{
-			id.* = null; // FIXME: does this work for posix?
+			next += 1;
+			continue;
 		}
 
-		const buffer_size: usize = 4096;
-		const buffers = try allocator.alloc( u8, len * buffer_size );
-
-		for ( items.items( .buffer ), 0.. ) |*buffer, i|
-		{
-			const start = i * buffer_size;
-			const end = start + buffer_size;
-			buffer.* = buffers[start..end];
-		}
+		const path = try Fingerprint.objectPath( allocator, cmd );
+		defer allocator.free( path );
+		var reader = ObjFile.Reader.open( path ) catch continue;
+		defer reader.close();
+		session.keepHeaders( index, @ptrCast( reader.headerRefs() ) );
+	}
+}
 
-		const nul_handle = try Child.nullHandle();
+fn statsPathFor( allocator: std.mem.Allocator, cmd: Clang.CompileCommand ) ![]u8
+{
+	const path = try Fingerprint.objectPath( allocator, cmd );
+	defer allocator.free( path );
+	return Report.statsPath( allocator, path );
+}
 
-		var saAttr = windows.SECURITY_ATTRIBUTES{
-			.nLength = @sizeOf(windows.SECURITY_ATTRIBUTES),
-			.bInheritHandle = windows.TRUE,
-			.lpSecurityDescriptor = null,
-		};
-		for ( items.items( .pipe_write ), items.items( .pipe_read ) ) |*wr,*rd|
-		{
-			var rd_handle: ?windows.HANDLE = undefined;
-			var wr_handle: ?windows.HANDLE = undefined;
-			try Child.windowsMakeAsyncPipe(&rd_handle, &wr_handle, &saAttr );
-			wr.* = .{ .handle = wr_handle.? };
-			rd.* = .{ .handle = rd_handle.? };
-		}
+// every cet-cl that exited since the last call frees its share of the memory budget
+// the ones that succeeded have their time kept for the history, the rest are counted as failed
+// with a report its stats are read back and the file removed
+const ExitContext = struct {
+	allocator: std.mem.Allocator,
+	report: ?*Report.Report,
+	clock: *Report.Report,
+	commands: []Clang.CompileCommand,
+	starts: []const u64,
+	took: []?Schedule.History.Entry,
+	queue: *Schedule.Queue,
+	failed: *u32,
+
+	fn collect( self: ExitContext, pool: *ProcessPool ) void
+	{
+		defer pool.exits.clearRetainingCapacity();
 
-		for ( items.items( .overlapped ),  items.items( .pipe_read ), items.items( .buffer ) ) |*overlap, rd, buffer|
+		for ( pool.exits.items ) |exit|
 		{
-			overlap.* = std.mem.zeroes( windows.OVERLAPPED );
-			if (windows.kernel32.ReadFile(rd.?.handle, buffer.ptr, @intCast( buffer.len ), null, overlap) == 0) {
-			switch (windows.GetLastError()) {
-					.IO_PENDING => {},
-					.OPERATION_ABORTED => continue,
-					.BROKEN_PIPE => return error.BrokenPipe,
-					.HANDLE_EOF => return error.HandleEof,
-					.NETNAME_DELETED => return error.ConnectionResetByPeer,
-					.LOCK_VIOLATION => return error.LockViolation,
-					else => |err| return windows.unexpectedError(err),
-				}
+			self.queue.release( @intCast( exit.tag ) );
+			const cmd = self.commands[exit.tag];
+			const end_ns = if ( exit.time ) |t| self.clock.since( t ) else self.clock.now();
+			const total_ns = end_ns -| self.starts[exit.tag];
+			if ( exit.ok() ) {
+				self.took[exit.tag] = .{ .ns = total_ns, .memory = exit.peak_memory orelse 0 };
+			} else {
+				std.io.getStdErr().writer().print( "failed to parse {s}: {}\n", .{ cmd.filename, exit.term } ) catch {};
+				self.failed.* += 1;
 			}
 
-		}
-
-		var handles = HandleList{};
-		try handles.resize( allocator, len );
-
-		return .{ 
-			.items = items,
-			.first_free = 0,
-			.free_count = @intCast( len ),
-			.nul_handle = nul_handle ,
-			.handles = handles
+			const r = self.report orelse continue;
+			const stats: ?Report.TuStats = blk: {
+				const stats_path = statsPathFor( self.allocator, cmd ) catch break :blk null;
+				defer self.allocator.free( stats_path );
+				const parsed = Report.readStats( self.allocator, stats_path ) catch break :blk null;
+				std.fs.cwd().deleteFile( stats_path ) catch {};
+				break :blk parsed;
 			};
-	}
-
-	pub fn deinit( self: *ProcessPool, allocator: std.mem.Allocator ) void
-	{
-		self.handles.deinit( allocator );
 
-		const buffer_size: usize = 4096;
-		const buffer = self.items.items( .buffer )[0];
-		const len = self.items.len * buffer_size;
-		allocator.free( buffer.ptr[0..len]);
-		self.items.deinit( allocator );
+			r.add( .{
+				.file = std.mem.span( cmd.filename ),
+				.worker = exit.slot,
+				.start_ns = self.starts[exit.tag],
+				.total_ns = total_ns,
+				.ok = exit.ok() and stats != null,
+				.stats = stats,
+			}) catch {};
+		}
 	}
+};
 
-	// returns true if a process finished
-	fn run( self: *ProcessPool ) !bool
-	{
-		if (self.first_free != null) return false;
-
-		while ( try self.wait() ) {
-			try self.processPipes( false );
-		}
 
-		return true;
-	}
 
-	fn finish( self: *ProcessPool ) !bool
-	{
-		while ( try self.wait() ) {
-			try self.processPipes( false );
+// recorders for parseCommands, one per command in flight, written out as the commands finish
+// R is Recorder or StreamingRecorder, a StreamingRecorder writes its object as the blocks arrive
+fn InProcessContext( comptime R: type ) type
+{
+	return struct {
+		allocator: std.mem.Allocator,
+		commands: []Clang.CompileCommand,
+		mode: []const []const u8,
+		report: ?*Report.Report,
+		clock: *Report.Report,
+		starts: []u64,
+		took: []?Schedule.History.Entry,
+		failed: std.atomic.Value( u32 ) = .init( 0 ),
+
+		// only commands that are out of date are handed to the session, and with --dedupe-headers the ones that lost a header to a lower index
+		// those come once the rest are done and can come twice, the second object replaces the first
+		pub fn begin( self: *@This(), index: u64 ) ?*R
+		{
+			self.starts[index] = self.clock.now();
+			return self.create( self.commands[index] ) catch |err| {
+				std.io.getStdErr().writer().print( "failed to start output for {s}: {}\n", .{ self.commands[index].filename, err } ) catch {};
+				_ = self.failed.fetchAdd( 1, .monotonic );
+				return null;
+			};
 		}
 
-		if ( self.free_count < self.items.len )
+		fn create( self: *@This(), cmd: Clang.CompileCommand ) !*R
 		{
-			return true;
+			const recorder = try self.allocator.create( R );
+			errdefer self.allocator.destroy( recorder );
+			if ( R == StreamingRecorder ) {
+				const path = try Fingerprint.objectPath( self.allocator, cmd );
+				defer self.allocator.free( path );
+				recorder.* = try StreamingRecorder.create( self.allocator, path );
+			} else {
+				recorder.* = Recorder.init( self.allocator );
+			}
+			return recorder;
 		}
 
-		try self.processPipes( true );
-
-		return false;
-	}
-
-
-	// make sure there is a free index before calling
-	fn add( self: *ProcessPool, allocator: std.mem.Allocator, args: [][]const u8, cwd: []const u8 ) !void
-	{
-		const free = self.first_free.?;
-		self.first_free = self.items.items( .next_free )[free];
-
-		//const dir = try std.fs.openDirAbsolute( cwd, .{} );
-		const pipe_write = self.items.items( .pipe_write )[free];
-		const pipe_in = self.nul_handle;
-
-		var child = Child.init( args, allocator );
-		child.cwd = cwd;
-		_ = try child.spawn( pipe_write, pipe_in );
-
-
-		self.items.items( .next_free )[free] = null;
-		self.items.items( .process )[free] 	 = child;
-		self.items.items( .id )[free] 		 = child.id;
-
-
-		self.free_count -= 1;
-	}
-
-
+		pub fn end( self: *@This(), index: u64, recorder: *R, ok: bool ) void
+		{
+			defer {
+				recorder.deinit();
+				self.allocator.destroy( recorder );
+			}
 
+			const cmd = self.commands[index];
+			const write_start = self.clock.now();
+			var bytes_written: ?u64 = null;
+			if ( !ok ) {
+				std.io.getStdErr().writer().print( "failed to parse {s}\n", .{ cmd.filename } ) catch {};
+				_ = self.failed.fetchAdd( 1, .monotonic );
+			} else if ( self.writeOutput( cmd, recorder ) ) |bytes| {
+				bytes_written = bytes;
+			} else |err| {
+				std.io.getStdErr().writer().print( "failed to write output for {s}: {}\n", .{ cmd.filename, err } ) catch {};
+				_ = self.failed.fetchAdd( 1, .monotonic );
+			}
 
-	fn wait( self: *ProcessPool ) !bool {
-		const handles = &self.handles;
-		handles.shrinkRetainingCapacity( 0 );
+			const end_ns = self.clock.now();
+			if ( bytes_written != null ) self.took[index] = .{ .ns = end_ns -| self.starts[index] };
 
-		for ( self.items.items( .id ), 0.. ) |id, idx|
-		{
-			if (id == null) continue;
-			handles.appendAssumeCapacity( .{ .id = id.?, .idx = @intCast( idx ) });
+			const r = self.report orelse return;
+			var stats: ?Report.TuStats = null;
+			if ( bytes_written != null and recorder.stats != null ) {
+				stats = Report.TuStats.fromParse( recorder.stats.? );
+				stats.?.write_ns = end_ns - write_start;
+				stats.?.bytes_written = bytes_written.?;
+			}
+			r.add( .{
+				.file = std.mem.span( cmd.filename ),
+				.worker = std.Thread.getCurrentId(),
+				.start_ns = self.starts[index],
+				.total_ns = end_ns -| self.starts[index],
+				.ok = bytes_written != null,
+				.stats = stats,
+			}) catch {};
 		}
 
-		const slice = handles.items( .id );
-		const offset = std.os.windows.WaitForMultipleObjectsEx( slice, false, 10, false ) catch |err| {
-			if ( err == error.WaitTimeOut ) return true;
-			return err;
-		};
-
-		const idx = handles.items( .idx )[offset];
+		// returns the size of the object
+		fn writeOutput( self: *@This(), cmd: Clang.CompileCommand, recorder: *R ) !u64
+		{
+			const path = try Fingerprint.objectPath( self.allocator, cmd );
+			defer self.allocator.free( path );
+			try recorder.write( path );
 
-		var item = self.items.get( idx );
+			const fingerprint_path = try Fingerprint.pathForObject( self.allocator, path );
+			defer self.allocator.free( fingerprint_path );
+			try recorder.writeFingerprint( fingerprint_path, Fingerprint.hashCommand( cmd, self.mode ) );
 
-		item.next_free = self.first_free;
-		item.id = null;
-		_ = try item.process.wait();
+			return ( try std.fs.cwd().statFile( path ) ).size;
+		}
+	};
+}
 
-		self.items.set( idx, item );
+// returns true if the cetobj for cmd was written from the same inputs and can be kept
+// with clean set the existing output gets deleted instead
+fn checkOutput( allocator: std.mem.Allocator, cmd: Clang.CompileCommand, command_hash: u64, clean: bool ) !bool
+{
+	const path = try Fingerprint.objectPath( allocator, cmd );
+	defer allocator.free( path );
 
-		self.first_free = idx;
-		self.free_count += 1;
+	const fingerprint_path = try Fingerprint.pathForObject( allocator, path );
+	defer allocator.free( fingerprint_path );
 
+	if ( clean ) {
+		std.fs.cwd().deleteFile( path ) catch |err| if ( err != error.FileNotFound ) return err;
+		std.fs.cwd().deleteFile( fingerprint_path ) catch |err| if ( err != error.FileNotFound ) return err;
 		return false;
 	}
 
-	fn processPipes( self: *ProcessPool, final: bool ) !void {
-		const overlapped = self.items.items( .overlapped );
-		const children = self.items.items( .id );
-		const buffers = self.items.items( .buffer );
-		const reads = self.items.items( .pipe_read );
-		for ( overlapped, children, buffers, reads ) |*overlap, id, buffer, *rd_op|
-		{
-			_ = id;
-			const rd = if (rd_op.*) |r| r else continue;
-			const bytes = std.os.windows.GetOverlappedResult( rd.handle, overlap, false ) catch |err|
-			{
-				if ( err == error.WouldBlock ) continue;
-				return err;
-			};
-
-			const stdout = std.io.getStdOut();
-			_ = try stdout.write( buffer[0..bytes] );
-			
-			if (!final) {
-				try beginRead( overlap, rd.handle, buffer );
-			} else {
-				const windows =std.os.windows;
-
-				// empty the pipe
-				var bytes_available: DWORD = 0;
-				var bytes_read: DWORD = 0;
-				if ( PeekNamedPipe( rd.handle, null, 0, null, &bytes_available, null) == 1 ) {
-					while ( bytes_available > bytes_read ) {
-						bytes_available -= bytes_read;
-						if (windows.kernel32.ReadFile(rd.handle, buffer.ptr, @intCast( buffer.len ), &bytes_read, null) == 0) {
-							switch (windows.GetLastError()) {
-								.IO_PENDING => {},
-								.OPERATION_ABORTED => return,
-								.BROKEN_PIPE => return error.BrokenPipe,
-								.HANDLE_EOF => return error.HandleEof,
-								.NETNAME_DELETED => return error.ConnectionResetByPeer,
-								.LOCK_VIOLATION => return error.LockViolation,
-								else => |err| return windows.unexpectedError(err),
-							}
-						}
-
-						if (bytes_read == 0) break;
-						_ = try stdout.write( buffer[0..bytes_read] );
-					}
-				}
-				// TODO check errors
-			}
-		}
-	}
-
-
-	fn beginRead( overlap: *std.os.windows.OVERLAPPED, handle: std.os.windows.HANDLE, buffer: []u8 ) !void
-	{
-		const windows =std.os.windows;
-		overlap.* = std.mem.zeroes( windows.OVERLAPPED  );
-		if (windows.kernel32.ReadFile(handle, buffer.ptr, @intCast( buffer.len ), null, overlap) == 0) {
-		switch (windows.GetLastError()) {
-				.IO_PENDING => {},
-				.OPERATION_ABORTED => return,
-				.BROKEN_PIPE => return error.BrokenPipe,
-				.HANDLE_EOF => return error.HandleEof,
-				.NETNAME_DELETED => return error.ConnectionResetByPeer,
-				.LOCK_VIOLATION => return error.LockViolation,
-				else => |err| return windows.unexpectedError(err),
-			}
-		}
-	}
-};
+	std.fs.cwd().access( path, .{} ) catch return false;
+	return Fingerprint.isUpToDate( allocator, fingerprint_path, command_hash );
+}
 
 fn printInvocation( args: [][]const u8 ) !void
 {
@@ -399,18 +473,8 @@ fn getChildExePath( allocator: std.mem.Allocator, name: []const u8 ) ![]const u8
 }
 
 
-fn rewriteOutputPath( allocator: std.mem.Allocator, c_output: []const u8 ) ![]const u8
-{
-	const ext = std.fs.path.extension( c_output );
-	const new_ext = ".cetobj";
-	const name_no_ext = c_output[0..c_output.len-ext.len];
-	const out = try allocator.alloc( u8, name_no_ext.len + new_ext.len);
-	@memcpy( out[0..name_no_ext.len], name_no_ext );
-	@memcpy( out[name_no_ext.len..], new_ext);
-	return out;
-}
-
-fn rewriteOrAppendOutput( allocator: std.mem.Allocator, c_args: [][*c]const u8, output: []const u8 ) ![][]const u8
+// cl_options go to cet-cl itself, they get placed in front of the compile args with a "--" between
+fn rewriteOrAppendOutput( allocator: std.mem.Allocator, c_args: [][*c]const u8, output: []const u8, cl_options: []const []const u8 ) ![][]const u8
 {
 	var idx : ?usize = null;
 	var desired_size: usize = c_args.len + 2; 
@@ -440,13 +504,16 @@ fn rewriteOrAppendOutput( allocator: std.mem.Allocator, c_args: [][*c]const u8,
 	};
 
 	const extra_args = [_][]const u8{ driver_mode };
-	const prepend_len = extra_args.len;
+	const separator: []const []const u8 = if ( cl_options.len > 0 ) &.{ "--" } else &.{};
+	const prepend_len = cl_options.len + separator.len + extra_args.len;
 	const args = try allocator.alloc( []const u8, desired_size + prepend_len );
 
 	// arg0
 	args[0] = arg0;
 
-	@memcpy( args[1..prepend_len+1], &extra_args );
+	@memcpy( args[1..][0..cl_options.len], cl_options );
+	@memcpy( args[1+cl_options.len..][0..separator.len], separator );
+	@memcpy( args[1+cl_options.len+separator.len..prepend_len+1], &extra_args );
 
 	for (args[1+prepend_len..c_args.len+prepend_len],c_args[1..]) |*dst,src|
 	{
@@ -1,10 +1,12 @@
 const std = @import( "std" );
 const Options = @import( "options.zig" );
 const ObjFile = @import( "objfile.zig" );
+const DbFile = @import( "dbfile.zig" );
+const Graph = @import( "graph.zig" );
 
 
 const OptionsParser = Options.makeOptions(.{
-
+	.{ "node", ?i64, null, 'n', "only print the neighbors of this node id in a linked object" },
 });
 
 pub fn main() !u8
@@ -25,47 +27,194 @@ pub fn main() !u8
 	}
 
 	const path = options.args[0];
-	var reader = try ObjFile.Reader.open( path );
-
-	const nodes = try reader.readNodes( allocator );
-	defer allocator.free( nodes );
-
-	const connections = try reader.readConnections( allocator );
-	defer allocator.free( connections );
+	if ( std.mem.endsWith( u8, path, ".cetdb" ) ) return dumpDatabase( path );
 
-	var strings = try reader.readStrings( allocator );
-	defer strings.deinit( allocator );
-
-	const linklinks = try reader.readLinkLinks( allocator );
-	defer allocator.free( linklinks );
+	var reader = try ObjFile.Reader.open( path );
+	defer reader.close();
 
-	var linknames = try reader.readLinkNames( allocator );
-	defer linknames.deinit( allocator );
+	const nodes = reader.nodes();
+	const compact = reader.compact();
+	const strings = reader.strings();
+	const linklinks = reader.linkLinks();
+	const linknames = reader.linkNames();
+	const headerrefs = reader.headerRefs();
 
+	if ( options.get( .node ) ) |id| return dumpNeighbors( reader, strings, id );
 
 	std.debug.print( "{}\n", .{ reader.hdr } );
+	for ( reader.sections.values ) |section|
+	{
+		if ( section ) |sect| std.debug.print( "{s: <16} offset {d: >10} size {d: >10} count {d}\n", .{ @tagName( sect.kind ), sect.offset, sect.size, sect.count } );
+	}
 
 	for (nodes) |node|
 	{
 		const id = node.id;
-		const str = strings.hashmap.get( node.string_hash ).?;
+		const str = strings.get( node.string_hash ).?;
 		std.debug.print("{} {s}\n", .{ id, str });
 	}
 
+	for (compact.node_ids, compact.node_strings) |id, string|
+	{
+		std.debug.print("{} {s}\n", .{ id, stringAt( strings, string ) });
+	}
+
 	for (linklinks) |link|
 	{
-		var node: ?*ObjFile.Node = null;
-		for (nodes) |*n|
+		var str: []const u8 = "????";
+		for (nodes) |n|
 		{
 			if ( link.node_id == n.id ) {
-				node = n;
+				str = strings.get( n.string_hash ).?;
+			}
+		}
+		for (compact.node_ids, compact.node_strings) |id, string|
+		{
+			if ( link.node_id == id ) {
+				str = stringAt( strings, string );
 			}
 		}
 
-		const str = if (node) |n| strings.hashmap.get( n.string_hash ).? else "????";
-		const linkname = linknames.hashmap.get( link.string_hash ).?;
+		const linkname = linknames.get( link.string_hash ).?;
 		std.debug.print("{s} {s}\n", .{ str, linkname });
 	}
 
+	for (reader.references()) |ref|
+	{
+		std.debug.print("{} {s} {}\n", .{ ref.from, std.enums.tagName(ObjFile.ReferenceKind, ref.kind) orelse "????", ref.to });
+	}
+
+	for (compact.reference_from, compact.reference_to, compact.reference_kinds) |from, to, kind|
+	{
+		std.debug.print("{} {s} {}\n", .{ from, kindName( kind ), to });
+	}
+
+	for (headerrefs) |ref|
+	{
+		const path = strings.get( ref.path_hash ).?;
+		std.debug.print("{x:0>16} {s} {s}\n", .{ ref.key, if (ref.owned != 0) "owned" else "ref", path });
+	}
+
+	// the TU as a tree, walking the connections from the translation unit
+	if ( compact.connection_from.len > 0 ) try dumpTree( allocator, compact, strings );
+
+	return 0;
+}
+
+fn stringAt( strings: ObjFile.StringTable, index: u32 ) []const u8
+{
+	if ( index >= strings.hashes.len ) return "????";
+	return strings.get( strings.hashes[index] ) orelse "????";
+}
+
+fn dumpTree( allocator: std.mem.Allocator, compact: ObjFile.Compact, strings: ObjFile.StringTable ) !void
+{
+	var len: usize = 1;
+	for ( compact.node_ids ) |node| len = @max( len, node + 1 );
+	for ( compact.connection_from, compact.connection_to ) |from, to| len = @max( len, from + 1, to + 1 );
+
+	const names = try allocator.alloc( []const u8, len );
+	defer allocator.free( names );
+	@memset( names, "" );
+	for ( compact.node_ids, compact.node_strings ) |node, string| names[node] = stringAt( strings, string );
+
+	// children by parent, in the order they were recorded
+	const offsets = try allocator.alloc( u32, len + 1 );
+	defer allocator.free( offsets );
+	@memset( offsets, 0 );
+	for ( compact.connection_to ) |parent| offsets[parent + 1] += 1;
+	for ( 1..offsets.len ) |i| offsets[i] += offsets[i - 1];
+	const children = try allocator.alloc( u32, compact.connection_from.len );
+	defer allocator.free( children );
+	const cursor = try allocator.dupe( u32, offsets[0..len] );
+	defer allocator.free( cursor );
+	for ( compact.connection_from, compact.connection_to ) |child, parent|
+	{
+		children[cursor[parent]] = child;
+		cursor[parent] += 1;
+	}
+
+	const Entry = struct { node: u32, depth: u32 };
+	var stack: std.ArrayListUnmanaged( Entry ) = .empty;
+	defer stack.deinit( allocator );
+
+	try stack.append( allocator, .{ .node = 0, .depth = 0 } );
+	while ( stack.pop() ) |entry|
+	{
+		std.debug.print( "{s}{} {s}\n", .{ indent[0..@min( entry.depth * 2, indent.len )], entry.node, names[entry.node] } );
+
+		const node_children = children[offsets[entry.node]..offsets[entry.node + 1]];
+		var i = node_children.len;
+		while ( i > 0 ) : ( i -= 1 ) try stack.append( allocator, .{ .node = node_children[i - 1], .depth = entry.depth + 1 } );
+	}
+}
+
+const indent = " " ** 64;
+
+fn dumpNeighbors( reader: ObjFile.Reader, strings: ObjFile.StringTable, id: i64 ) !u8
+{
+	const ids = reader.graphIds();
+	if ( ids.len == 0 ) {
+		_ = try std.io.getStdErr().write( "object has no adjacency, link it with cet-ld\n" );
+		return 1;
+	}
+
+	const index = Graph.indexOf( ids, id ) orelse {
+		std.debug.print( "no node {}\n", .{ id } );
+		return 1;
+	};
+
+	std.debug.print( "{} {s}\n", .{ id, nameOf( reader, strings, ids[index] ) } );
+	for ( reader.forwardOf( index ) ) |to| std.debug.print( "  -> {} {s}\n", .{ @as( i64, @bitCast( ids[to] ) ), nameOf( reader, strings, ids[to] ) } );
+	for ( reader.reverseOf( index ) ) |from| std.debug.print( "  <- {} {s}\n", .{ @as( i64, @bitCast( ids[from] ) ), nameOf( reader, strings, ids[from] ) } );
+
+	const refers = reader.refersOf( index );
+	for ( refers.targets, refers.kinds ) |to, kind| std.debug.print( "  {s} {} {s}\n", .{ kindName( kind ), @as( i64, @bitCast( ids[to] ) ), nameOf( reader, strings, ids[to] ) } );
+	const referrers = reader.referrersOf( index );
+	for ( referrers.targets, referrers.kinds ) |from, kind| std.debug.print( "  {s} by {} {s}\n", .{ kindName( kind ), @as( i64, @bitCast( ids[from] ) ), nameOf( reader, strings, ids[from] ) } );
+	return 0;
+}
+
+fn kindName( kind: u8 ) []const u8
+{
+	return std.enums.tagName( ObjFile.ReferenceKind, @enumFromInt( kind ) ) orelse "????";
+}
+
+// nodes are sorted by id in a linked object
+fn nameOf( reader: ObjFile.Reader, strings: ObjFile.StringTable, id: u64 ) []const u8
+{
+	const Context = struct {
+		fn order( k: u64, node: ObjFile.Node ) std.math.Order { return std.math.order( k, @as( u64, @bitCast( node.id ) ) ); }
+	};
+	const nodes = reader.nodes();
+	const i = std.sort.lowerBound( ObjFile.Node, nodes, id, Context.order );
+	if ( i == nodes.len or nodes[i].id != @as( i64, @bitCast( id ) ) ) return "";
+	return strings.get( nodes[i].string_hash ) orelse "????";
+}
+
+// chunk sizes per kind, the records themselves are only looked up
+fn dumpDatabase( path: []const u8 ) !u8
+{
+	var reader = try DbFile.Reader.open( path );
+	defer reader.close();
+
+	std.debug.print( "{}\n", .{ reader.hdr } );
+
+	const idens = [_]DbFile.ChunkIden{ DbFile.nodes_iden, DbFile.connections_iden, DbFile.linklinks_iden, DbFile.strings_iden, DbFile.linknames_iden };
+	for ( idens ) |iden|
+	{
+		var records: u64 = 0;
+		var compressed: u64 = 0;
+		var uncompressed: u64 = 0;
+		const chunks = reader.chunks( iden );
+		for ( chunks ) |entry|
+		{
+			records += entry.count;
+			compressed += entry.compressed_size;
+			uncompressed += entry.uncompressed_size;
+		}
+		std.debug.print( "{s} {d: >8} chunks {d: >12} records {d: >12} bytes {d: >12} compressed\n", .{ &iden.str, chunks.len, records, uncompressed, compressed } );
+	}
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,9 +1,17 @@
 const Clang = @import("clang.zig");
 const std = @import("std");
 const ObjFile = @import("objfile.zig");
+const DbFile = @import("dbfile.zig");
+const Graph = @import("graph.zig");
+const Report = @import("report.zig");
 
 const Options = @import("options.zig").makeOptions(.{
-
+	.{ "output", ?[:0]const u8, null, 'o', "linked object to write, defaults to out.cetobj" },
+	.{ "jobs", usize, 0, 'j', "number of shards to link at once, 0 uses every hardware thread" },
+	.{ "shard-size", usize, 256, 0, "MiB of objects linked together in each shard" },
+	.{ "database", ?[:0]const u8, null, 'd', "also write the linked output as a compressed database" },
+	.{ "chunk-size", u32, DbFile.default_chunk_size, 0, "bytes of records in each database chunk before compression" },
+	.{ "trace", ?[:0]const u8, null, 0, "write the shards and phases of the link to this path as a chrome trace" },
 });
 
 
@@ -18,8 +26,420 @@ const Options = @import("options.zig").makeOptions(.{
 // node id to node index
 // 
 
+// linking happens in two passes
+// shards of objects are linked in parallel into temporary objects, with every section sorted
+// the shard objects are then merged into the output one section at a time, nothing but the string index is held in memory
+// so peak memory is bounded by the largest shard times the number of jobs
+
+
+// node ids in an object are local to its TU, these are the same rules parseFromDB uses
+// a node with a link name is the same node in every object it is in, its id is the link name hash with the top bit set
+// everything else gets the object's index in the top bits, 0 is the translation unit and stays 0
+const link_bit: u64 = 1 << 63;
+const object_shift = 40;
+
+fn globalId( remap: *const std.AutoHashMapUnmanaged( i64, i64 ), object: u64, local: i64 ) i64
+{
+	if ( local == 0 ) return 0;
+	if ( remap.get( local ) ) |id| return id;
+	return @bitCast( ((object + 1) << object_shift) | @as( u64, @bitCast( local ) ) );
+}
+
+// ids are sorted as unsigned so linked nodes are in the same order as the database chunk keys
+fn key( id: i64 ) u64
+{
+	return @bitCast( id );
+}
+
+fn nodeLessThan( _: void, a: ObjFile.Node, b: ObjFile.Node ) bool
+{
+	return key( a.id ) < key( b.id );
+}
+
+fn connectionLessThan( _: void, a: ObjFile.Connection, b: ObjFile.Connection ) bool
+{
+	return key( a.from ) < key( b.from ) or ( a.from == b.from and key( a.to ) < key( b.to ) );
+}
+
+fn referenceLessThan( _: void, a: ObjFile.Reference, b: ObjFile.Reference ) bool
+{
+	if ( a.from != b.from ) return key( a.from ) < key( b.from );
+	if ( a.to != b.to ) return key( a.to ) < key( b.to );
+	return @intFromEnum( a.kind ) < @intFromEnum( b.kind );
+}
+
+fn linkLinkLessThan( _: void, a: ObjFile.LinkLink, b: ObjFile.LinkLink ) bool
+{
+	return key( a.node_id ) < key( b.node_id ) or ( a.node_id == b.node_id and a.string_hash < b.string_hash );
+}
+
+fn hashLessThan( _: void, a: u64, b: u64 ) bool
+{
+	return a < b;
+}
+
+
+const Shard = struct {
+	objects: []const [:0]const u8,
+	first_object: usize, // index of objects[0] in every object being linked
+	path: []const u8,
+	result: anyerror!void = {},
+	// for the trace, from the start of the link
+	start_ns: u64 = 0,
+	dur_ns: u64 = 0,
+	tid: u64 = 0,
+};
+
+// strings point into the mapped objects of the shard
+const StringSet = std.AutoArrayHashMapUnmanaged( u64, []const u8 );
+
+fn addStrings( allocator: std.mem.Allocator, set: *StringSet, table: ObjFile.StringTable ) !void
+{
+	try set.ensureUnusedCapacity( allocator, table.count() );
+	var itr = table.iterator();
+	while ( itr.next() ) |entry| set.putAssumeCapacity( entry.hash, entry.str );
+}
+
+// sorted by hash, so shards can be merged without a hash map
+fn writeStrings( allocator: std.mem.Allocator, writer: *ObjFile.StreamWriter, set: *StringSet, comptime kind: ObjFile.SectionKind ) !void
+{
+	const Context = struct {
+		keys: []const u64,
+		pub fn lessThan( ctx: @This(), a: usize, b: usize ) bool { return ctx.keys[a] < ctx.keys[b]; }
+	};
+	set.sort( Context{ .keys = set.keys() } );
+
+	const entries = try allocator.alloc( ObjFile.IndexEntry, set.count() );
+	defer allocator.free( entries );
+
+	try writer.beginSection( kind );
+	for ( set.keys(), set.values(), entries ) |hash, str, *entry| entry.* = try writer.writeString( hash, str );
+	writer.endSection( entries.len );
+	try writer.writeStringIndex( allocator, if ( kind == .strings ) .strings else .linknames, entries );
+}
+
+fn sortUnique( comptime T: type, items: *std.ArrayListUnmanaged( T ), comptime lessThan: fn ( void, T, T ) bool ) void
+{
+	std.sort.pdq( T, items.items, {}, lessThan );
+
+	var len: usize = 0;
+	for ( items.items ) |item|
+	{
+		if ( len > 0 and std.meta.eql( items.items[len - 1], item ) ) continue;
+		items.items[len] = item;
+		len += 1;
+	}
+	items.shrinkRetainingCapacity( len );
+}
+
+fn linkShard( allocator: std.mem.Allocator, shard: *Shard, run_start: std.time.Instant ) void
+{
+	const begin = std.time.Instant.now() catch run_start;
+	shard.result = linkShardInternal( allocator, shard );
+	const end = std.time.Instant.now() catch begin;
+
+	shard.start_ns = begin.since( run_start );
+	shard.dur_ns = end.since( begin );
+	shard.tid = std.Thread.getCurrentId();
+}
+
+fn linkShardInternal( allocator: std.mem.Allocator, shard: *Shard ) !void
+{
+	var readers: std.ArrayListUnmanaged( ObjFile.Reader ) = .empty;
+	defer {
+		for ( readers.items ) |*reader| reader.close();
+		readers.deinit( allocator );
+	}
+
+	var nodes: std.ArrayListUnmanaged( ObjFile.Node ) = .empty;
+	defer nodes.deinit( allocator );
+	var connections: std.ArrayListUnmanaged( ObjFile.Connection ) = .empty;
+	defer connections.deinit( allocator );
+	var references: std.ArrayListUnmanaged( ObjFile.Reference ) = .empty;
+	defer references.deinit( allocator );
+	var linklinks: std.ArrayListUnmanaged( ObjFile.LinkLink ) = .empty;
+	defer linklinks.deinit( allocator );
+	var strings: StringSet = .empty;
+	defer strings.deinit( allocator );
+	var linknames: StringSet = .empty;
+	defer linknames.deinit( allocator );
+	var remap: std.AutoHashMapUnmanaged( i64, i64 ) = .empty;
+	defer remap.deinit( allocator );
+
+	for ( shard.objects, shard.first_object.. ) |path, object|
+	{
+		const reader = try readers.addOne( allocator );
+		reader.* = ObjFile.Reader.open( path ) catch |err| {
+			readers.items.len -= 1;
+			std.log.err( "failed to open \"{s}\": {}", .{ path, err } );
+			return err;
+		};
+
+		// the first link name of a node decides its id, any others still get linked to it
+		remap.clearRetainingCapacity();
+		for ( reader.linkLinks() ) |link|
+		{
+			const gop = try remap.getOrPut( allocator, link.node_id );
+			if ( !gop.found_existing ) gop.value_ptr.* = @bitCast( link.string_hash | link_bit );
+		}
+
+		try nodes.ensureUnusedCapacity( allocator, reader.nodes().len );
+		for ( reader.nodes() ) |node| nodes.appendAssumeCapacity( .{ .id = globalId( &remap, object, node.id ), .string_hash = node.string_hash } );
+
+		try connections.ensureUnusedCapacity( allocator, reader.connections().len );
+		for ( reader.connections() ) |conn| connections.appendAssumeCapacity( .{ .from = globalId( &remap, object, conn.from ), .to = globalId( &remap, object, conn.to ) } );
+
+		try references.ensureUnusedCapacity( allocator, reader.references().len );
+		for ( reader.references() ) |ref| references.appendAssumeCapacity( .{ .from = globalId( &remap, object, ref.from ), .to = globalId( &remap, object, ref.to ), .kind = ref.kind } );
+
+		// objects from cet-cl have the compact form instead of records, a node's string is its position in the strings
+		const compact = reader.compact();
+		const string_hashes = reader.strings().hashes;
+
+		try nodes.ensureUnusedCapacity( allocator, compact.node_ids.len );
+		for ( compact.node_ids, compact.node_strings ) |node, string| nodes.appendAssumeCapacity( .{ .id = globalId( &remap, object, node ), .string_hash = string_hashes[string] } );
+
+		try connections.ensureUnusedCapacity( allocator, compact.connection_from.len );
+		for ( compact.connection_from, compact.connection_to ) |from, to| connections.appendAssumeCapacity( .{ .from = globalId( &remap, object, from ), .to = globalId( &remap, object, to ) } );
+
+		try references.ensureUnusedCapacity( allocator, compact.reference_from.len );
+		for ( compact.reference_from, compact.reference_to, compact.reference_kinds ) |from, to, kind| references.appendAssumeCapacity( .{ .from = globalId( &remap, object, from ), .to = globalId( &remap, object, to ), .kind = @enumFromInt( kind ) } );
+
+		try linklinks.ensureUnusedCapacity( allocator, reader.linkLinks().len );
+		for ( reader.linkLinks() ) |link| linklinks.appendAssumeCapacity( .{ .node_id = globalId( &remap, object, link.node_id ), .string_hash = link.string_hash } );
+
+		try addStrings( allocator, &strings, reader.strings() );
+		try addStrings( allocator, &linknames, reader.linkNames() );
+	}
+
+	// a node with a link name shows up in every object that has it, it only needs to be written once
+	std.sort.pdq( ObjFile.Node, nodes.items, {}, nodeLessThan );
+	{
+		var len: usize = 0;
+		for ( nodes.items ) |node|
+		{
+			if ( len > 0 and nodes.items[len - 1].id == node.id ) continue;
+			nodes.items[len] = node;
+			len += 1;
+		}
+		nodes.shrinkRetainingCapacity( len );
+	}
+	sortUnique( ObjFile.Connection, &connections, connectionLessThan );
+	sortUnique( ObjFile.Reference, &references, referenceLessThan );
+	sortUnique( ObjFile.LinkLink, &linklinks, linkLinkLessThan );
+
+	var writer = try ObjFile.StreamWriter.create( shard.path );
+	errdefer writer.abort();
+	try writer.writeSection( .nodes, std.mem.sliceAsBytes( nodes.items ), nodes.items.len );
+	try writer.writeSection( .connections, std.mem.sliceAsBytes( connections.items ), connections.items.len );
+	try writer.writeSection( .references, std.mem.sliceAsBytes( references.items ), references.items.len );
+	try writeStrings( allocator, &writer, &strings, .strings );
+	try writer.writeSection( .linklinks, std.mem.sliceAsBytes( linklinks.items ), linklinks.items.len );
+	try writeStrings( allocator, &writer, &linknames, .linknames );
+	try writer.finish( 0 );
+}
+
+
+// pops the items of several sorted runs in order, ties go to the earlier run
+fn MergeIterator( comptime T: type, comptime lessThan: fn ( void, T, T ) bool ) type
+{
+	return struct {
+		const Self = @This();
+		pub const Head = struct { run: usize, i: usize };
+		const Queue = std.PriorityQueue( Head, []const []const T, compare );
+
+		runs: []const []const T,
+		queue: Queue,
+
+		fn compare( runs: []const []const T, a: Head, b: Head ) std.math.Order
+		{
+			const x = runs[a.run][a.i];
+			const y = runs[b.run][b.i];
+			if ( lessThan( {}, x, y ) ) return .lt;
+			if ( lessThan( {}, y, x ) ) return .gt;
+			return std.math.order( a.run, b.run );
+		}
+
+		pub fn init( allocator: std.mem.Allocator, runs: []const []const T ) !Self
+		{
+			var queue = Queue.init( allocator, runs );
+			errdefer queue.deinit();
+			try queue.ensureTotalCapacity( runs.len );
+			for ( runs, 0.. ) |run, i|
+			{
+				if ( run.len > 0 ) queue.add( .{ .run = i, .i = 0 } ) catch unreachable;
+			}
+			return .{ .runs = runs, .queue = queue };
+		}
+
+		pub fn deinit( self: *Self ) void
+		{
+			self.queue.deinit();
+		}
+
+		pub fn next( self: *Self ) ?Head
+		{
+			const head = self.queue.removeOrNull() orelse return null;
+			if ( head.i + 1 < self.runs[head.run].len ) self.queue.add( .{ .run = head.run, .i = head.i + 1 } ) catch unreachable;
+			return head;
+		}
+	};
+}
 
-pub fn main() !void
+// like sortUnique but across runs that are already sorted, equal tells whether an item repeats the last one written
+fn mergeSection( allocator: std.mem.Allocator, writer: *ObjFile.StreamWriter, kind: ObjFile.SectionKind, comptime T: type, runs: []const []const T, comptime lessThan: fn ( void, T, T ) bool, comptime equal: fn ( T, T ) bool ) !void
+{
+	var itr = try MergeIterator( T, lessThan ).init( allocator, runs );
+	defer itr.deinit();
+
+	try writer.beginSection( kind );
+	var count: u64 = 0;
+	var last: ?T = null;
+	while ( itr.next() ) |head|
+	{
+		const item = runs[head.run][head.i];
+		if ( last != null and equal( last.?, item ) ) continue;
+		try writer.writeBytes( std.mem.asBytes( &item ) );
+		last = item;
+		count += 1;
+	}
+	writer.endSection( count );
+}
+
+fn mergeStrings( allocator: std.mem.Allocator, writer: *ObjFile.StreamWriter, comptime kind: ObjFile.SectionKind, tables: []const ObjFile.StringTable ) !void
+{
+	const runs = try allocator.alloc( []const u64, tables.len );
+	defer allocator.free( runs );
+	const positions = try allocator.alloc( usize, tables.len );
+	defer allocator.free( positions );
+	for ( tables, runs, positions ) |table, *run, *pos|
+	{
+		run.* = table.hashes;
+		pos.* = 0;
+	}
+
+	var itr = try MergeIterator( u64, hashLessThan ).init( allocator, runs );
+	defer itr.deinit();
+
+	var entries: std.ArrayListUnmanaged( ObjFile.IndexEntry ) = .empty;
+	defer entries.deinit( allocator );
+
+	try writer.beginSection( kind );
+	while ( itr.next() ) |head|
+	{
+		// each run's strings are popped in order, so the text is walked front to back
+		const text = tables[head.run].text;
+		const pos = positions[head.run];
+		const len = std.mem.indexOfScalarPos( u8, text, pos, 0 ).? - pos;
+		positions[head.run] = pos + len + 1;
+
+		const hash = runs[head.run][head.i];
+		if ( entries.items.len > 0 and entries.items[entries.items.len - 1].hash == hash ) continue;
+		try entries.append( allocator, try writer.writeString( hash, text[pos..][0..len] ) );
+	}
+	writer.endSection( entries.items.len );
+	try writer.writeStringIndex( allocator, if ( kind == .strings ) .strings else .linknames, entries.items );
+}
+
+fn nodeEqual( a: ObjFile.Node, b: ObjFile.Node ) bool
+{
+	return a.id == b.id;
+}
+
+fn connectionEqual( a: ObjFile.Connection, b: ObjFile.Connection ) bool
+{
+	return a.from == b.from and a.to == b.to;
+}
+
+fn referenceEqual( a: ObjFile.Reference, b: ObjFile.Reference ) bool
+{
+	return a.from == b.from and a.to == b.to and a.kind == b.kind;
+}
+
+fn linkLinkEqual( a: ObjFile.LinkLink, b: ObjFile.LinkLink ) bool
+{
+	return a.node_id == b.node_id and a.string_hash == b.string_hash;
+}
+
+fn mergeShards( allocator: std.mem.Allocator, shards: []const Shard, output: []const u8 ) !void
+{
+	var readers = try allocator.alloc( ObjFile.Reader, shards.len );
+	var opened: usize = 0;
+	defer {
+		for ( readers[0..opened] ) |*reader| reader.close();
+		allocator.free( readers );
+	}
+	for ( shards ) |shard|
+	{
+		readers[opened] = try ObjFile.Reader.open( shard.path );
+		opened += 1;
+	}
+
+	const nodes = try allocator.alloc( []const ObjFile.Node, readers.len );
+	defer allocator.free( nodes );
+	const connections = try allocator.alloc( []const ObjFile.Connection, readers.len );
+	defer allocator.free( connections );
+	const references = try allocator.alloc( []const ObjFile.Reference, readers.len );
+	defer allocator.free( references );
+	const linklinks = try allocator.alloc( []const ObjFile.LinkLink, readers.len );
+	defer allocator.free( linklinks );
+	const strings = try allocator.alloc( ObjFile.StringTable, readers.len );
+	defer allocator.free( strings );
+	const linknames = try allocator.alloc( ObjFile.StringTable, readers.len );
+	defer allocator.free( linknames );
+
+	for ( readers, 0.. ) |reader, i|
+	{
+		nodes[i] = reader.nodes();
+		connections[i] = reader.connections();
+		references[i] = reader.references();
+		linklinks[i] = reader.linkLinks();
+		strings[i] = reader.strings();
+		linknames[i] = reader.linkNames();
+	}
+
+	var writer = try ObjFile.StreamWriter.create( output );
+	errdefer writer.abort();
+	try mergeSection( allocator, &writer, .nodes, ObjFile.Node, nodes, nodeLessThan, nodeEqual );
+	try mergeSection( allocator, &writer, .connections, ObjFile.Connection, connections, connectionLessThan, connectionEqual );
+	try mergeSection( allocator, &writer, .references, ObjFile.Reference, references, referenceLessThan, referenceEqual );
+	try mergeStrings( allocator, &writer, .strings, strings );
+	try mergeSection( allocator, &writer, .linklinks, ObjFile.LinkLink, linklinks, linkLinkLessThan, linkLinkEqual );
+	try mergeStrings( allocator, &writer, .linknames, linknames );
+	try writer.finish( 0 );
+}
+
+
+// forward and reverse adjacency of the connections and references of the linked output, so neighbors are a lookup instead of a scan
+fn appendGraph( allocator: std.mem.Allocator, output: []const u8, jobs: usize ) !void
+{
+	var pool: std.Thread.Pool = undefined;
+	try pool.init( .{ .allocator = allocator, .n_jobs = @intCast( jobs ) } );
+	defer pool.deinit();
+
+	const graph = blk: {
+		var linked = try ObjFile.Reader.open( output );
+		defer linked.close();
+		break :blk try Graph.build( allocator, &pool, jobs, linked.nodes(), linked.connections(), linked.references() );
+	};
+	defer graph.deinit( allocator );
+
+	try ObjFile.appendSections( output, &.{
+		.{ .kind = .graph_ids, .bytes = std.mem.sliceAsBytes( graph.ids ), .count = graph.ids.len },
+		.{ .kind = .forward_offsets, .bytes = std.mem.sliceAsBytes( graph.forward.offsets ), .count = graph.forward.offsets.len },
+		.{ .kind = .forward_targets, .bytes = std.mem.sliceAsBytes( graph.forward.targets ), .count = graph.forward.targets.len },
+		.{ .kind = .reverse_offsets, .bytes = std.mem.sliceAsBytes( graph.reverse.offsets ), .count = graph.reverse.offsets.len },
+		.{ .kind = .reverse_targets, .bytes = std.mem.sliceAsBytes( graph.reverse.targets ), .count = graph.reverse.targets.len },
+		.{ .kind = .refers_offsets, .bytes = std.mem.sliceAsBytes( graph.refers.offsets ), .count = graph.refers.offsets.len },
+		.{ .kind = .refers_targets, .bytes = std.mem.sliceAsBytes( graph.refers.targets ), .count = graph.refers.targets.len },
+		.{ .kind = .refers_kinds, .bytes = graph.refers.kinds.?, .count = graph.refers.kinds.?.len },
+		.{ .kind = .referrers_offsets, .bytes = std.mem.sliceAsBytes( graph.referrers.offsets ), .count = graph.referrers.offsets.len },
+		.{ .kind = .referrers_targets, .bytes = std.mem.sliceAsBytes( graph.referrers.targets ), .count = graph.referrers.targets.len },
+		.{ .kind = .referrers_kinds, .bytes = graph.referrers.kinds.?, .count = graph.referrers.kinds.?.len },
+	});
+}
+
+pub fn main() !u8
 {
 	var gpa = std.heap.GeneralPurposeAllocator(.{}){};
 	const allocator = gpa.allocator();
@@ -32,30 +452,115 @@ pub fn main() !void
 	const options = try Options.parse( allocator );
 	defer options.deinit();
 
-	for ( options.args ) |file| {
-		var reader = ObjFile.Reader.open( file ) catch |err|
+	const output: []const u8 = options.get( .output ) orelse "out.cetobj";
+	const jobs = if ( options.get( .jobs ) == 0 ) try std.Thread.getCpuCount() else options.get( .jobs );
+	const shard_size = options.get( .@"shard-size" ) * 1024 * 1024;
+
+	if ( options.args.len == 0 ) {
+		_ = try std.io.getStdErr().write( "no objects to link\n" );
+		return 1;
+	}
+
+	// split the objects into shards of about shard_size bytes, keeping their order
+	var shards: std.ArrayListUnmanaged( Shard ) = .empty;
+	defer {
+		for ( shards.items ) |shard| allocator.free( shard.path );
+		shards.deinit( allocator );
+	}
+
+	var start: usize = 0;
+	var size: u64 = 0;
+	for ( options.args, 0.. ) |file, i|
+	{
+		const stat = std.fs.cwd().statFile( file ) catch |err| {
+			std.log.err( "failed to open \"{s}\": {}", .{ file, err } );
+			return 1;
+		};
+		size += stat.size;
+
+		if ( size >= shard_size or i + 1 == options.args.len )
 		{
-			return err;
+			const path = try std.fmt.allocPrint( allocator, "{s}.shard{}.tmp", .{ output, shards.items.len } );
+			errdefer allocator.free( path );
+			try shards.append( allocator, .{ .objects = options.args[start..i + 1], .first_object = start, .path = path } );
+			start = i + 1;
+			size = 0;
+		}
+	}
+
+	var timer = try std.time.Timer.start();
+	const run_start = try std.time.Instant.now();
+
+	{
+		var pool: std.Thread.Pool = undefined;
+		try pool.init( .{ .allocator = allocator, .n_jobs = @intCast( @min( jobs, shards.items.len ) ) } );
+		defer pool.deinit();
+
+		var wg: std.Thread.WaitGroup = .{};
+		for ( shards.items ) |*shard| pool.spawnWg( &wg, linkShard, .{ allocator, shard, run_start } );
+		pool.waitAndWork( &wg );
+	}
+
+	defer for ( shards.items ) |shard| std.fs.cwd().deleteFile( shard.path ) catch {};
+
+	for ( shards.items ) |shard|
+	{
+		shard.result catch |err| {
+			std.log.err( "failed to link \"{s}\": {}", .{ shard.path, err } );
+			return 1;
 		};
+	}
 
-		const nodes = try reader.readNodes( allocator );
-		defer allocator.free( nodes );
+	const link_time = timer.lap();
 
-		const connections = try reader.readConnections( allocator );
-		defer allocator.free( connections );
+	// a single shard is already sorted and unique
+	if ( shards.items.len == 1 ) {
+		try std.fs.cwd().rename( shards.items[0].path, output );
+	} else {
+		try mergeShards( allocator, shards.items, output );
+	}
 
-		var strings = try reader.readStrings( allocator );
-		defer strings.deinit( allocator );
+	const merge_time = timer.lap();
 
-		const linklinks = try reader.readLinkLinks( allocator );
-		defer allocator.free( linklinks );
+	try appendGraph( allocator, output, jobs );
 
-		var linknames = try reader.readLinkNames( allocator );
-		defer linknames.deinit( allocator );
+	const graph_time = timer.lap();
+	std.debug.print( "linked {} objects in {} shards, {}ms linking shards, {}ms merging, {}ms building adjacency\n", .{
+		options.args.len, shards.items.len, link_time / std.time.ns_per_ms, merge_time / std.time.ns_per_ms, graph_time / std.time.ns_per_ms,
+	});
 
-		
+	var database_time: u64 = 0;
+	if ( options.get( .database ) ) |database|
+	{
+		var linked = try ObjFile.Reader.open( output );
+		defer linked.close();
+		try DbFile.writeFromObject( allocator, linked, database, options.get( .@"chunk-size" ) );
+
+		database_time = timer.lap();
+		const object_size = linked.file.bytes.len;
+		const database_size = ( try std.fs.cwd().statFile( database ) ).size;
+		std.debug.print( "wrote database in {}ms, {} bytes from {} bytes of linked object\n", .{ database_time / std.time.ns_per_ms, database_size, object_size } );
+	}
 
+	if ( options.get( .trace ) ) |path|
+	{
+		var trace = try Report.TraceWriter.create( path );
+		defer trace.close();
+
+		const main_tid = std.Thread.getCurrentId();
+		try trace.event( "link shards", main_tid, 0, link_time, .{ .objects = options.args.len, .shards = shards.items.len } );
+		for ( shards.items ) |shard| try trace.event( std.fs.path.basename( shard.path ), shard.tid, shard.start_ns, shard.dur_ns, .{ .objects = shard.objects.len } );
+
+		var t = link_time;
+		try trace.event( "merge", main_tid, t, merge_time, .{} );
+		t += merge_time;
+		try trace.event( "adjacency", main_tid, t, graph_time, .{} );
+		t += graph_time;
+		if ( database_time > 0 ) try trace.event( "database", main_tid, t, database_time, .{} );
+		try trace.finish();
 	}
+
+	return 0;
 }
 
 
@@ -153,62 +658,3 @@ pub fn PagedArray( T: type, size: usize ) type {
 
     };
 }
-
-
-// chunks
-// name
-
-const DatabaseWriter = struct {
-	
-	fd: std.fs.File,
-
-	const PAGE_SIZE: usize = 2048;
-
-	const ChunkIden = packed struct {
-		int: u32,
-		str: [4]u8,
-	};
-
-	pub fn idenFromStr( str: []u8 ) ChunkIden
-	{
-		std.debug.assert( str.len <= 4 and str.len > 0 );
-		const len = @min( str.len, 4 );
-		var arr = std.mem.zeroes( [4]u8 );
-		@memcpy( arr[0..len], str[0..len] );
-		return .{ .str = arr };
-	}
-
-
-
-	const ChunkTable = extern struct {
-		len: u32,
-		pad: u32,
-		data: [1023]Entry,
-	
-		const Entry = extern struct {
-			iden: ChunkIden,
-			offset: u32 // going to round this so the 4gb limit shouldn't be a problem
-		};
-	};
-
-	
-	pub fn writeString( self: *@This() ) usize
-	{
-
-	}
-
-	pub fn writeNode( self: *@This(), node: ObjFile.Node ) usize
-	{
-
-	}
-
-	pub fn writeConnection( self: *@This(), connection: ObjFile.Connection ) usize 
-	{
-		
-	}
-
-	pub fn writeChunk( self: *@This(), iden: ChunkIden, compressed_size: u32, uncompressed_size: u32 ) void
-	{
-		
-	}
-};
\ No newline at end of file
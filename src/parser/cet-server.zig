@@ -0,0 +1,470 @@
+const std = @import("std");
+
+const Clang = @import("clang.zig");
+const Options = @import("options.zig");
+const Recorder = @import("recorder.zig").Recorder;
+const Fingerprint = @import("fingerprint.zig");
+const Report = @import("report.zig");
+
+
+const OptionsParser = Options.makeOptions(.{
+	.{ "path", ?[:0]const u8, null, 'p', "directory of the compile database" },
+	.{ "socket", ?[:0]const u8, null, 's', "path of the server's socket, defaults to cet-server.sock in the database directory" },
+	.{ "notify", bool, false, 0, "tell a running server that the files given as args changed and wait for it to update" },
+	.{ "jobs", usize, 0, 'j', "number of commands to parse at once, 0 uses every hardware thread" },
+	.{ "shared-preamble", bool, false, 0, "share precompiled preambles between TUs that include the same headers with the same flags" },
+	.{ "preamble-dir", ?[:0]const u8, null, 0, "directory shared preambles are kept in, defaults to the system temp dir" },
+	.{ "no-references", bool, false, 0, "only record the decl tree, not the call and reference edges between decls" },
+	.{ "skip-bodies", bool, false, 0, "skip function bodies, only the decl tree is recorded" },
+	.{ "keep-main-bodies", bool, false, 0, "with --skip-bodies, still parse function bodies in each TU's main file" },
+	.{ "lazy-link-names", bool, false, 0, "mangle link names after the traversal, only for decls the TU defines or refers to" },
+	.{ "huge-pages", bool, false, 0, "back the parser's arenas with transparent huge pages where the OS supports them" },
+	.{ "prefault", bool, false, 0, "fault arena pages in when they are committed instead of on first touch" },
+});
+
+// keeps a compile database parsed in process between reindexes, with the file cache and shared preambles warm
+// editors tell it which files were saved over a local socket and it writes the .cetobj of every TU that read one of them
+// the objects and fingerprints are the ones cet-driver --in-process writes with the same options, linking is left to cet-ld
+//
+// requests and replies are lines:
+//   changed <path>  the file at the absolute path changed or was created, nothing is parsed yet
+//   update          parse every TU that read a changed file, replies "wrote <cetobj>" or "failed <file>" per TU then "done <TUs> <ms>"
+//                   a file no TU read yet parses the TUs that read a file in its directory and the ones that failed
+//   quit            replies "bye" and stops the server
+// changes to the compile database itself need a restart
+
+pub fn main() !u8
+{
+	var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+	const allocator = gpa.allocator();
+	defer {
+		const deinit_status = gpa.deinit();
+		if (deinit_status == .leak) @panic("LEAK");
+	}
+
+	const options = try OptionsParser.parse( allocator );
+	defer options.deinit();
+
+	const path: [:0]const u8 = options.get( .path ) orelse {
+		_ = try std.io.getStdErr().write( "failed to get path\n" );
+		return 1;
+	};
+	const socket_path = if ( options.get( .socket ) ) |s| try allocator.dupe( u8, s ) else try std.fs.path.join( allocator, &.{ path, "cet-server.sock" } );
+	defer allocator.free( socket_path );
+
+	if ( options.get( .notify ) ) return notify( allocator, socket_path, options.args );
+
+	try Clang.initialize();
+
+	var err : [*c]const u8 = undefined;
+	const db = Clang.parseDB( path.ptr, &err ) orelse {
+		try std.io.getStdErr().writer().print( "failed to parse db: {s}", .{ err } );
+		return 1;
+	};
+	defer db.deinit();
+
+	var parse_options: Clang.ParseOptions = .{};
+	parse_options.flags.shared_preamble = options.get( .@"shared-preamble" );
+	parse_options.flags.no_references = options.get( .@"no-references" );
+	parse_options.flags.skip_bodies = options.get( .@"skip-bodies" );
+	parse_options.flags.keep_main_bodies = options.get( .@"keep-main-bodies" );
+	parse_options.flags.lazy_link_names = options.get( .@"lazy-link-names" );
+	parse_options.flags.huge_pages = options.get( .@"huge-pages" );
+	parse_options.flags.prefault = options.get( .prefault );
+	if ( options.get( .@"preamble-dir" ) ) |dir| parse_options.preamble_dir = dir.ptr;
+
+	var mode = std.ArrayList( []const u8 ).init( allocator );
+	defer mode.deinit();
+	try Fingerprint.appendModeArgs( &mode, parse_options.flags, options.get( .@"preamble-dir" ) );
+
+	const session = try Clang.ParseSession.create( parse_options );
+	defer session.deinit();
+
+	var server = try Server.init( allocator, db, session, mode.items, options.get( .jobs ) );
+	defer server.deinit();
+
+	try server.start();
+	try server.listen( socket_path );
+	return 0;
+}
+
+
+const Server = struct {
+	const Result = struct {
+		index: u32,
+		ok: bool,
+	};
+
+	allocator: std.mem.Allocator,
+	db: Clang.CompileDatabase,
+	commands: []Clang.CompileCommand,
+	session: Clang.ParseSession,
+	mode: []const []const u8,
+	jobs: usize,
+
+	// everything below is written by the parse threads
+	lock: std.Thread.Mutex = .{},
+	// every file a TU read to the TUs that read it, the keys are resolved paths owned by the map
+	dependents: std.StringHashMapUnmanaged( std.ArrayListUnmanaged( u32 ) ) = .empty,
+	// the keys of dependents read by each command
+	dependencies: []std.ArrayListUnmanaged( []const u8 ),
+	// commands whose last parse failed or couldn't be written
+	failed: std.DynamicBitSetUnmanaged,
+	// one per command of the last parse
+	results: std.ArrayListUnmanaged( Result ) = .empty,
+
+	pub fn init( allocator: std.mem.Allocator, db: Clang.CompileDatabase, session: Clang.ParseSession, mode: []const []const u8, jobs: usize ) !Server
+	{
+		const commands = db.getAllCommands();
+		const dependencies = try allocator.alloc( std.ArrayListUnmanaged( []const u8 ), commands.len );
+		errdefer allocator.free( dependencies );
+		@memset( dependencies, .empty );
+		const failed = try std.DynamicBitSetUnmanaged.initEmpty( allocator, commands.len );
+		return .{ .allocator = allocator, .db = db, .commands = commands, .session = session, .mode = mode, .jobs = jobs, .dependencies = dependencies, .failed = failed };
+	}
+
+	pub fn deinit( self: *Server ) void
+	{
+		for ( self.dependencies ) |*list| list.deinit( self.allocator );
+		self.allocator.free( self.dependencies );
+		self.failed.deinit( self.allocator );
+
+		var it = self.dependents.iterator();
+		while ( it.next() ) |entry|
+		{
+			entry.value_ptr.deinit( self.allocator );
+			self.allocator.free( entry.key_ptr.* );
+		}
+		self.dependents.deinit( self.allocator );
+		self.results.deinit( self.allocator );
+	}
+
+	// picks up the objects already on disk and parses the commands they are missing or out of date for
+	pub fn start( self: *Server ) !void
+	{
+		var stale = std.ArrayList( u64 ).init( self.allocator );
+		defer stale.deinit();
+
+		for ( self.commands, 0.. ) |cmd, index|
+		{
+			if ( try self.loadFingerprint( @intCast( index ), cmd ) ) continue;
+			try stale.append( index );
+		}
+
+		var timer = try std.time.Timer.start();
+		self.parse( stale.items );
+		try std.io.getStdErr().writer().print( "{} of {} commands up to date, parsed the rest in {}ms\n", .{
+			self.commands.len - stale.items.len, self.commands.len, timer.read() / std.time.ns_per_ms,
+		} );
+		try Report.printFileStats( std.io.getStdErr().writer(), self.session.fileStats() );
+	}
+
+	// true if the command's object is up to date, its dependencies are taken from the fingerprint
+	fn loadFingerprint( self: *Server, index: u32, cmd: Clang.CompileCommand ) !bool
+	{
+		const path = try Fingerprint.objectPath( self.allocator, cmd );
+		defer self.allocator.free( path );
+		std.fs.cwd().access( path, .{} ) catch return false;
+
+		const fingerprint_path = try Fingerprint.pathForObject( self.allocator, path );
+		defer self.allocator.free( fingerprint_path );
+		if ( !Fingerprint.isUpToDate( self.allocator, fingerprint_path, Fingerprint.hashCommand( cmd, self.mode ) ) ) return false;
+
+		const contents = Fingerprint.read( self.allocator, fingerprint_path ) catch return false;
+		defer contents.deinit( self.allocator );
+		try self.setDependencies( index, contents.dependencies, contents.paths );
+		return true;
+	}
+
+	// replaces what the command read, the main file is always part of it so a TU that failed to parse gets another go when it's saved
+	// called with the lock held or before parsing starts
+	fn setDependencies( self: *Server, index: u32, dependencies: []const Fingerprint.Dependency, paths: []const u8 ) !void
+	{
+		const list = &self.dependencies[index];
+		for ( list.items ) |key|
+		{
+			const dependents = self.dependents.getPtr( key ).?;
+			const pos = std.mem.indexOfScalar( u32, dependents.items, index ).?;
+			_ = dependents.swapRemove( pos );
+		}
+		list.clearRetainingCapacity();
+
+		const cmd = self.commands[index];
+		try self.addDependency( index, &.{ std.mem.span( cmd.directory ), std.mem.span( cmd.filename ) } );
+		for ( dependencies ) |dep| try self.addDependency( index, &.{ paths[dep.path_offset..][0..dep.path_len] } );
+	}
+
+	fn addDependency( self: *Server, index: u32, path: []const []const u8 ) !void
+	{
+		const resolved = try std.fs.path.resolve( self.allocator, path );
+		const entry = self.dependents.getOrPut( self.allocator, resolved ) catch |err| {
+			self.allocator.free( resolved );
+			return err;
+		};
+		if ( entry.found_existing ) {
+			self.allocator.free( resolved );
+		} else {
+			entry.value_ptr.* = .empty;
+		}
+
+		// the main file shows up again in the dependencies
+		const dependents = entry.value_ptr;
+		if ( dependents.items.len > 0 and dependents.items[dependents.items.len - 1] == index ) return;
+
+		try dependents.append( self.allocator, index );
+		try self.dependencies[index].append( self.allocator, entry.key_ptr.* );
+	}
+
+	fn parse( self: *Server, indices: []const u64 ) void
+	{
+		self.results.clearRetainingCapacity();
+		if ( indices.len == 0 ) return;
+		self.session.parseCommands( self.db, indices, self, *Recorder, self.jobs );
+	}
+
+	// a file the server hasn't seen can change what an include resolves to, or be the one a failed TU was missing
+	// every TU that read a file in the same directory is parsed again, along with every TU that failed last time
+	fn addUnknown( self: *Server, path: []const u8, affected: *std.DynamicBitSetUnmanaged ) void
+	{
+		affected.setUnion( self.failed );
+		const dir = std.fs.path.dirname( path ) orelse return;
+		var it = self.dependents.iterator();
+		while ( it.next() ) |entry|
+		{
+			const dep_dir = std.fs.path.dirname( entry.key_ptr.* ) orelse continue;
+			if ( !std.mem.eql( u8, dir, dep_dir ) ) continue;
+			for ( entry.value_ptr.items ) |index| affected.set( index );
+		}
+	}
+
+	// parses every TU that read one of paths, paths are resolved
+	fn update( self: *Server, paths: []const []const u8 ) !void
+	{
+		var affected = try std.DynamicBitSetUnmanaged.initEmpty( self.allocator, self.commands.len );
+		defer affected.deinit( self.allocator );
+
+		var c_paths = std.ArrayList( [*:0]const u8 ).init( self.allocator );
+		defer {
+			for ( c_paths.items ) |p| self.allocator.free( std.mem.span( p ) );
+			c_paths.deinit();
+		}
+
+		var unknown = false;
+		for ( paths ) |path|
+		{
+			const c_path = try self.allocator.dupeZ( u8, path );
+			c_paths.append( c_path ) catch |err| {
+				self.allocator.free( c_path );
+				return err;
+			};
+
+			const dependents = self.dependents.get( path ) orelse {
+				unknown = true;
+				self.addUnknown( path, &affected );
+				continue;
+			};
+			for ( dependents.items ) |index| affected.set( index );
+		}
+
+		// a new file can change what an include resolves to in any TU, forget every cached stat as well
+		self.session.invalidate( c_paths.items );
+		if ( unknown ) self.session.invalidateAll();
+
+		var indices = std.ArrayList( u64 ).init( self.allocator );
+		defer indices.deinit();
+		var it = affected.iterator( .{} );
+		while ( it.next() ) |index| try indices.append( index );
+
+		self.parse( indices.items );
+	}
+
+	pub fn begin( self: *Server, index: u64 ) ?*Recorder
+	{
+		_ = index;
+		const recorder = self.allocator.create( Recorder ) catch @panic( "OOM" );
+		recorder.* = Recorder.init( self.allocator );
+		return recorder;
+	}
+
+	pub fn end( self: *Server, index: u64, recorder: *Recorder, ok: bool ) void
+	{
+		defer {
+			recorder.deinit();
+			self.allocator.destroy( recorder );
+		}
+
+		const cmd = self.commands[index];
+		const written = ok and if ( self.writeOutput( cmd, recorder ) ) |_| true else |err| blk: {
+			std.io.getStdErr().writer().print( "failed to write output for {s}: {}\n", .{ cmd.filename, err } ) catch {};
+			break :blk false;
+		};
+
+		self.lock.lock();
+		defer self.lock.unlock();
+		self.results.append( self.allocator, .{ .index = @intCast( index ), .ok = written } ) catch {};
+		self.failed.setValue( index, !written );
+
+		// what it read before is kept, but a TU that never parsed still has to be known by its main file so saving it parses it again
+		if ( !written ) {
+			if ( self.dependencies[index].items.len > 0 ) return;
+			self.setDependencies( @intCast( index ), &.{}, &.{} ) catch |err| {
+				std.io.getStdErr().writer().print( "failed to track the main file of {s}: {}\n", .{ cmd.filename, err } ) catch {};
+			};
+			return;
+		}
+		self.setDependencies( @intCast( index ), recorder.dependencies.items, recorder.dependency_paths.items ) catch |err| {
+			std.io.getStdErr().writer().print( "failed to track the dependencies of {s}: {}\n", .{ cmd.filename, err } ) catch {};
+		};
+	}
+
+	fn writeOutput( self: *Server, cmd: Clang.CompileCommand, recorder: *Recorder ) !void
+	{
+		const path = try Fingerprint.objectPath( self.allocator, cmd );
+		defer self.allocator.free( path );
+		try recorder.write( path );
+
+		const fingerprint_path = try Fingerprint.pathForObject( self.allocator, path );
+		defer self.allocator.free( fingerprint_path );
+		try recorder.writeFingerprint( fingerprint_path, Fingerprint.hashCommand( cmd, self.mode ) );
+	}
+
+	// one client at a time, parsing already uses every job
+	pub fn listen( self: *Server, socket_path: []const u8 ) !void
+	{
+		// left behind by a server that didn't shut down
+		std.fs.cwd().deleteFile( socket_path ) catch |err| if ( err != error.FileNotFound ) return err;
+
+		const address = try std.net.Address.initUnix( socket_path );
+		var listener = try address.listen( .{} );
+		defer {
+			listener.deinit();
+			std.fs.cwd().deleteFile( socket_path ) catch {};
+		}
+		try std.io.getStdErr().writer().print( "listening on {s}\n", .{ socket_path } );
+
+		while ( true )
+		{
+			const connection = try listener.accept();
+			defer connection.stream.close();
+
+			const keep_going = self.serve( connection.stream ) catch |err| blk: {
+				std.io.getStdErr().writer().print( "dropped a client: {}\n", .{ err } ) catch {};
+				break :blk true;
+			};
+			if ( !keep_going ) return;
+		}
+	}
+
+	// false once the client asked to quit
+	fn serve( self: *Server, stream: std.net.Stream ) !bool
+	{
+		var reader = std.io.bufferedReader( stream.reader() );
+		var buffer = std.io.bufferedWriter( stream.writer() );
+		const writer = buffer.writer();
+
+		var line = std.ArrayList( u8 ).init( self.allocator );
+		defer line.deinit();
+		var changed = std.ArrayList( []u8 ).init( self.allocator );
+		defer {
+			for ( changed.items ) |path| self.allocator.free( path );
+			changed.deinit();
+		}
+
+		while ( true )
+		{
+			line.clearRetainingCapacity();
+			reader.reader().streamUntilDelimiter( line.writer(), '\n', std.fs.max_path_bytes + 64 ) catch |err| switch ( err ) {
+				error.EndOfStream => return true,
+				else => return err,
+			};
+			const request = std.mem.trimRight( u8, line.items, "\r" );
+
+			if ( std.mem.startsWith( u8, request, "changed " ) )
+			{
+				const path = try std.fs.path.resolve( self.allocator, &.{ request["changed ".len..] } );
+				changed.append( path ) catch |err| {
+					self.allocator.free( path );
+					return err;
+				};
+			}
+			else if ( std.mem.eql( u8, request, "update" ) )
+			{
+				var timer = try std.time.Timer.start();
+				try self.update( changed.items );
+				for ( changed.items ) |path| self.allocator.free( path );
+				changed.clearRetainingCapacity();
+
+				for ( self.results.items ) |result|
+				{
+					const cmd = self.commands[result.index];
+					if ( !result.ok ) {
+						try writer.print( "failed {s}\n", .{ cmd.filename } );
+						continue;
+					}
+					const path = try Fingerprint.objectPath( self.allocator, cmd );
+					defer self.allocator.free( path );
+					try writer.print( "wrote {s}\n", .{ path } );
+				}
+				try writer.print( "done {} {}\n", .{ self.results.items.len, timer.read() / std.time.ns_per_ms } );
+			}
+			else if ( std.mem.eql( u8, request, "quit" ) )
+			{
+				try writer.writeAll( "bye\n" );
+				try buffer.flush();
+				return false;
+			}
+			else
+			{
+				try writer.print( "error unknown request \"{s}\"\n", .{ request } );
+			}
+			try buffer.flush();
+		}
+	}
+};
+
+
+// the client side, sends files as changed, asks for an update and prints the reply
+// fails if the server couldn't parse or write one of the TUs
+fn notify( allocator: std.mem.Allocator, socket_path: []const u8, files: []const [:0]const u8 ) !u8
+{
+	const stderr = std.io.getStdErr().writer();
+	const stream = std.net.connectUnixSocket( socket_path ) catch |err| {
+		try stderr.print( "failed to connect to {s}: {}\n", .{ socket_path, err } );
+		return 1;
+	};
+	defer stream.close();
+
+	const cwd = try std.process.getCwdAlloc( allocator );
+	defer allocator.free( cwd );
+
+	var buffer = std.io.bufferedWriter( stream.writer() );
+	for ( files ) |file|
+	{
+		const path = try std.fs.path.resolve( allocator, &.{ cwd, file } );
+		defer allocator.free( path );
+		try buffer.writer().print( "changed {s}\n", .{ path } );
+	}
+	try buffer.writer().writeAll( "update\n" );
+	try buffer.flush();
+
+	var reader = std.io.bufferedReader( stream.reader() );
+	var line = std.ArrayList( u8 ).init( allocator );
+	defer line.deinit();
+	const stdout = std.io.getStdOut().writer();
+	var failed = false;
+	while ( true )
+	{
+		line.clearRetainingCapacity();
+		reader.reader().streamUntilDelimiter( line.writer(), '\n', null ) catch |err| switch ( err ) {
+			error.EndOfStream => {
+				try stderr.writeAll( "server closed the connection\n" );
+				return 1;
+			},
+			else => return err,
+		};
+		try stdout.print( "{s}\n", .{ line.items } );
+
+		if ( std.mem.startsWith( u8, line.items, "failed " ) ) failed = true;
+		if ( std.mem.startsWith( u8, line.items, "done " ) ) return if ( failed ) 1 else 0;
+	}
+}
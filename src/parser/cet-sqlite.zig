@@ -0,0 +1,171 @@
+const std = @import("std");
+const ObjFile = @import("objfile.zig");
+const sqlite = @import("sqlite");
+
+const Options = @import("options.zig").makeOptions(.{
+	.{ "output", ?[:0]const u8, null, 'o', "sqlite database to write, defaults to out.sqlite" },
+	.{ "batch", usize, 1_000_000, 0, "rows inserted in each transaction" },
+});
+
+// loads a linked object from cet-ld into sqlite
+// the load runs with the journal in WAL and syncing off, every table is filled with one reused prepared insert
+// in transactions of --batch rows, the indexes are only built once everything has been inserted
+// the CSR sections cet-ld builds aren't copied, their offsets index arrays sqlite doesn't have
+// the indexes on from_id and to_id are sqlite's forward and reverse adjacency, the edges themselves all end up in the tables
+
+const schema =
+	\\CREATE TABLE nodes (id INTEGER PRIMARY KEY, name_hash INTEGER NOT NULL);
+	\\CREATE TABLE connections (from_id INTEGER NOT NULL, to_id INTEGER NOT NULL);
+	\\CREATE TABLE refs (from_id INTEGER NOT NULL, to_id INTEGER NOT NULL, kind INTEGER NOT NULL);
+	\\CREATE TABLE links (node_id INTEGER NOT NULL, name_hash INTEGER NOT NULL);
+	\\CREATE TABLE strings (hash INTEGER PRIMARY KEY, text TEXT NOT NULL);
+	\\CREATE TABLE linknames (hash INTEGER PRIMARY KEY, text TEXT NOT NULL);
+;
+
+const load_pragmas =
+	\\PRAGMA journal_mode = WAL;
+	\\PRAGMA synchronous = OFF;
+	\\PRAGMA temp_store = MEMORY;
+	\\PRAGMA cache_size = -262144;
+;
+
+const indexes =
+	\\CREATE INDEX connections_from ON connections (from_id);
+	\\CREATE INDEX connections_to ON connections (to_id);
+	\\CREATE INDEX refs_from ON refs (from_id);
+	\\CREATE INDEX refs_to ON refs (to_id);
+	\\CREATE INDEX links_node ON links (node_id);
+	\\CREATE INDEX links_name ON links (name_hash);
+;
+
+// ids and hashes are stored as their bits, sqlite only has signed integers
+fn int( value: anytype ) i64
+{
+	return @bitCast( value );
+}
+
+const Loader = struct {
+	db: sqlite.DB,
+	batch: usize,
+	pending: usize = 0,
+
+	fn insert( self: *Loader, stmt: sqlite.Stmt, values: anytype ) !void
+	{
+		try stmt.exec( values );
+		self.pending += 1;
+		if ( self.pending == self.batch ) {
+			try self.db.exec( "COMMIT; BEGIN;" );
+			self.pending = 0;
+		}
+	}
+};
+
+fn report( name: []const u8, rows: usize, ns: u64 ) void
+{
+	const seconds = @as( f64, @floatFromInt( ns ) ) / std.time.ns_per_s;
+	const rate = if ( seconds > 0 ) @as( f64, @floatFromInt( rows ) ) / seconds else 0;
+	std.debug.print( "{s: <12} {d: >12} rows {d: >10.3}s {d: >14.0} rows/s\n", .{ name, rows, seconds, rate } );
+}
+
+fn loadStrings( loader: *Loader, sql: []const u8, table: ObjFile.StringTable ) !usize
+{
+	const stmt = try loader.db.prepare( sql );
+	defer stmt.destroy();
+
+	var itr = table.iterator();
+	while ( itr.next() ) |entry| try loader.insert( stmt, .{ int( entry.hash ), entry.str } );
+	return table.count();
+}
+
+pub fn main() !u8
+{
+	var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+	const allocator = gpa.allocator();
+	defer {
+		const deinit_status = gpa.deinit();
+		if (deinit_status == .leak) @panic("LEAK");
+	}
+
+	const options = try Options.parse( allocator );
+	defer options.deinit();
+
+	if ( options.args.len < 1 ) {
+		_ = try std.io.getStdErr().write( "missing linked object arg\n" );
+		return 1;
+	}
+
+	const output: [:0]const u8 = options.get( .output ) orelse "out.sqlite";
+	std.fs.cwd().deleteFile( output ) catch |err| switch ( err ) {
+		error.FileNotFound => {},
+		else => return err,
+	};
+
+	var object = try ObjFile.Reader.open( options.args[0] );
+	defer object.close();
+
+	const db = try sqlite.open( output, .create );
+	defer db.close();
+
+	try db.exec( load_pragmas );
+	try db.exec( schema );
+
+	var loader = Loader{ .db = db, .batch = @max( options.get( .batch ), 1 ) };
+	var load_timer = try std.time.Timer.start();
+	var timer = try std.time.Timer.start();
+	var total_rows: usize = 0;
+
+	try db.exec( "BEGIN;" );
+	{
+		const stmt = try db.prepare( "INSERT INTO nodes (id, name_hash) VALUES (?, ?);" );
+		defer stmt.destroy();
+		for ( object.nodes() ) |node| try loader.insert( stmt, .{ int( node.id ), int( node.string_hash ) } );
+		report( "nodes", object.nodes().len, timer.lap() );
+		total_rows += object.nodes().len;
+	}
+	{
+		const stmt = try db.prepare( "INSERT INTO connections (from_id, to_id) VALUES (?, ?);" );
+		defer stmt.destroy();
+		for ( object.connections() ) |conn| try loader.insert( stmt, .{ int( conn.from ), int( conn.to ) } );
+		report( "connections", object.connections().len, timer.lap() );
+		total_rows += object.connections().len;
+	}
+	{
+		// kind is a ReferenceKind
+		const stmt = try db.prepare( "INSERT INTO refs (from_id, to_id, kind) VALUES (?, ?, ?);" );
+		defer stmt.destroy();
+		for ( object.references() ) |ref| try loader.insert( stmt, .{ int( ref.from ), int( ref.to ), int( @intFromEnum( ref.kind ) ) } );
+		report( "references", object.references().len, timer.lap() );
+		total_rows += object.references().len;
+	}
+	{
+		const stmt = try db.prepare( "INSERT INTO links (node_id, name_hash) VALUES (?, ?);" );
+		defer stmt.destroy();
+		for ( object.linkLinks() ) |link| try loader.insert( stmt, .{ int( link.node_id ), int( link.string_hash ) } );
+		report( "links", object.linkLinks().len, timer.lap() );
+		total_rows += object.linkLinks().len;
+	}
+	{
+		const rows = try loadStrings( &loader, "INSERT INTO strings (hash, text) VALUES (?, ?);", object.strings() );
+		report( "strings", rows, timer.lap() );
+		total_rows += rows;
+	}
+	{
+		const rows = try loadStrings( &loader, "INSERT INTO linknames (hash, text) VALUES (?, ?);", object.linkNames() );
+		report( "linknames", rows, timer.lap() );
+		total_rows += rows;
+	}
+	try db.exec( "COMMIT;" );
+	const load_time = load_timer.read();
+
+	timer.reset();
+	try db.exec( indexes );
+	const index_time = timer.read();
+
+	// back to a journal that survives a crash for whoever opens it next
+	try db.exec( "PRAGMA synchronous = NORMAL; PRAGMA wal_checkpoint(TRUNCATE);" );
+
+	report( "total", total_rows, load_time );
+	std.debug.print( "indexes built in {d:.3}s\n", .{ @as( f64, @floatFromInt( index_time ) ) / std.time.ns_per_s } );
+
+	return 0;
+}
@@ -6,6 +6,8 @@
 #define EXPORTED __attribute__((__visibility__("default"))) extern "C"
 #elif (defined _WIN32 && !defined __CYGWIN__) 
 #define EXPORTED __declspec(dllexport) extern "C"
+#elif defined __GNUC__
+#define EXPORTED extern "C" __attribute__((visibility("default")))
 #else
 #error ""
 #endif
@@ -13,6 +15,7 @@
 #define EXPORTED
 #endif
 
+typedef unsigned int u32;
 typedef unsigned long long u64;
 typedef long long i64;
 
@@ -39,6 +42,8 @@ EXPORTED Slice_CompileCommand CompileDatabase_getAllCommands( CompileDatabase* d
 EXPORTED void CompileDatabase_deinit( CompileDatabase* db );
 
 // pointer is owned by caller, call CompileDatabase_deinit to free it
+// compile_commands.json is read directly when possible, everything else goes through clang's loaders
+// strings are shared between commands, equal strings have the same pointer
 EXPORTED CompileDatabase* parseDB( const char* directory , const char** err );
 
 EXPORTED void printFree( );
@@ -73,14 +78,162 @@ EXPORTED struct Slice_Byte ParsedModuleInfo_getTextCache( ParsedModuleInfo* minf
 
 EXPORTED void ParsedModuleInfo_deinit( ParsedModuleInfo* minfo );
 
+typedef struct LinkIdentifier {
+	i64 node_id;
+	u64 string_hash;
+} LinkIdentifier;
+
+// what an expression inside a decl does with another decl
+enum ReferenceKind {
+	REFERENCE_USE = 0,       // names a variable, function or field without calling it
+	REFERENCE_CALL = 1,      // calls a function or method
+	REFERENCE_CONSTRUCT = 2, // calls a constructor
+};
+
+#define RECORD_BLOCK_SIZE 4096
+
+// filled by the parser and handed over whole, only valid for the duration of the flush call
+// string hashes are XXH3-64 of the string, computed once on the parser side
+// records are struct of arrays with dense 32 bit node indices local to the TU, in the order the parser first saw each decl, 0 is the translation unit
+// a node's string is its index in the order strings are handed over, starting from the TU's first block
+// references go from the innermost enclosing decl that isn't a local to the canonical decl referred to
+typedef struct RecordBlock {
+	u64 nodes_len;
+	u64 connections_len;
+	u64 links_len;
+	u64 references_len;
+
+	// strings first seen since the previous block, null terminated and back to back
+	// hashes in this block can also refer to strings handed over by earlier blocks
+	// the hashes are in the same order as the strings, one per string
+	const char* strings;
+	const u64* string_hashes;
+	u64 strings_len;
+	u64 strings_count;
+	const char* linknames;
+	const u64* linkname_hashes;
+	u64 linknames_len;
+	u64 linknames_count;
+
+	u32 node_ids[RECORD_BLOCK_SIZE];
+	u32 node_strings[RECORD_BLOCK_SIZE];
+	u32 connection_from[RECORD_BLOCK_SIZE]; // the child
+	u32 connection_to[RECORD_BLOCK_SIZE];   // its parent
+	LinkIdentifier links[RECORD_BLOCK_SIZE];
+	u32 reference_from[RECORD_BLOCK_SIZE];
+	u32 reference_to[RECORD_BLOCK_SIZE];
+	unsigned char reference_kinds[RECORD_BLOCK_SIZE]; // ReferenceKind
+} RecordBlock;
+
+// where a TU's time went and how much it recorded, times are in nanoseconds
+typedef struct ParseStats {
+	u64 load_ns;         // preprocessing, parsing and sema, clang's ASTUnit does them in one go
+	u64 traverse_ns;
+	u64 link_names_ns;   // all mangling, during the traversal or after it with PARSE_LAZY_LINK_NAMES, traverse_ns leaves it out
+	u64 finish_ns;       // handing over the last block
+	u64 dependencies_ns;
+	u64 nodes;
+	u64 connections;
+	u64 references;
+	u64 links;
+	u64 strings;
+	u64 string_bytes;
+	u64 arena_committed; // bytes held by the recorder's arenas, id table, reference set and block, they only grow so this is the peak
+} ParseStats;
+
 typedef struct RecorderInterface {
 	void* ud;
-	void (*addNode)( void* ud, i64 id, const char* str, u64 str_len );
-	void (*addConnection)( void* ud, i64 from, i64 to );
-	void (*addLinkIdentifier)( void* ud, i64 id, const char* str, u64 str_len );
+	// called whenever one of the block's arrays fills up and once more when the TU has been traversed
+	void (*flush)( void* ud, const RecordBlock* block );
+	// called once per file read by the TU after it has been recorded, path is absolute
+	// mtime is in seconds, hash is XXH3-64 of the contents
+	void (*addDependency)( void* ud, const char* path, u64 path_len, u64 size, i64 mtime, u64 hash );
+	// with PARSE_DEDUPE_HEADERS, called once for every header the TU has decls in
+	// key identifies the header and the macros it was included under, owned is 0 if another TU in the session records its decls
+	// the path is in the strings table
+	void (*addHeaderReference)( void* ud, u64 key, u64 path_hash, int owned );
+	// can be null, called once after everything else for the TU
+	void (*stats)( void* ud, const ParseStats* stats );
 } RecorderInterface;
 
-EXPORTED void parseFromArgs( RecorderInterface interface, u64 argc, const char* argv[] );
-EXPORTED ParsedModuleInfo* parseFromDB( const char* path );
-EXPORTED void dumpFromArgs( u64 argc, const char* argv[] );
+// hands out a recorder for each command parsed by parseCommands
+// begin and end are called from the worker threads, end is called once the command has been recorded
+// begin can return a recorder with a null ud to skip the command, end is not called for skipped commands
+// status is 0 if clang failed to produce an ast for the command
+typedef struct RecorderFactory {
+	void* ud;
+	RecorderInterface (*begin)( void* ud, u64 index );
+	void (*end)( void* ud, u64 index, RecorderInterface recorder, int status );
+} RecorderFactory;
+
+enum ParseFlags {
+	// build a precompiled preamble for the leading includes of each TU and reuse it for every TU with the same preamble and flags
+	PARSE_SHARED_PREAMBLE = 1 << 0,
+	// record the decls of each header only in the TU with the lowest command index that includes it with the same definitions of the macros the header tests, other TUs only reference it
+	PARSE_DEDUPE_HEADERS = 1 << 1,
+	// back the parser's arenas with transparent huge pages where the OS supports them
+	PARSE_HUGE_PAGES = 1 << 2,
+	// fault arena pages in when they are committed instead of on first touch
+	PARSE_PREFAULT = 1 << 3,
+	// don't record call and reference edges from expressions, only the decl tree
+	PARSE_NO_REFERENCES = 1 << 4,
+	// skip function bodies while parsing and don't traverse statements, only the decl tree gets recorded
+	PARSE_SKIP_BODIES = 1 << 5,
+	// with PARSE_SKIP_BODIES, still parse and traverse bodies in the main file, only bodies in headers are skipped
+	// headers are only skipped when they are part of a preamble, either the shared one or one built for the TU
+	PARSE_KEEP_MAIN_BODIES = 1 << 6,
+	// mangle link names once the traversal is done and only for decls the TU defines or refers to
+	// decls with internal linkage never get a link name, they keep the id of the TU they are in instead of being merged with same named decls in other TUs
+	PARSE_LAZY_LINK_NAMES = 1 << 7,
+};
+
+typedef struct ParseOptions {
+	u64 flags;
+	const char* preamble_dir; // where shared preambles are kept between runs, null uses the system temp dir
+} ParseOptions;
+
+// returns 0 if clang failed to produce an ast, nothing is recorded then
+EXPORTED int parseFromArgs( ParseOptions options, RecorderInterface interface, u64 argc, const char* argv[] );
+// parse every command in db inside this process, thread_count of 0 uses every hardware thread
+EXPORTED void parseCommands( CompileDatabase* db, ParseOptions options, RecorderFactory factory, u64 thread_count );
+
+// what parseCommands keeps between TUs: the file cache, the shared preambles and the header registry
+// a session can be kept around to parse commands again after their files change without starting cold
+// with PARSE_DEDUPE_HEADERS the registry knows TUs by command index, a TU parsed again keeps the headers it owns
+// and TUs whose objects end up with decls of a header another TU owns are parsed again in the same call
+// pointer is owned by caller, call ParseSession_deinit to free it
+typedef struct ParseSession ParseSession;
+EXPORTED ParseSession* ParseSession_create( ParseOptions options );
+EXPORTED void ParseSession_deinit( ParseSession* session );
+// forget the cached stats and contents of files that changed or were created, paths are absolute
+// shared preambles built from one of the paths are deleted and built again by the next TU that needs them
+// null paths forgets every file, the preambles are then left for clang to validate when they are loaded
+EXPORTED void ParseSession_invalidate( ParseSession* session, const char** paths, u64 count );
+// what the session's file cache saved, counted since the session was created
+typedef struct FileStats {
+	u64 stat_hits;
+	u64 stat_misses;
+	u64 read_hits;    // opened files whose contents were already in memory
+	u64 read_misses;
+	u64 bytes_read;   // read from disk
+	u64 bytes_served; // handed out from memory instead of being read again
+	u64 bytes_evicted; // dropped from memory to stay within the cache's budget, read again if asked for
+} FileStats;
+EXPORTED FileStats ParseSession_fileStats( ParseSession* session );
+// same layout as the header refs in a .cetobj
+typedef struct HeaderRef {
+	u64 key;
+	u64 path_hash;
+	u64 owned;
+} HeaderRef;
+// with PARSE_DEDUPE_HEADERS, the header refs of the object command index already has, for TUs that are up to date and won't be parsed
+// the lowest command index that includes a header owns it, TUs that lose a header they recorded are parsed by the next parseSessionCommands
+EXPORTED void ParseSession_keepHeaders( ParseSession* session, u64 index, const HeaderRef* refs, u64 count );
+// parse db's commands at indices[0..count] with the session's caches, thread_count of 0 uses every hardware thread
+EXPORTED void parseSessionCommands( ParseSession* session, CompileDatabase* db, const u64* indices, u64 count, RecorderFactory factory, u64 thread_count );
+
+// parse every command of the compile database in directory into one graph, null if the database fails to load
+// pointer is owned by caller, call ParsedModuleInfo_deinit to free it
+EXPORTED ParsedModuleInfo* parseFromDB( const char* directory, ParseOptions options );
+EXPORTED void dumpFromArgs( ParseOptions options, u64 argc, const char* argv[] );
 
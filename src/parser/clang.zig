@@ -1,4 +1,5 @@
 const std = @import( "std" );
+const builtin = @import( "builtin" );
 const c = @cImport({
 	@cInclude("parser/clang.h");
 });
@@ -86,7 +87,18 @@ var g_lib: struct {
 	CompileDatabase_getAllCommands: @TypeOf( &c.CompileDatabase_getAllCommands ),
 	CompileDatabase_deinit: @TypeOf( &c.CompileDatabase_deinit ),
 	ParsedModuleInfo_deinit: @TypeOf( &c.ParsedModuleInfo_deinit ),
+	ParsedModuleInfo_getNodes: @TypeOf( &c.ParsedModuleInfo_getNodes ),
+	ParsedModuleInfo_getConnections: @TypeOf( &c.ParsedModuleInfo_getConnections ),
+	ParsedModuleInfo_getTextCache: @TypeOf( &c.ParsedModuleInfo_getTextCache ),
+	parseFromDB: @TypeOf( &c.parseFromDB ),
 	parseFromArgs: @TypeOf( &c.parseFromArgs ),
+	parseCommands: @TypeOf( &c.parseCommands ),
+	ParseSession_create: @TypeOf( &c.ParseSession_create ),
+	ParseSession_deinit: @TypeOf( &c.ParseSession_deinit ),
+	ParseSession_invalidate: @TypeOf( &c.ParseSession_invalidate ),
+	ParseSession_fileStats: @TypeOf( &c.ParseSession_fileStats ),
+	ParseSession_keepHeaders: @TypeOf( &c.ParseSession_keepHeaders ),
+	parseSessionCommands: @TypeOf( &c.parseSessionCommands ),
 	dumpFromArgs: @TypeOf( &c.dumpFromArgs ),
 } = undefined;
 
@@ -96,19 +108,55 @@ fn makeRecorderType( T: type ) type
 	const pointer = @typeInfo(T).pointer;
     std.debug.assert(pointer.size == .one);
 	return struct {
-		pub fn addNode( ud: ?*anyopaque, id: c_longlong, str: [*c]const u8, len: c_ulonglong ) callconv(.C) void {
+		pub fn flush( ud: ?*anyopaque, block: [*c]const c.RecordBlock ) callconv(.C) void {
 			const recorder: T =  @ptrCast( @alignCast( ud.? ) );
-			recorder.addNode( id, str[0..len] );
+			recorder.addBlock( block );
 		}
 
-		pub fn addConnection( ud: ?*anyopaque, from: c_longlong, to: c_longlong ) callconv(.C) void {
+		pub fn addDependency( ud: ?*anyopaque, path: [*c]const u8, len: c_ulonglong, size: c_ulonglong, mtime: c_longlong, hash: c_ulonglong ) callconv(.C) void {
 			const recorder: T =  @ptrCast( @alignCast( ud.? ) );
-			recorder.addConnection( from,  to );
+			recorder.addDependency( path[0..len], size, mtime, hash );
 		}
 
-		pub fn addLinkIdentifier( ud: ?*anyopaque, id: c_longlong, str: [*c]const u8, len: c_ulonglong ) callconv(.C) void {
+		pub fn addHeaderReference( ud: ?*anyopaque, key: c_ulonglong, path_hash: c_ulonglong, owned: c_int ) callconv(.C) void {
 			const recorder: T =  @ptrCast( @alignCast( ud.? ) );
-			recorder.addLinkIdentifier( id, str[0..len] );
+			recorder.addHeaderReference( key, path_hash, owned != 0 );
+		}
+
+		pub fn stats( ud: ?*anyopaque, s: [*c]const c.ParseStats ) callconv(.C) void {
+			const recorder: T =  @ptrCast( @alignCast( ud.? ) );
+			recorder.addStats( s );
+		}
+	};
+}
+
+fn makeRecorderInterface( recorder: anytype ) c.RecorderInterface
+{
+	const interface = makeRecorderType( @TypeOf( recorder ) );
+	return .{
+		.ud = recorder,
+		.flush = &interface.flush,
+		.addDependency = &interface.addDependency,
+		.addHeaderReference = &interface.addHeaderReference,
+		.stats = if ( @hasDecl( @typeInfo( @TypeOf( recorder ) ).pointer.child, "addStats" ) ) &interface.stats else null,
+	};
+}
+
+// F.begin( index ) returns the recorder for a command or null to skip it, F.end( index, recorder, ok ) hands it back once recorded
+// both get called from clang_tool_lib's worker threads
+fn makeFactoryType( F: type, R: type ) type
+{
+	return struct {
+		pub fn begin( ud: ?*anyopaque, index: c_ulonglong ) callconv(.C) c.RecorderInterface {
+			const factory: F = @ptrCast( @alignCast( ud.? ) );
+			const recorder: R = factory.begin( index ) orelse return std.mem.zeroes( c.RecorderInterface );
+			return makeRecorderInterface( recorder );
+		}
+
+		pub fn end( ud: ?*anyopaque, index: c_ulonglong, interface: c.RecorderInterface, status: c_int ) callconv(.C) void {
+			const factory: F = @ptrCast( @alignCast( ud.? ) );
+			const recorder: R = @ptrCast( @alignCast( interface.ud.? ) );
+			factory.end( index, recorder, status != 0 );
 		}
 	};
 }
@@ -120,26 +168,113 @@ pub fn parseDB( directory: [*c]const u8, err: [*c][*c]const u8 ) ?CompileDatabas
 	return null;
 }
 
-pub fn parseFromArgs( recorder: anytype, args: [][*c]const u8 ) void
+// mirrors ParseFlags in clang.h
+pub const ParseFlags = packed struct(u64) {
+	shared_preamble: bool = false,
+	dedupe_headers: bool = false,
+	huge_pages: bool = false,
+	prefault: bool = false,
+	no_references: bool = false,
+	skip_bodies: bool = false,
+	keep_main_bodies: bool = false,
+	lazy_link_names: bool = false,
+	_: u56 = 0,
+};
+
+pub const ParseOptions = struct {
+	flags: ParseFlags = .{},
+	preamble_dir: ?[*:0]const u8 = null,
+
+	fn toC( self: ParseOptions ) c.ParseOptions
+	{
+		return .{ .flags = @bitCast( self.flags ), .preamble_dir = self.preamble_dir };
+	}
+};
+
+// false if clang failed to produce an ast, nothing was recorded then
+pub fn parseFromArgs( options: ParseOptions, recorder: anytype, args: [][*c]const u8 ) bool
 {
-	const interface = makeRecorderType( @TypeOf( recorder) );
-	g_lib.parseFromArgs( .{ .ud = recorder, .addNode = &interface.addNode, .addConnection = &interface.addConnection, .addLinkIdentifier = &interface.addLinkIdentifier }, args.len, args.ptr );
-	//if ( module ) |ptr| return .{ .ptr = ptr };
-	//return null;
+	return g_lib.parseFromArgs( options.toC(), makeRecorderInterface( recorder ), args.len, args.ptr ) != 0;
 }
 
-pub fn dumpFromArgs( args: [][*c]const u8 ) void
+// parse every command in db on clang_tool_lib's thread pool, thread_count of 0 uses every hardware thread
+pub fn parseCommands( db: CompileDatabase, options: ParseOptions, factory: anytype, comptime R: type, thread_count: usize ) void
+{
+	const interface = makeFactoryType( @TypeOf( factory ), R );
+	g_lib.parseCommands( db.ptr, options.toC(), .{ .ud = factory, .begin = &interface.begin, .end = &interface.end }, thread_count );
+}
+
+// the caches of parseCommands kept between calls, for parsing the same commands again after their files change
+pub const ParseSession = struct {
+	ptr: *c.ParseSession,
+
+	pub fn create( options: ParseOptions ) error{OutOfMemory}!ParseSession
+	{
+		const ptr: ?*c.ParseSession = g_lib.ParseSession_create( options.toC() );
+		return .{ .ptr = ptr orelse return error.OutOfMemory };
+	}
+
+	pub fn deinit( self: ParseSession ) void
+	{
+		g_lib.ParseSession_deinit( self.ptr );
+	}
+
+	// paths are absolute
+	pub fn invalidate( self: ParseSession, paths: []const [*:0]const u8 ) void
+	{
+		g_lib.ParseSession_invalidate( self.ptr, @ptrCast( @constCast( paths.ptr ) ), paths.len );
+	}
+
+	pub fn invalidateAll( self: ParseSession ) void
+	{
+		g_lib.ParseSession_invalidate( self.ptr, null, 0 );
+	}
+
+	pub fn fileStats( self: ParseSession ) FileStats
+	{
+		return g_lib.ParseSession_fileStats( self.ptr );
+	}
+
+	// the header refs of an object that is up to date, see ParseSession_keepHeaders
+	pub fn keepHeaders( self: ParseSession, index: u64, refs: []const HeaderRef ) void
+	{
+		g_lib.ParseSession_keepHeaders( self.ptr, index, refs.ptr, refs.len );
+	}
+
+	// same as parseCommands but only db's commands at indices
+	pub fn parseCommands( self: ParseSession, db: CompileDatabase, indices: []const u64, factory: anytype, comptime R: type, thread_count: usize ) void
+	{
+		const interface = makeFactoryType( @TypeOf( factory ), R );
+		g_lib.parseSessionCommands( self.ptr, db.ptr, @ptrCast( indices.ptr ), indices.len, .{ .ud = factory, .begin = &interface.begin, .end = &interface.end }, thread_count );
+	}
+};
+
+pub fn dumpFromArgs( options: ParseOptions, args: [][*c]const u8 ) void
 {
-	g_lib.dumpFromArgs( args.len, args.ptr );
+	g_lib.dumpFromArgs( options.toC(), args.len, args.ptr );
 }
 
 pub fn initialize() !void
 {
-	g_lib = try loadLib( @TypeOf( g_lib ), "libclang_tool_lib" );
+	if ( builtin.os.tag == .windows ) {
+		g_lib = try loadLib( @TypeOf( g_lib ), "libclang_tool_lib" );
+		return;
+	}
+
+	// dlopen doesn't look next to the executable the way LoadLibrary does
+	var dir_buf: [std.fs.max_path_bytes]u8 = undefined;
+	const dir = try std.fs.selfExeDirPath( &dir_buf );
+	var path_buf: [std.fs.max_path_bytes]u8 = undefined;
+	const path = try std.fmt.bufPrint( &path_buf, "{s}/libclang_tool_lib.so", .{ dir } );
+	g_lib = try loadLib( @TypeOf( g_lib ), path );
 }
 
 
 pub const CompileCommand = c.CompileCommand;
+pub const RecordBlock = c.RecordBlock;
+pub const ParseStats = c.ParseStats;
+pub const FileStats = c.FileStats;
+pub const HeaderRef = c.HeaderRef;
 
 pub const CompileDatabase = struct {
 	ptr: *c.CompileDatabase,
@@ -159,6 +294,16 @@ pub const CompileDatabase = struct {
 };
 
 pub const ParsedItemInfo = c.ParsedItemInfo;
+pub const Node = c.Node;
+pub const Connection = c.Connection;
+
+// parse the compile database in directory into one graph inside this process
+pub fn parseFromDB( directory: [*:0]const u8, options: ParseOptions ) ?ParsedModuleInfo
+{
+	const minfo = g_lib.parseFromDB( directory, options.toC() );
+	if ( minfo ) |ptr| return .{ .ptr = ptr };
+	return null;
+}
 
 pub const ParsedModuleInfo = struct {
 	ptr: *c.ParsedModuleInfo,
@@ -168,9 +313,23 @@ pub const ParsedModuleInfo = struct {
 		g_lib.ParsedModuleInfo_deinit( self.ptr );
 	}
 
-	pub fn getItems( self: ParsedModuleInfo )  []ParsedItemInfo
+	// all data is owned by the module info so it will get free'd with it
+	pub fn getNodes( self: ParsedModuleInfo ) []Node
+	{
+		const s = g_lib.ParsedModuleInfo_getNodes( self.ptr );
+		return s.ptr[ 0..s.len ];
+	}
+
+	pub fn getConnections( self: ParsedModuleInfo ) []Connection
+	{
+		const s = g_lib.ParsedModuleInfo_getConnections( self.ptr );
+		return s.ptr[ 0..s.len ];
+	}
+
+	// every node string once, null terminated back to back
+	pub fn getTextCache( self: ParsedModuleInfo ) []const u8
 	{
-		const s = g_lib.ParsedModuleInfo_getItems( self.ptr );
+		const s = g_lib.ParsedModuleInfo_getTextCache( self.ptr );
 		return s.ptr[ 0..s.len ];
 	}
 };
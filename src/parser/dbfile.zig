@@ -0,0 +1,390 @@
+const std = @import("std");
+const ObjFile = @import("objfile.zig");
+const Lz4 = @import("lz4.zig");
+const MappedFile = @import("mapped_file.zig").MappedFile;
+
+// linked database, the records of a linked object split into chunks that are compressed on their own
+// layout:
+//   Sig, Header, chunks back to back, chunk table at header.table_offset
+// the chunk table is sorted by iden then first_key, records in a chunk are sorted by key
+// so a lookup is a binary search of the table and decompressing a single chunk
+
+const version_major: u8 = 1;
+const version_minor: u8 = 0;
+
+pub const default_chunk_size: u32 = 64 * 1024;
+
+const Sig = extern struct {
+	sig: [6]u8, // "cetdb\x00"
+	ver_major: u8,
+	ver_minor: u8,
+};
+
+pub const Header = extern struct {
+	run_id: u64,
+	chunk_size: u32, // largest uncompressed chunk, a chunk holding a single record can be bigger
+	chunk_count: u32,
+	table_offset: u64,
+};
+
+pub const ChunkIden = extern union {
+	int: u32,
+	str: [4]u8,
+
+	pub fn eql( a: ChunkIden, b: ChunkIden ) bool
+	{
+		return a.int == b.int;
+	}
+};
+
+pub fn idenFromStr( str: []const u8 ) ChunkIden
+{
+	std.debug.assert( str.len <= 4 and str.len > 0 );
+	const len = @min( str.len, 4 );
+	var arr = std.mem.zeroes( [4]u8 );
+	@memcpy( arr[0..len], str[0..len] );
+	return .{ .str = arr };
+}
+
+// record layout of each chunk kind, keyed by
+pub const nodes_iden = idenFromStr( "node" );           // ObjFile.Node, id
+pub const connections_iden = idenFromStr( "conn" );     // ObjFile.Connection, from
+pub const linklinks_iden = idenFromStr( "link" );       // ObjFile.LinkLink, node_id
+pub const strings_iden = idenFromStr( "strs" );         // u64 hash then the null terminated string, hash
+pub const linknames_iden = idenFromStr( "lnam" );       // same as strings
+
+pub const Codec = enum(u32) {
+	stored,
+	lz4,
+	_,
+};
+
+pub const ChunkEntry = extern struct {
+	iden: ChunkIden,
+	codec: Codec,
+	offset: u64,
+	compressed_size: u32,
+	uncompressed_size: u32,
+	count: u32, // records in the chunk
+	_pad: u32 = 0,
+	first_key: u64, // key of the first record, compared as unsigned
+};
+
+
+pub const DatabaseWriter = struct {
+	const BufferedWriter = std.io.BufferedWriter( 64 * 1024, std.fs.File.Writer );
+
+	allocator: std.mem.Allocator,
+	file: std.fs.File,
+	buffer: BufferedWriter,
+	offset: u64,
+	chunk_size: u32,
+
+	entries: std.ArrayListUnmanaged( ChunkEntry ) = .empty,
+	chunk: std.ArrayListUnmanaged( u8 ) = .empty,
+	compressed: std.ArrayListUnmanaged( u8 ) = .empty,
+	iden: ?ChunkIden = null,
+	count: u32 = 0,
+	first_key: u64 = 0,
+
+	pub fn create( allocator: std.mem.Allocator, path: []const u8, chunk_size: u32 ) !DatabaseWriter
+	{
+		const file = try std.fs.cwd().createFile( path, .{ .truncate = true, .lock = .exclusive } );
+		errdefer file.close();
+
+		var writer = DatabaseWriter{
+			.allocator = allocator,
+			.file = file,
+			.buffer = .{ .unbuffered_writer = file.writer() },
+			.offset = @sizeOf( Sig ) + @sizeOf( Header ),
+			.chunk_size = chunk_size,
+		};
+		try writer.buffer.writer().writeByteNTimes( 0, writer.offset );
+		try writer.chunk.ensureTotalCapacity( allocator, chunk_size );
+		try writer.compressed.ensureTotalCapacity( allocator, Lz4.compressBound( chunk_size ) );
+		return writer;
+	}
+
+	pub fn deinit( self: *DatabaseWriter ) void
+	{
+		self.entries.deinit( self.allocator );
+		self.chunk.deinit( self.allocator );
+		self.compressed.deinit( self.allocator );
+	}
+
+	// close without finishing, leaves a file readers reject
+	pub fn abort( self: *DatabaseWriter ) void
+	{
+		self.file.close();
+		self.deinit();
+	}
+
+	// records have to be added in key order, a record never spans two chunks
+	pub fn beginChunks( self: *DatabaseWriter, iden: ChunkIden ) void
+	{
+		std.debug.assert( self.iden == null );
+		self.iden = iden;
+	}
+
+	pub fn addRecord( self: *DatabaseWriter, key: u64, parts: []const []const u8 ) !void
+	{
+		var len: usize = 0;
+		for ( parts ) |part| len += part.len;
+
+		if ( self.count > 0 and self.chunk.items.len + len > self.chunk_size ) try self.writeChunk();
+		if ( self.count == 0 ) self.first_key = key;
+
+		for ( parts ) |part| try self.chunk.appendSlice( self.allocator, part );
+		self.count += 1;
+	}
+
+	pub fn endChunks( self: *DatabaseWriter ) !void
+	{
+		if ( self.count > 0 ) try self.writeChunk();
+		self.iden = null;
+	}
+
+	// on error the file is still open, call abort
+	pub fn finish( self: *DatabaseWriter, run_id: u64 ) !void
+	{
+		std.debug.assert( self.iden == null );
+
+		const Context = struct {
+			fn lessThan( _: void, a: ChunkEntry, b: ChunkEntry ) bool
+			{
+				if ( a.iden.int != b.iden.int ) return a.iden.int < b.iden.int;
+				return a.first_key < b.first_key;
+			}
+		};
+		std.sort.block( ChunkEntry, self.entries.items, {}, Context.lessThan );
+
+		const table_offset = std.mem.alignForward( u64, self.offset, @alignOf( ChunkEntry ) );
+		const writer = self.buffer.writer();
+		try writer.writeByteNTimes( 0, table_offset - self.offset );
+		try writer.writeAll( std.mem.sliceAsBytes( self.entries.items ) );
+		try self.buffer.flush();
+
+		var head: [@sizeOf( Sig ) + @sizeOf( Header )]u8 = undefined;
+		var stream = std.io.fixedBufferStream( &head );
+		try stream.writer().writeStruct( Sig{ .sig = "cetdb\x00".*, .ver_major = version_major, .ver_minor = version_minor } );
+		try stream.writer().writeStruct( Header{
+			.run_id = run_id,
+			.chunk_size = self.chunk_size,
+			.chunk_count = @intCast( self.entries.items.len ),
+			.table_offset = table_offset,
+		});
+		try self.file.pwriteAll( &head, 0 );
+
+		self.file.close();
+		self.deinit();
+	}
+
+	// stored as is when compressing would not save anything
+	fn writeChunk( self: *DatabaseWriter ) !void
+	{
+		const src = self.chunk.items;
+		try self.compressed.resize( self.allocator, Lz4.compressBound( src.len ) );
+		const len = Lz4.compress( src, self.compressed.items );
+
+		const compressed = len < src.len;
+		const codec: Codec = if ( compressed ) .lz4 else .stored;
+		const bytes = if ( compressed ) self.compressed.items[0..len] else src;
+		try self.buffer.writer().writeAll( bytes );
+
+		try self.entries.append( self.allocator, .{
+			.iden = self.iden.?,
+			.codec = codec,
+			.offset = self.offset,
+			.compressed_size = @intCast( bytes.len ),
+			.uncompressed_size = @intCast( src.len ),
+			.count = self.count,
+			.first_key = self.first_key,
+		});
+
+		self.offset += bytes.len;
+		self.chunk.clearRetainingCapacity();
+		self.count = 0;
+	}
+};
+
+fn addStrings( writer: *DatabaseWriter, iden: ChunkIden, table: ObjFile.StringTable ) !void
+{
+	writer.beginChunks( iden );
+	var itr = table.iterator();
+	while ( itr.next() ) |entry|
+	{
+		try writer.addRecord( entry.hash, &.{ std.mem.asBytes( &entry.hash ), entry.str, &.{ 0 } } );
+	}
+	try writer.endChunks();
+}
+
+fn addRecords( writer: *DatabaseWriter, iden: ChunkIden, comptime T: type, items: []const T, comptime key_field: []const u8 ) !void
+{
+	writer.beginChunks( iden );
+	for ( items ) |*item| try writer.addRecord( @bitCast( @field( item, key_field ) ), &.{ std.mem.asBytes( item ) } );
+	try writer.endChunks();
+}
+
+// the object has to be linked, cet-ld writes every section sorted
+pub fn writeFromObject( allocator: std.mem.Allocator, object: ObjFile.Reader, path: []const u8, chunk_size: u32 ) !void
+{
+	var writer = try DatabaseWriter.create( allocator, path, chunk_size );
+	errdefer writer.abort();
+
+	try addRecords( &writer, nodes_iden, ObjFile.Node, object.nodes(), "id" );
+	try addRecords( &writer, connections_iden, ObjFile.Connection, object.connections(), "from" );
+	try addRecords( &writer, linklinks_iden, ObjFile.LinkLink, object.linkLinks(), "node_id" );
+	try addStrings( &writer, strings_iden, object.strings() );
+	try addStrings( &writer, linknames_iden, object.linkNames() );
+
+	try writer.finish( object.hdr.run_id );
+}
+
+
+// mapped database, chunks are only decompressed when a lookup needs them
+pub const Reader = struct {
+	pub const OpenError = error{IncorrectHeader,IncorrectVersion,CorruptChunk} || MappedFile.OpenError;
+
+	file: MappedFile,
+	hdr: Header,
+	entries: []const ChunkEntry,
+
+	pub fn open( path: []const u8 ) OpenError!Reader
+	{
+		const file = try MappedFile.open( path );
+		errdefer file.close();
+		const bytes = file.bytes;
+
+		if ( bytes.len < @sizeOf( Sig ) + @sizeOf( Header ) ) return error.IncorrectHeader;
+		const sig = std.mem.bytesToValue( Sig, bytes[0..@sizeOf( Sig )] );
+		if ( !std.mem.eql( u8, &sig.sig, "cetdb\x00" ) ) return error.IncorrectHeader;
+		if ( sig.ver_major != version_major or sig.ver_minor != version_minor ) return error.IncorrectVersion;
+
+		const hdr = std.mem.bytesToValue( Header, bytes[@sizeOf( Sig )..][0..@sizeOf( Header )] );
+		const table_size = @as( u64, hdr.chunk_count ) * @sizeOf( ChunkEntry );
+		if ( hdr.table_offset % @alignOf( ChunkEntry ) != 0 or hdr.table_offset > bytes.len or table_size > bytes.len - hdr.table_offset ) return error.IncorrectHeader;
+
+		const entries: []const ChunkEntry = @alignCast( std.mem.bytesAsSlice( ChunkEntry, bytes[hdr.table_offset..][0..table_size] ) );
+		for ( entries ) |entry|
+		{
+			if ( entry.offset > hdr.table_offset or entry.compressed_size > hdr.table_offset - entry.offset ) return error.CorruptChunk;
+		}
+
+		return .{ .file = file, .hdr = hdr, .entries = entries };
+	}
+
+	pub fn close( self: *Reader ) void
+	{
+		self.file.close();
+	}
+
+	// every chunk of a kind, in key order
+	pub fn chunks( self: Reader, iden: ChunkIden ) []const ChunkEntry
+	{
+		const Context = struct {
+			fn before( key: u32, entry: ChunkEntry ) std.math.Order { return std.math.order( key, entry.iden.int ); }
+		};
+		const start = std.sort.lowerBound( ChunkEntry, self.entries, iden.int, Context.before );
+		const end = std.sort.upperBound( ChunkEntry, self.entries, iden.int, Context.before );
+		return self.entries[start..end];
+	}
+
+	// chunks that can hold records with key, more than one when a key's records span chunks
+	pub fn chunksFor( self: Reader, iden: ChunkIden, key: u64 ) []const ChunkEntry
+	{
+		const all = self.chunks( iden );
+		const Context = struct {
+			fn before( k: u64, entry: ChunkEntry ) std.math.Order { return std.math.order( k, entry.first_key ); }
+		};
+		// the chunk before the first one starting at key can end with it
+		var start = std.sort.lowerBound( ChunkEntry, all, key, Context.before );
+		if ( start > 0 ) start -= 1;
+		const end = std.sort.upperBound( ChunkEntry, all, key, Context.before );
+		return all[start..@max( start, end )];
+	}
+
+	// decompress a chunk into out, which has to hold at least entry.uncompressed_size bytes
+	pub fn readChunk( self: Reader, entry: ChunkEntry, out: []u8 ) error{CorruptChunk}![]u8
+	{
+		const src = self.file.bytes[entry.offset..][0..entry.compressed_size];
+		const dst = out[0..entry.uncompressed_size];
+		switch ( entry.codec )
+		{
+			.stored => {
+				if ( src.len != dst.len ) return error.CorruptChunk;
+				@memcpy( dst, src );
+			},
+			.lz4 => {
+				const len = Lz4.decompress( src, dst ) catch return error.CorruptChunk;
+				if ( len != dst.len ) return error.CorruptChunk;
+			},
+			_ => return error.CorruptChunk,
+		}
+		return dst;
+	}
+
+	// scratch is reused for every chunk, it is grown to fit the largest one touched
+	pub const Scratch = std.ArrayListUnmanaged( u8 );
+
+	fn readInto( self: Reader, allocator: std.mem.Allocator, entry: ChunkEntry, scratch: *Scratch ) ![]u8
+	{
+		try scratch.resize( allocator, entry.uncompressed_size );
+		return self.readChunk( entry, scratch.items );
+	}
+
+	// the string is in scratch, it is only valid until the next lookup with the same scratch
+	pub fn getString( self: Reader, allocator: std.mem.Allocator, iden: ChunkIden, hash: u64, scratch: *Scratch ) !?[]const u8
+	{
+		for ( self.chunksFor( iden, hash ) ) |entry|
+		{
+			const bytes = try self.readInto( allocator, entry, scratch );
+			var pos: usize = 0;
+			while ( pos < bytes.len )
+			{
+				const record_hash = std.mem.readInt( u64, bytes[pos..][0..8], .little );
+				const len = std.mem.indexOfScalarPos( u8, bytes, pos + 8, 0 ) orelse return error.CorruptChunk;
+				if ( record_hash == hash ) return bytes[pos + 8 .. len];
+				if ( record_hash > hash ) break;
+				pos = len + 1;
+			}
+		}
+		return null;
+	}
+
+	pub fn getNode( self: Reader, allocator: std.mem.Allocator, id: i64, scratch: *Scratch ) !?ObjFile.Node
+	{
+		var result: ?ObjFile.Node = null;
+		try self.forEachRecord( allocator, nodes_iden, ObjFile.Node, "id", id, scratch, &result, struct {
+			fn f( out: *?ObjFile.Node, node: ObjFile.Node ) !void { out.* = node; }
+		}.f );
+		return result;
+	}
+
+	// every connection from the node
+	pub fn connectionsFrom( self: Reader, allocator: std.mem.Allocator, id: i64, scratch: *Scratch, out: *std.ArrayListUnmanaged( ObjFile.Connection ) ) !void
+	{
+		const Append = struct {
+			list: *std.ArrayListUnmanaged( ObjFile.Connection ),
+			allocator: std.mem.Allocator,
+			fn f( self_: *const @This(), conn: ObjFile.Connection ) !void { try self_.list.append( self_.allocator, conn ); }
+		};
+		const ctx = Append{ .list = out, .allocator = allocator };
+		try self.forEachRecord( allocator, connections_iden, ObjFile.Connection, "from", id, scratch, &ctx, Append.f );
+	}
+
+	fn forEachRecord( self: Reader, allocator: std.mem.Allocator, iden: ChunkIden, comptime T: type, comptime key_field: []const u8, key: i64, scratch: *Scratch, ctx: anytype, comptime f: anytype ) !void
+	{
+		const unsigned: u64 = @bitCast( key );
+		for ( self.chunksFor( iden, unsigned ) ) |entry|
+		{
+			const bytes = try self.readInto( allocator, entry, scratch );
+			const records = std.mem.bytesAsSlice( T, bytes[0 .. bytes.len - bytes.len % @sizeOf( T )] );
+			for ( records ) |record|
+			{
+				const record_key: u64 = @bitCast( @field( record, key_field ) );
+				if ( record_key == unsigned ) try f( ctx, record );
+				if ( record_key > unsigned ) break;
+			}
+		}
+	}
+};
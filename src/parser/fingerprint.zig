@@ -0,0 +1,213 @@
+const std = @import("std");
+const Clang = @import("clang.zig");
+
+// written next to each .cetobj, records everything the object was built from
+// so the driver can tell if a TU needs to be parsed again
+
+const version_major: u8 = 0;
+const version_minor: u8 = 2;
+
+pub const extension = ".cetdep";
+
+const Sig = extern struct {
+	sig: [6]u8, // "cetdep"
+	ver_major: u8,
+	ver_minor: u8,
+};
+
+pub const Header = extern struct {
+	command_hash: u64,
+	dependencies_count: u64,
+	paths_len: u64,
+	started: i64, // seconds, when the recorder for the TU was created, before clang read anything
+};
+
+// a file clang read while parsing the TU, including the main file
+// size and mtime let the check skip hashing files that weren't touched
+// clang only has the mtime in whole seconds, a file with an mtime in the second the parse started or later
+// could have been written again in that same second after clang read it, so it is always hashed
+pub const Dependency = extern struct {
+	size: u64,
+	mtime: i64, // seconds
+	hash: u64, // XxHash3 of the contents
+	path_offset: u32,
+	path_len: u32,
+};
+
+// for Header.started
+pub fn now() i64
+{
+	return std.time.timestamp();
+}
+
+pub fn hashContents( contents: []const u8 ) u64
+{
+	return std.hash.XxHash3.hash( 0, contents );
+}
+
+// the command as it is in the database plus any options that change what gets recorded
+// arguments that only name outputs are left out, the object's path already follows the output
+// the order is kept, -I, -D, -U and most other flags mean something else in another order
+pub fn hashCommand( cmd: Clang.CompileCommand, mode: []const []const u8 ) u64
+{
+	var hasher = std.hash.XxHash3.init( 0 );
+	hasher.update( std.mem.span( cmd.directory ) );
+	var i: usize = 0;
+	while ( i < cmd.argc ) : ( i += 1 )
+	{
+		const arg = std.mem.span( cmd.argv[i] );
+		switch ( outputArg( arg ) ) {
+			.none => {},
+			.joined => continue,
+			.separate => { i += 1; continue; },
+		}
+		hasher.update( &.{ 0 } );
+		hasher.update( arg );
+	}
+	for ( mode ) |arg|
+	{
+		hasher.update( &.{ 0 } );
+		hasher.update( arg );
+	}
+	return hasher.final();
+}
+
+// -o and the dependency file flags, either with the path in the same argument or in the next one
+fn outputArg( arg: []const u8 ) enum { none, joined, separate }
+{
+	const separate = [_][]const u8{ "-o", "-MF", "-MT", "-MQ" };
+	const joined = [_][]const u8{ "-o", "-MF", "-MT", "-MQ", "/Fo", "-Fo", "/Fd", "-Fd" };
+	const flags = [_][]const u8{ "-MD", "-MMD" };
+	for ( separate ) |flag| if ( std.mem.eql( u8, arg, flag ) ) return .separate;
+	for ( flags ) |flag| if ( std.mem.eql( u8, arg, flag ) ) return .joined;
+	for ( joined ) |flag| if ( std.mem.startsWith( u8, arg, flag ) ) return .joined;
+	return .none;
+}
+
+// the cet-cl options for flags that change what gets recorded, in the order hashCommand expects them
+pub fn appendModeArgs( list: *std.ArrayList( []const u8 ), flags: Clang.ParseFlags, preamble_dir: ?[]const u8 ) !void
+{
+	if ( flags.shared_preamble ) try list.append( "--shared-preamble" );
+	if ( preamble_dir ) |dir| try list.appendSlice( &.{ "--preamble-dir", dir } );
+	if ( flags.dedupe_headers ) try list.append( "--dedupe-headers" );
+	if ( flags.no_references ) try list.append( "--no-references" );
+	if ( flags.skip_bodies ) try list.append( "--skip-bodies" );
+	if ( flags.skip_bodies and flags.keep_main_bodies ) try list.append( "--keep-main-bodies" );
+	if ( flags.lazy_link_names ) try list.append( "--lazy-link-names" );
+}
+
+// caller owns the returned path
+pub fn pathForObject( allocator: std.mem.Allocator, obj_path: []const u8 ) ![]u8
+{
+	const ext = std.fs.path.extension( obj_path );
+	return std.mem.concat( allocator, u8, &.{ obj_path[0..obj_path.len-ext.len], extension } );
+}
+
+// the output of a compile command with its extension swapped for .cetobj, caller owns the returned path
+pub fn objectOutput( allocator: std.mem.Allocator, c_output: []const u8 ) ![]const u8
+{
+	const ext = std.fs.path.extension( c_output );
+	const new_ext = ".cetobj";
+	const name_no_ext = c_output[0..c_output.len-ext.len];
+	const out = try allocator.alloc( u8, name_no_ext.len + new_ext.len);
+	@memcpy( out[0..name_no_ext.len], name_no_ext );
+	@memcpy( out[name_no_ext.len..], new_ext);
+	return out;
+}
+
+// absolute path of the cetobj for cmd, cet-cl runs inside the command's directory so relative outputs end up there
+pub fn objectPath( allocator: std.mem.Allocator, cmd: Clang.CompileCommand ) ![]u8
+{
+	const output = try objectOutput( allocator, cmd.output[0..std.mem.len(cmd.output)] );
+	defer allocator.free( output );
+
+	const cwd = cmd.directory[ 0..std.mem.len( cmd.directory ) ];
+	return std.fs.path.resolve( allocator, &.{ cwd, output } );
+}
+
+pub fn write( path: []const u8, command_hash: u64, started: i64, dependencies: []const Dependency, paths: []const u8 ) !void
+{
+	const file = try std.fs.cwd().createFile( path, .{ .truncate = true, .lock = .exclusive } );
+	defer file.close();
+
+	var buf = std.io.bufferedWriter( file.writer() );
+	const writer = buf.writer();
+	try writer.writeStruct( Sig{ .sig = "cetdep".*, .ver_major = version_major, .ver_minor = version_minor } );
+	try writer.writeStruct( Header{ .command_hash = command_hash, .dependencies_count = dependencies.len, .paths_len = paths.len, .started = started } );
+	try writer.writeAll( std.mem.sliceAsBytes( dependencies ) );
+	try writer.writeAll( paths );
+	try buf.flush();
+}
+
+// true if the fingerprint at path was written for command_hash and none of its dependencies changed since
+// any problem reading it just means the TU gets parsed again
+pub fn isUpToDate( allocator: std.mem.Allocator, path: []const u8, command_hash: u64 ) bool
+{
+	return check( allocator, path, command_hash ) catch false;
+}
+
+// a whole fingerprint, free with deinit
+pub const Contents = struct {
+	command_hash: u64,
+	started: i64,
+	dependencies: []Dependency,
+	paths: []u8,
+
+	pub fn pathOf( self: Contents, dep: Dependency ) []const u8
+	{
+		return self.paths[dep.path_offset..][0..dep.path_len];
+	}
+
+	pub fn deinit( self: Contents, allocator: std.mem.Allocator ) void
+	{
+		allocator.free( self.dependencies );
+		allocator.free( self.paths );
+	}
+};
+
+pub fn read( allocator: std.mem.Allocator, path: []const u8 ) !Contents
+{
+	const file = try std.fs.cwd().openFile( path, .{ .mode = .read_only } );
+	defer file.close();
+
+	var buf = std.io.bufferedReader( file.reader() );
+	const reader = buf.reader();
+
+	const sig = try reader.readStruct( Sig );
+	if ( !std.mem.eql( u8, &sig.sig, "cetdep" ) ) return error.IncorrectHeader;
+	if ( sig.ver_major != version_major or sig.ver_minor != version_minor ) return error.IncorrectVersion;
+
+	const hdr = try reader.readStruct( Header );
+
+	const dependencies = try allocator.alloc( Dependency, hdr.dependencies_count );
+	errdefer allocator.free( dependencies );
+	try reader.readNoEof( std.mem.sliceAsBytes( dependencies ) );
+
+	const paths = try allocator.alloc( u8, hdr.paths_len );
+	errdefer allocator.free( paths );
+	try reader.readNoEof( paths );
+
+	return .{ .command_hash = hdr.command_hash, .started = hdr.started, .dependencies = dependencies, .paths = paths };
+}
+
+fn check( allocator: std.mem.Allocator, path: []const u8, command_hash: u64 ) !bool
+{
+	const contents = try read( allocator, path );
+	defer contents.deinit( allocator );
+	if ( contents.command_hash != command_hash ) return false;
+
+	for ( contents.dependencies ) |dep|
+	{
+		const dep_path = contents.pathOf( dep );
+		const stat = try std.fs.cwd().statFile( dep_path );
+		if ( stat.size != dep.size ) return false;
+		if ( @divFloor( stat.mtime, std.time.ns_per_s ) == dep.mtime and dep.mtime < contents.started ) continue;
+
+		// touched but maybe not changed, or written in the second the parse started in
+		const file_contents = try std.fs.cwd().readFileAlloc( allocator, dep_path, std.math.maxInt( usize ) );
+		defer allocator.free( file_contents );
+		if ( hashContents( file_contents ) != dep.hash ) return false;
+	}
+
+	return true;
+}
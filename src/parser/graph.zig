@@ -0,0 +1,342 @@
+const std = @import("std");
+const ObjFile = @import("objfile.zig");
+
+// adjacency for a linked object
+// every id that shows up in nodes, connections or references gets a dense index, ids is sorted so an id's index is a binary search
+// build itself never searches, endpoints are sorted together with where they came from and get their index as duplicates are dropped
+// forward is from -> to (child to parent), reverse is to -> from (parent to children)
+// refers is from the referring decl to what it refers to, referrers the other way, both with the kind of each reference
+pub const Csr = struct {
+	offsets: []u32, // by index plus one past the end
+	targets: []u32,
+	kinds: ?[]u8 = null, // ReferenceKind by target, only for references
+
+	pub fn neighbors( self: Csr, index: u32 ) []const u32
+	{
+		return self.targets[self.offsets[index]..self.offsets[index + 1]];
+	}
+
+	pub fn deinit( self: Csr, allocator: std.mem.Allocator ) void
+	{
+		allocator.free( self.offsets );
+		allocator.free( self.targets );
+		if ( self.kinds ) |kinds| allocator.free( kinds );
+	}
+};
+
+pub const Graph = struct {
+	ids: []u64, // sorted, as unsigned
+	forward: Csr,
+	reverse: Csr,
+	refers: Csr,
+	referrers: Csr,
+
+	pub fn deinit( self: Graph, allocator: std.mem.Allocator ) void
+	{
+		allocator.free( self.ids );
+		self.forward.deinit( allocator );
+		self.reverse.deinit( allocator );
+		self.refers.deinit( allocator );
+		self.referrers.deinit( allocator );
+	}
+};
+
+pub fn indexOf( ids: []const u64, id: i64 ) ?u32
+{
+	const key: u64 = @bitCast( id );
+	const Context = struct {
+		fn order( k: u64, item: u64 ) std.math.Order { return std.math.order( k, item ); }
+	};
+	const i = std.sort.lowerBound( u64, ids, key, Context.order );
+	if ( i < ids.len and ids[i] == key ) return @intCast( i );
+	return null;
+}
+
+const radix_bits = 8;
+const radix = 1 << radix_bits;
+const lanes = 8;
+
+// splits 0..len into one range per job
+fn chunk( len: usize, jobs: usize, job: usize ) struct { usize, usize }
+{
+	const size = ( len + jobs - 1 ) / jobs;
+	const start = @min( len, job * size );
+	return .{ start, @min( len, start + size ) };
+}
+
+// the digit of every key is pulled out lanes at a time, counting stays scalar
+fn histogram( keys: []const u64, shift: u6, counts: *[radix]usize ) void
+{
+	@memset( counts, 0 );
+	const V = @Vector( lanes, u64 );
+	const shift_v: @Vector( lanes, u6 ) = @splat( shift );
+	const mask_v: V = @splat( radix - 1 );
+
+	var i: usize = 0;
+	while ( i + lanes <= keys.len ) : ( i += lanes )
+	{
+		const v: V = keys[i..][0..lanes].*;
+		const digits: [lanes]u64 = ( v >> shift_v ) & mask_v;
+		inline for ( digits ) |d| counts[@intCast( d )] += 1;
+	}
+	while ( i < keys.len ) : ( i += 1 ) counts[@intCast( ( keys[i] >> shift ) & ( radix - 1 ) )] += 1;
+}
+
+// a u32 carried along with each key, empty if there is none
+pub const Payload = struct {
+	values: []u32 = &.{},
+	scratch: []u32 = &.{},
+};
+
+const SortPass = struct {
+	src: []const u64,
+	dst: []u64,
+	src_payload: []const u32,
+	dst_payload: []u32,
+	shift: u6,
+	jobs: usize,
+	counts: [][radix]usize, // by job
+
+	fn count( self: *const SortPass, job: usize ) void
+	{
+		const start, const end = chunk( self.src.len, self.jobs, job );
+		histogram( self.src[start..end], self.shift, &self.counts[job] );
+	}
+
+	// counts have been turned into each job's first slot for every digit
+	fn scatter( self: *const SortPass, job: usize ) void
+	{
+		const start, const end = chunk( self.src.len, self.jobs, job );
+		var slots = self.counts[job];
+		for ( self.src[start..end], start.. ) |key, i|
+		{
+			const d: usize = @intCast( ( key >> self.shift ) & ( radix - 1 ) );
+			self.dst[slots[d]] = key;
+			if ( self.dst_payload.len != 0 ) self.dst_payload[slots[d]] = self.src_payload[i];
+			slots[d] += 1;
+		}
+	}
+};
+
+fn runJobs( pool: *std.Thread.Pool, jobs: usize, comptime f: anytype, ctx: anytype ) void
+{
+	var wg: std.Thread.WaitGroup = .{};
+	for ( 0..jobs ) |job| pool.spawnWg( &wg, f, .{ ctx, job } );
+	pool.waitAndWork( &wg );
+}
+
+// parallel LSD radix sort by bits low_bit..high_bit of each key, stable, scratch has to be as long as keys and so does the payload's
+// returns whichever of keys or scratch holds the result, the payload ends up in the matching one of its values or scratch
+pub fn radixSort( allocator: std.mem.Allocator, pool: *std.Thread.Pool, jobs: usize, keys: []u64, scratch: []u64, payload: Payload, low_bit: u7, high_bit: u7 ) !struct { []u64, []u32 }
+{
+	const counts = try allocator.alloc( [radix]usize, jobs );
+	defer allocator.free( counts );
+
+	var src = keys;
+	var dst = scratch;
+	var src_payload = payload.values;
+	var dst_payload = payload.scratch;
+	var shift: u7 = low_bit;
+	while ( shift < high_bit ) : ( shift += radix_bits )
+	{
+		const pass = SortPass{ .src = src, .dst = dst, .src_payload = src_payload, .dst_payload = dst_payload, .shift = @intCast( shift ), .jobs = jobs, .counts = counts };
+		runJobs( pool, jobs, SortPass.count, &pass );
+
+		// digit major, job minor, so equal digits keep their order across jobs
+		var total: usize = 0;
+		for ( 0..radix ) |d|
+		{
+			for ( counts ) |*job_counts|
+			{
+				const n = job_counts[d];
+				job_counts[d] = total;
+				total += n;
+			}
+		}
+
+		runJobs( pool, jobs, SortPass.scatter, &pass );
+		std.mem.swap( []u64, &src, &dst );
+		std.mem.swap( []u32, &src_payload, &dst_payload );
+	}
+
+	return .{ src, src_payload };
+}
+
+fn bitsFor( max: u64 ) u7
+{
+	return @intCast( 64 - @clz( max ) );
+}
+
+// endpoints holds the index of each edge's from and to, back to back
+const Extract = struct {
+	endpoints: []const u32,
+	forward: []u64,
+	reverse: []u64,
+	jobs: usize,
+
+	// edges packed as key << 32 | target so sorting by key keeps the target with it
+	fn run( self: *const Extract, job: usize ) void
+	{
+		const start, const end = chunk( self.forward.len, self.jobs, job );
+		for ( self.forward[start..end], self.reverse[start..end], start.. ) |*f, *r, i|
+		{
+			const from: u64 = self.endpoints[i * 2];
+			const to: u64 = self.endpoints[i * 2 + 1];
+			f.* = from << 32 | to;
+			r.* = to << 32 | from;
+		}
+	}
+};
+
+fn csrFromSorted( allocator: std.mem.Allocator, nodes_len: usize, edges: []const u64 ) !Csr
+{
+	const offsets = try allocator.alloc( u32, nodes_len + 1 );
+	errdefer allocator.free( offsets );
+	const targets = try allocator.alloc( u32, edges.len );
+
+	@memset( offsets, 0 );
+	for ( edges, targets ) |edge, *target|
+	{
+		offsets[@intCast( ( edge >> 32 ) + 1 )] += 1;
+		target.* = @truncate( edge );
+	}
+	for ( 1..offsets.len ) |i| offsets[i] += offsets[i - 1];
+
+	return .{ .offsets = offsets, .targets = targets };
+}
+
+// forward and reverse adjacency of edges sorted by from then to, given as the indices of their endpoints
+// forward and reverse are scratch with one slot per edge
+fn buildCsrs( allocator: std.mem.Allocator, pool: *std.Thread.Pool, jobs: usize, nodes_len: usize, endpoints: []const u32, forward: []u64, reverse: []u64 ) !struct { Csr, Csr }
+{
+	const edge_scratch = try allocator.alloc( u64, forward.len );
+	defer allocator.free( edge_scratch );
+
+	const extract = Extract{ .endpoints = endpoints, .forward = forward, .reverse = reverse, .jobs = jobs };
+	runJobs( pool, jobs, Extract.run, &extract );
+
+	// only the key half needs sorting, edges are sorted by from then to so targets stay sorted within a key
+	const key_bits = 32 + @as( u7, bitsFor( nodes_len ) );
+	const forward_sorted, _ = try radixSort( allocator, pool, jobs, forward, edge_scratch, .{}, 32, key_bits );
+	const forward_csr = try csrFromSorted( allocator, nodes_len, forward_sorted );
+	errdefer forward_csr.deinit( allocator );
+
+	const reverse_sorted, _ = try radixSort( allocator, pool, jobs, reverse, edge_scratch, .{}, 32, key_bits );
+	const reverse_csr = try csrFromSorted( allocator, nodes_len, reverse_sorted );
+
+	return .{ forward_csr, reverse_csr };
+}
+
+// the kind of every reference in refers and referrers
+// references are sorted by from then to then kind, so refers has them in their own order
+// referrers has them by to then from, a from and to can be there with more than one kind
+fn addKinds( allocator: std.mem.Allocator, ids: []const u64, references: []const ObjFile.Reference, refers: *Csr, referrers: *Csr ) !void
+{
+	const forward_kinds = try allocator.alloc( u8, references.len );
+	errdefer allocator.free( forward_kinds );
+	for ( references, forward_kinds ) |ref, *kind| kind.* = @intCast( @intFromEnum( ref.kind ) );
+
+	const reverse_kinds = try allocator.alloc( u8, references.len );
+	errdefer allocator.free( reverse_kinds );
+	const cursor = try allocator.dupe( u32, referrers.offsets[0 .. referrers.offsets.len - 1] );
+	defer allocator.free( cursor );
+	for ( 0..ids.len ) |from|
+	{
+		for ( refers.offsets[from]..refers.offsets[from + 1] ) |i|
+		{
+			const to = refers.targets[i];
+			referrers.targets[cursor[to]] = @intCast( from );
+			reverse_kinds[cursor[to]] = forward_kinds[i];
+			cursor[to] += 1;
+		}
+	}
+
+	refers.kinds = forward_kinds;
+	referrers.kinds = reverse_kinds;
+}
+
+pub fn build( allocator: std.mem.Allocator, pool: *std.Thread.Pool, jobs: usize, nodes: []const ObjFile.Node, connections: []const ObjFile.Connection, references: []const ObjFile.Reference ) !Graph
+{
+	// every id, connections and references can point at nodes that never got a record, like the translation unit
+	const all = try allocator.alloc( u64, nodes.len + connections.len * 2 + references.len * 2 );
+	defer allocator.free( all );
+	const scratch = try allocator.alloc( u64, all.len );
+	defer allocator.free( scratch );
+	if ( all.len > std.math.maxInt( u32 ) ) return error.TooManyNodes;
+
+	// where each id came from in all, sorted along with it
+	const positions = try allocator.alloc( u32, all.len );
+	defer allocator.free( positions );
+	const positions_scratch = try allocator.alloc( u32, all.len );
+	defer allocator.free( positions_scratch );
+	for ( positions, 0.. ) |*p, i| p.* = @intCast( i );
+
+	for ( nodes, 0.. ) |node, i| all[i] = @bitCast( node.id );
+	for ( connections, 0.. ) |conn, i|
+	{
+		all[nodes.len + i * 2] = @bitCast( conn.from );
+		all[nodes.len + i * 2 + 1] = @bitCast( conn.to );
+	}
+	const refs_start = nodes.len + connections.len * 2;
+	for ( references, 0.. ) |ref, i|
+	{
+		all[refs_start + i * 2] = @bitCast( ref.from );
+		all[refs_start + i * 2 + 1] = @bitCast( ref.to );
+	}
+
+	const sorted, const sorted_positions = try radixSort( allocator, pool, jobs, all, scratch, .{ .values = positions, .scratch = positions_scratch }, 0, 64 );
+
+	// dropping duplicates hands out the indices, index_of is by position in all
+	// the other positions buffer is free once the sort is done
+	const index_of = if ( sorted_positions.ptr == positions.ptr ) positions_scratch else positions;
+	var unique_len: usize = 0;
+	for ( sorted, sorted_positions ) |id, position|
+	{
+		if ( unique_len == 0 or sorted[unique_len - 1] != id ) {
+			sorted[unique_len] = id;
+			unique_len += 1;
+		}
+		index_of[position] = @intCast( unique_len - 1 );
+	}
+
+	const ids = try allocator.dupe( u64, sorted[0..unique_len] );
+	errdefer allocator.free( ids );
+
+	// the id buffers are big enough to be reused for the edges
+	const connection_endpoints = index_of[nodes.len..refs_start];
+	const forward, const reverse = try buildCsrs( allocator, pool, jobs, ids.len, connection_endpoints, all[0..connections.len], scratch[0..connections.len] );
+	errdefer forward.deinit( allocator );
+	errdefer reverse.deinit( allocator );
+
+	const reference_endpoints = index_of[refs_start..];
+	var refers, var referrers = try buildCsrs( allocator, pool, jobs, ids.len, reference_endpoints, all[0..references.len], scratch[0..references.len] );
+	errdefer refers.deinit( allocator );
+	errdefer referrers.deinit( allocator );
+	try addKinds( allocator, ids, references, &refers, &referrers );
+
+	return .{ .ids = ids, .forward = forward, .reverse = reverse, .refers = refers, .referrers = referrers };
+}
+
+test "build" {
+	const allocator = std.testing.allocator;
+	var pool: std.Thread.Pool = undefined;
+	try pool.init( .{ .allocator = allocator, .n_jobs = 3 } );
+	defer pool.deinit();
+
+	const nodes = [_]ObjFile.Node{ .{ .id = 5, .string_hash = 0 }, .{ .id = -2, .string_hash = 0 }, .{ .id = 9, .string_hash = 0 } };
+	const connections = [_]ObjFile.Connection{ .{ .from = 5, .to = 0 }, .{ .from = 9, .to = 5 }, .{ .from = -2, .to = 5 } };
+	const references = [_]ObjFile.Reference{ .{ .from = 9, .to = 5, .kind = .use }, .{ .from = 9, .to = 5, .kind = .call }, .{ .from = 9, .to = 7, .kind = .use } };
+	const graph = try build( allocator, &pool, 3, &nodes, &connections, &references );
+	defer graph.deinit( allocator );
+
+	// -2 sorts last as unsigned, 7 only shows up as a reference target
+	try std.testing.expectEqualSlices( u64, &.{ 0, 5, 7, 9, @bitCast( @as( i64, -2 ) ) }, graph.ids );
+	try std.testing.expectEqualSlices( u32, &.{ 0 }, graph.forward.neighbors( 1 ) );
+	try std.testing.expectEqualSlices( u32, &.{ 3, 4 }, graph.reverse.neighbors( 1 ) );
+	try std.testing.expectEqualSlices( u32, &.{ 1 }, graph.reverse.neighbors( 0 ) );
+
+	try std.testing.expectEqualSlices( u32, &.{ 1, 1, 2 }, graph.refers.neighbors( 3 ) );
+	try std.testing.expectEqualSlices( u8, &.{ 0, 1, 0 }, graph.refers.kinds.?[graph.refers.offsets[3]..graph.refers.offsets[4]] );
+	try std.testing.expectEqualSlices( u32, &.{ 3, 3 }, graph.referrers.neighbors( 1 ) );
+	try std.testing.expectEqualSlices( u8, &.{ 0, 1 }, graph.referrers.kinds.?[graph.referrers.offsets[1]..graph.referrers.offsets[2]] );
+}
@@ -0,0 +1,165 @@
+const std = @import("std");
+
+// lz4 block format, no frame
+// sequences of: token, literal length bytes, literals, 2 byte offset, match length bytes
+// the last sequence is only literals, the last 5 bytes are always literals and no match starts in the last 12
+
+const min_match = 4;
+const last_literals = 5;
+const match_limit = 12;
+const max_offset = 65535;
+const hash_log = 12;
+
+pub fn compressBound( len: usize ) usize
+{
+	return len + len / 255 + 16;
+}
+
+fn read32( bytes: []const u8, pos: usize ) u32
+{
+	return std.mem.readInt( u32, bytes[pos..][0..4], .little );
+}
+
+fn hash( seq: u32 ) usize
+{
+	return ( seq *% 2654435761 ) >> ( 32 - hash_log );
+}
+
+fn writeLength( dst: []u8, pos: *usize, len: usize ) void
+{
+	var remaining = len;
+	while ( remaining >= 255 ) : ( remaining -= 255 )
+	{
+		dst[pos.*] = 255;
+		pos.* += 1;
+	}
+	dst[pos.*] = @intCast( remaining );
+	pos.* += 1;
+}
+
+fn writeSequence( dst: []u8, pos: *usize, literals: []const u8, offset: usize, match_len: usize ) void
+{
+	const lit_token: u8 = @intCast( @min( literals.len, 15 ) );
+	const match_token: u8 = if ( match_len == 0 ) 0 else @intCast( @min( match_len - min_match, 15 ) );
+	dst[pos.*] = ( lit_token << 4 ) | match_token;
+	pos.* += 1;
+
+	if ( literals.len >= 15 ) writeLength( dst, pos, literals.len - 15 );
+	@memcpy( dst[pos.*..][0..literals.len], literals );
+	pos.* += literals.len;
+
+	if ( match_len == 0 ) return; // last sequence
+
+	std.mem.writeInt( u16, dst[pos.*..][0..2], @intCast( offset ), .little );
+	pos.* += 2;
+	if ( match_len - min_match >= 15 ) writeLength( dst, pos, match_len - min_match - 15 );
+}
+
+// greedy single probe matcher, dst must be at least compressBound( src.len ) long
+// returns the compressed length
+pub fn compress( src: []const u8, dst: []u8 ) usize
+{
+	std.debug.assert( dst.len >= compressBound( src.len ) );
+
+	var pos: usize = 0;
+	var anchor: usize = 0;
+
+	if ( src.len > match_limit )
+	{
+		var table = [_]u32{ 0 } ** ( 1 << hash_log );
+		const limit = src.len - match_limit;
+		const end = src.len - last_literals;
+
+		var i: usize = 0;
+		while ( i < limit )
+		{
+			const seq = read32( src, i );
+			const h = hash( seq );
+			const candidate: usize = table[h];
+			table[h] = @intCast( i );
+
+			if ( candidate >= i or i - candidate > max_offset or read32( src, candidate ) != seq ) {
+				i += 1;
+				continue;
+			}
+
+			var len: usize = min_match;
+			while ( i + len < end and src[candidate + len] == src[i + len] ) len += 1;
+
+			writeSequence( dst, &pos, src[anchor..i], i - candidate, len );
+			i += len;
+			anchor = i;
+		}
+	}
+
+	writeSequence( dst, &pos, src[anchor..], 0, 0 );
+	return pos;
+}
+
+fn readLength( src: []const u8, pos: *usize, base: usize ) error{Corrupt}!usize
+{
+	var len = base;
+	if ( base != 15 ) return len;
+	while ( true )
+	{
+		if ( pos.* >= src.len ) return error.Corrupt;
+		const byte = src[pos.*];
+		pos.* += 1;
+		len += byte;
+		if ( byte != 255 ) return len;
+	}
+}
+
+// returns the decompressed length, every read and write is bounds checked
+pub fn decompress( src: []const u8, dst: []u8 ) error{Corrupt}!usize
+{
+	var s: usize = 0;
+	var d: usize = 0;
+
+	while ( true )
+	{
+		if ( s >= src.len ) return error.Corrupt;
+		const token = src[s];
+		s += 1;
+
+		const lit_len = try readLength( src, &s, token >> 4 );
+		if ( lit_len > src.len - s or lit_len > dst.len - d ) return error.Corrupt;
+		@memcpy( dst[d..][0..lit_len], src[s..][0..lit_len] );
+		s += lit_len;
+		d += lit_len;
+
+		if ( s == src.len ) return d;
+
+		if ( src.len - s < 2 ) return error.Corrupt;
+		const offset = std.mem.readInt( u16, src[s..][0..2], .little );
+		s += 2;
+		if ( offset == 0 or offset > d ) return error.Corrupt;
+
+		const match_len = try readLength( src, &s, token & 15 ) + min_match;
+		if ( match_len > dst.len - d ) return error.Corrupt;
+
+		// the match can overlap what it is writing
+		for ( 0..match_len ) |i| dst[d + i] = dst[d - offset + i];
+		d += match_len;
+	}
+}
+
+test "round trip" {
+	const allocator = std.testing.allocator;
+	var prng = std.Random.DefaultPrng.init( 0 );
+	const random = prng.random();
+
+	const src = try allocator.alloc( u8, 100_000 );
+	defer allocator.free( src );
+	for ( src, 0.. ) |*c, i| c.* = if ( i % 1000 < 700 ) @intCast( i % 7 ) else random.int( u8 );
+
+	const compressed = try allocator.alloc( u8, compressBound( src.len ) );
+	defer allocator.free( compressed );
+	const len = compress( src, compressed );
+	try std.testing.expect( len < src.len );
+
+	const out = try allocator.alloc( u8, src.len );
+	defer allocator.free( out );
+	try std.testing.expectEqual( src.len, try decompress( compressed[0..len], out ) );
+	try std.testing.expectEqualSlices( u8, src, out );
+}
@@ -0,0 +1,66 @@
+const std = @import("std");
+const builtin = @import("builtin");
+
+// a whole file mapped read only, the bytes stay valid until close
+pub const MappedFile = struct {
+	bytes: []align(std.heap.page_size_min) const u8,
+	mapping: if ( builtin.os.tag == .windows ) std.os.windows.HANDLE else void,
+
+	pub const OpenError = error{ EmptyFile, MapFailed } || std.fs.File.OpenError || std.fs.File.StatError;
+
+	pub fn open( path: []const u8 ) OpenError!MappedFile
+	{
+		const file = try std.fs.cwd().openFile( path, .{ .mode = .read_only } );
+		defer file.close();
+
+		const size = try file.getEndPos();
+		if ( size == 0 ) return error.EmptyFile;
+
+		if ( builtin.os.tag == .windows ) {
+			const mapping = CreateFileMappingW( file.handle, null, PAGE_READONLY, 0, 0, null ) orelse return error.MapFailed;
+			errdefer std.os.windows.CloseHandle( mapping );
+			const ptr = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) orelse return error.MapFailed;
+			const bytes: [*]align(std.heap.page_size_min) const u8 = @ptrCast( @alignCast( ptr ) );
+			return .{ .bytes = bytes[0..size], .mapping = mapping };
+		} else {
+			const bytes = std.posix.mmap( null, size, std.posix.PROT.READ, .{ .TYPE = .PRIVATE }, file.handle, 0 ) catch return error.MapFailed;
+			return .{ .bytes = bytes, .mapping = {} };
+		}
+	}
+
+	pub fn close( self: MappedFile ) void
+	{
+		if ( builtin.os.tag == .windows ) {
+			_ = UnmapViewOfFile( self.bytes.ptr );
+			std.os.windows.CloseHandle( self.mapping );
+		} else {
+			std.posix.munmap( self.bytes );
+		}
+	}
+};
+
+const DWORD = std.os.windows.DWORD;
+const HANDLE = std.os.windows.HANDLE;
+const BOOL = std.os.windows.BOOL;
+
+const PAGE_READONLY: DWORD = 0x02;
+const FILE_MAP_READ: DWORD = 0x04;
+
+extern "kernel32" fn CreateFileMappingW(
+	hFile: HANDLE,
+	lpFileMappingAttributes: ?*anyopaque,
+	flProtect: DWORD,
+	dwMaximumSizeHigh: DWORD,
+	dwMaximumSizeLow: DWORD,
+	lpName: ?[*:0]const u16
+) ?HANDLE;
+
+extern "kernel32" fn MapViewOfFile(
+	hFileMappingObject: HANDLE,
+	dwDesiredAccess: DWORD,
+	dwFileOffsetHigh: DWORD,
+	dwFileOffsetLow: DWORD,
+	dwNumberOfBytesToMap: usize
+) ?*anyopaque;
+
+extern "kernel32" fn UnmapViewOfFile( lpBaseAddress: *const anyopaque ) BOOL;
@@ -3,10 +3,23 @@
 // TODO: move linknames to a different data structure in storage, feels like 
 
 const std = @import("std");
+const MappedFile = @import("mapped_file.zig").MappedFile;
 
 
-const version_major: u8 = 0;
-const version_minor: u8 = 1;
+const version_major: u8 = 1;
+const version_minor: u8 = 4;
+
+// every string hash in an object, computed by the parser
+pub fn hashString( str: []const u8 ) u64
+{
+	return std.hash.XxHash3.hash( 0, str );
+}
+
+// layout:
+//   Sig, Header, Section[header.section_count]
+//   then every section, each starting on a section_align boundary
+// the whole file is meant to be mapped, every section can be used in place
+const section_align: usize = 64;
 
 
 const Sig = extern struct {
@@ -17,13 +30,49 @@ const Sig = extern struct {
 
 pub const Header = extern struct {
 	run_id: u64,
-	nodes_count: u64,
-	connections_count: u64,
-	strings_len: u64,
-	strings_count: u32,
-	linklinks_count: u32,
-	linknames_len: u64,
-	linknames_count: u32
+	section_count: u32,
+	_pad: u32 = 0,
+};
+
+pub const SectionKind = enum(u32) {
+	nodes,            // Node
+	connections,      // Connection
+	strings,          // null terminated strings back to back
+	string_index,     // IndexEntry, hash table into strings
+	linklinks,        // LinkLink
+	linknames,        // null terminated strings back to back
+	linkname_index,   // IndexEntry, hash table into linknames
+	headerrefs,       // HeaderRef
+	string_hashes,    // u64, hash of each string in strings in the same order
+	linkname_hashes,  // u64, hash of each string in linknames in the same order
+	node_strings,     // u32, index into strings of the string of the node in node_ids at the same position
+	connection_from,  // u32 node index of the child
+	connection_to,    // u32 node index of the parent
+	graph_ids,        // u64 every node id in a linked object sorted as unsigned, a node's index is its position
+	forward_offsets,  // u32 by index plus one past the end, into forward_targets
+	forward_targets,  // u32 indices connections go to from each node
+	reverse_offsets,  // u32 by index plus one past the end, into reverse_targets
+	reverse_targets,  // u32 indices with connections to each node
+	references,       // Reference
+	node_ids,         // u32 node index
+	reference_from,   // u32 node index
+	reference_to,     // u32 node index
+	reference_kinds,  // u8 ReferenceKind
+	refers_offsets,   // u32 by index plus one past the end, into refers_targets
+	refers_targets,   // u32 indices each node refers to
+	refers_kinds,     // u8 ReferenceKind of each of refers_targets
+	referrers_offsets, // u32 by index plus one past the end, into referrers_targets
+	referrers_targets, // u32 indices referring to each node
+	referrers_kinds,  // u8 ReferenceKind of each of referrers_targets
+	_,
+};
+
+pub const Section = extern struct {
+	kind: SectionKind,
+	_pad: u32 = 0,
+	offset: u64, // from the start of the file
+	size: u64,   // in bytes
+	count: u64,  // in elements, for the string sections the number of strings
 };
 
 // program stuff, should be mostly shared between obj files and db files
@@ -37,6 +86,21 @@ pub const Connection = extern struct {
 	to: i64
 };
 
+// mirrors ReferenceKind in clang.h
+pub const ReferenceKind = enum(u64) {
+	use,
+	call,
+	construct,
+	_,
+};
+
+// an expression in from's body or initializer refers to to
+pub const Reference = extern struct {
+	from: i64,
+	to: i64,
+	kind: ReferenceKind,
+};
+
 // link stuff, should only exist in link files
 // connect a node with a link name, more than one may exist for a single node
 pub const LinkLink = extern struct {
@@ -44,197 +108,736 @@ pub const LinkLink = extern struct {
 	string_hash: u64,
 };
 
+// a header the TU had decls in, only written when headers are deduplicated
+// the decls are in whichever object has the same key with owned set
+pub const HeaderRef = extern struct {
+	key: u64,
+	path_hash: u64, // in the strings table
+	owned: u64,
+};
 
+// open addressing table of every string in a string section, linear probing from hash & (len-1)
+// len is a power of two and at least twice the number of strings, empty slots have offset empty_offset
+pub const IndexEntry = extern struct {
+	hash: u64,
+	offset: u32,
+	len: u32,
+};
 
-pub const Writer = struct {
-	const BufferedWriter = std.io.BufferedWriter( 2048, std.fs.File.Writer );
-	const WriteError = std.fs.File.Writer.Error;
-	const OpenError = std.fs.File.OpenError || WriteError;
+const empty_offset: u32 = std.math.maxInt(u32);
+
+// how cet-cl stores a single TU, struct of arrays with dense u32 node indices local to the TU, 0 is the translation unit
+// node_strings[i] is the position in strings of node_ids[i]'s string, link links use the same node indices
+// linked objects have Node, Connection and Reference records with global ids instead
+pub const Compact = struct {
+	node_ids: []const u32 = &.{},
+	node_strings: []const u32 = &.{},
+	connection_from: []const u32 = &.{},
+	connection_to: []const u32 = &.{},
+	reference_from: []const u32 = &.{},
+	reference_to: []const u32 = &.{},
+	reference_kinds: []const u8 = &.{},
+};
 
-	buffer: BufferedWriter,
 
 
-	pub fn open( path: []const u8 ) OpenError!Writer
+// everything that goes into an object, the string hashes are in the same order as the strings
+pub const Contents = struct {
+	run_id: u64 = 0,
+	nodes: []const Node = &.{},
+	connections: []const Connection = &.{},
+	references: []const Reference = &.{},
+	compact: Compact = .{},
+	strings: []const u8 = &.{},
+	string_hashes: []const u64 = &.{},
+	linklinks: []const LinkLink = &.{},
+	linknames: []const u8 = &.{},
+	linkname_hashes: []const u64 = &.{},
+	headerrefs: []const HeaderRef = &.{},
+};
+
+// pairs every string with its hash, offsets are from the start of strings
+pub fn indexEntries( allocator: std.mem.Allocator, strings: []const u8, hashes: []const u64 ) error{OutOfMemory}![]IndexEntry
+{
+	const entries = try allocator.alloc( IndexEntry, hashes.len );
+	var start: usize = 0;
+	for ( hashes, entries ) |hash, *entry|
+	{
+		const len = std.mem.indexOfScalarPos( u8, strings, start, 0 ).? - start;
+		entry.* = .{ .hash = hash, .offset = @intCast( start ), .len = @intCast( len ) };
+		start += len + 1;
+	}
+	return entries;
+}
+
+pub fn buildIndex( allocator: std.mem.Allocator, entries: []const IndexEntry ) error{OutOfMemory}![]IndexEntry
+{
+	const len = std.math.ceilPowerOfTwoAssert( usize, @max( entries.len * 2, 2 ) );
+	const index = try allocator.alloc( IndexEntry, len );
+	@memset( index, .{ .hash = 0, .offset = empty_offset, .len = 0 } );
+
+	const mask = len - 1;
+	for ( entries ) |entry|
+	{
+		var slot = entry.hash & mask;
+		while ( index[slot].offset != empty_offset ) slot = (slot + 1) & mask;
+		index[slot] = entry;
+	}
+
+	return index;
+}
+
+pub fn write( allocator: std.mem.Allocator, path: []const u8, contents: Contents ) !void
+{
+	const string_entries = try indexEntries( allocator, contents.strings, contents.string_hashes );
+	defer allocator.free( string_entries );
+	const linkname_entries = try indexEntries( allocator, contents.linknames, contents.linkname_hashes );
+	defer allocator.free( linkname_entries );
+
+	var writer = try StreamWriter.create( path );
+	errdefer writer.abort();
+
+	try writer.writeSection( .nodes, std.mem.sliceAsBytes( contents.nodes ), contents.nodes.len );
+	try writer.writeSection( .connections, std.mem.sliceAsBytes( contents.connections ), contents.connections.len );
+	try writer.writeSection( .references, std.mem.sliceAsBytes( contents.references ), contents.references.len );
+	inline for ( std.meta.fields( Compact ) ) |field|
+	{
+		const items = @field( contents.compact, field.name );
+		try writer.writeSection( @field( SectionKind, field.name ), std.mem.sliceAsBytes( items ), items.len );
+	}
+	try writer.writeSection( .strings, contents.strings, contents.string_hashes.len );
+	try writer.writeStringIndex( allocator, .strings, string_entries );
+	try writer.writeSection( .linklinks, std.mem.sliceAsBytes( contents.linklinks ), contents.linklinks.len );
+	try writer.writeSection( .linknames, contents.linknames, contents.linkname_hashes.len );
+	try writer.writeStringIndex( allocator, .linknames, linkname_entries );
+	try writer.writeSection( .headerrefs, std.mem.sliceAsBytes( contents.headerrefs ), contents.headerrefs.len );
+
+	try writer.finish( contents.run_id );
+}
+
+
+// writes an object one section at a time, for when the contents are not all in memory
+// the section table is reserved up front and filled in by finish
+pub const StreamWriter = struct {
+	const BufferedWriter = std.io.BufferedWriter( 64 * 1024, std.fs.File.Writer );
+	const max_sections = @typeInfo( SectionKind ).@"enum".fields.len;
+	const table_end = @sizeOf( Sig ) + @sizeOf( Header ) + max_sections * @sizeOf( Section );
+
+	file: std.fs.File,
+	buffer: BufferedWriter,
+	offset: u64,
+	sections: [max_sections]Section = undefined,
+	section_count: u32 = 0,
+	current: ?Section = null,
+
+	pub fn create( path: []const u8 ) !StreamWriter
 	{
 		const file = try std.fs.cwd().createFile( path, .{ .truncate = true, .lock = .exclusive } );
-		var buf = BufferedWriter{ .unbuffered_writer = file.writer() };
-		const writer = buf.writer();
-		const sig = Sig{ .sig = "cetobj".*, .ver_major = version_major, .ver_minor = version_minor };
-		
-		try writer.writeStruct( sig );
-		return .{ .buffer = buf };
+		errdefer file.close();
+		var writer = StreamWriter{ .file = file, .buffer = .{ .unbuffered_writer = file.writer() }, .offset = 0 };
+		try writer.pad( table_end );
+		return writer;
 	}
 
-	pub fn close( self: *Writer ) !void
+	// close without finishing, leaves a file readers reject
+	pub fn abort( self: *StreamWriter ) void
 	{
-		try self.buffer.flush();
-		self.buffer.unbuffered_writer.context.close();
+		self.file.close();
+	}
+
+	pub fn beginSection( self: *StreamWriter, kind: SectionKind ) !void
+	{
+		std.debug.assert( self.current == null );
+		try self.pad( std.mem.alignForward( u64, self.offset, section_align ) );
+		self.current = .{ .kind = kind, .offset = self.offset, .size = 0, .count = 0 };
+	}
+
+	pub fn writeBytes( self: *StreamWriter, bytes: []const u8 ) !void
+	{
+		try self.buffer.writer().writeAll( bytes );
+		self.offset += bytes.len;
 	}
 
+	// appends a null terminated string to the current section, the entry's offset is from the start of the section
+	pub fn writeString( self: *StreamWriter, hash: u64, str: []const u8 ) !IndexEntry
+	{
+		const entry = IndexEntry{ .hash = hash, .offset = @intCast( self.offset - self.current.?.offset ), .len = @intCast( str.len ) };
+		try self.writeBytes( str );
+		try self.writeBytes( &.{ 0 } );
+		return entry;
+	}
 
-	pub fn writeHeader( self: *Writer, header: Header ) WriteError!void
+	pub fn endSection( self: *StreamWriter, count: u64 ) void
 	{
-		const writer = self.buffer.writer();
-		return writer.writeStruct( header );
+		var section = self.current.?;
+		section.size = self.offset - section.offset;
+		section.count = count;
+		self.sections[self.section_count] = section;
+		self.section_count += 1;
+		self.current = null;
 	}
 
-	pub fn writeNodes( self: *Writer, nodes: []Node ) WriteError!void
+	pub fn writeSection( self: *StreamWriter, kind: SectionKind, bytes: []const u8, count: u64 ) !void
 	{
-		const writer = self.buffer.writer();
-		return writer.writeAll( std.mem.sliceAsBytes( nodes ) );
+		try self.beginSection( kind );
+		try self.writeBytes( bytes );
+		self.endSection( count );
 	}
 
-	pub fn writeConnections( self: *Writer, connections: []Connection ) WriteError!void
+	// the hashes and index sections for a string table that has already been written, entries are in the order of the text
+	pub fn writeStringIndex( self: *StreamWriter, allocator: std.mem.Allocator, table: enum { strings, linknames }, entries: []const IndexEntry ) !void
 	{
-		const writer = self.buffer.writer();
-		return writer.writeAll( std.mem.sliceAsBytes( connections ) );
+		const hashes_kind: SectionKind, const index_kind: SectionKind = switch ( table ) {
+			.strings => .{ .string_hashes, .string_index },
+			.linknames => .{ .linkname_hashes, .linkname_index },
+		};
+
+		try self.beginSection( hashes_kind );
+		for ( entries ) |entry| try self.writeBytes( std.mem.asBytes( &entry.hash ) );
+		self.endSection( entries.len );
+
+		const index = try buildIndex( allocator, entries );
+		defer allocator.free( index );
+		try self.writeSection( index_kind, std.mem.sliceAsBytes( index ), index.len );
 	}
 
-	pub fn writeStrings( self: *Writer, strings: []const u8 ) WriteError!void
+	// copies the first len bytes of source into the current section
+	pub fn writeFile( self: *StreamWriter, source: std.fs.File, len: u64 ) !void
 	{
-		const writer = self.buffer.writer();
-		return writer.writeAll( strings );
+		try self.buffer.flush();
+		if ( try source.copyRangeAll( 0, self.file, self.offset, len ) != len ) return error.EndOfStream;
+		self.offset += len;
+		try self.file.seekTo( self.offset );
 	}
 
-	pub fn writeLinkLinks( self: *Writer, links: []LinkLink ) WriteError!void
+	// the index section of a string table whose entries don't fit in memory, built chunk_len slots at a time
+	// source.entries() is read once, every entry goes to a bucket for the chunk its hash lands in
+	// and each chunk is then filled from its bucket alone
+	// the buckets are kept in scratch, an empty file opened for reading and writing, in blocks of up to bucket_block_len entries
+	pub fn writeStringIndexChunked( self: *StreamWriter, allocator: std.mem.Allocator, kind: SectionKind, count: u64, chunk_len: usize, source: anytype, scratch: std.fs.File ) !void
 	{
-		const writer = self.buffer.writer();
-		return writer.writeAll( std.mem.sliceAsBytes( links ) );
+		const len = std.math.ceilPowerOfTwoAssert( u64, @max( count * 2, 2 ) );
+		const mask = len - 1;
+		const slots = try allocator.alloc( IndexEntry, @min( chunk_len, len ) );
+		defer allocator.free( slots );
+
+		// small chunks get smaller blocks, so a bucket never holds much more than its chunk in memory
+		const block_len = std.math.clamp( slots.len / 4, 1, bucket_block_len );
+		var buckets = try Buckets.init( allocator, std.math.divCeil( u64, len, slots.len ) catch unreachable, block_len );
+		defer buckets.deinit( allocator );
+		var entries = try source.entries();
+		while ( try entries.next() ) |entry| try buckets.add( allocator, scratch, ( entry.hash & mask ) / slots.len, entry );
+
+		// entries that probed past the end of their chunk, they continue from the start of the next one
+		var carry: std.ArrayListUnmanaged( IndexEntry ) = .empty;
+		defer carry.deinit( allocator );
+		var next_carry: std.ArrayListUnmanaged( IndexEntry ) = .empty;
+		defer next_carry.deinit( allocator );
+		var bucket: std.ArrayListUnmanaged( IndexEntry ) = .empty;
+		defer bucket.deinit( allocator );
+
+		try self.beginSection( kind );
+		const section_offset = self.offset;
+
+		var start: u64 = 0;
+		while ( start < len ) : ( start += slots.len )
+		{
+			const chunk = slots[0..@min( slots.len, len - start )];
+			@memset( chunk, .{ .hash = 0, .offset = empty_offset, .len = 0 } );
+
+			next_carry.clearRetainingCapacity();
+			for ( carry.items ) |entry| try probeChunk( allocator, chunk, 0, entry, &next_carry );
+
+			try buckets.read( allocator, scratch, start / slots.len, &bucket );
+			for ( bucket.items ) |entry| try probeChunk( allocator, chunk, ( entry.hash & mask ) - start, entry, &next_carry );
+
+			try self.writeBytes( std.mem.sliceAsBytes( chunk ) );
+			std.mem.swap( std.ArrayListUnmanaged( IndexEntry ), &carry, &next_carry );
+		}
+
+		// probing wraps around, what ran off the end goes into the chunks already written
+		if ( carry.items.len > 0 ) try self.buffer.flush();
+		start = 0;
+		while ( carry.items.len > 0 ) : ( start += slots.len )
+		{
+			std.debug.assert( start < len ); // never more than half full
+			const chunk = slots[0..@min( slots.len, len - start )];
+			const at = section_offset + start * @sizeOf( IndexEntry );
+			_ = try self.file.preadAll( std.mem.sliceAsBytes( chunk ), at );
+
+			next_carry.clearRetainingCapacity();
+			for ( carry.items ) |entry| try probeChunk( allocator, chunk, 0, entry, &next_carry );
+			try self.file.pwriteAll( std.mem.sliceAsBytes( chunk ), at );
+			std.mem.swap( std.ArrayListUnmanaged( IndexEntry ), &carry, &next_carry );
+		}
+
+		self.endSection( len );
+	}
+
+	const bucket_block_len = 256; // 4KiB
+
+	// a bucket per chunk, each fills a block in memory that is written to the scratch file once full
+	// blocks are appended in the order they fill up, a bucket keeps the list of its own
+	const Buckets = struct {
+		block_len: usize,
+		pending: []IndexEntry, // block_len per bucket
+		pending_len: []u32,
+		blocks: []std.ArrayListUnmanaged( u32 ),
+		block_count: u32 = 0,
+
+		fn init( allocator: std.mem.Allocator, count: u64, block_len: usize ) !Buckets
+		{
+			const pending = try allocator.alloc( IndexEntry, count * block_len );
+			errdefer allocator.free( pending );
+			const pending_len = try allocator.alloc( u32, count );
+			errdefer allocator.free( pending_len );
+			@memset( pending_len, 0 );
+			const blocks = try allocator.alloc( std.ArrayListUnmanaged( u32 ), count );
+			@memset( blocks, .empty );
+			return .{ .block_len = block_len, .pending = pending, .pending_len = pending_len, .blocks = blocks };
+		}
+
+		fn deinit( self: *Buckets, allocator: std.mem.Allocator ) void
+		{
+			for ( self.blocks ) |*b| b.deinit( allocator );
+			allocator.free( self.blocks );
+			allocator.free( self.pending_len );
+			allocator.free( self.pending );
+		}
+
+		fn add( self: *Buckets, allocator: std.mem.Allocator, scratch: std.fs.File, index: u64, entry: IndexEntry ) !void
+		{
+			const block = self.pending[index * self.block_len ..][0..self.block_len];
+			block[self.pending_len[index]] = entry;
+			self.pending_len[index] += 1;
+			if ( self.pending_len[index] < self.block_len ) return;
+
+			try scratch.pwriteAll( std.mem.sliceAsBytes( block ), @as( u64, self.block_count ) * self.block_len * @sizeOf( IndexEntry ) );
+			try self.blocks[index].append( allocator, self.block_count );
+			self.block_count += 1;
+			self.pending_len[index] = 0;
+		}
+
+		// every entry of the bucket in the order they were added
+		fn read( self: *const Buckets, allocator: std.mem.Allocator, scratch: std.fs.File, index: u64, out: *std.ArrayListUnmanaged( IndexEntry ) ) !void
+		{
+			const blocks = self.blocks[index].items;
+			const pending = self.pending[index * self.block_len ..][0..self.pending_len[index]];
+			try out.resize( allocator, blocks.len * self.block_len + pending.len );
+			for ( blocks, 0.. ) |block, i|
+			{
+				const dst = std.mem.sliceAsBytes( out.items[i * self.block_len ..][0..self.block_len] );
+				if ( try scratch.preadAll( dst, @as( u64, block ) * dst.len ) != dst.len ) return error.EndOfStream;
+			}
+			@memcpy( out.items[blocks.len * self.block_len ..], pending );
+		}
+	};
+
+	fn probeChunk( allocator: std.mem.Allocator, chunk: []IndexEntry, from: u64, entry: IndexEntry, overflow: *std.ArrayListUnmanaged( IndexEntry ) ) !void
+	{
+		for ( chunk[from..] ) |*slot|
+		{
+			if ( slot.offset != empty_offset ) continue;
+			slot.* = entry;
+			return;
+		}
+		try overflow.append( allocator, entry );
+	}
+
+	// on error the file is still open, call abort
+	pub fn finish( self: *StreamWriter, run_id: u64 ) !void
+	{
+		std.debug.assert( self.current == null );
+		try self.buffer.flush();
+
+		var head = [_]u8{ 0 } ** table_end;
+		var stream = std.io.fixedBufferStream( &head );
+		const writer = stream.writer();
+		try writer.writeStruct( Sig{ .sig = "cetobj".*, .ver_major = version_major, .ver_minor = version_minor } );
+		try writer.writeStruct( Header{ .run_id = run_id, .section_count = self.section_count } );
+		try writer.writeAll( std.mem.sliceAsBytes( self.sections[0..self.section_count] ) );
+		try self.file.pwriteAll( &head, 0 );
+		self.file.close();
 	}
 
-	pub fn writeLinkNames( self: *Writer, names: []const u8 ) WriteError!void
+	fn pad( self: *StreamWriter, to: u64 ) !void
 	{
-		const writer = self.buffer.writer();
-		return writer.writeAll( names );
+		try self.buffer.writer().writeByteNTimes( 0, to - self.offset );
+		self.offset = to;
 	}
 };
 
+
+pub const Append = struct { kind: SectionKind, bytes: []const u8, count: u64 };
+
+// adds sections to the end of a finished object, the table was reserved with room for every kind
+pub fn appendSections( path: []const u8, sections: []const Append ) !void
+{
+	const file = try std.fs.cwd().openFile( path, .{ .mode = .read_write, .lock = .exclusive } );
+	defer file.close();
+
+	var head: [StreamWriter.table_end]u8 = undefined;
+	if ( try file.preadAll( &head, 0 ) != head.len ) return error.IncorrectHeader;
+	var hdr = std.mem.bytesToValue( Header, head[@sizeOf( Sig )..][0..@sizeOf( Header )] );
+	if ( hdr.section_count + sections.len > StreamWriter.max_sections ) return error.TooManySections;
+
+	var table: [StreamWriter.max_sections]Section = undefined;
+	@memcpy( std.mem.sliceAsBytes( table[0..] ), head[@sizeOf( Sig ) + @sizeOf( Header )..] );
+
+	var offset = try file.getEndPos();
+	for ( sections ) |append|
+	{
+		offset = std.mem.alignForward( u64, offset, section_align );
+		try file.pwriteAll( append.bytes, offset );
+		table[hdr.section_count] = .{ .kind = append.kind, .offset = offset, .size = append.bytes.len, .count = append.count };
+		hdr.section_count += 1;
+		offset += append.bytes.len;
+	}
+
+	// the table goes last so a failed append leaves the old sections readable
+	try file.pwriteAll( std.mem.sliceAsBytes( table[0..hdr.section_count] ), @sizeOf( Sig ) + @sizeOf( Header ) );
+	try file.pwriteAll( std.mem.asBytes( &hdr ), @sizeOf( Sig ) );
+}
+
+
+// a mapped object, nothing is copied or rehashed
+// the slices handed out are valid until close
 pub const Reader = struct {
-	const BufferedReader = std.io.BufferedReader( 2048, std.fs.File.Reader);
-	const ReadError = error{EndOfStream,OutOfMemory} || std.fs.File.ReadError;
-	const OpenError = error{IncorrectHeader,IncorrectVersion} || std.fs.File.OpenError || ReadError;
+	pub const OpenError = error{IncorrectHeader,IncorrectVersion,CorruptSection,InvalidObject} || MappedFile.OpenError;
 
-	buffer: BufferedReader,
+	file: MappedFile,
 	hdr: Header,
+	sections: std.EnumArray( SectionKind, ?Section ),
 
 	pub fn open( path: []const u8 ) OpenError!Reader
 	{
-		const file = try std.fs.cwd().openFile( path, .{ .mode = .read_only, .lock = .shared } );
-		var buf = BufferedReader{ .unbuffered_reader = file.reader() };
-		const reader = buf.reader();
-		const sig = reader.readStruct( Sig ) catch |err| {
-			switch( err ) {
-				error.EndOfStream => return error.IncorrectHeader,
-				else => return err,
-			}
-		};
+		const file = try MappedFile.open( path );
+		errdefer file.close();
+		const bytes = file.bytes;
+
+		if ( bytes.len < @sizeOf( Sig ) + @sizeOf( Header ) ) return error.IncorrectHeader;
 
+		const sig = std.mem.bytesToValue( Sig, bytes[0..@sizeOf( Sig )] );
 		if ( !std.mem.eql( u8, &sig.sig, "cetobj" ) )
 		{
 			return error.IncorrectHeader;
 		}
 
-		if ( sig.ver_major == version_major and sig.ver_minor == sig.ver_major )
+		if ( sig.ver_major != version_major or sig.ver_minor != version_minor )
 		{
 			return error.IncorrectVersion;
 		}
 
-		const hdr = try reader.readStruct( Header );
+		const hdr = std.mem.bytesToValue( Header, bytes[@sizeOf( Sig )..][0..@sizeOf( Header )] );
+		const table_start = @sizeOf( Sig ) + @sizeOf( Header );
+		const table_end = table_start + @as( usize, hdr.section_count ) * @sizeOf( Section );
+		if ( table_end > bytes.len ) return error.IncorrectHeader;
+
+		const table: []const Section = @alignCast( std.mem.bytesAsSlice( Section, bytes[table_start..table_end] ) );
+
+		var sections = std.EnumArray( SectionKind, ?Section ).initFill( null );
+		for ( table ) |section|
+		{
+			// sections from newer writers are skipped
+			if ( std.enums.tagName( SectionKind, section.kind ) == null ) continue;
+
+			if ( section.offset % section_align != 0 ) return error.CorruptSection;
+			if ( section.offset > bytes.len or section.size > bytes.len - section.offset ) return error.CorruptSection;
+			sections.set( section.kind, section );
+		}
 
-		return .{ .buffer = buf, .hdr = hdr };
+		const reader = Reader{ .file = file, .hdr = hdr, .sections = sections };
+		if ( !reader.valid() ) return error.InvalidObject;
+		return reader;
 	}
 
-	pub fn close( self: Reader ) void
+	// everything the accessors index with is checked once here, so they can trust the contents
+	fn valid( self: Reader ) bool
 	{
-		self.unbuffered_reader.context.close();
+		if ( !validStrings( self.strings() ) or !validStrings( self.linkNames() ) ) return false;
+
+		const c = self.compact();
+		if ( c.node_ids.len != c.node_strings.len ) return false;
+		if ( c.connection_from.len != c.connection_to.len ) return false;
+		if ( c.reference_from.len != c.reference_to.len or c.reference_from.len != c.reference_kinds.len ) return false;
+		const string_count = self.strings().count();
+		for ( c.node_strings ) |string| if ( string >= string_count ) return false;
+
+		const ids = self.graphIds();
+		return validAdjacency( ids.len, self.section( u32, .forward_offsets ), self.section( u32, .forward_targets ), null ) and
+			validAdjacency( ids.len, self.section( u32, .reverse_offsets ), self.section( u32, .reverse_targets ), null ) and
+			validAdjacency( ids.len, self.section( u32, .refers_offsets ), self.section( u32, .refers_targets ), self.section( u8, .refers_kinds ) ) and
+			validAdjacency( ids.len, self.section( u32, .referrers_offsets ), self.section( u32, .referrers_targets ), self.section( u8, .referrers_kinds ) );
 	}
 
-	pub fn readNodes( self: *Reader, allocator: std.mem.Allocator ) ReadError![]Node
+	// every string terminated, a hash for each and every index entry inside the text
+	fn validStrings( table: StringTable ) bool
 	{
-		const nodes = try allocator.alloc( Node, self.hdr.nodes_count );
-		const reader = self.buffer.reader();
-		try reader.readNoEof(std.mem.sliceAsBytes(nodes));
-		return nodes;
+		if ( table.text.len > 0 and table.text[table.text.len - 1] != 0 ) return false;
+		if ( std.mem.count( u8, table.text, &.{ 0 } ) != table.hashes.len ) return false;
+		if ( table.index.len > 0 and !std.math.isPowerOfTwo( table.index.len ) ) return false;
+		for ( table.index ) |entry|
+		{
+			if ( entry.offset == empty_offset ) continue;
+			if ( @as( u64, entry.offset ) + entry.len >= table.text.len or table.text[entry.offset + entry.len] != 0 ) return false;
+		}
+		return true;
 	}
 
-	pub fn readConnections( self: *Reader, allocator: std.mem.Allocator ) ReadError![]Connection
+	// missing adjacency is fine, otherwise offsets cover every id, never go back and stay within targets, which are all ids
+	fn validAdjacency( ids_len: usize, offsets: []const u32, targets: []const u32, kinds: ?[]const u8 ) bool
 	{
-		const connections = try allocator.alloc( Connection, self.hdr.connections_count );
-		const reader = self.buffer.reader();
-		try reader.readNoEof(std.mem.sliceAsBytes(connections));
-		return connections;
+		if ( offsets.len == 0 ) return targets.len == 0;
+		if ( offsets.len != ids_len + 1 or offsets[0] != 0 or offsets[offsets.len - 1] != targets.len ) return false;
+		if ( kinds ) |k| if ( k.len != targets.len ) return false;
+		for ( offsets[0 .. offsets.len - 1], offsets[1..] ) |a, b| if ( a > b ) return false;
+		for ( targets ) |target| if ( target >= ids_len ) return false;
+		return true;
 	}
 
-	
-	pub fn readStrings( self: *Reader, allocator: std.mem.Allocator ) ReadError!StringTable
+	pub fn close( self: *Reader ) void
 	{
-		return self.readStringsInternal( allocator, self.hdr.strings_len, self.hdr.strings_count );
+		self.file.close();
 	}
 
+	pub fn nodes( self: Reader ) []const Node
+	{
+		return self.section( Node, .nodes );
+	}
 
-	pub fn readLinkLinks( self: *Reader, allocator: std.mem.Allocator ) ReadError![]LinkLink
+	pub fn connections( self: Reader ) []const Connection
 	{
-		const links = try allocator.alloc( LinkLink, self.hdr.linknames_count );
-		const reader = self.buffer.reader();
-		try reader.readNoEof(std.mem.sliceAsBytes(links));
-		return links;
+		return self.section( Connection, .connections );
 	}
 
-	pub fn readLinkNames( self: *Reader, allocator: std.mem.Allocator ) ReadError!StringTable 
+	pub fn references( self: Reader ) []const Reference
 	{
-		return self.readStringsInternal( allocator, self.hdr.linknames_len, self.hdr.linknames_count );
+		return self.section( Reference, .references );
 	}
 
+	pub fn strings( self: Reader ) StringTable
+	{
+		return .{ .text = self.section( u8, .strings ), .hashes = self.section( u64, .string_hashes ), .index = self.section( IndexEntry, .string_index ) };
+	}
 
-	fn readStringsInternal(  self: *Reader, allocator: std.mem.Allocator, len: usize, count: u32 ) ReadError!StringTable
+	pub fn linkLinks( self: Reader ) []const LinkLink
 	{
-		const strings = try allocator.alloc( u8, len );
-		try self.buffer.reader().readNoEof( strings );
+		return self.section( LinkLink, .linklinks );
+	}
 
-		var hashmap = HashMap.empty;
-		try hashmap.ensureTotalCapacity( allocator, count );
+	pub fn linkNames( self: Reader ) StringTable
+	{
+		return .{ .text = self.section( u8, .linknames ), .hashes = self.section( u64, .linkname_hashes ), .index = self.section( IndexEntry, .linkname_index ) };
+	}
 
-		var str_start: usize = 0;
-		for (strings, 0..) |c, i|
-		{
-			if (c != 0) continue;
+	pub fn headerRefs( self: Reader ) []const HeaderRef
+	{
+		return self.section( HeaderRef, .headerrefs );
+	}
 
-			const str = strings[str_start..i];
-			const hash = std.hash.Wyhash.hash( 0, str );
-			hashmap.putAssumeCapacity( hash, str );
-			str_start = i+1;
+	// empty for linked objects
+	pub fn compact( self: Reader ) Compact
+	{
+		var result: Compact = .{};
+		inline for ( std.meta.fields( Compact ) ) |field|
+		{
+			@field( result, field.name ) = self.section( @typeInfo( field.type ).pointer.child, @field( SectionKind, field.name ) );
 		}
+		return result;
+	}
+
+	// adjacency of a linked object, empty if cet-ld did not build it
+	pub fn graphIds( self: Reader ) []const u64
+	{
+		return self.section( u64, .graph_ids );
+	}
+
+	pub fn forwardOf( self: Reader, index: u32 ) []const u32
+	{
+		return adjacency( self.section( u32, .forward_offsets ), self.section( u32, .forward_targets ), index );
+	}
+
+	pub fn reverseOf( self: Reader, index: u32 ) []const u32
+	{
+		return adjacency( self.section( u32, .reverse_offsets ), self.section( u32, .reverse_targets ), index );
+	}
+
+	pub const Referenced = struct { targets: []const u32, kinds: []const u8 };
 
-		return .{ .hashmap = hashmap, .strings = strings };
+	// what the node at index refers to, empty if cet-ld did not build it
+	pub fn refersOf( self: Reader, index: u32 ) Referenced
+	{
+		const offsets = self.section( u32, .refers_offsets );
+		return .{
+			.targets = adjacency( offsets, self.section( u32, .refers_targets ), index ),
+			.kinds = adjacency( offsets, self.section( u8, .refers_kinds ), index ),
+		};
 	}
 
-	const HashContext = struct {
-		pub fn hash( self: HashContext, a: u64 ) u64
+	pub fn referrersOf( self: Reader, index: u32 ) Referenced
+	{
+		const offsets = self.section( u32, .referrers_offsets );
+		return .{
+			.targets = adjacency( offsets, self.section( u32, .referrers_targets ), index ),
+			.kinds = adjacency( offsets, self.section( u8, .referrers_kinds ), index ),
+		};
+	}
+
+	fn adjacency( offsets: []const u32, targets: anytype, index: u32 ) @TypeOf( targets )
+	{
+		if ( index + 1 >= offsets.len ) return &.{};
+		return targets[offsets[index]..offsets[index + 1]];
+	}
+
+	// missing sections are empty
+	fn section( self: Reader, comptime T: type, kind: SectionKind ) []const T
+	{
+		const s = self.sections.get( kind ) orelse return &.{};
+		const bytes = self.file.bytes[s.offset..][0..s.size];
+		return @alignCast( std.mem.bytesAsSlice( T, bytes[0 .. bytes.len - bytes.len % @sizeOf( T )] ) );
+	}
+};
+
+pub const StringTable = struct {
+	text: []const u8,
+	hashes: []const u64, // in the order of text
+	index: []const IndexEntry,
+
+	pub fn get( self: StringTable, hash: u64 ) ?[]const u8
+	{
+		if ( self.index.len == 0 ) return null;
+
+		const mask = self.index.len - 1;
+		var slot = hash & mask;
+		while ( true ) : ( slot = (slot + 1) & mask )
 		{
-			_ = self;
-			return a;
+			const entry = self.index[slot];
+			if ( entry.offset == empty_offset ) return null;
+			if ( entry.hash == hash ) return self.text[entry.offset..][0..entry.len];
 		}
+	}
 
-		pub fn eql( self: HashContext, a: u64, b: u64 ) bool
+	pub fn count( self: StringTable ) usize
+	{
+		return self.hashes.len;
+	}
+
+	// every string in the order it was written
+	pub const Iterator = struct {
+		text: []const u8,
+		hashes: []const u64,
+		i: usize = 0,
+		pos: usize = 0,
+
+		pub const Entry = struct { hash: u64, str: []const u8 };
+
+		pub fn next( self: *Iterator ) ?Entry
 		{
-			_ = self;
-			return a == b;
+			if ( self.i >= self.hashes.len ) return null;
+
+			const len = std.mem.indexOfScalarPos( u8, self.text, self.pos, 0 ).? - self.pos;
+			const entry = Entry{ .hash = self.hashes[self.i], .str = self.text[self.pos..][0..len] };
+			self.i += 1;
+			self.pos += len + 1;
+			return entry;
 		}
 	};
 
-	pub const HashMap = std.HashMapUnmanaged( u64, []const u8, HashContext, 99);
+	pub fn iterator( self: StringTable ) Iterator
+	{
+		return .{ .text = self.text, .hashes = self.hashes };
+	}
+};
+
+
+test "chunked string index" {
+	const allocator = std.testing.allocator;
+	var tmp = std.testing.tmpDir( .{} );
+	defer tmp.cleanup();
+	const path = try std.fmt.allocPrint( allocator, ".zig-cache/tmp/{s}/index.cetobj", .{ tmp.sub_path } );
+	defer allocator.free( path );
 
-	pub const StringTable = struct {
+	// 40 strings in 128 slots, most of them home in the last 8 so probing carries across chunks and wraps around
+	var text: std.ArrayListUnmanaged( u8 ) = .empty;
+	defer text.deinit( allocator );
+	var expected: [40]IndexEntry = undefined;
+	for ( &expected, 0.. ) |*entry, i|
+	{
+		const home: u64 = if ( i % 4 == 0 ) i else 120 + i % 8;
+		entry.* = .{ .hash = @as( u64, i ) << 32 | home, .offset = @intCast( text.items.len ), .len = 0 };
+		try text.writer( allocator ).print( "s{}", .{ i } );
+		entry.len = @intCast( text.items.len - entry.offset );
+		try text.append( allocator, 0 );
+	}
+
+	const Source = struct {
+		items: []const IndexEntry,
+		calls: *usize,
 
-		hashmap: HashMap,
-		strings: []const u8,
+		const Iterator = struct {
+			entries: []const IndexEntry,
+			i: usize = 0,
+
+			pub fn next( self: *Iterator ) !?IndexEntry
+			{
+				if ( self.i == self.entries.len ) return null;
+				self.i += 1;
+				return self.entries[self.i - 1];
+			}
+		};
 
-		pub fn deinit( self: *StringTable, allocator: std.mem.Allocator ) void
+		pub fn entries( self: @This() ) !Iterator
 		{
-			self.hashmap.deinit( allocator );
-			allocator.free( self.strings );
+			self.calls.* += 1;
+			return .{ .entries = self.items };
 		}
 	};
 
-};
+	const scratch = try tmp.dir.createFile( "index.scratch", .{ .read = true } );
+	defer scratch.close();
+
+	// with 16 slot chunks the blocks are 4 entries, so buckets go to scratch in several blocks interleaved with other buckets
+	var entries_calls: usize = 0;
+	{
+		var writer = try StreamWriter.create( path );
+		errdefer writer.abort();
+		try writer.writeSection( .strings, text.items, expected.len );
+		try writer.beginSection( .string_hashes );
+		for ( expected ) |entry| try writer.writeBytes( std.mem.asBytes( &entry.hash ) );
+		writer.endSection( expected.len );
+		try writer.writeStringIndexChunked( allocator, .string_index, expected.len, 16, Source{ .items = &expected, .calls = &entries_calls }, scratch );
+		try writer.finish( 0 );
+	}
 
+	var reader = try Reader.open( path );
+	defer reader.close();
+	const table = reader.strings();
+	try std.testing.expectEqual( 128, table.index.len );
+	for ( expected ) |entry| try std.testing.expectEqualStrings( text.items[entry.offset..][0..entry.len], table.get( entry.hash ).? );
+	try std.testing.expectEqual( null, table.get( 77 ) );
+	try std.testing.expectEqual( 1, entries_calls );
+}
+
+test "invalid object" {
+	const allocator = std.testing.allocator;
+	var tmp = std.testing.tmpDir( .{} );
+	defer tmp.cleanup();
+	const path = try std.fmt.allocPrint( allocator, ".zig-cache/tmp/{s}/invalid.cetobj", .{ tmp.sub_path } );
+	defer allocator.free( path );
+
+	// node 1's string is past the one string there is
+	try write( allocator, path, .{
+		.compact = .{ .node_ids = &.{ 0, 1 }, .node_strings = &.{ 0, 1 } },
+		.strings = "tu\x00",
+		.string_hashes = &.{ hashString( "tu" ) },
+	});
+	try std.testing.expectError( error.InvalidObject, Reader.open( path ) );
+
+	try write( allocator, path, .{
+		.compact = .{ .node_ids = &.{ 0 }, .node_strings = &.{ 0 } },
+		.strings = "tu\x00",
+		.string_hashes = &.{ hashString( "tu" ) },
+	});
+	var reader = try Reader.open( path );
+	reader.close();
+}
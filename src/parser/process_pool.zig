@@ -0,0 +1,606 @@
+const std = @import("std");
+const builtin = @import("builtin");
+
+const Child = @import("Child.zig");
+
+// runs cet-cl processes for the driver, at most len at once, each tagged with what it was added for
+// their output goes to stdout
+pub const ProcessPool = switch ( builtin.os.tag ) {
+	.windows => WindowsProcessPool,
+	.linux => LinuxProcessPool,
+	else => @compileError( "no process pool for this os" ),
+};
+
+// a process that was reaped, tag is what it was added with
+pub const Exit = struct {
+	tag: usize,
+	slot: u32,
+	term: Child.Term,
+	time: ?std.time.Instant,
+	peak_memory: ?usize,
+
+	pub fn ok( self: Exit ) bool
+	{
+		return self.term == .Exited and self.term.Exited == 0;
+	}
+};
+
+
+const DWORD = std.os.windows.DWORD;
+const HANDLE = std.os.windows.HANDLE;
+const BOOL = std.os.windows.BOOL;
+
+extern "kernel32" fn PeekNamedPipe( 
+  hNamedPipe: HANDLE,
+  lpBuffer: ?*anyopaque,
+  nBufferSize: DWORD,
+  lpBytesRead: ?*DWORD,
+  lpTotalBytesAvail: *DWORD,
+  lpBytesLeftThisMessage: ?*DWORD
+) BOOL;
+
+
+
+// overlapped reads on one pipe per slot, processes are waited on 64 at a time
+const WindowsProcessPool = struct {
+
+	// WaitForMultipleObjects waits on at most 64 handles
+	pub const max_len = 64;
+
+	const HandlePair = struct {
+		id: Child.Id,
+		idx: u32
+	};
+
+	const HandleList = std.MultiArrayList( HandlePair );
+
+	const Item = struct {
+		process: Child,
+		id: ?Child.Id,
+		tag: usize,
+		next_free: ?u32,
+
+		overlapped: std.os.windows.OVERLAPPED,
+		buffer: []u8,
+
+		pipe_read: ?std.fs.File,
+		pipe_write: std.fs.File,
+	};
+
+	const ItemList = std.MultiArrayList( Item );
+
+	items: ItemList,
+	handles: HandleList,
+	exits: std.ArrayListUnmanaged( Exit ), // waitExit and finish reap at most one process each, emptied by the caller
+	first_free: ?u32,
+	free_count: u32,
+	nul_handle: std.fs.File,
+
+
+	pub fn init( allocator: std.mem.Allocator, len: usize ) !WindowsProcessPool
+	{
+		const windows = std.os.windows;
+		var items = ItemList{};
+		try items.resize( allocator, len );
+
+		const s = items.items( .next_free );
+		for ( s[0..s.len-1], 0.. ) |*idx, i| {
+			idx.* = @as( u32, @intCast(i) ) + 1;
+		}
+		s[s.len-1] = null;
+
+		for ( items.items( .id ) ) |*id|
+		{
+			id.* = null; // FIXME: does this work for posix?
+		}
+
+		const buffer_size: usize = 4096;
+		const buffers = try allocator.alloc( u8, len * buffer_size );
+
+		for ( items.items( .buffer ), 0.. ) |*buffer, i|
+		{
+			const start = i * buffer_size;
+			const end = start + buffer_size;
+			buffer.* = buffers[start..end];
+		}
+
+		const nul_handle = try Child.nullHandle();
+
+		var saAttr = windows.SECURITY_ATTRIBUTES{
+			.nLength = @sizeOf(windows.SECURITY_ATTRIBUTES),
+			.bInheritHandle = windows.TRUE,
+			.lpSecurityDescriptor = null,
+		};
+		for ( items.items( .pipe_write ), items.items( .pipe_read ) ) |*wr,*rd|
+		{
+			var rd_handle: ?windows.HANDLE = undefined;
+			var wr_handle: ?windows.HANDLE = undefined;
+			try Child.windowsMakeAsyncPipe(&rd_handle, &wr_handle, &saAttr );
+			wr.* = .{ .handle = wr_handle.? };
+			rd.* = .{ .handle = rd_handle.? };
+		}
+
+		for ( items.items( .overlapped ),  items.items( .pipe_read ), items.items( .buffer ) ) |*overlap, rd, buffer|
+		{
+			overlap.* = std.mem.zeroes( windows.OVERLAPPED );
+			if (windows.kernel32.ReadFile(rd.?.handle, buffer.ptr, @intCast( buffer.len ), null, overlap) == 0) {
+			switch (windows.GetLastError()) {
+					.IO_PENDING => {},
+					.OPERATION_ABORTED => continue,
+					.BROKEN_PIPE => return error.BrokenPipe,
+					.HANDLE_EOF => return error.HandleEof,
+					.NETNAME_DELETED => return error.ConnectionResetByPeer,
+					.LOCK_VIOLATION => return error.LockViolation,
+					else => |err| return windows.unexpectedError(err),
+				}
+			}
+
+		}
+
+		var handles = HandleList{};
+		try handles.resize( allocator, len );
+
+		var exits: std.ArrayListUnmanaged( Exit ) = .empty;
+		try exits.ensureTotalCapacity( allocator, len );
+
+		return .{ 
+			.items = items,
+			.first_free = 0,
+			.free_count = @intCast( len ),
+			.nul_handle = nul_handle ,
+			.handles = handles,
+			.exits = exits,
+			};
+	}
+
+	pub fn deinit( self: *WindowsProcessPool, allocator: std.mem.Allocator ) void
+	{
+		self.handles.deinit( allocator );
+		self.exits.deinit( allocator );
+
+		const buffer_size: usize = 4096;
+		const buffer = self.items.items( .buffer )[0];
+		const len = self.items.len * buffer_size;
+		allocator.free( buffer.ptr[0..len]);
+		self.items.deinit( allocator );
+	}
+
+	pub fn hasFree( self: *const WindowsProcessPool ) bool
+	{
+		return self.first_free != null;
+	}
+
+	// blocks until a process exits, make sure one is running before calling
+	pub fn waitExit( self: *WindowsProcessPool ) !void
+	{
+		while ( try self.wait() ) {
+			try self.processPipes( false );
+		}
+	}
+
+	pub fn finish( self: *WindowsProcessPool ) !bool
+	{
+		while ( try self.wait() ) {
+			try self.processPipes( false );
+		}
+
+		if ( self.free_count < self.items.len )
+		{
+			return true;
+		}
+
+		try self.processPipes( true );
+
+		return false;
+	}
+
+
+	// make sure there is a free index before calling
+	pub fn add( self: *WindowsProcessPool, allocator: std.mem.Allocator, args: [][]const u8, cwd: []const u8, tag: usize ) !void
+	{
+		const free = self.first_free.?;
+		self.first_free = self.items.items( .next_free )[free];
+
+		//const dir = try std.fs.openDirAbsolute( cwd, .{} );
+		const pipe_write = self.items.items( .pipe_write )[free];
+		const pipe_in = self.nul_handle;
+
+		var child = Child.init( args, allocator );
+		child.cwd = cwd;
+		child.request_resource_usage_statistics = true;
+		_ = try child.spawn( pipe_write, pipe_in );
+
+
+		self.items.items( .next_free )[free] = null;
+		self.items.items( .process )[free] 	 = child;
+		self.items.items( .id )[free] 		 = child.id;
+		self.items.items( .tag )[free] 		 = tag;
+
+
+		self.free_count -= 1;
+	}
+
+
+
+
+	fn wait( self: *WindowsProcessPool ) !bool {
+		const handles = &self.handles;
+		handles.shrinkRetainingCapacity( 0 );
+
+		for ( self.items.items( .id ), 0.. ) |id, idx|
+		{
+			if (id == null) continue;
+			handles.appendAssumeCapacity( .{ .id = id.?, .idx = @intCast( idx ) });
+		}
+
+		const slice = handles.items( .id );
+		const offset = std.os.windows.WaitForMultipleObjectsEx( slice, false, 10, false ) catch |err| {
+			if ( err == error.WaitTimeOut ) return true;
+			return err;
+		};
+
+		const idx = handles.items( .idx )[offset];
+
+		var item = self.items.get( idx );
+
+		item.next_free = self.first_free;
+		item.id = null;
+		const term = try item.process.wait();
+		self.exits.appendAssumeCapacity( .{
+			.tag = item.tag,
+			.slot = idx,
+			.term = term,
+			.time = std.time.Instant.now() catch null,
+			.peak_memory = item.process.resource_usage_statistics.getMaxRss(),
+		} );
+
+		self.items.set( idx, item );
+
+		self.first_free = idx;
+		self.free_count += 1;
+
+		return false;
+	}
+
+	fn processPipes( self: *WindowsProcessPool, final: bool ) !void {
+		const overlapped = self.items.items( .overlapped );
+		const children = self.items.items( .id );
+		const buffers = self.items.items( .buffer );
+		const reads = self.items.items( .pipe_read );
+		for ( overlapped, children, buffers, reads ) |*overlap, id, buffer, *rd_op|
+		{
+			_ = id;
+			const rd = if (rd_op.*) |r| r else continue;
+			const bytes = std.os.windows.GetOverlappedResult( rd.handle, overlap, false ) catch |err|
+			{
+				if ( err == error.WouldBlock ) continue;
+				return err;
+			};
+
+			const stdout = std.io.getStdOut();
+			_ = try stdout.write( buffer[0..bytes] );
+			
+			if (!final) {
+				try beginRead( overlap, rd.handle, buffer );
+			} else {
+				const windows =std.os.windows;
+
+				// empty the pipe
+				var bytes_available: DWORD = 0;
+				var bytes_read: DWORD = 0;
+				if ( PeekNamedPipe( rd.handle, null, 0, null, &bytes_available, null) == 1 ) {
+					while ( bytes_available > bytes_read ) {
+						bytes_available -= bytes_read;
+						if (windows.kernel32.ReadFile(rd.handle, buffer.ptr, @intCast( buffer.len ), &bytes_read, null) == 0) {
+							switch (windows.GetLastError()) {
+								.IO_PENDING => {},
+								.OPERATION_ABORTED => return,
+								.BROKEN_PIPE => return error.BrokenPipe,
+								.HANDLE_EOF => return error.HandleEof,
+								.NETNAME_DELETED => return error.ConnectionResetByPeer,
+								.LOCK_VIOLATION => return error.LockViolation,
+								else => |err| return windows.unexpectedError(err),
+							}
+						}
+
+						if (bytes_read == 0) break;
+						_ = try stdout.write( buffer[0..bytes_read] );
+					}
+				}
+				// TODO check errors
+			}
+		}
+	}
+
+
+	fn beginRead( overlap: *std.os.windows.OVERLAPPED, handle: std.os.windows.HANDLE, buffer: []u8 ) !void
+	{
+		const windows =std.os.windows;
+		overlap.* = std.mem.zeroes( windows.OVERLAPPED  );
+		if (windows.kernel32.ReadFile(handle, buffer.ptr, @intCast( buffer.len ), null, overlap) == 0) {
+		switch (windows.GetLastError()) {
+				.IO_PENDING => {},
+				.OPERATION_ABORTED => return,
+				.BROKEN_PIPE => return error.BrokenPipe,
+				.HANDLE_EOF => return error.HandleEof,
+				.NETNAME_DELETED => return error.ConnectionResetByPeer,
+				.LOCK_VIOLATION => return error.LockViolation,
+				else => |err| return windows.unexpectedError(err),
+			}
+		}
+	}
+};
+
+
+// one epoll loop over a pidfd and an output pipe per running process, it only wakes up when a process writes or exits
+// processes are started with posix_spawn, a vfork and exec in glibc and musl, so hundreds of short ones a second stay cheap
+const LinuxProcessPool = struct {
+	const linux = std.os.linux;
+	const posix = std.posix;
+
+	pub const max_len = std.math.maxInt( u32 );
+
+	const buffer_size: usize = 4096;
+
+	const Slot = struct {
+		pid: posix.pid_t,
+		pidfd: posix.fd_t,
+		pipe: ?posix.fd_t, // read end of the process's stdout and stderr, null once it is closed
+		tag: usize,
+		buffered: usize, // bytes of output that aren't a whole line yet
+		next_free: ?u32,
+	};
+
+	// in the epoll data, a slot's pidfd is slot << 1 and its pipe slot << 1 | 1
+	const pipe_bit: u64 = 1;
+
+	epoll: posix.fd_t,
+	slots: []Slot,
+	buffers: []u8, // buffer_size per slot
+	exits: std.ArrayListUnmanaged( Exit ), // emptied by the caller
+	first_free: ?u32,
+	free_count: u32,
+
+	pub fn init( allocator: std.mem.Allocator, len: usize ) !LinuxProcessPool
+	{
+		const epoll = try posix.epoll_create1( linux.EPOLL.CLOEXEC );
+		errdefer posix.close( epoll );
+
+		const slots = try allocator.alloc( Slot, len );
+		errdefer allocator.free( slots );
+		for ( slots, 0.. ) |*slot, i|
+		{
+			slot.* = .{ .pid = 0, .pidfd = -1, .pipe = null, .tag = 0, .buffered = 0, .next_free = if ( i + 1 < len ) @intCast( i + 1 ) else null };
+		}
+
+		const buffers = try allocator.alloc( u8, len * buffer_size );
+		errdefer allocator.free( buffers );
+
+		var exits: std.ArrayListUnmanaged( Exit ) = .empty;
+		try exits.ensureTotalCapacity( allocator, len );
+
+		return .{
+			.epoll = epoll,
+			.slots = slots,
+			.buffers = buffers,
+			.exits = exits,
+			.first_free = if ( len > 0 ) 0 else null,
+			.free_count = @intCast( len ),
+		};
+	}
+
+	pub fn deinit( self: *LinuxProcessPool, allocator: std.mem.Allocator ) void
+	{
+		for ( self.slots ) |slot|
+		{
+			if ( slot.pid == 0 ) continue;
+			posix.close( slot.pidfd );
+			if ( slot.pipe ) |pipe| posix.close( pipe );
+		}
+		posix.close( self.epoll );
+		self.exits.deinit( allocator );
+		allocator.free( self.buffers );
+		allocator.free( self.slots );
+	}
+
+	pub fn hasFree( self: *const LinuxProcessPool ) bool
+	{
+		return self.first_free != null;
+	}
+
+	// make sure there is a free slot before calling
+	pub fn add( self: *LinuxProcessPool, allocator: std.mem.Allocator, args: [][]const u8, cwd: []const u8, tag: usize ) !void
+	{
+		const free = self.first_free.?;
+
+		var arena = std.heap.ArenaAllocator.init( allocator );
+		defer arena.deinit();
+		const argv = try arena.allocator().allocSentinel( ?[*:0]const u8, args.len, null );
+		for ( args, argv ) |arg, *dst| dst.* = try arena.allocator().dupeZ( u8, arg );
+		const cwd_z = try arena.allocator().dupeZ( u8, cwd );
+
+		const fds = try posix.pipe2( .{ .CLOEXEC = true } );
+		errdefer posix.close( fds[0] );
+		// the process has its own copy once it is spawned, so the pipe ends when it exits
+		defer posix.close( fds[1] );
+		// only the pool's end, the process writes to its end as usual
+		const fl = try posix.fcntl( fds[0], posix.F.GETFL, 0 );
+		_ = try posix.fcntl( fds[0], posix.F.SETFL, fl | @as( u32, @bitCast( posix.O{ .NONBLOCK = true } ) ) );
+
+		var actions: SpawnFileActions = undefined;
+		try spawnCheck( posix_spawn_file_actions_init( &actions ) );
+		defer _ = posix_spawn_file_actions_destroy( &actions );
+		try spawnCheck( posix_spawn_file_actions_addopen( &actions, posix.STDIN_FILENO, "/dev/null", @bitCast( posix.O{ .ACCMODE = .RDONLY } ), 0 ) );
+		try spawnCheck( posix_spawn_file_actions_adddup2( &actions, fds[1], posix.STDOUT_FILENO ) );
+		try spawnCheck( posix_spawn_file_actions_adddup2( &actions, fds[1], posix.STDERR_FILENO ) );
+		try spawnCheck( posix_spawn_file_actions_addchdir_np( &actions, cwd_z ) );
+
+		var pid: posix.pid_t = undefined;
+		try spawnCheck( posix_spawn( &pid, argv[0].?, &actions, null, argv.ptr, std.c.environ ) );
+
+		const pidfd_rc = linux.pidfd_open( pid, 0 );
+		const pidfd: posix.fd_t = switch ( linux.E.init( pidfd_rc ) ) {
+			.SUCCESS => @intCast( pidfd_rc ),
+			else => |err| {
+				// nothing could wait on it
+				posix.kill( pid, posix.SIG.KILL ) catch {};
+				_ = posix.waitpid( pid, 0 );
+				return posix.unexpectedErrno( err );
+			},
+		};
+		errdefer posix.close( pidfd );
+
+		var pid_event = linux.epoll_event{ .events = linux.EPOLL.IN, .data = .{ .u64 = @as( u64, free ) << 1 } };
+		try posix.epoll_ctl( self.epoll, linux.EPOLL.CTL_ADD, pidfd, &pid_event );
+		var pipe_event = linux.epoll_event{ .events = linux.EPOLL.IN, .data = .{ .u64 = @as( u64, free ) << 1 | pipe_bit } };
+		try posix.epoll_ctl( self.epoll, linux.EPOLL.CTL_ADD, fds[0], &pipe_event );
+
+		const slot = &self.slots[free];
+		self.first_free = slot.next_free;
+		slot.* = .{ .pid = pid, .pidfd = pidfd, .pipe = fds[0], .tag = tag, .buffered = 0, .next_free = null };
+		self.free_count -= 1;
+	}
+
+	// blocks until a process exits, make sure one is running before calling
+	pub fn waitExit( self: *LinuxProcessPool ) !void
+	{
+		const exits = self.exits.items.len;
+		while ( self.exits.items.len == exits ) try self.poll();
+	}
+
+	// waits for a process to exit, false once none are running
+	pub fn finish( self: *LinuxProcessPool ) !bool
+	{
+		if ( self.free_count == self.slots.len ) return false;
+		try self.waitExit();
+		return self.free_count < self.slots.len;
+	}
+
+	fn poll( self: *LinuxProcessPool ) !void
+	{
+		var events: [64]linux.epoll_event = undefined;
+		const count = posix.epoll_wait( self.epoll, &events, -1 );
+
+		// output first, a process's last lines are read before its exit is handled
+		for ( events[0..count] ) |event|
+		{
+			if ( event.data.u64 & pipe_bit != 0 ) try self.drain( @intCast( event.data.u64 >> 1 ) );
+		}
+		for ( events[0..count] ) |event|
+		{
+			if ( event.data.u64 & pipe_bit == 0 ) try self.reap( @intCast( event.data.u64 >> 1 ) );
+		}
+	}
+
+	// reads until the pipe is empty, closing it once the process's end is closed
+	fn drain( self: *LinuxProcessPool, index: u32 ) !void
+	{
+		const slot = &self.slots[index];
+		const buffer = self.buffers[index * buffer_size ..][0..buffer_size];
+		while ( slot.pipe ) |pipe|
+		{
+			const bytes = posix.read( pipe, buffer[slot.buffered..] ) catch |err| switch ( err ) {
+				error.WouldBlock => return,
+				else => return err,
+			};
+			if ( bytes == 0 ) {
+				posix.close( pipe );
+				slot.pipe = null;
+				try flushLines( slot, buffer, true );
+				return;
+			}
+			slot.buffered += bytes;
+			try flushLines( slot, buffer, false );
+		}
+	}
+
+	// whole lines only, so lines of processes running at once don't get mixed up, unless one line fills the buffer
+	fn flushLines( slot: *Slot, buffer: []u8, all: bool ) !void
+	{
+		const data = buffer[0..slot.buffered];
+		const end = if ( all or data.len == buffer.len ) data.len else if ( std.mem.lastIndexOfScalar( u8, data, '\n' ) ) |nl| nl + 1 else 0;
+		if ( end == 0 ) return;
+
+		try std.io.getStdOut().writeAll( data[0..end] );
+		std.mem.copyForwards( u8, buffer, data[end..] );
+		slot.buffered -= end;
+	}
+
+	fn reap( self: *LinuxProcessPool, index: u32 ) !void
+	{
+		const slot = &self.slots[index];
+
+		var status: u32 = 0;
+		var usage: linux.rusage = undefined;
+		while ( true )
+		{
+			const rc = linux.wait4( slot.pid, &status, 0, &usage );
+			switch ( linux.E.init( rc ) ) {
+				.SUCCESS => break,
+				.INTR => continue,
+				else => |err| return posix.unexpectedErrno( err ),
+			}
+		}
+		const time = std.time.Instant.now() catch null;
+
+		// everything it wrote is in the pipe already, a process it started could still hold the pipe open
+		try self.drain( index );
+		if ( slot.pipe ) |pipe| {
+			posix.close( pipe );
+			slot.pipe = null;
+			try flushLines( slot, self.buffers[index * buffer_size ..][0..buffer_size], true );
+		}
+		posix.close( slot.pidfd );
+
+		self.exits.appendAssumeCapacity( .{
+			.tag = slot.tag,
+			.slot = index,
+			.term = decodeStatus( status ),
+			.time = time,
+			.peak_memory = @as( usize, @intCast( usage.maxrss ) ) * 1024, // kilobytes
+		} );
+
+		slot.* = .{ .pid = 0, .pidfd = -1, .pipe = null, .tag = 0, .buffered = 0, .next_free = self.first_free };
+		self.first_free = index;
+		self.free_count += 1;
+	}
+
+	fn decodeStatus( status: u32 ) Child.Term
+	{
+		if ( posix.W.IFEXITED( status ) ) return .{ .Exited = posix.W.EXITSTATUS( status ) };
+		if ( posix.W.IFSIGNALED( status ) ) return .{ .Signal = posix.W.TERMSIG( status ) };
+		if ( posix.W.IFSTOPPED( status ) ) return .{ .Stopped = posix.W.STOPSIG( status ) };
+		return .{ .Unknown = status };
+	}
+
+	fn spawnCheck( rc: c_int ) !void
+	{
+		if ( rc == 0 ) return;
+		return switch ( @as( posix.E, @enumFromInt( rc ) ) ) {
+			.NOENT => error.FileNotFound,
+			.ACCES => error.AccessDenied,
+			.NOMEM, .AGAIN => error.SystemResources,
+			else => |err| posix.unexpectedErrno( err ),
+		};
+	}
+};
+
+// declared here, std.c only has posix_spawn for darwin
+// big enough for glibc (80 bytes) and musl, it is only ever used through the functions below
+const SpawnFileActions = extern struct {
+	data: [128]u8 align(8),
+};
+
+extern "c" fn posix_spawn(
+	pid: *std.posix.pid_t,
+	path: [*:0]const u8,
+	file_actions: ?*const SpawnFileActions,
+	attrp: ?*const anyopaque,
+	argv: [*:null]const ?[*:0]const u8,
+	envp: [*:null]const ?[*:0]const u8
+) c_int;
+extern "c" fn posix_spawn_file_actions_init( file_actions: *SpawnFileActions ) c_int;
+extern "c" fn posix_spawn_file_actions_destroy( file_actions: *SpawnFileActions ) c_int;
+extern "c" fn posix_spawn_file_actions_adddup2( file_actions: *SpawnFileActions, fd: c_int, newfd: c_int ) c_int;
+extern "c" fn posix_spawn_file_actions_addopen( file_actions: *SpawnFileActions, fd: c_int, path: [*:0]const u8, oflag: c_int, mode: std.posix.mode_t ) c_int;
+extern "c" fn posix_spawn_file_actions_addchdir_np( file_actions: *SpawnFileActions, path: [*:0]const u8 ) c_int;
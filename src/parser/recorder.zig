@@ -0,0 +1,457 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const ObjFile = @import("objfile.zig");
+const Fingerprint = @import("fingerprint.zig");
+const Clang = @import("clang.zig");
+
+// sink for everything clang_tool_lib records for a single translation unit
+// shared by cet-cl and the in-process parse in cet-driver
+
+pub const StringArena = struct {
+    start: [*]u8, // start of the whole reserved area
+    head: [*]u8, // start of the current free but committed area
+    tail: [*]u8, // end of current committed area
+    end: [*]u8, // end of the whole reserved area
+
+    const COMMIT_GRANULARITY: usize = 1024 * 64;
+    const RESERVE_GRANULARITY: usize = 1024 * 64;
+    const RESERVE_SIZE: usize = RESERVE_GRANULARITY * 256;
+
+    pub fn init() StringArena {
+        const ptr: [*]u8 = if (builtin.os.tag == .windows) blk: {
+            const win = std.os.windows;
+            break :blk @ptrCast(win.VirtualAlloc(null, RESERVE_SIZE, win.MEM_RESERVE, win.PAGE_NOACCESS) catch @panic("page reserve failed"));
+        } else blk: {
+            const posix = std.posix;
+            const mem = posix.mmap(null, RESERVE_SIZE, posix.PROT.NONE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true, .NORESERVE = true }, -1, 0) catch @panic("page reserve failed");
+            break :blk mem.ptr;
+        };
+        return .{
+            .start = ptr,
+            .head = ptr,
+            .tail = ptr,
+            .end = ptr + RESERVE_SIZE,
+        };
+    }
+
+    pub fn add(self: *StringArena, str: []const u8) void {
+        const write_len = str.len + 1; // +1 for null terminator
+        self.reserve(write_len);
+
+        @memcpy(self.head[0..str.len], str);
+        self.head[str.len] = 0;
+
+        self.head += write_len;
+    }
+
+    // append bytes that are already null terminated strings
+    pub fn addRaw(self: *StringArena, bytes: []const u8) void {
+        self.reserve(bytes.len);
+        @memcpy(self.head[0..bytes.len], bytes);
+        self.head += bytes.len;
+    }
+
+    fn reserve(self: *StringArena, write_len: usize) void {
+        const ilen: isize = @intCast(write_len);
+        const ispace: isize = @intCast(self.tail - self.head);
+        const delta: isize = ispace - ilen;
+
+        if (delta < 0) {
+            self.expand(@intCast(-delta));
+        }
+    }
+
+    pub fn deinit(self: *StringArena) void {
+        if (builtin.os.tag == .windows) {
+            const win = std.os.windows;
+            win.VirtualFree(self.start, 0, win.MEM_RELEASE);
+        } else {
+            const mem: []align(std.heap.page_size_min) u8 = @alignCast(self.start[0..RESERVE_SIZE]);
+            std.posix.munmap(mem);
+        }
+    }
+
+    pub fn data(self: StringArena) []const u8 {
+        return self.start[0..self.len()];
+    }
+
+    pub fn len(self: StringArena) usize {
+        return self.head - self.start;
+    }
+
+    // grows by at least what is already committed so the number of commits stays logarithmic
+    fn expand(self: *StringArena, amount: usize) void {
+        const committed = self.tail - self.start;
+        const commit_size = @min(std.mem.alignForward(usize, @max(amount, committed), COMMIT_GRANULARITY), self.end - self.tail);
+        if (commit_size < amount) @panic("string arena ran out of reserved memory");
+
+        if (builtin.os.tag == .windows) {
+            const win = std.os.windows;
+            _ = win.VirtualAlloc(self.tail, commit_size, win.MEM_COMMIT, win.PAGE_READWRITE) catch @panic("allocation failed");
+        } else {
+            const mem: []align(std.heap.page_size_min) u8 = @alignCast(self.tail[0..commit_size]);
+            std.posix.mprotect(mem, std.posix.PROT.READ | std.posix.PROT.WRITE) catch @panic("allocation failed");
+        }
+        self.tail += commit_size;
+    }
+};
+
+// the length of the block's array for a field of ObjFile.Compact, the block has an array of the same name
+fn blockLen( block: *const Clang.RecordBlock, comptime field: []const u8 ) u64 {
+	if ( comptime std.mem.startsWith( u8, field, "node_" ) ) return block.nodes_len;
+	if ( comptime std.mem.startsWith( u8, field, "connection_" ) ) return block.connections_len;
+	return block.references_len;
+}
+
+fn blockItems( block: *const Clang.RecordBlock, comptime field: std.builtin.Type.StructField ) field.type {
+	const items: [*]const @typeInfo( field.type ).pointer.child = @ptrCast( &@field( block, field.name ) );
+	return items[0..blockLen( block, field.name )];
+}
+
+pub const Recorder = struct {
+    allocator: std.mem.Allocator,
+	// the fields of ObjFile.Compact
+	node_ids: std.ArrayListUnmanaged( u32 ) = .empty,
+	node_strings: std.ArrayListUnmanaged( u32 ) = .empty,
+	connection_from: std.ArrayListUnmanaged( u32 ) = .empty,
+	connection_to: std.ArrayListUnmanaged( u32 ) = .empty,
+	reference_from: std.ArrayListUnmanaged( u32 ) = .empty,
+	reference_to: std.ArrayListUnmanaged( u32 ) = .empty,
+	reference_kinds: std.ArrayListUnmanaged( u8 ) = .empty,
+    stringarena: StringArena,
+    string_hashes: std.ArrayListUnmanaged(u64) = .empty,
+	linklinks: std.ArrayListUnmanaged( ObjFile.LinkLink ) = .empty,
+	linknames: StringArena,
+	linkname_hashes: std.ArrayListUnmanaged(u64) = .empty,
+	headerrefs: std.ArrayListUnmanaged( ObjFile.HeaderRef ) = .empty,
+	dependencies: std.ArrayListUnmanaged( Fingerprint.Dependency ) = .empty,
+	dependency_paths: std.ArrayListUnmanaged( u8 ) = .empty,
+	stats: ?Clang.ParseStats = null,
+	started: i64, // for the fingerprint, the recorder is created before clang reads anything
+
+	pub fn init(allocator: std.mem.Allocator) Recorder {
+		return .{ .allocator = allocator, .stringarena = StringArena.init(), .linknames = StringArena.init(), .started = Fingerprint.now() };
+	}
+
+	// strings were interned and hashed by the parser, new ones only ever show up once
+	pub fn addBlock(self: *Recorder, block: *const Clang.RecordBlock) void {
+		const links: [*]const ObjFile.LinkLink = @ptrCast(&block.links);
+
+		inline for ( std.meta.fields( ObjFile.Compact ) ) |field| {
+			@field( self, field.name ).appendSlice( self.allocator, blockItems( block, field ) ) catch unreachable;
+		}
+		self.linklinks.appendSlice(self.allocator, links[0..block.links_len]) catch unreachable;
+
+		self.stringarena.addRaw(block.strings[0..block.strings_len]);
+		self.string_hashes.appendSlice(self.allocator, block.string_hashes[0..block.strings_count]) catch unreachable;
+		self.linknames.addRaw(block.linknames[0..block.linknames_len]);
+		self.linkname_hashes.appendSlice(self.allocator, block.linkname_hashes[0..block.linknames_count]) catch unreachable;
+	}
+
+	pub fn addStats(self: *Recorder, stats: *const Clang.ParseStats) void {
+		self.stats = stats.*;
+	}
+
+	pub fn addHeaderReference(self: *Recorder, key: u64, path_hash: u64, owned: bool) void {
+		self.headerrefs.append( self.allocator, .{ .key = key, .path_hash = path_hash, .owned = @intFromBool( owned ) }) catch unreachable;
+	}
+
+	pub fn addDependency(self: *Recorder, path: []const u8, size: u64, mtime: i64, hash: u64) void {
+		self.dependencies.append( self.allocator, .{
+			.size = size,
+			.mtime = mtime,
+			.hash = hash,
+			.path_offset = @intCast( self.dependency_paths.items.len ),
+			.path_len = @intCast( path.len ),
+		}) catch unreachable;
+		self.dependency_paths.appendSlice( self.allocator, path ) catch unreachable;
+	}
+
+	pub fn writeFingerprint(self: *Recorder, path: []const u8, command_hash: u64) !void {
+		try Fingerprint.write( path, command_hash, self.started, self.dependencies.items, self.dependency_paths.items );
+	}
+
+	pub fn write(self: *Recorder, path: []const u8) !void {
+		try ObjFile.write(self.allocator, path, .{
+			.run_id = 0, // TODO: generate this
+			.compact = .{
+				.node_ids = self.node_ids.items,
+				.node_strings = self.node_strings.items,
+				.connection_from = self.connection_from.items,
+				.connection_to = self.connection_to.items,
+				.reference_from = self.reference_from.items,
+				.reference_to = self.reference_to.items,
+				.reference_kinds = self.reference_kinds.items,
+			},
+			.strings = self.stringarena.data(),
+			.string_hashes = self.string_hashes.items,
+			.linklinks = self.linklinks.items,
+			.linknames = self.linknames.data(),
+			.linkname_hashes = self.linkname_hashes.items,
+			.headerrefs = self.headerrefs.items,
+		});
+	}
+
+    pub fn deinit(self: *Recorder) void {
+		inline for ( std.meta.fields( ObjFile.Compact ) ) |field| @field( self, field.name ).deinit( self.allocator );
+        self.stringarena.deinit();
+		self.string_hashes.deinit( self.allocator );
+		self.linklinks.deinit( self.allocator );
+		self.linknames.deinit();
+		self.linkname_hashes.deinit( self.allocator );
+		self.headerrefs.deinit( self.allocator );
+		self.dependencies.deinit( self.allocator );
+		self.dependency_paths.deinit( self.allocator );
+    }
+};
+
+// writes a TU out as the parser hands it over instead of holding a copy of all of it
+// this only bounds the recorder, the parser still keeps the TU's interned strings, its node index and the references it has seen until it is done with the TU
+// every kind of record goes to its own spill file next to the output, write copies them into the object as sections
+// only the header refs and dependencies are kept in memory, there is one of each per included file
+pub const StreamingRecorder = struct {
+	const spill_buffer_size = 64 * 1024;
+	const index_chunk_len = 64 * 1024; // slots of a string index built at once, 1MiB
+
+	// index is scratch space for building the string indexes, it never gets copied into the object
+	// the first ones are the fields of ObjFile.Compact
+	const SpillKind = enum { node_ids, node_strings, connection_from, connection_to, reference_from, reference_to, reference_kinds, strings, string_hashes, linklinks, linknames, linkname_hashes, index };
+
+	const Spill = struct {
+		file: std.fs.File,
+		buffer: std.io.BufferedWriter( spill_buffer_size, std.fs.File.Writer ),
+		bytes: u64 = 0,
+		count: u64 = 0, // in records, for strings the number of strings
+
+		fn write( self: *Spill, bytes: []const u8, count: u64 ) !void {
+			try self.buffer.writer().writeAll( bytes );
+			self.bytes += bytes.len;
+			self.count += count;
+		}
+	};
+
+	allocator: std.mem.Allocator,
+	path: []u8,
+	writer: ObjFile.StreamWriter,
+	spills: std.EnumArray( SpillKind, Spill ),
+	headerrefs: std.ArrayListUnmanaged( ObjFile.HeaderRef ) = .empty,
+	dependencies: std.ArrayListUnmanaged( Fingerprint.Dependency ) = .empty,
+	dependency_paths: std.ArrayListUnmanaged( u8 ) = .empty,
+	stats: ?Clang.ParseStats = null,
+	started: i64, // as in Recorder
+	err: ?anyerror = null, // the first write that failed, the callbacks can't return it so write does
+	finished: bool = false,
+
+	pub fn create( allocator: std.mem.Allocator, path: []const u8 ) !StreamingRecorder {
+		const owned_path = try allocator.dupe( u8, path );
+		errdefer allocator.free( owned_path );
+
+		var writer = try ObjFile.StreamWriter.create( path );
+		errdefer {
+			writer.abort();
+			std.fs.cwd().deleteFile( path ) catch {};
+		}
+
+		var spills: std.EnumArray( SpillKind, Spill ) = undefined;
+		var created: usize = 0;
+		errdefer for ( spills.values[0..created], 0.. ) |*s, i| closeSpill( allocator, path, @enumFromInt( i ), s );
+
+		for ( &spills.values, 0.. ) |*s, i| {
+			const spill_path = try spillPath( allocator, path, @enumFromInt( i ) );
+			defer allocator.free( spill_path );
+			const file = try std.fs.cwd().createFile( spill_path, .{ .read = true, .truncate = true } );
+			s.* = .{ .file = file, .buffer = .{ .unbuffered_writer = file.writer() } };
+			created += 1;
+		}
+
+		return .{ .allocator = allocator, .path = owned_path, .writer = writer, .spills = spills, .started = Fingerprint.now() };
+	}
+
+	fn spillPath( allocator: std.mem.Allocator, path: []const u8, kind: SpillKind ) ![]u8 {
+		return std.fmt.allocPrint( allocator, "{s}.{s}.spill", .{ path, @tagName( kind ) } );
+	}
+
+	fn closeSpill( allocator: std.mem.Allocator, path: []const u8, kind: SpillKind, s: *Spill ) void {
+		s.file.close();
+		const spill_path = spillPath( allocator, path, kind ) catch return;
+		defer allocator.free( spill_path );
+		std.fs.cwd().deleteFile( spill_path ) catch {};
+	}
+
+	fn spill( self: *StreamingRecorder, kind: SpillKind, bytes: []const u8, count: u64 ) void {
+		if ( self.err != null ) return;
+		self.spills.getPtr( kind ).write( bytes, count ) catch |err| {
+			self.err = err;
+		};
+	}
+
+	pub fn addBlock( self: *StreamingRecorder, block: *const Clang.RecordBlock ) void {
+		const links: [*]const ObjFile.LinkLink = @ptrCast( &block.links );
+
+		inline for ( std.meta.fields( ObjFile.Compact ) ) |field| {
+			const items = blockItems( block, field );
+			self.spill( @field( SpillKind, field.name ), std.mem.sliceAsBytes( items ), items.len );
+		}
+		self.spill( .linklinks, std.mem.sliceAsBytes( links[0..block.links_len] ), block.links_len );
+
+		self.spill( .strings, block.strings[0..block.strings_len], block.strings_count );
+		self.spill( .string_hashes, std.mem.sliceAsBytes( block.string_hashes[0..block.strings_count] ), block.strings_count );
+		self.spill( .linknames, block.linknames[0..block.linknames_len], block.linknames_count );
+		self.spill( .linkname_hashes, std.mem.sliceAsBytes( block.linkname_hashes[0..block.linknames_count] ), block.linknames_count );
+	}
+
+	pub fn addStats( self: *StreamingRecorder, stats: *const Clang.ParseStats ) void {
+		self.stats = stats.*;
+	}
+
+	pub fn addHeaderReference( self: *StreamingRecorder, key: u64, path_hash: u64, owned: bool ) void {
+		self.headerrefs.append( self.allocator, .{ .key = key, .path_hash = path_hash, .owned = @intFromBool( owned ) } ) catch unreachable;
+	}
+
+	pub fn addDependency( self: *StreamingRecorder, path: []const u8, size: u64, mtime: i64, hash: u64 ) void {
+		self.dependencies.append( self.allocator, .{
+			.size = size,
+			.mtime = mtime,
+			.hash = hash,
+			.path_offset = @intCast( self.dependency_paths.items.len ),
+			.path_len = @intCast( path.len ),
+		}) catch unreachable;
+		self.dependency_paths.appendSlice( self.allocator, path ) catch unreachable;
+	}
+
+	pub fn writeFingerprint( self: *StreamingRecorder, path: []const u8, command_hash: u64 ) !void {
+		try Fingerprint.write( path, command_hash, self.started, self.dependencies.items, self.dependency_paths.items );
+	}
+
+	// finishes the object it was created for, path is only there to match Recorder
+	pub fn write( self: *StreamingRecorder, path: []const u8 ) !void {
+		std.debug.assert( std.mem.eql( u8, path, self.path ) );
+		if ( self.err ) |err| return err;
+		for ( &self.spills.values ) |*s| try s.buffer.flush();
+
+		inline for ( std.meta.fields( ObjFile.Compact ) ) |field| {
+			try self.copySpill( @field( SpillKind, field.name ), @field( ObjFile.SectionKind, field.name ) );
+		}
+		try self.copySpill( .strings, .strings );
+		try self.copySpill( .string_hashes, .string_hashes );
+		try self.writeIndex( .strings, .string_hashes, .string_index );
+		try self.copySpill( .linklinks, .linklinks );
+		try self.copySpill( .linknames, .linknames );
+		try self.copySpill( .linkname_hashes, .linkname_hashes );
+		try self.writeIndex( .linknames, .linkname_hashes, .linkname_index );
+		try self.writer.writeSection( .headerrefs, std.mem.sliceAsBytes( self.headerrefs.items ), self.headerrefs.items.len );
+
+		try self.writer.finish( 0 ); // TODO: generate the run id
+		self.finished = true;
+	}
+
+	fn copySpill( self: *StreamingRecorder, kind: SpillKind, section: ObjFile.SectionKind ) !void {
+		const s = self.spills.getPtr( kind );
+		try self.writer.beginSection( section );
+		try self.writer.writeFile( s.file, s.bytes );
+		self.writer.endSection( s.count );
+	}
+
+	fn writeIndex( self: *StreamingRecorder, text: SpillKind, hashes: SpillKind, section: ObjFile.SectionKind ) !void {
+		const source = IndexSource{ .text = self.spills.get( text ).file, .hashes = self.spills.get( hashes ).file, .count = self.spills.get( hashes ).count };
+		try self.writer.writeStringIndexChunked( self.allocator, section, source.count, index_chunk_len, source, self.spills.get( .index ).file );
+	}
+
+	// reads the entries of a string table back from its spills
+	const IndexSource = struct {
+		text: std.fs.File,
+		hashes: std.fs.File,
+		count: u64,
+
+		const Iterator = struct {
+			text: std.io.BufferedReader( spill_buffer_size, std.fs.File.Reader ),
+			hashes: std.io.BufferedReader( spill_buffer_size, std.fs.File.Reader ),
+			remaining: u64,
+			offset: u64 = 0,
+
+			pub fn next( self: *Iterator ) !?ObjFile.IndexEntry {
+				if ( self.remaining == 0 ) return null;
+				self.remaining -= 1;
+
+				const hash = try self.hashes.reader().readInt( u64, builtin.cpu.arch.endian() );
+				// only the length of the string is needed
+				var counter = std.io.countingWriter( std.io.null_writer );
+				try self.text.reader().streamUntilDelimiter( counter.writer(), 0, null );
+
+				const entry = ObjFile.IndexEntry{ .hash = hash, .offset = @intCast( self.offset ), .len = @intCast( counter.bytes_written ) };
+				self.offset += counter.bytes_written + 1;
+				return entry;
+			}
+		};
+
+		pub fn entries( self: IndexSource ) !Iterator {
+			try self.text.seekTo( 0 );
+			try self.hashes.seekTo( 0 );
+			return .{ .text = .{ .unbuffered_reader = self.text.reader() }, .hashes = .{ .unbuffered_reader = self.hashes.reader() }, .remaining = self.count };
+		}
+	};
+
+	pub fn deinit( self: *StreamingRecorder ) void {
+		for ( &self.spills.values, 0.. ) |*s, i| closeSpill( self.allocator, self.path, @enumFromInt( i ), s );
+		if ( !self.finished ) {
+			// a half written object would only get rejected by readers
+			self.writer.abort();
+			std.fs.cwd().deleteFile( self.path ) catch {};
+		}
+		self.allocator.free( self.path );
+		self.headerrefs.deinit( self.allocator );
+		self.dependencies.deinit( self.allocator );
+		self.dependency_paths.deinit( self.allocator );
+	}
+};
+
+
+test "streaming strings" {
+	const allocator = std.testing.allocator;
+	var tmp = std.testing.tmpDir( .{} );
+	defer tmp.cleanup();
+	const path = try std.fmt.allocPrint( allocator, ".zig-cache/tmp/{s}/tu.cetobj", .{ tmp.sub_path } );
+	defer allocator.free( path );
+
+	const block = try allocator.create( Clang.RecordBlock );
+	defer allocator.destroy( block );
+	block.nodes_len = 0;
+	block.connections_len = 0;
+	block.links_len = 0;
+	block.references_len = 0;
+	block.linknames = "";
+	block.linkname_hashes = &[_]u64{};
+	block.linknames_len = 0;
+	block.linknames_count = 0;
+
+	// the strings of a TU come over in more than one block
+	{
+		var recorder = try StreamingRecorder.create( allocator, path );
+		defer recorder.deinit();
+
+		const first = [_]u64{ 11, 22 };
+		block.strings = "alpha\x00beta\x00";
+		block.string_hashes = &first;
+		block.strings_len = 11;
+		block.strings_count = 2;
+		recorder.addBlock( block );
+
+		const second = [_]u64{ 33 };
+		block.strings = "gamma\x00";
+		block.string_hashes = &second;
+		block.strings_len = 6;
+		block.strings_count = 1;
+		recorder.addBlock( block );
+
+		try recorder.write( path );
+	}
+
+	var reader = try ObjFile.Reader.open( path );
+	defer reader.close();
+	const strings = reader.strings();
+	try std.testing.expectEqualStrings( "alpha", strings.get( 11 ).? );
+	try std.testing.expectEqualStrings( "beta", strings.get( 22 ).? );
+	try std.testing.expectEqualStrings( "gamma", strings.get( 33 ).? );
+	try std.testing.expectEqual( null, strings.get( 44 ) );
+	try std.testing.expectEqual( 0, reader.compact().node_ids.len );
+}
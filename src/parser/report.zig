@@ -0,0 +1,216 @@
+const std = @import("std");
+const Clang = @import("clang.zig");
+const Schedule = @import("schedule.zig");
+
+// timings and counters of a run, written as a json report and a chrome trace (chrome://tracing, perfetto)
+// every time is in nanoseconds, starts are from the start of the run
+
+
+// a TU's ParseStats plus what happened to it once the parser was done
+pub const TuStats = struct {
+	load_ns: u64 = 0,
+	traverse_ns: u64 = 0,
+	link_names_ns: u64 = 0,
+	finish_ns: u64 = 0,
+	dependencies_ns: u64 = 0,
+	write_ns: u64 = 0,
+	nodes: u64 = 0,
+	connections: u64 = 0,
+	references: u64 = 0,
+	links: u64 = 0,
+	strings: u64 = 0,
+	string_bytes: u64 = 0,
+	arena_committed: u64 = 0,
+	bytes_written: u64 = 0,
+
+	pub fn fromParse( stats: Clang.ParseStats ) TuStats
+	{
+		var result: TuStats = .{};
+		inline for ( std.meta.fields( Clang.ParseStats ) ) |field| @field( result, field.name ) = @field( stats, field.name );
+		return result;
+	}
+
+	// in the order they happen
+	const phases = .{ "load", "traverse", "link_names", "finish", "dependencies", "write" };
+};
+
+// where stats for an object are written by cet-cl, caller owns the returned path
+pub fn statsPath( allocator: std.mem.Allocator, obj_path: []const u8 ) ![]u8
+{
+	return std.fmt.allocPrint( allocator, "{s}.stats.json", .{ obj_path } );
+}
+
+pub fn writeStats( path: []const u8, stats: TuStats ) !void
+{
+	const file = try std.fs.cwd().createFile( path, .{} );
+	defer file.close();
+	var buffer = std.io.bufferedWriter( file.writer() );
+	try std.json.stringify( stats, .{}, buffer.writer() );
+	try buffer.flush();
+}
+
+pub fn readStats( allocator: std.mem.Allocator, path: []const u8 ) !TuStats
+{
+	const text = try std.fs.cwd().readFileAlloc( allocator, path, 1 << 20 );
+	defer allocator.free( text );
+	const parsed = try std.json.parseFromSlice( TuStats, allocator, text, .{ .ignore_unknown_fields = true } );
+	defer parsed.deinit();
+	return parsed.value;
+}
+
+
+fn percent( hits: u64, misses: u64 ) u64
+{
+	const total = hits + misses;
+	return if ( total == 0 ) 0 else hits * 100 / total;
+}
+
+// one line for what a session's file cache saved
+pub fn printFileStats( writer: anytype, stats: Clang.FileStats ) !void
+{
+	try writer.print( "file cache: {}% of {} stats and {}% of {} opens hit, read {}MB from disk, served {}MB from memory and evicted {}MB\n", .{
+		percent( stats.stat_hits, stats.stat_misses ), stats.stat_hits + stats.stat_misses,
+		percent( stats.read_hits, stats.read_misses ), stats.read_hits + stats.read_misses,
+		stats.bytes_read / ( 1024 * 1024 ), stats.bytes_served / ( 1024 * 1024 ), stats.bytes_evicted / ( 1024 * 1024 ),
+	} );
+}
+
+
+// complete events only, one per span
+pub const TraceWriter = struct {
+	file: std.fs.File,
+	buffer: std.io.BufferedWriter( 4096, std.fs.File.Writer ),
+	first: bool = true,
+
+	pub fn create( path: []const u8 ) !TraceWriter
+	{
+		const file = try std.fs.cwd().createFile( path, .{} );
+		var self = TraceWriter{ .file = file, .buffer = std.io.bufferedWriter( file.writer() ) };
+		errdefer file.close();
+		try self.buffer.writer().writeAll( "{\"traceEvents\":[\n" );
+		return self;
+	}
+
+	// tid is whatever the span ran on, a thread or a process slot
+	pub fn event( self: *TraceWriter, name: []const u8, tid: u64, start_ns: u64, dur_ns: u64, args: anytype ) !void
+	{
+		const writer = self.buffer.writer();
+		if ( !self.first ) try writer.writeAll( ",\n" );
+		self.first = false;
+		try std.json.stringify( .{
+			.name = name,
+			.ph = "X",
+			.pid = 1,
+			.tid = tid,
+			.ts = @as( f64, @floatFromInt( start_ns ) ) / std.time.ns_per_us,
+			.dur = @as( f64, @floatFromInt( dur_ns ) ) / std.time.ns_per_us,
+			.args = args,
+		}, .{}, writer );
+	}
+
+	pub fn finish( self: *TraceWriter ) !void
+	{
+		try self.buffer.writer().writeAll( "\n],\"displayTimeUnit\":\"ms\"}\n" );
+		try self.buffer.flush();
+	}
+
+	pub fn close( self: *TraceWriter ) void
+	{
+		self.file.close();
+	}
+};
+
+
+// every TU of a run, added to from any thread
+pub const Report = struct {
+	pub const Entry = struct {
+		file: []const u8,
+		worker: u64,
+		start_ns: u64,
+		total_ns: u64,
+		ok: bool,
+		stats: ?TuStats, // null if the TU failed or its stats couldn't be read
+	};
+
+	allocator: std.mem.Allocator,
+	start: std.time.Instant,
+	lock: std.Thread.Mutex = .{},
+	entries: std.ArrayListUnmanaged( Entry ) = .empty,
+	schedule: ?Schedule.Estimate = null,
+	files: ?Clang.FileStats = null, // only for TUs parsed in process, cet-cl processes each have their own cache
+
+	pub fn init( allocator: std.mem.Allocator ) !Report
+	{
+		return .{ .allocator = allocator, .start = try std.time.Instant.now() };
+	}
+
+	pub fn deinit( self: *Report ) void
+	{
+		for ( self.entries.items ) |entry| self.allocator.free( entry.file );
+		self.entries.deinit( self.allocator );
+	}
+
+	pub fn since( self: *const Report, instant: std.time.Instant ) u64
+	{
+		return instant.since( self.start );
+	}
+
+	pub fn now( self: *const Report ) u64
+	{
+		const instant = std.time.Instant.now() catch return 0;
+		return self.since( instant );
+	}
+
+	pub fn add( self: *Report, entry: Entry ) !void
+	{
+		const file = try self.allocator.dupe( u8, entry.file );
+		errdefer self.allocator.free( file );
+
+		self.lock.lock();
+		defer self.lock.unlock();
+		var copy = entry;
+		copy.file = file;
+		try self.entries.append( self.allocator, copy );
+	}
+
+	fn slowestFirst( _: void, a: Entry, b: Entry ) bool
+	{
+		return a.total_ns > b.total_ns;
+	}
+
+	// slowest TU first
+	pub fn writeJson( self: *Report, path: []const u8 ) !void
+	{
+		std.sort.pdq( Entry, self.entries.items, {}, slowestFirst );
+
+		const file = try std.fs.cwd().createFile( path, .{} );
+		defer file.close();
+		var buffer = std.io.bufferedWriter( file.writer() );
+		try std.json.stringify( .{ .total_ns = self.now(), .schedule = self.schedule, .files = self.files, .tus = self.entries.items }, .{ .whitespace = .indent_1 }, buffer.writer() );
+		try buffer.flush();
+	}
+
+	// a span per TU with its phases under it, the phases are laid end to end from the TU's start
+	// for TUs parsed by cet-cl the start is when the process was spawned, so the phases are off by the process start up
+	pub fn writeTrace( self: *Report, path: []const u8 ) !void
+	{
+		var trace = try TraceWriter.create( path );
+		defer trace.close();
+
+		for ( self.entries.items ) |entry|
+		{
+			try trace.event( std.fs.path.basename( entry.file ), entry.worker, entry.start_ns, entry.total_ns, .{ .file = entry.file, .ok = entry.ok } );
+			const stats = entry.stats orelse continue;
+
+			var t = entry.start_ns;
+			inline for ( TuStats.phases ) |phase|
+			{
+				const ns = @field( stats, phase ++ "_ns" );
+				try trace.event( phase, entry.worker, t, ns, .{} );
+				t += ns;
+			}
+		}
+
+		try trace.finish();
+	}
+};
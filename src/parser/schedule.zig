@@ -0,0 +1,427 @@
+const std = @import("std");
+const Clang = @import("clang.zig");
+const Fingerprint = @import("fingerprint.zig");
+
+// the order the driver starts commands in, longest first (LPT) so a huge TU that happens to come last in the
+// database doesn't start last and leave every other worker idle at the end of the run
+// a command's cost is how long it took last run, from the history the driver writes after every run,
+// commands without history get a guess from the size of their main file and how many includes it has
+
+
+// what each command took the last time it ran, by the path of its cetobj
+pub const History = struct {
+	pub const Entry = struct {
+		ns: u64,
+		memory: u64 = 0, // peak memory of its cet-cl, 0 if unknown
+	};
+
+	const FileEntry = struct {
+		file: []const u8,
+		ns: u64,
+		memory: u64 = 0,
+	};
+
+	allocator: std.mem.Allocator,
+	entries: std.StringHashMapUnmanaged( Entry ) = .empty, // keys are owned
+
+	pub fn init( allocator: std.mem.Allocator ) History
+	{
+		return .{ .allocator = allocator };
+	}
+
+	// a missing or unreadable file is an empty history, it is only ever a guess
+	pub fn load( allocator: std.mem.Allocator, path: []const u8 ) !History
+	{
+		var self = History.init( allocator );
+		errdefer self.deinit();
+
+		const text = std.fs.cwd().readFileAlloc( allocator, path, 1 << 30 ) catch return self;
+		defer allocator.free( text );
+		const parsed = std.json.parseFromSlice( []FileEntry, allocator, text, .{ .ignore_unknown_fields = true } ) catch return self;
+		defer parsed.deinit();
+
+		try self.entries.ensureTotalCapacity( allocator, @intCast( parsed.value.len ) );
+		for ( parsed.value ) |entry| try self.putPath( entry.file, .{ .ns = entry.ns, .memory = entry.memory } );
+		return self;
+	}
+
+	pub fn deinit( self: *History ) void
+	{
+		var it = self.entries.keyIterator();
+		while ( it.next() ) |key| self.allocator.free( key.* );
+		self.entries.deinit( self.allocator );
+	}
+
+	pub fn get( self: *const History, cmd: Clang.CompileCommand ) !?Entry
+	{
+		const path = try Fingerprint.objectPath( self.allocator, cmd );
+		defer self.allocator.free( path );
+		return self.entries.get( path );
+	}
+
+	// a memory of 0 keeps the last one known, in-process runs have no memory per command
+	pub fn put( self: *History, cmd: Clang.CompileCommand, entry: Entry ) !void
+	{
+		const path = try Fingerprint.objectPath( self.allocator, cmd );
+		defer self.allocator.free( path );
+		try self.putPath( path, entry );
+	}
+
+	fn putPath( self: *History, path: []const u8, entry: Entry ) !void
+	{
+		const result = try self.entries.getOrPut( self.allocator, path );
+		if ( !result.found_existing ) {
+			result.key_ptr.* = self.allocator.dupe( u8, path ) catch |err| {
+				self.entries.removeByPtr( result.key_ptr );
+				return err;
+			};
+		}
+		const memory = if ( entry.memory == 0 and result.found_existing ) result.value_ptr.memory else entry.memory;
+		result.value_ptr.* = .{ .ns = entry.ns, .memory = memory };
+	}
+
+	pub fn write( self: *const History, path: []const u8 ) !void
+	{
+		const file = try std.fs.cwd().createFile( path, .{} );
+		defer file.close();
+		var buffer = std.io.bufferedWriter( file.writer() );
+		const writer = buffer.writer();
+
+		try writer.writeAll( "[\n" );
+		var it = self.entries.iterator();
+		var first = true;
+		while ( it.next() ) |entry|
+		{
+			if ( !first ) try writer.writeAll( ",\n" );
+			first = false;
+			try std.json.stringify( FileEntry{ .file = entry.key_ptr.*, .ns = entry.value_ptr.ns, .memory = entry.value_ptr.memory }, .{}, writer );
+		}
+		try writer.writeAll( "\n]\n" );
+		try buffer.flush();
+	}
+};
+
+
+// a guess at what each include brings in, only the ratio to the main file's size matters
+const include_bytes: u64 = 64 * 1024;
+// a guess at the peak memory of a TU when none has run yet
+const default_memory: u64 = 512 * 1024 * 1024;
+
+// bytes of the main file plus include_bytes per #include in it
+fn guessCost( allocator: std.mem.Allocator, cmd: Clang.CompileCommand ) u64
+{
+	const path = std.fs.path.resolve( allocator, &.{ std.mem.span( cmd.directory ), std.mem.span( cmd.filename ) } ) catch return include_bytes;
+	defer allocator.free( path );
+	const file = std.fs.cwd().openFile( path, .{} ) catch return include_bytes;
+	defer file.close();
+
+	var buffer = std.io.bufferedReader( file.reader() );
+	var size: u64 = 0;
+	var includes: u64 = 0;
+	var line_buf: [4096]u8 = undefined;
+	while ( true )
+	{
+		var stream = std.io.fixedBufferStream( &line_buf );
+		buffer.reader().streamUntilDelimiter( stream.writer(), '\n', null ) catch |err| switch ( err ) {
+			error.EndOfStream => if ( stream.pos == 0 ) break,
+			error.NoSpaceLeft => {}, // a long line is still counted, the rest of it is skipped as the next lines
+			else => break,
+		};
+		const line = stream.getWritten();
+		size += line.len + 1;
+
+		const trimmed = std.mem.trimLeft( u8, line, " \t" );
+		if ( trimmed.len == 0 or trimmed[0] != '#' ) continue;
+		if ( std.mem.startsWith( u8, std.mem.trimLeft( u8, trimmed[1..], " \t" ), "include" ) ) includes += 1;
+	}
+	return size + includes * include_bytes;
+}
+
+
+pub const Plan = struct {
+	allocator: std.mem.Allocator,
+	order: []u32, // indices of the commands to run, in the order to start them
+	costs: []u64, // by position in order
+	memory: []u64, // by position in order, bytes
+	timed: bool, // costs are nanoseconds, otherwise there was no history to scale the guesses with
+
+	pub fn deinit( self: Plan ) void
+	{
+		self.allocator.free( self.order );
+		self.allocator.free( self.costs );
+		self.allocator.free( self.memory );
+	}
+};
+
+// pending are command indices in database order, fifo keeps that order instead of longest first
+pub fn plan( allocator: std.mem.Allocator, commands: []const Clang.CompileCommand, pending: []const u32, history: *const History, fifo: bool ) !Plan
+{
+	const order = try allocator.dupe( u32, pending );
+	errdefer allocator.free( order );
+	const costs = try allocator.alloc( u64, pending.len );
+	errdefer allocator.free( costs );
+	const memory = try allocator.alloc( u64, pending.len );
+	errdefer allocator.free( memory );
+
+	const known = try allocator.alloc( ?History.Entry, pending.len );
+	defer allocator.free( known );
+	var missing: usize = 0;
+	var known_memory: u64 = 0;
+	var known_memory_count: u64 = 0;
+	for ( pending, known ) |index, *entry|
+	{
+		entry.* = try history.get( commands[index] );
+		if ( entry.* ) |e| {
+			if ( e.memory != 0 ) {
+				known_memory += e.memory;
+				known_memory_count += 1;
+			}
+		} else missing += 1;
+	}
+
+	// the guesses are turned into nanoseconds with the ratio of the commands that have both
+	var guesses: []u64 = &.{};
+	defer allocator.free( guesses );
+	var ns_per_byte: f64 = 1;
+	if ( missing > 0 )
+	{
+		guesses = try allocator.alloc( u64, pending.len );
+		var ns_total: u64 = 0;
+		var guess_total: u64 = 0;
+		for ( pending, known, guesses ) |index, entry, *guess|
+		{
+			guess.* = guessCost( allocator, commands[index] );
+			if ( entry ) |e| {
+				ns_total += e.ns;
+				guess_total += guess.*;
+			}
+		}
+		if ( guess_total > 0 ) ns_per_byte = @as( f64, @floatFromInt( ns_total ) ) / @as( f64, @floatFromInt( guess_total ) );
+	}
+
+	const average_memory = if ( known_memory_count > 0 ) known_memory / known_memory_count else default_memory;
+	for ( known, costs, memory, 0.. ) |entry, *cost, *mem, i|
+	{
+		if ( entry ) |e| {
+			cost.* = e.ns;
+			mem.* = if ( e.memory != 0 ) e.memory else average_memory;
+		} else {
+			cost.* = @intFromFloat( @as( f64, @floatFromInt( guesses[i] ) ) * ns_per_byte );
+			mem.* = average_memory;
+		}
+	}
+
+	if ( !fifo )
+	{
+		// stable so commands of equal cost stay in database order
+		const positions = try allocator.alloc( usize, pending.len );
+		defer allocator.free( positions );
+		for ( positions, 0.. ) |*pos, i| pos.* = i;
+		std.sort.block( usize, positions, @as( []const u64, costs ), struct {
+			fn lessThan( c: []const u64, a: usize, b: usize ) bool { return c[a] > c[b]; }
+		}.lessThan );
+
+		const old_costs = try allocator.dupe( u64, costs );
+		defer allocator.free( old_costs );
+		const old_memory = try allocator.dupe( u64, memory );
+		defer allocator.free( old_memory );
+		for ( positions, order, costs, memory ) |pos, *index, *cost, *mem|
+		{
+			index.* = pending[pos];
+			cost.* = old_costs[pos];
+			mem.* = old_memory[pos];
+		}
+	}
+
+	return .{ .allocator = allocator, .order = order, .costs = costs, .memory = memory, .timed = missing < pending.len };
+}
+
+
+// when the last command finishes if each one goes to the worker that frees up first, in the given order
+pub fn makespan( allocator: std.mem.Allocator, costs: []const u64, workers: usize ) !u64
+{
+	const Queue = std.PriorityQueue( u64, void, struct {
+		fn order( _: void, a: u64, b: u64 ) std.math.Order { return std.math.order( a, b ); }
+	}.order );
+
+	// when each worker is free again
+	var free_at = Queue.init( allocator, {} );
+	defer free_at.deinit();
+	for ( 0..@min( @max( workers, 1 ), costs.len ) ) |_| try free_at.add( 0 );
+
+	var end: u64 = 0;
+	for ( costs ) |cost|
+	{
+		const finish = free_at.remove() + cost;
+		end = @max( end, finish );
+		try free_at.add( finish );
+	}
+	return end;
+}
+
+// the plan's makespan against starting the same commands in database order
+pub const Estimate = struct {
+	jobs: usize,
+	timed: bool, // the times are nanoseconds, otherwise they are only comparable with each other
+	planned_ns: u64,
+	fifo_ns: u64,
+	lower_bound_ns: u64, // no order can do better than the longest command or the work split evenly
+
+	pub fn print( self: Estimate, writer: anytype ) !void
+	{
+		if ( self.fifo_ns == 0 ) return;
+		const planned = @as( f64, @floatFromInt( self.planned_ns ) ) * 100 / @as( f64, @floatFromInt( self.fifo_ns ) );
+		const bound = @as( f64, @floatFromInt( self.lower_bound_ns ) ) * 100 / @as( f64, @floatFromInt( self.fifo_ns ) );
+		if ( self.timed ) {
+			try writer.print( "estimated makespan on {} jobs: {}ms, {}ms in database order, at best {}ms\n", .{
+				self.jobs, self.planned_ns / std.time.ns_per_ms, self.fifo_ns / std.time.ns_per_ms, self.lower_bound_ns / std.time.ns_per_ms } );
+		} else {
+			try writer.print( "estimated makespan on {} jobs from file sizes: {d:.0}% of database order, at best {d:.0}%\n", .{ self.jobs, planned, bound } );
+		}
+	}
+};
+
+pub fn estimate( allocator: std.mem.Allocator, p: Plan, jobs: usize ) !Estimate
+{
+	// the plan's costs back in database order
+	const fifo_costs = try allocator.dupe( u64, p.costs );
+	defer allocator.free( fifo_costs );
+	const positions = try allocator.alloc( usize, p.order.len );
+	defer allocator.free( positions );
+	for ( positions, 0.. ) |*pos, i| pos.* = i;
+	std.sort.pdq( usize, positions, @as( []const u32, p.order ), struct {
+		fn lessThan( order: []const u32, a: usize, b: usize ) bool { return order[a] < order[b]; }
+	}.lessThan );
+	for ( positions, fifo_costs ) |pos, *cost| cost.* = p.costs[pos];
+
+	var total: u64 = 0;
+	var longest: u64 = 0;
+	for ( p.costs ) |cost| {
+		total += cost;
+		longest = @max( longest, cost );
+	}
+
+	return .{
+		.jobs = jobs,
+		.timed = p.timed,
+		.planned_ns = try makespan( allocator, p.costs, jobs ),
+		.fifo_ns = try makespan( allocator, fifo_costs, jobs ),
+		.lower_bound_ns = @max( longest, if ( jobs > 0 ) std.math.divCeil( u64, total, jobs ) catch total else total ),
+	};
+}
+
+
+// hands out a plan's commands in order, passing over any that would take the commands running past the memory budget
+// a command that doesn't fit on its own still runs once nothing else is
+pub const Queue = struct {
+	allocator: std.mem.Allocator,
+	order: []const u32,
+	memory: []const u64,
+	budget: u64,
+	taken: std.DynamicBitSetUnmanaged, // by position in order
+	head: usize = 0, // every position before it is taken
+	in_use: u64 = 0,
+	running: usize = 0,
+	positions: std.AutoHashMapUnmanaged( u32, usize ) = .empty, // of running commands, to release them by index
+
+	// order and memory are a plan's
+	pub fn init( allocator: std.mem.Allocator, order: []const u32, memory: []const u64, budget: u64 ) !Queue
+	{
+		return .{
+			.allocator = allocator,
+			.order = order,
+			.memory = memory,
+			.budget = budget,
+			.taken = try std.DynamicBitSetUnmanaged.initEmpty( allocator, order.len ),
+		};
+	}
+
+	pub fn deinit( self: *Queue ) void
+	{
+		self.taken.deinit( self.allocator );
+		self.positions.deinit( self.allocator );
+	}
+
+	pub fn empty( self: *const Queue ) bool
+	{
+		return self.head == self.order.len;
+	}
+
+	// null if every command was handed out or none fit until something is released
+	pub fn next( self: *Queue ) !?u32
+	{
+		var pos = self.head;
+		while ( pos < self.order.len ) : ( pos += 1 )
+		{
+			if ( self.taken.isSet( pos ) ) continue;
+			if ( self.running > 0 and self.in_use + self.memory[pos] > self.budget ) continue;
+
+			try self.positions.put( self.allocator, self.order[pos], pos );
+			self.taken.set( pos );
+			while ( self.head < self.order.len and self.taken.isSet( self.head ) ) self.head += 1;
+			self.in_use += self.memory[pos];
+			self.running += 1;
+			return self.order[pos];
+		}
+		return null;
+	}
+
+	pub fn release( self: *Queue, index: u32 ) void
+	{
+		const entry = self.positions.fetchRemove( index ) orelse return;
+		self.in_use -= self.memory[entry.value];
+		self.running -= 1;
+	}
+};
+
+
+// ParseSession.parseCommands splits the positions into an even contiguous range per thread and each thread works through
+// its own range front to back, dealing the order out like cards gives every thread its share of the big commands
+pub fn deal( allocator: std.mem.Allocator, order: []const u32, threads: usize ) ![]u64
+{
+	const result = try allocator.alloc( u64, order.len );
+	errdefer allocator.free( result );
+	if ( order.len == 0 ) return result;
+
+	const fill = try allocator.alloc( usize, threads );
+	defer allocator.free( fill );
+	for ( fill, 0.. ) |*f, t| f.* = order.len * t / threads;
+
+	var t: usize = 0;
+	for ( order ) |index|
+	{
+		while ( fill[t] == order.len * ( t + 1 ) / threads ) t = ( t + 1 ) % threads;
+		result[fill[t]] = index;
+		fill[t] += 1;
+		t = ( t + 1 ) % threads;
+	}
+	return result;
+}
+
+
+test "longest first" {
+	const allocator = std.testing.allocator;
+
+	// one big command last in the database
+	const costs = [_]u64{ 1, 1, 1, 1, 1, 1, 6 };
+	try std.testing.expectEqual( 9, try makespan( allocator, &costs, 2 ) );
+	const sorted = [_]u64{ 6, 1, 1, 1, 1, 1, 1 };
+	try std.testing.expectEqual( 6, try makespan( allocator, &sorted, 2 ) );
+
+	const order = [_]u32{ 10, 11, 12, 13, 14, 15, 16 };
+	const dealt = try deal( allocator, &order, 3 );
+	defer allocator.free( dealt );
+	// ranges of 2, 2 and 3, each gets the next biggest in turn until it is full
+	try std.testing.expectEqualSlices( u64, &.{ 10, 13, 11, 14, 12, 15, 16 }, dealt );
+
+	const memory = [_]u64{ 6, 5, 1, 1 };
+	var queue = try Queue.init( allocator, order[0..4], &memory, 8 );
+	defer queue.deinit();
+	try std.testing.expectEqual( 10, try queue.next() );
+	try std.testing.expectEqual( 12, try queue.next() ); // 11 doesn't fit next to 10
+	try std.testing.expectEqual( 13, try queue.next() );
+	try std.testing.expectEqual( null, try queue.next() );
+	queue.release( 10 );
+	try std.testing.expectEqual( 11, try queue.next() );
+	try std.testing.expect( queue.empty() );
+}
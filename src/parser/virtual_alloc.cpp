@@ -1,5 +1,21 @@
-#include <Windows.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "virtual_alloc.h"
+
+static std::atomic<uint64_t> g_mem_flags{ 0 };
+
+void OS_MemSetFlags( uint64_t flags )
+{
+	g_mem_flags.store( flags, std::memory_order_relaxed );
+}
+
+#ifdef _WIN32
+
+#include <Windows.h>
+
+// large pages on windows need SeLockMemoryPrivilege and have to be committed up front, both flags are ignored
 
 void* OS_MemReserve( size_t size )
 {
@@ -11,7 +27,59 @@ void* OS_MemCommit( void* ptr, size_t size )
 	return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
 }
 
-void OS_MemFree( void* ptr )
+void OS_MemFree( void* ptr, size_t size )
 {
 	VirtualFree(ptr, 0, MEM_RELEASE);
-}
\ No newline at end of file
+}
+
+#else
+
+#include <sys/mman.h>
+
+// reserving maps the range with no access and no backing, committing makes pages writable
+// the kernel still only hands out a page when it is first touched unless OS_MEM_PREFAULT is set
+
+void* OS_MemReserve( size_t size )
+{
+	void* ptr = mmap( NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if ( ptr == MAP_FAILED ) return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if ( g_mem_flags.load( std::memory_order_relaxed ) & OS_MEM_HUGE_PAGES ) madvise( ptr, size, MADV_HUGEPAGE );
+#endif
+
+	return ptr;
+}
+
+// MADV_POPULATE_WRITE is linux 5.14, older headers don't have it and older kernels fail it
+#if defined( __linux__ ) && !defined( MADV_POPULATE_WRITE )
+#define MADV_POPULATE_WRITE 23
+#endif
+
+void* OS_MemCommit( void* ptr, size_t size )
+{
+	uint64_t flags = g_mem_flags.load( std::memory_order_relaxed );
+
+	if ( mprotect( ptr, size, PROT_READ | PROT_WRITE ) != 0 ) return NULL;
+	if ( !( flags & OS_MEM_PREFAULT ) ) return ptr;
+
+	// the range has to be marked before anything faults in, pages faulted in before madvise stay small
+#ifdef MADV_HUGEPAGE
+	if ( flags & OS_MEM_HUGE_PAGES ) madvise( ptr, size, MADV_HUGEPAGE );
+#endif
+
+#ifdef MADV_POPULATE_WRITE
+	if ( madvise( ptr, size, MADV_POPULATE_WRITE ) == 0 ) return ptr;
+#endif
+
+	// a write per page, the range was never touched so the zeros are already there
+	for ( size_t offset = 0; offset < size; offset += 4096 ) ((volatile char*)ptr)[offset] = 0;
+	return ptr;
+}
+
+void OS_MemFree( void* ptr, size_t size )
+{
+	munmap( ptr, size );
+}
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// reserve address space up front and commit it as it is used
+// windows uses VirtualAlloc, everything else mmap and mprotect
+
+enum OS_MemFlags {
+	// ask for transparent huge pages on reserved ranges
+	OS_MEM_HUGE_PAGES = 1 << 0,
+	// fault committed pages in when they are committed instead of on first touch
+	OS_MEM_PREFAULT = 1 << 1,
+};
+
+// applies to every range reserved or committed after the call
+void OS_MemSetFlags( uint64_t flags );
+
+void* OS_MemReserve( size_t size );
+void* OS_MemCommit( void* ptr, size_t size );
+// size is the size that was reserved
+void OS_MemFree( void* ptr, size_t size );
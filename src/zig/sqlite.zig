@@ -1,4 +1,6 @@
 
+const std = @import("std");
+
 pub const r = @cImport({
 	@cInclude("external/sqlite/sqlite3.h");
 });
@@ -39,62 +41,75 @@ pub const Result = enum(c_int) {
 };
 
 
-fn makeCmdStmt() type
-{
-	const s = struct {
-		stmt: Stmt,
-		pub fn exec() void {
+pub const Error = error{ SqliteError };
 
-		}
-	};
-
-	_ = s;
+fn check( db: ?*r.sqlite3, rc: c_int ) Error!void
+{
+	if ( rc == r.SQLITE_OK ) return;
+	if ( db ) |handle| {
+		std.log.err( "sqlite: {s}", .{ r.sqlite3_errmsg( handle ) } );
+	} else {
+		std.log.err( "sqlite: {s}", .{ r.sqlite3_errstr( rc ) } );
+	}
+	return error.SqliteError;
 }
 
 pub const Stmt = struct {
 	stmt: *r.sqlite3_stmt,
 
+	pub fn destroy( self: @This() ) void
+	{
+		_ = r.sqlite3_finalize( self.stmt );
+	}
 
+	// ROW or DONE, anything else is an error
+	pub fn step( self: @This() ) Error!Result
+	{
+		const rc = r.sqlite3_step( self.stmt );
+		if ( rc == r.SQLITE_ROW or rc == r.SQLITE_DONE ) return @enumFromInt( rc );
+		try check( r.sqlite3_db_handle( self.stmt ), rc );
+		unreachable;
+	}
 
-	pub fn destroy( self: @This() ) error{Unexpected}
+	// ready the statement to be stepped again, bindings are kept until the next bind
+	pub fn reset( self: @This() ) Error!void
 	{
-		const ret = r.sqlite3_finalize( self.stmt );
-		if ( ret != r.SQLITE_OK )
-		{
-			return error.Unexpected;
-		}
-	} 
+		try check( r.sqlite3_db_handle( self.stmt ), r.sqlite3_reset( self.stmt ) );
+	}
 
-	pub fn step( self: @This() ) !Result
+	// binds every field of a tuple in order, starting at parameter 1
+	pub fn bind( self: @This(), values: anytype ) Error!void
 	{
-		const rc: Result = @enumFromInt( r.sqlite3_run( self.stmt ) );
-		if ( rc != .ERROR )
+		inline for ( values, 1.. ) |value, i|
 		{
-			return error.Error;
+			try self.bindField( @TypeOf( value ), value, i );
 		}
-
-		return rc;
 	}
 
-	pub fn bind( self: @This(), values: anytype ) !void 
+	// bind, step until done and reset, for statements that return no rows
+	pub fn exec( self: @This(), values: anytype ) Error!void
 	{
-		_ = self;
-		_ = values;
+		try self.bind( values );
+		while ( try self.step() == .ROW ) {}
+		try self.reset();
 	}
 
-	pub fn bindField( self: @This(), comptime T: type, value: anytype, bind_index: c_int ) !void
+	pub fn bindField( self: @This(), comptime T: type, value: T, bind_index: c_int ) Error!void
 	{
-		var rc: c_int = 0;
-
-		switch ( @typeInfo(T) )
+		const rc = switch ( @typeInfo( T ) )
 		{
-			.null => rc = r.sqlite3_bind_null( self.stmt, bind_index ),
-			.int, .comptime_int => rc = r.sqlite3_bind_int64( self.stmt, bind_index, @intCast(value) ),
-			.float, .comptime_float => rc = r.sqlite3_bind_double( self.stmt, bind_index, value ),
-			.pointer => |ptr| {
-				_ = ptr;
+			.null => r.sqlite3_bind_null( self.stmt, bind_index ),
+			.int, .comptime_int => r.sqlite3_bind_int64( self.stmt, bind_index, @intCast( value ) ),
+			.float, .comptime_float => r.sqlite3_bind_double( self.stmt, bind_index, value ),
+			.optional => if ( value ) |v| return self.bindField( @TypeOf( v ), v, bind_index ) else r.sqlite3_bind_null( self.stmt, bind_index ),
+			.pointer => blk: {
+				// a null destructor is SQLITE_STATIC, the text has to stay alive until the statement is stepped
+				const str: []const u8 = value;
+				break :blk r.sqlite3_bind_text64( self.stmt, bind_index, str.ptr, str.len, null, r.SQLITE_UTF8 );
 			},
-		}
+			else => @compileError( "cannot bind " ++ @typeName( T ) ),
+		};
+		try check( r.sqlite3_db_handle( self.stmt ), rc );
 	}
 };
 
@@ -105,25 +120,16 @@ pub const Stmt = struct {
 pub const DB = struct {
 	db: *r.sqlite3,
 
-	pub fn prepare( self: @This(), zSql:[]const u8 ) !Stmt
+	pub fn prepare( self: @This(), zSql:[]const u8 ) Error!Stmt
 	{
-		var stmt: *r.sqlite3_stmt = undefined;
-		const ret = r.sqlite3_prepare_v2( self.db, zSql.ptr, zSql.len, &stmt, null );
-		if ( ret != r.SQLITE_OK )
-		{
-			return error.Unexpected;
-		}
-
-		return .{ .stmt = stmt };
+		var stmt: ?*r.sqlite3_stmt = null;
+		try check( self.db, r.sqlite3_prepare_v2( self.db, zSql.ptr, @intCast( zSql.len ), &stmt, null ) );
+		return .{ .stmt = stmt.? };
 	}
 
-	pub fn close( self: @This() ) error{Unexpected}
+	pub fn close( self: @This() ) void
 	{
-		const ret = r.sqlite3_close( self.db );
-		if ( ret != r.SQLITE_OK )
-		{
-			return error.Unexpected;
-		}
+		_ = r.sqlite3_close_v2( self.db );
 	}
 
 	pub fn enter( self: @This() ) void
@@ -136,41 +142,55 @@ pub const DB = struct {
 		r.sqlite3_mutex_exit( r.sqlite3_db_mutex( self.db ) );
 	}
 
-	pub fn exec( self: @This(), zSql:[]const u8 ) !Result
+	// runs every statement in zSql, rows are thrown away
+	pub fn exec( self: @This(), zSql:[*:0]const u8 ) Error!void
 	{
 		self.enter();
 		defer self.exit();
 
-		const stmt = try self.prepare( zSql );
-		const rc = try stmt.step();
-		stmt.destroy();
-
-		return rc;
+		try check( self.db, r.sqlite3_exec( self.db, zSql, null, null, null ) );
 	}
 
 };
 
 
+pub const OpenMode = enum { read_only, read_write, create };
 
-pub fn open( name:[*:0]const u8 ) error{Unexpected}!DB
+pub fn open( name:[*:0]const u8, mode: OpenMode ) Error!DB
 {
-	var db: *r.sqlite3 = undefined;
-	const ret = r.sqlite3_open_v2( name, @ptrCast(&db), r.SQLITE_OPEN_READONLY, null );
-	if ( ret != r.SQLITE_OK ) 
+	const flags: c_int = switch ( mode ) {
+		.read_only => r.SQLITE_OPEN_READONLY,
+		.read_write => r.SQLITE_OPEN_READWRITE,
+		.create => r.SQLITE_OPEN_READWRITE | r.SQLITE_OPEN_CREATE,
+	};
+
+	var db: ?*r.sqlite3 = null;
+	const ret = r.sqlite3_open_v2( name, &db, flags, null );
+	if ( ret != r.SQLITE_OK )
 	{
-		return error.Unexpected;
+		// a handle is returned even when opening fails, unless sqlite ran out of memory
+		defer _ = r.sqlite3_close_v2( db );
+		try check( db, ret );
 	}
 
-	return .{ .db = db };
+	return .{ .db = db.? };
 }
 
 
 
 test "database" {
-	const db = open( ":memory:" );
+	const db = try open( ":memory:", .create );
 	defer db.close();
 
-	_ = db.exec( "CREATE TABLE compile_db (id BIGINT, parent_id BIGINT, identifier text, usr text, params text);" );
+	try db.exec( "CREATE TABLE compile_db (id BIGINT, parent_id BIGINT, identifier text, usr text, params text);" );
+
+	const insert = try db.prepare( "INSERT INTO compile_db (id, parent_id, identifier) VALUES (?, ?, ?);" );
+	defer insert.destroy();
+	try insert.exec( .{ 1, 0, "main" } );
+	try insert.exec( .{ 2, 1, "argc" } );
 
-	
-}
\ No newline at end of file
+	const count = try db.prepare( "SELECT COUNT(*) FROM compile_db;" );
+	defer count.destroy();
+	try std.testing.expectEqual( Result.ROW, try count.step() );
+	try std.testing.expectEqual( 2, r.sqlite3_column_int64( count.stmt, 0 ) );
+}